@@ -136,6 +136,16 @@ Java_com_bambulab_iotc_IOTCNative_IOTC_1Get_1Version_1String(JNIEnv *env, jclass
     return (*env)->NewStringUTF(env, version_str);
 }
 
+JNIEXPORT jlong JNICALL
+Java_com_bambulab_iotc_IOTCNative_IOTC_1Set_1Log_1Path(JNIEnv *env, jclass clazz, jstring path, jint maxSize) {
+    // A null path stops logging
+    if (!path) return IOTC_Set_Log_Path(NULL, maxSize);
+    const char *path_str = (*env)->GetStringUTFChars(env, path, NULL);
+    jlong result = IOTC_Set_Log_Path(path_str, maxSize);
+    (*env)->ReleaseStringUTFChars(env, path, path_str);
+    return result;
+}
+
 // Endianness conversion helpers
 JNIEXPORT jint JNICALL
 Java_com_bambulab_iotc_IOTCNative_IOTC_1Data_1ntoh(JNIEnv *env, jclass clazz, jint data) {
@@ -172,10 +182,17 @@ Java_com_bambulab_iotc_IOTCNative_IOTC_1Connect(JNIEnv *env, jclass clazz, jstri
     return result;
 }
 
-// Information functions (stubs)
+// Information functions
 JNIEXPORT jlong JNICALL
 Java_com_bambulab_iotc_IOTCNative_IOTC_1Session_1Get_1Info(JNIEnv *env, jclass clazz, jint sessionId, jbyteArray info) {
+    // The array length is the IOTCSessionInfo size the caller can take; one
+    // too short to hold it gets IOTC_ER_INVALID_ARG
+    unsigned int size = (unsigned int)(*env)->GetArrayLength(env, info);
+    if (size < sizeof(size)) {
+        return IOTC_Session_Get_Info(sessionId, NULL);
+    }
     jbyte *info_ptr = (*env)->GetByteArrayElements(env, info, NULL);
+    memcpy(info_ptr, &size, sizeof(size));
     jlong result = IOTC_Session_Get_Info(sessionId, info_ptr);
     (*env)->ReleaseByteArrayElements(env, info, info_ptr, 0);
     return result;
@@ -183,6 +200,10 @@ Java_com_bambulab_iotc_IOTCNative_IOTC_1Session_1Get_1Info(JNIEnv *env, jclass c
 
 JNIEXPORT jlong JNICALL
 Java_com_bambulab_iotc_IOTCNative_IOTC_1Get_1Login_1Info(JNIEnv *env, jclass clazz, jint sessionId, jbyteArray loginInfo) {
+    // The status is one unsigned int; shorter arrays get IOTC_ER_INVALID_ARG
+    if ((*env)->GetArrayLength(env, loginInfo) < (jsize)sizeof(unsigned int)) {
+        return IOTC_Get_Login_Info(sessionId, NULL);
+    }
     jbyte *login_info_ptr = (*env)->GetByteArrayElements(env, loginInfo, NULL);
     jlong result = IOTC_Get_Login_Info(sessionId, login_info_ptr);
     (*env)->ReleaseByteArrayElements(env, loginInfo, login_info_ptr, 0);
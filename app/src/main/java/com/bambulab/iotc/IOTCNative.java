@@ -36,6 +36,7 @@ public class IOTCNative {
     // Utility functions
     public static native void IOTC_Get_Version(int[] version);
     public static native String IOTC_Get_Version_String();
+    public static native long IOTC_Set_Log_Path(String path, int maxSize);
 
     // Endianness conversion helpers
     public static native int IOTC_Data_ntoh(int data);
@@ -8,6 +8,63 @@
 extern "C" {
 #endif
 
+/* IOTC error codes */
+#define IOTC_ER_NoERROR                    0
+#define IOTC_ER_NOT_INITIALIZED           -1
+#define IOTC_ER_ALREADY_INITIALIZED       -2
+#define IOTC_ER_FAIL_RESOLVE_HOSTNAME     -3
+#define IOTC_ER_ALREADY_LISTENING         -4
+#define IOTC_ER_FAIL_CREATE_THREAD        -5
+#define IOTC_ER_FAIL_CREATE_SOCKET        -6
+#define IOTC_ER_FAIL_SOCKET_OPT           -7
+#define IOTC_ER_FAIL_SOCKET_BIND          -8
+#define IOTC_ER_NOT_SUPPORT_RELAY         -9
+#define IOTC_ER_NO_PERMISSION             -10
+#define IOTC_ER_SERVER_NOT_RESPONSE       -11
+#define IOTC_ER_FAIL_GET_LOCAL_IP         -12
+#define IOTC_ER_FAIL_SETUP_RELAY          -13
+#define IOTC_ER_FAIL_CONNECT_SEARCH       -14
+#define IOTC_ER_INVALID_SID               -15
+#define IOTC_ER_EXCEED_MAX_SESSION         -16
+#define IOTC_ER_CAN_NOT_FIND_DEVICE       -17
+#define IOTC_ER_SESSION_CLOSE_BY_REMOTE    -18
+#define IOTC_ER_REMOTE_TIMEOUT_DISCONNECT  -19
+#define IOTC_ER_DEVICE_NOT_LISTENING       -20
+#define IOTC_ER_CH_NOT_ON                  -21
+#define IOTC_ER_FAIL_CREATE_MUTEX         -22
+#define IOTC_ER_FAIL_CREATE_SEMAPHORE     -23
+#define IOTC_ER_UNLICENSE                 -24
+#define IOTC_ER_NOT_SUPPORT               -25
+#define IOTC_ER_DEVICE_MULTI_LOGIN        -26
+#define IOTC_ER_INVALID_ARG               -27
+#define IOTC_ER_NETWORK_UNREACHABLE       -28
+#define IOTC_ER_FAIL_SETUP_CHANNEL        -29
+#define IOTC_ER_TIMEOUT                   -30
+
+/* RDT error codes */
+#define RDT_ER_NoERROR                     0
+#define RDT_ER_NOT_INITIALIZED            -10000
+#define RDT_ER_ALREADY_INITIALIZED        -10001
+#define RDT_ER_EXCEED_MAX_CHANNEL         -10002
+#define RDT_ER_MEM_INSUFF                 -10003
+#define RDT_ER_TIMEOUT                    -10007
+#define RDT_ER_INVALID_RDT_ID             -10008
+#define RDT_ER_INVALID_ARG                -10010
+#define RDT_ER_LOCAL_ABORT                -10013
+#define RDT_ER_CHANNEL_OCCUPIED           -10014
+
+/* AV error codes */
+#define AV_ER_NoERROR                      0
+#define AV_ER_INVALID_ARG                 -20000
+#define AV_ER_BUFPARA_MAXSIZE_INSUFF      -20001
+#define AV_ER_EXCEED_MAX_CHANNEL          -20002
+#define AV_ER_INVALID_SID                 -20010
+#define AV_ER_DATA_NOREADY                -20012
+#define AV_ER_LOSED_THIS_FRAME            -20014
+#define AV_ER_SESSION_CLOSE_BY_REMOTE     -20015
+#define AV_ER_REMOTE_TIMEOUT_DISCONNECT   -20016
+#define AV_ER_NOT_INITIALIZED             -20019
+
 /*
  * Minimal representation of the packet header used by the
  * IOTC library.  Only the fields required by the exported
@@ -29,18 +86,333 @@ typedef struct {
     char reserved[2];    /* Reserved for alignment */
 } IOTCDevInfo;
 
+/* Entry of the background LAN discovery device table */
+typedef struct {
+    IOTCDevInfo info;        /* UID, IP and port from the last 0xFD response */
+    uint32_t last_seen_ms;   /* Milliseconds since the device last answered */
+} IOTCLanDevice;
+
+/* Events delivered to the LAN discovery change callback */
+#define IOTC_LAN_DEVICE_ADDED    1
+#define IOTC_LAN_DEVICE_UPDATED  2  /* IP address or port changed */
+#define IOTC_LAN_DEVICE_REMOVED  3  /* Not seen for several probe intervals */
+
+/* Called from the discovery thread; must not block */
+typedef void (*IOTC_Lan_Device_Callback)(const IOTCDevInfo *dev, int event, void *user_data);
+
+/* Reliable channel state reported by RDT_Status_Check */
+typedef struct {
+    unsigned short Timeout;              /* Current retransmission timeout (ms) */
+    unsigned short TimeoutThreshold;     /* Retransmission timeout ceiling (ms) */
+    unsigned int BufSizeInSendQueue;     /* Bytes written but not yet acknowledged */
+    unsigned int BufSizeInRecvQueue;     /* Bytes received in order but not yet read */
+} st_RDT_Status;
+
+/* Frame description filled in by avRecvFrameData2, in the vendor
+ * FRAMEINFO_t layout */
+#define MEDIA_CODEC_VIDEO_H264     0x4E
+#define IPC_FRAME_FLAG_PBFRAME     0x00
+#define IPC_FRAME_FLAG_IFRAME      0x01  /* The frame holds an IDR picture */
+#define IPC_FRAME_FLAG_INCOMPLETE  0x80  /* Packets were lost; see lost_fragments */
+
+typedef struct {
+    unsigned short codec_id;             /* MEDIA_CODEC_VIDEO_H264 */
+    unsigned char flags;                 /* IPC_FRAME_FLAG_* */
+    unsigned char cam_index;
+    unsigned char onlineNum;
+    unsigned char reserve1[3];
+    unsigned int lost_fragments;         /* RTP packets missing since the previous frame */
+    unsigned int timestamp;              /* RTP timestamp, 90 kHz */
+} FRAMEINFO_t;
+
+/* Path MTU and transmit counters reported by IOTC_Session_Get_Path_Stats.
+ * Sizes are UDP payload bytes, IOTC header included. */
+typedef struct {
+    unsigned int pmtu;                   /* Datagram size used for framing */
+    unsigned int pmtu_probing;           /* Non-zero while a probe search runs */
+    uint64_t bytes_sent;                 /* Data, fragment and RDT bytes on the wire */
+    uint64_t send_calls;                 /* sendto/sendmmsg system calls */
+    uint64_t datagrams_sent;
+    uint64_t messages_fragmented;        /* Writes split into DATA_FRAG datagrams */
+    uint64_t fragments_sent;
+    uint64_t parity_sent;                /* FEC parity fragments */
+    uint64_t fragments_recovered;        /* Received fragments rebuilt from parity */
+    uint64_t pacing_queued;              /* Bytes waiting for the pacing token buckets */
+    unsigned int bandwidth_estimate;     /* Available bandwidth, bytes per second */
+    unsigned int peer_receive_rate;      /* Bytes per second the peer last reported receiving */
+    unsigned int congestion_state;       /* IOTC_CONGESTION_* from the peer's delay detector */
+    unsigned int loss_permille;          /* Datagram loss in the peer's last report */
+} IOTCSessionPathStats;
+
+/* Delay detector states reported in IOTCSessionPathStats.congestion_state */
+#define IOTC_CONGESTION_NORMAL    0
+#define IOTC_CONGESTION_UNDERUSE  1  /* Queues draining */
+#define IOTC_CONGESTION_OVERUSE   2  /* Queuing delay rising */
+
+/* Per-channel traffic in IOTCSessionInfo.  Byte counts are UDP payload,
+ * IOTC header included. */
+typedef struct {
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t packets_in;
+    uint64_t packets_out;
+    uint64_t drops;                      /* Messages discarded on receive, datagrams the socket refused */
+    uint64_t retransmits;                /* RDT segments sent again */
+    unsigned int queue_messages;         /* Received messages waiting for IOTC_Session_Read */
+    unsigned int queue_bytes;
+    uint64_t pacing_queued;              /* Bytes waiting for the pacing token buckets */
+} IOTCChannelInfo;
+
+#define IOTC_SESSION_INFO_CHANNELS 32
+
+/* How a session reaches its peer (IOTCSessionInfo.mode).  Sessions are
+ * direct, so RELAY is never reported; it keeps the SDK's numbering. */
+#define IOTC_SESSION_MODE_P2P    0
+#define IOTC_SESSION_MODE_RELAY  1
+#define IOTC_SESSION_MODE_LAN    2  /* Private, link-local or loopback peer address */
+
+/* Per-session statistics reported by IOTC_Session_Get_Info.  Set size to
+ * sizeof(IOTCSessionInfo) before the call: the library fills at most that
+ * many bytes, so callers built against an older header get the fields they
+ * know about.  New fields are only ever appended. */
+#define IOTC_SESSION_INFO_VERSION 2
+
+typedef struct {
+    unsigned int size;                   /* In: bytes available at info */
+    unsigned int version;                /* Out: IOTC_SESSION_INFO_VERSION of the library */
+
+    /* Delay, from echoed header timestamps and the peer's media timestamps */
+    unsigned int rtt_us;                 /* Smoothed round-trip time */
+    unsigned int rtt_var_us;             /* Round-trip time variation */
+    unsigned int rtt_min_us;
+    unsigned int rtt_latest_us;
+    unsigned int rtt_samples;            /* 0 until the first echo arrives */
+    unsigned int jitter_us;              /* RFC 3550 interarrival jitter */
+    unsigned int queuing_delay_us;       /* One-way delay above its 10-20 s minimum */
+    int delay_trend;                     /* One-way delay growth, microseconds per second */
+
+    /* Version 2: connection and traffic.  Session totals include control messages. */
+    unsigned int mode;                   /* IOTC_SESSION_MODE_* */
+    unsigned int remote_port;
+    char remote_ip[16];                  /* Dotted decimal, empty without a peer */
+    uint64_t uptime_ms;                  /* Since the session connected, 0 before */
+    uint64_t idle_ms;                    /* Since the last datagram from the peer */
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t packets_in;
+    uint64_t packets_out;
+    uint64_t drops;
+    uint64_t retransmits;
+    IOTCChannelInfo channels[IOTC_SESSION_INFO_CHANNELS];
+} IOTCSessionInfo;
+
+/* Status bits written by IOTC_Get_Login_Info.  There is no master server
+ * client in this library, so only LOCAL_READY is ever set. */
+#define IOTC_LOGIN_LOCAL_READY   0x01  /* Sockets up: LAN search and direct connections work */
+#define IOTC_LOGIN_MASTER_FOUND  0x02
+#define IOTC_LOGIN_ONLINE        0x04
+
+/* Shared-memory metrics file written by IOTC_Metrics_Start.  Readers map
+ * it read-only and copy it out under the seqlock: wait for an even seq, copy,
+ * and retry if seq changed meanwhile.  native/tools/iotc_metrics.c is a
+ * reference reader.  Traffic totals include sessions that have closed. */
+#define IOTC_METRICS_MAGIC        0x4D544F49  /* "IOTM" */
+#define IOTC_METRICS_VERSION      1
+
+/* Upper bounds of the RTT histogram buckets; the last bucket is unbounded */
+#define IOTC_METRICS_RTT_BOUNDS_US \
+    { 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000, 2000000 }
+#define IOTC_METRICS_RTT_BUCKETS  12
+
+typedef struct {
+    uint64_t sessions_opened;
+    uint64_t sessions_closed;
+    uint32_t sessions_active;            /* Allocated slots */
+    uint32_t sessions_connected;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t packets_in;
+    uint64_t packets_out;
+    uint64_t drops;
+    uint64_t retransmits;
+    uint64_t rtt_count;                  /* RTT samples from echoed timestamps */
+    uint64_t rtt_sum_us;
+    uint64_t rtt_buckets[IOTC_METRICS_RTT_BUCKETS];  /* Per bucket, not cumulative */
+} IOTCMetricsGlobal;
+
+typedef struct {
+    uint32_t session_id;
+    uint32_t state;                      /* 0 free, 1 allocated, 2 connecting, 3 connected, 4 disconnected */
+    uint32_t mode;                       /* IOTC_SESSION_MODE_* */
+    uint32_t remote_port;
+    char remote_ip[16];
+    char uid[24];
+    uint64_t uptime_ms;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t packets_in;
+    uint64_t packets_out;
+    uint64_t drops;
+    uint64_t retransmits;
+    uint64_t queue_bytes;                /* Received, not yet read */
+    uint64_t pacing_queued;
+    uint32_t channels_on;                /* Bitmap */
+    uint32_t rtt_us;
+    uint32_t jitter_us;
+    uint32_t bandwidth_estimate;         /* Bytes per second */
+} IOTCMetricsSession;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;                       /* Bytes in the file */
+    uint32_t seq;                        /* Odd while a snapshot is being written */
+    uint32_t pid;                        /* Writer process, 0 once it stopped */
+    uint32_t interval_ms;
+    uint32_t max_sessions;               /* Entries in sessions[] */
+    uint32_t reserved;
+    uint64_t updated_ms;                 /* Wall clock of the last snapshot */
+    uint64_t snapshots;
+    IOTCMetricsGlobal global;
+    IOTCMetricsSession sessions[];
+} IOTCMetricsFile;
+
+/* Latency histograms for IOTC_Histogram_Get.  Buckets are log-linear in
+ * microseconds: 16 per power of two, so a bucket spans at most 1/16 of its
+ * value, up to 2^32 us (71 minutes); longer samples land in the last one. */
+#define IOTC_HISTOGRAM_READ_WAIT  0  /* Time IOTC_Session_Read blocked waiting for data */
+#define IOTC_HISTOGRAM_WRITE      1  /* Time inside successful IOTC_Session_Write calls */
+#define IOTC_HISTOGRAM_CONNECT    2  /* Successful IOTC_Connect calls, handshake included */
+#define IOTC_HISTOGRAM_DELIVERY   3  /* Per channel: message queued until IOTC_Session_Read took it */
+#define IOTC_HISTOGRAM_BUCKETS    464
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t min_us;
+    uint64_t max_us;
+    uint64_t buckets[IOTC_HISTOGRAM_BUCKETS];
+} IOTCHistogram;
+
+/* Receive classes for IOTC_Receive_Stats_Get.  Every datagram an endpoint
+ * takes in is classified once, by its first byte and then, for 0xF1 session
+ * datagrams, by message type, whether or not a session claims it. */
+#define IOTC_RX_FOREIGN        0   /* First byte of no known format */
+#define IOTC_RX_MALFORMED      1   /* 0xF1, but shorter than its header says */
+#define IOTC_RX_UNKNOWN_TYPE   2   /* 0xF1 with an unlisted message type */
+#define IOTC_RX_CONNECT        3
+#define IOTC_RX_CONNECT_ACK    4
+#define IOTC_RX_DATA           5
+#define IOTC_RX_KEEPALIVE      6
+#define IOTC_RX_CLOSE          7
+#define IOTC_RX_DATA_FRAG      8
+#define IOTC_RX_DATA_FEC       9
+#define IOTC_RX_RDT_DATA       10
+#define IOTC_RX_RDT_ACK        11
+#define IOTC_RX_PMTU_PROBE     12
+#define IOTC_RX_PMTU_ACK       13
+#define IOTC_RX_CC_FEEDBACK    14
+#define IOTC_RX_LOGIN          15  /* 0x0122 server login (example.py), dropped */
+#define IOTC_RX_AV_AUTH        16  /* 0x0200 AV authentication (example.py), dropped */
+#define IOTC_RX_LAN_PROBE      17  /* 0xFC search probe on a session port, dropped */
+#define IOTC_RX_LAN_RESPONSE   18  /* 0xFD discovery response on a session port, dropped */
+#define IOTC_RX_RTP            19  /* Bare RTP version 2, dropped */
+#define IOTC_RX_RTP_H264       20  /* Bare RTP with payload type 96, dropped */
+#define IOTC_RX_CLASSES        21
+
+typedef struct {
+    uint64_t datagrams[IOTC_RX_CLASSES];
+    uint64_t bytes[IOTC_RX_CLASSES];
+} IOTCReceiveStats;
+
+/* Log levels for IOTC_Set_Log_Level and TUTK_LOG_MSG */
+#define IOTC_LOG_LEVEL_DEBUG    0
+#define IOTC_LOG_LEVEL_INFO     1  /* Default */
+#define IOTC_LOG_LEVEL_WARNING  2
+#define IOTC_LOG_LEVEL_ERROR    3
+#define IOTC_LOG_LEVEL_NONE     4
+
+/* Forward error correction modes for IOTC_Session_Set_Channel_FEC */
+#define IOTC_FEC_OFF  0
+#define IOTC_FEC_XOR  1  /* One parity fragment per group */
+#define IOTC_FEC_RS   2  /* Reed-Solomon, up to 16 parity fragments per group */
+
+/* Network simulator settings for IOTC_Set_Network_Simulator.  Each
+ * direction between two endpoints is a separate link: a bottleneck of
+ * bandwidth_bytes per second with a queue_bytes buffer, then delay_ms plus up
+ * to jitter_ms of propagation.  Jitter never reorders a link; the
+ * reorder_permille datagrams skip the propagation delay instead and overtake
+ * those in flight.  Losses, jitter and reordering come from a generator
+ * seeded with seed, so the same calls produce the same network. */
+typedef struct {
+    unsigned int delay_ms;               /* One-way propagation delay */
+    unsigned int jitter_ms;              /* Extra delay, uniform in [0, jitter_ms] */
+    unsigned int loss_permille;          /* Datagrams dropped at random */
+    unsigned int reorder_permille;       /* Datagrams delivered without the propagation delay */
+    unsigned int bandwidth_bytes;        /* Bottleneck rate, 0 for unlimited */
+    unsigned int queue_bytes;            /* Bottleneck buffer, 0 for 64 KB */
+    unsigned int mtu;                    /* IP MTU; larger datagrams are dropped, 0 for 1500 */
+    unsigned int seed;
+    int virtual_clock;                   /* Non-zero: library time only moves with the simulation */
+} IOTCNetSimConfig;
+
+/* Simulator counters reported by IOTC_NetSim_Get_Stats */
+typedef struct {
+    uint64_t now_us;                     /* Library clock, virtual or monotonic */
+    uint64_t datagrams_sent;
+    uint64_t datagrams_delivered;
+    uint64_t bytes_delivered;
+    uint64_t dropped_loss;               /* Random losses */
+    uint64_t dropped_queue;              /* Bottleneck buffer overflows */
+    uint64_t dropped_mtu;                /* Datagrams over the MTU */
+    uint64_t dropped_unreachable;        /* No endpoint on the destination port */
+    uint64_t reordered;
+    uint64_t in_flight;                  /* Datagrams not yet delivered */
+} IOTCNetSimStats;
+
 /* Core initialization and cleanup */
 int64_t IOTC_Initialize(void);
 int64_t IOTC_DeInitialize(void);
 
+/* Network simulator.  With a configuration set, the next IOTC_Initialize
+ * replaces UDP sockets with an in-process network: endpoints are reachable
+ * by port at any IPv4 address, and datagrams between them go through the
+ * links described above.  LAN search and discovery still use real sockets.
+ * Pass NULL to go back to sockets at the next IOTC_Initialize.  While the
+ * simulator runs, a new configuration with the same clock mode changes the
+ * link impairments at once.
+ *
+ * With virtual_clock set the library clock starts at 1 s and only moves
+ * forward in IOTC_NetSim_Advance or inside a blocking call: a caller waiting
+ * in IOTC_Connect, IOTC_Session_Read, IOTC_Session_Write or RDT moves time to
+ * the next datagram arrival or timer tick until its wait ends, so a timeout
+ * passes in microseconds.  IOTC_Listen waits for other threads instead.  One
+ * thread should drive the sessions for runs to be reproducible. */
+int64_t IOTC_Set_Network_Simulator(const IOTCNetSimConfig *config);
+int64_t IOTC_NetSim_Advance(unsigned int ms);
+int64_t IOTC_NetSim_Get_Stats(IOTCNetSimStats *stats);
+
+/* Hands a datagram to a session's receive path as if it had just come from
+ * the session's peer, outside any link.  The header's sid must be the
+ * session's own ID.  Used to replay captures (native/tools/iotc_replay.c). */
+int64_t IOTC_NetSim_Inject(int session_id, const void *datagram, unsigned int len);
+
 /* Session management */
 int64_t IOTC_Get_SessionID(void);
 int64_t IOTC_Set_Max_Session_Number(unsigned int max_sessions);
+/* Handshakes with the address the background discovery table holds for uid,
+ * as IOTC_Connect does; IOTC_ER_CAN_NOT_FIND_DEVICE when it has none */
 int64_t IOTC_Connect_ByUID(const char *uid);
 int64_t IOTC_Session_Close(int session_id);
 int64_t IOTC_Session_Check(int session_id);
 int64_t IOTC_Get_Session_Status(int session_id);
 
+/* LAN discovery */
+int64_t IOTC_Lan_Search2(IOTCDevInfo *devices, int max_num, unsigned int timeout_ms);
+int64_t IOTC_Lan_Discovery_Start(unsigned int interval_ms, IOTC_Lan_Device_Callback callback, void *user_data);
+int64_t IOTC_Lan_Discovery_Stop(void);
+int64_t IOTC_Lan_Discovery_Get_Devices(IOTCLanDevice *devices, int max_num);
+
 /* Channel management */
 int64_t IOTC_Session_Channel_ON(int session_id, unsigned char channel);
 int64_t IOTC_Session_Channel_OFF(int session_id, unsigned char channel);
@@ -49,6 +421,97 @@ int32_t IOTC_Session_Get_Free_Channel(int session_id);
 int32_t IOTC_Session_Get_Channel_ON_Count(int session_id);
 uint32_t IOTC_Session_Get_Channel_ON_Bitmap(int session_id);
 
+/* Timeouts (milliseconds).  Idle timeout and keep-alive interval of 0 disable them. */
+int64_t IOTC_Setup_LANConnection_Timeout(unsigned int timeout_ms);
+int64_t IOTC_Setup_Session_Idle_Timeout(unsigned int timeout_ms);
+int64_t IOTC_Setup_Keepalive_Interval(unsigned int interval_ms);
+
+/* Largest message IOTC_Session_Write accepts and the receiver reassembles
+ * (default 4 MB, at most 16 MB).  Messages above the path MTU are fragmented. */
+int64_t IOTC_Setup_Max_Message_Size(unsigned int max_bytes);
+
+/* Per-path datagram size and transmit counters; bytes_sent / send_calls
+ * gives the average bytes moved per system call */
+int64_t IOTC_Session_Get_Path_Stats(int session_id, IOTCSessionPathStats *stats);
+
+/* Adds parity to fragmented writes on a channel: after every data_fragments
+ * fragments (1-64) the sender emits parity_fragments parity packets, and the
+ * receiver rebuilds up to that many lost fragments per group without a
+ * retransmission.  Messages that fit one datagram are not protected.  The
+ * setting lasts until the channel is turned off. */
+int64_t IOTC_Session_Set_Channel_FEC(int session_id, unsigned char channel, int mode,
+                                     unsigned int data_fragments, unsigned int parity_fragments);
+
+/* Paces channel data through token buckets (bytes per second, burst in
+ * bytes, 0 for a 16 KB default).  The session bucket covers all channels and
+ * each channel can have its own; a rate of 0 removes the limit.  Writers wait
+ * while more than 4 MB is queued. */
+int64_t IOTC_Session_Set_Pacing(int session_id, unsigned int rate_bytes, unsigned int burst_bytes);
+int64_t IOTC_Session_Channel_Set_Pacing(int session_id, unsigned char channel,
+                                        unsigned int rate_bytes, unsigned int burst_bytes);
+
+/* Every session estimates its available bandwidth from the peer's delay and
+ * loss reports (see IOTCSessionPathStats.bandwidth_estimate).  Enabling
+ * congestion control also paces the session at that estimate, capped by any
+ * IOTC_Session_Set_Pacing rate. */
+int64_t IOTC_Session_Set_Congestion_Control(int session_id, int enable);
+
+/* Publishes a metrics snapshot to a memory-mapped file every interval_ms
+ * (0 for one second).  Starting again switches files; the last snapshot
+ * stays in the file after IOTC_Metrics_Stop or IOTC_DeInitialize. */
+int64_t IOTC_Metrics_Start(const char *path, unsigned int interval_ms);
+int64_t IOTC_Metrics_Stop(void);
+
+/* Copies a latency histogram (channel only matters for DELIVERY, which is
+ * kept per channel number across sessions).  With reset set the histogram
+ * is cleared as it is read, so consecutive calls split the samples between
+ * them even while traffic flows; out may then be NULL.  Histograms are
+ * process-wide and survive IOTC_DeInitialize. */
+int64_t IOTC_Histogram_Get(int histogram, unsigned char channel, IOTCHistogram *out, int reset);
+
+/* Largest value that falls in a bucket, and the value at a percentile
+ * (0-100) of a copied histogram, accurate to its bucket */
+uint64_t IOTC_Histogram_Bucket_Limit(unsigned int bucket);
+uint64_t IOTC_Histogram_Percentile(const IOTCHistogram *histogram, double percentile);
+
+/* Copies the receive classification counters, clearing them with reset set
+ * (out may then be NULL).  Like the histograms they are process-wide and
+ * survive IOTC_DeInitialize. */
+int64_t IOTC_Receive_Stats_Get(IOTCReceiveStats *out, int reset);
+
+/* Logging.  Each thread appends binary records to its own lock-free ring
+ * and a background thread formats them into the file, moving it to
+ * "<path>.1" once it grows past max_size bytes (0 for no limit).  A NULL or
+ * empty path flushes what is buffered and stops logging.  Records from one
+ * thread stay in order; lines from different threads may interleave. */
+int64_t IOTC_Set_Log_Path(const char *path, int max_size);
+int64_t IOTC_Set_Log_Level(int level);
+
+/* Records per second, with bursts up to burst, that each thread may log
+ * (default 1000 and 1000); 0 lifts the limit.  Records over the limit or
+ * lost to a full ring are counted and reported in the log. */
+int64_t IOTC_Set_Log_Rate_Limit(unsigned int records_per_sec, unsigned int burst);
+
+/* printf-style record under the SDK's signature; type is accepted for
+ * compatibility and ignored.  Formatting is deferred to the writer thread,
+ * so fmt must outlive logging (a string literal); %s arguments are copied,
+ * up to 127 bytes each.  %n is not supported. */
+void TUTK_LOG_MSG(int level, const char *module, int type, const char *fmt, ...)
+#ifdef __GNUC__
+    __attribute__((format(printf, 4, 5)))
+#endif
+    ;
+
+/* Captures every datagram the session sends or accepts, IOTCHeader and
+ * payload, to a pcapng file (LINKTYPE_USER0, direction in epb_flags).  A
+ * background thread writes the file and moves it to "<path>.1" once it
+ * grows past max_bytes (0 for no limit); datagrams that arrive faster than
+ * it writes are counted as drops in the interface statistics.  Starting
+ * again switches files.  Stop returns once the file is complete; closing
+ * the session finishes it in the background. */
+int64_t IOTC_Session_Capture_Start(int session_id, const char *path, unsigned int max_bytes);
+int64_t IOTC_Session_Capture_Stop(int session_id);
+
 /* Data transmission */
 int64_t IOTC_Session_Write(int session_id, const void *data, unsigned int size, unsigned char channel);
 int64_t IOTC_Session_Read(int session_id, void *buf, int size, int timeout, int flags);
@@ -69,13 +532,42 @@ uint32_t IOTC_Data_hton(uint32_t data);
 void IOTC_Header_ntoh(IOTCHeader *hdr);
 void IOTC_Header_hton(IOTCHeader *hdr);
 
-/* Connection functions (limited implementation) */
+/* Convert count consecutive headers in place, with SSSE3, AVX2 or NEON
+ * byte shuffles where the CPU has them */
+void IOTC_Headers_ntoh_batch(IOTCHeader *hdrs, unsigned int count);
+void IOTC_Headers_hton_batch(IOTCHeader *hdrs, unsigned int count);
+
+/* Direct connections: IOTC_Listen accepts one session on a UDP port,
+ * IOTC_Connect handshakes with a device at a known address */
 int64_t IOTC_Listen(const char *uid, uint16_t port, uint32_t timeout_ms);
 int64_t IOTC_Connect(const char *uid, const char *server, uint16_t port);
 
-/* Information functions (stubs) */
-int64_t IOTC_Session_Get_Info(int session_id, void *info);
-int64_t IOTC_Get_Login_Info(int session_id, void *login_info);
+/* Reliable ordered byte streams over a session channel (RDT).  Both ends
+ * call RDT_Create on the same channel; writes block while the send window
+ * is full and reads wait up to timeout_ms for in-order data. */
+int32_t RDT_Initialize(void);
+int32_t RDT_DeInitialize(void);
+int32_t RDT_Create(int session_id, int timeout_ms, unsigned char channel);
+int32_t RDT_Destroy(int rdt_id);
+int32_t RDT_Abort(int rdt_id);
+int32_t RDT_Write(int rdt_id, const char *buf, int size);
+int32_t RDT_Read(int rdt_id, char *buf, int size, int timeout_ms);
+int32_t RDT_Status_Check(int rdt_id, st_RDT_Status *status);
+uint32_t RDT_GetRDTApiVer(void);
+
+/* AV client over a session channel.  The device sends H.264 as pseudo-RTP,
+ * one packet per message; avRecvFrameData2 never blocks and returns one
+ * whole frame as Annex-B NAL units, rebuilding FU-A fragments in place. */
+int32_t avClientStart(int session_id, const char *account, const char *password, unsigned int timeout_sec,
+                      unsigned int *serv_type, unsigned char channel);
+int32_t avRecvFrameData2(int av_index, char *frame, int frame_size, int *actual_frame_size,
+                         int *expected_frame_size, char *frame_info, int frame_info_size,
+                         int *actual_frame_info_size, unsigned int *frame_index);
+int32_t avClientStop(int av_index);
+
+/* Information functions */
+int64_t IOTC_Session_Get_Info(int session_id, void *info);   /* IOTCSessionInfo with size set */
+int64_t IOTC_Get_Login_Info(int session_id, void *login_info);  /* unsigned int of IOTC_LOGIN_* bits */
 
 #ifdef __cplusplus
 }
@@ -1,4 +1,3 @@
-
 /*
  * The original project was written in C++ and later decompiled back to C.  As a
  * consequence a number of compiler specific constructs (such as direct access
@@ -9,7 +8,12 @@
  * compilation while preserving the behaviour of the original code.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdint.h>
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,57 +26,499 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/time.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
 #include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#ifdef SO_TXTIME
+#include <linux/net_tstamp.h>
+#endif
+#ifdef IOTC_USDT
+#include <sys/sdt.h>
+#endif
 #include "libIOTCAPIsT.h"
 
 /*
- * When GCC emits stack protector code it references the variables below.  They
- * are normally supplied by the C runtime, but when compiling this file in
- * isolation we need to declare them ourselves.  They are defined by the
- * runtime, so we only provide extern declarations here.
+ * When GCC emits stack protector code it references the variables below.  Some
+ * C runtimes export __stack_chk_guard, but glibc on x86-64 keeps the canary in
+ * thread-local storage and has no such symbol, so the library carries a weak
+ * definition of its own.  It is hidden so the shared library never exports it
+ * and cannot interpose the guard of a runtime that does; a program linking this
+ * file and defining the guard itself still overrides it.
  */
-extern void *__stack_chk_guard;
+__attribute__((weak, visibility("hidden"))) void *__stack_chk_guard = (void *)0x1;
 void __stack_chk_fail(void);
 
-/* Error codes */
-#define IOTC_ER_NoERROR                    0
-#define IOTC_ER_NOT_INITIALIZED           -1
-#define IOTC_ER_ALREADY_INITIALIZED       -2
-#define IOTC_ER_FAIL_RESOLVE_HOSTNAME     -3
-#define IOTC_ER_ALREADY_LISTENING         -4
-#define IOTC_ER_FAIL_CREATE_THREAD        -5
-#define IOTC_ER_FAIL_CREATE_SOCKET        -6
-#define IOTC_ER_FAIL_SOCKET_OPT           -7
-#define IOTC_ER_FAIL_SOCKET_BIND          -8
-#define IOTC_ER_NOT_SUPPORT_RELAY         -9
-#define IOTC_ER_NO_PERMISSION             -10
-#define IOTC_ER_SERVER_NOT_RESPONSE       -11
-#define IOTC_ER_FAIL_GET_LOCAL_IP         -12
-#define IOTC_ER_FAIL_SETUP_RELAY          -13
-#define IOTC_ER_FAIL_CONNECT_SEARCH       -14
-#define IOTC_ER_INVALID_SID               -15
-#define IOTC_ER_EXCEED_MAX_SESSION         -16
-#define IOTC_ER_CAN_NOT_FIND_DEVICE       -17
-#define IOTC_ER_SESSION_CLOSE_BY_REMOTE    -18
-#define IOTC_ER_REMOTE_TIMEOUT_DISCONNECT  -19
-#define IOTC_ER_DEVICE_NOT_LISTENING       -20
-#define IOTC_ER_CH_NOT_ON                  -21
-#define IOTC_ER_FAIL_CREATE_MUTEX         -22
-#define IOTC_ER_FAIL_CREATE_SEMAPHORE     -23
-#define IOTC_ER_UNLICENSE                 -24
-#define IOTC_ER_NOT_SUPPORT               -25
-#define IOTC_ER_DEVICE_MULTI_LOGIN        -26
-#define IOTC_ER_INVALID_ARG               -27
-#define IOTC_ER_NETWORK_UNREACHABLE       -28
-#define IOTC_ER_FAIL_SETUP_CHANNEL        -29
-#define IOTC_ER_TIMEOUT                   -30
-
 /* Library constants */
 #define MAX_DEFAULT_SESSION_NUMBER         16
 #define MAX_CHANNEL_NUMBER                 32
 #define MAX_PACKET_SIZE                   1400
 
+/* Session datagram framing: an IOTCHeader in network byte order followed by
+ * the payload.  The header flag packs magic(8) | message type(16) | channel(8). */
+#define IOTC_SESSION_MAGIC                0xF1
+#define IOTC_WIRE_FLAG(type, ch)          (((uint32_t)IOTC_SESSION_MAGIC << 24) | ((uint32_t)(type) << 8) | (uint32_t)(ch))
+#define IOTC_WIRE_MAGIC(flag)             ((flag) >> 24)
+#define IOTC_WIRE_TYPE(flag)              (((flag) >> 8) & 0xFFFF)
+#define IOTC_WIRE_CHANNEL(flag)           ((flag) & 0xFF)
+
+/* Session message types.  CONNECT carries the UID and the sender's SID,
+ * CONNECT_ACK the acceptor's SID; every other message is addressed by the
+ * receiver's SID in the header. */
+#define IOTC_MSG_CONNECT                  0x0101
+#define IOTC_MSG_CONNECT_ACK              0x0102
+#define IOTC_CONNECT_PAYLOAD_SIZE         24
+#define IOTC_MSG_DATA                     0x0300
+#define IOTC_MSG_KEEPALIVE                0x0301
+#define IOTC_MSG_CLOSE                    0x0302
+#define IOTC_MSG_DATA_FRAG                0x0303
+#define IOTC_MSG_DATA_FEC                 0x0304
+#define IOTC_MSG_RDT_DATA                 0x0400
+#define IOTC_MSG_RDT_ACK                  0x0401
+#define IOTC_MSG_PMTU_PROBE               0x0500
+#define IOTC_MSG_PMTU_ACK                 0x0501
+#define IOTC_MSG_CC_FEEDBACK              0x0600
+
+/* Vendor SDK message types seen in example.py, recognised but not served:
+ * the login a device sends its P2P server, and AV authentication */
+#define IOTC_MSG_LOGIN                    0x0122
+#define IOTC_MSG_AV_AUTH                  0x0200
+
+/* Session timing defaults */
+#define DEFAULT_LAN_CONNECT_TIMEOUT_MS    5000
+#define DEFAULT_SESSION_IDLE_TIMEOUT_MS   30000
+#define DEFAULT_KEEPALIVE_INTERVAL_MS     1000
+#define CONNECT_RETRY_INTERVAL_MS         250
+
+/* Heartbeats: sessions are spread over a ring of buckets visited once per
+ * keep-alive interval; each visit probes its bucket with one sendmmsg per
+ * endpoint and disconnects sessions that missed too many beats. */
+#define HEARTBEAT_SLOTS                   16
+#define HEARTBEAT_MISSED_LIMIT            3
+#define HEARTBEAT_BATCH_MAX               64
+
+/* Path MTU discovery.  Sizes are UDP payload bytes (IOTC header included);
+ * the default matches the historical MAX_PACKET_SIZE framing. */
+#define PMTU_IP_UDP_OVERHEAD              28
+#define PMTU_BASE_DATAGRAM                1200
+#define PMTU_DEFAULT_DATAGRAM             (sizeof(IOTCHeader) + MAX_PACKET_SIZE)
+#define PMTU_MAX_DATAGRAM                 (9000 - PMTU_IP_UDP_OVERHEAD)
+#define PMTU_SEARCH_GRANULARITY           16
+#define PMTU_PROBE_TIMEOUT_MS             200
+#define PMTU_PROBE_TRIES                  3
+#define PMTU_RAISE_INTERVAL_MS            600000
+
+/* Large messages: DATA_FRAG payloads start with msg_id, total length and
+ * fragment index << 16 | fragment size, all 32-bit big-endian. */
+#define DEFAULT_MAX_MESSAGE_SIZE          (4 * 1024 * 1024)
+#define MAX_MESSAGE_SIZE_LIMIT            (16 * 1024 * 1024)
+#define FRAG_HEADER_SIZE                  12
+#define FRAG_BATCH_MAX                    64
+#define FRAG_SEND_WAIT_MS                 100
+#define REASSEMBLY_SLOTS                  16
+#define REASSEMBLY_TIMEOUT_MS             3000
+#define REASSEMBLY_POOL_SIZE              8
+
+/* Queue entries and paced datagrams come from power-of-two block classes,
+ * 64 bytes to 16 KB, each keeping up to BLOCK_POOL_CLASS_BYTES of free
+ * blocks for reuse. */
+#define BLOCK_POOL_MIN_SHIFT              6
+#define BLOCK_POOL_CLASSES                9
+#define BLOCK_POOL_CLASS_BYTES            (1024 * 1024)
+#define BLOCK_POOL_NONE                   0xff
+
+/* FEC parity packets: the fragment header with the group's first index,
+ * followed by mode << 24 | data fragments << 16 | parity fragments << 8 | row.
+ * Fragments on FEC channels shrink so parity fits the same datagram. */
+#define FEC_HEADER_SIZE                   16
+#define FEC_MAX_DATA                      64
+#define FEC_MAX_PARITY                    16
+
+/* Send pacing: a writer waits while its session has more than
+ * PACE_QUEUE_LIMIT bytes queued. */
+#define PACE_DEFAULT_BURST                (16 * 1024)
+#define PACE_QUEUE_LIMIT                  (4 * 1024 * 1024)
+#define PACE_BATCH_MAX                    64
+#define PACE_KIND_DATA                    0
+#define PACE_KIND_FRAGMENT                1
+#define PACE_KIND_PARITY                  2
+
+/* Congestion control.  DATA, fragment and parity datagrams carry a session
+ * transport sequence in the upper 16 bits of seq and their departure time in
+ * timestamp.  The receiver tracks the queuing delay trend of packet groups
+ * and reports it with loss and its receive rate in a CC_FEEDBACK every
+ * CC_FEEDBACK_INTERVAL_MS: rate(32) | received(16) | lost(16) | usage(8),
+ * then the delay echo. */
+#define CC_FEEDBACK_INTERVAL_MS           100
+#define CC_FEEDBACK_SIZE                  (12 + DELAY_ECHO_SIZE)
+#define CC_GROUP_SPAN_MS                  5
+#define CC_TREND_WINDOW                   20
+#define CC_TREND_SMOOTHING                0.9
+#define CC_TREND_GAIN                     4.0
+#define CC_TREND_MAX_DELTAS               60
+#define CC_OVERUSE_TIME_MS                10.0
+#define CC_THRESHOLD_INITIAL              12.5
+#define CC_THRESHOLD_MIN                  6.0
+#define CC_THRESHOLD_MAX                  600.0
+#define CC_THRESHOLD_MAX_STEP             15.0
+#define CC_THRESHOLD_UP                   0.0087
+#define CC_THRESHOLD_DOWN                 0.039
+#define CC_START_RATE                     (300 * 1000)
+#define CC_MIN_RATE                       (16 * 1000)
+#define CC_MAX_RATE                       (256 * 1000 * 1000)
+#define CC_STARTUP_GROWTH                 1.0       /* per second, until the first congestion signal */
+#define CC_GROWTH                         0.08
+#define CC_DECREASE_FACTOR                0.85
+#define CC_DECREASE_INTERVAL_MS           200
+#define CC_LOSS_HOLD_PERMILLE             20        /* no growth above this loss */
+#define CC_LOSS_DECREASE_PERMILLE         100       /* back off above this loss */
+#define CC_RATE_HEADROOM                  (10 * 1000)
+
+/* Path delay: CC_FEEDBACK and KEEPALIVE end with an echo of the newest peer
+ * timestamp and how long it was held: echo(32) | hold in us(32). */
+#define DELAY_ECHO_SIZE                   8
+#define DELAY_NO_ECHO                     UINT32_MAX
+#define DELAY_MIN_WINDOW_MS               10000
+#define DELAY_MAX_RTT_US                  (60 * 1000 * 1000)
+
+/* Reliable delivery: a 64-segment sliding window per RDT instance.  ACKs
+ * carry cumulative ack, 64-bit SACK bitmap, window and timestamp echo. */
+#define RDT_MAX_CHANNEL_NUMBER            64
+#define RDT_WINDOW                        64
+#define RDT_SEGMENT_SIZE                  MAX_PACKET_SIZE
+#define RDT_INITIAL_RTO_MS                200
+#define RDT_MIN_RTO_MS                    30
+#define RDT_MAX_RTO_MS                    3000
+#define RDT_DUPACK_THRESHOLD              3
+
+/* AV clients: pseudo-RTP H.264 read from one session channel each */
+#define AV_MAX_CLIENT_NUMBER              32
+#define AV_AUTH_MAX_SIZE                  256
+#define AV_START_CODE_SIZE                4
+
+/* Hierarchical timer wheel: 4 levels of 64 slots at 10 ms per tick covers ~46 hours */
+#define TIMER_WHEEL_TICK_MS               10
+#define TIMER_WHEEL_BITS                  6
+#define TIMER_WHEEL_SLOTS                 (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK                  (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS                4
+#define TIMER_WHEEL_MAX_DELTA             ((1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+/* I/O thread.  Sessions share UDP endpoints: index 0 is the client socket,
+ * the others are created by IOTC_Listen on fixed ports. */
+#define IO_MAX_EVENTS                     64
+#define IO_RECV_BATCH                     32
+#define IO_SOCKET_BUFFER_SIZE             (4 * 1024 * 1024)
+#define IO_WAKE_TOKEN                     UINT32_MAX
+#define MAX_ENDPOINT_NUMBER               8
+#define CLIENT_ENDPOINT                   0
+
+/* Network simulator (IOTC_Set_Network_Simulator).  Simulated endpoints
+ * have no socket; the client one takes an ephemeral port. */
+#define NETSIM_ENDPOINT_FD                0x7fffffff
+#define NETSIM_EPHEMERAL_PORT             49152
+#define NETSIM_DEFAULT_QUEUE              (64 * 1024)
+#define NETSIM_DEFAULT_MTU                1500
+#define NETSIM_MIN_MTU                    576
+#define NETSIM_EPOCH_US                   1000000ULL
+
+/* LAN discovery constants (see discover_printers() in example.py) */
+#define LAN_SEARCH_MULTICAST_ADDR         "239.255.255.250"
+#define LAN_SEARCH_PORT                   10000
+#define LAN_SEARCH_PROBE_MAGIC            0xFC
+#define LAN_SEARCH_RESPONSE_MAGIC         0xFD
+#define LAN_SEARCH_RESPONSE_MIN_SIZE      42
+#define LAN_DEVICE_TABLE_SIZE             64
+#define LAN_DISCOVERY_DEFAULT_INTERVAL_MS 2000
+#define LAN_DISCOVERY_EXPIRY_INTERVALS    3
+#define LAN_DISCOVERY_POLL_MS             100
+
+/* Shared-memory metrics export */
+#define METRICS_DEFAULT_INTERVAL_MS       1000
+
+/* Latency histograms: 16 buckets per power of two up to 2^32 us */
+#define HISTOGRAM_SUB_BITS                4
+#define HISTOGRAM_SUB_BUCKETS             (1u << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS                32
+
+/* Single-producer byte rings: set in a record's size word to mark padding */
+#define BYTE_RING_PAD                     0x80000000u
+
+/* Logging: a ring per logging thread, drained by the flusher every interval */
+#define LOG_RING_SIZE                     (64 * 1024)
+#define LOG_RECORD_MAX                    512
+#define LOG_STRING_MAX                    127
+#define LOG_TAG_SIZE                      16
+#define LOG_LINE_MAX                      1024
+#define LOG_OUTPUT_BUFFER                 (64 * 1024)
+#define LOG_FLUSH_INTERVAL_MS             50
+#define LOG_DEFAULT_RATE                  1000      /* records per second per thread */
+#define LOG_DEFAULT_BURST                 1000
+
+/* Packet capture: one ring and pcapng writer thread per captured session */
+#define CAPTURE_RING_SIZE                 (1024 * 1024)
+#define CAPTURE_OUTPUT_BUFFER             (64 * 1024)
+#define CAPTURE_FLUSH_INTERVAL_MS         20
+#define CAPTURE_LINKTYPE                  147       /* LINKTYPE_USER0 */
+#define CAPTURE_STATS_BLOCK               64        /* ISB closing every file */
+
+/* Wire views
+ *
+ * Read-only views over datagrams where they sit in the receive buffer.  The
+ * layouts are all byte arrays, so a view may point anywhere in a buffer with
+ * no alignment assumption, and the accessors load big-endian fields in place
+ * rather than copying the packet out into host-order structs.  Each view
+ * function checks the length before handing out a pointer; the offsets are
+ * checked against the formats in PROTOCOL.md and example.py at compile time. */
+static inline uint16_t wire_be16(const uint8_t *p) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return ntohs(v);
+}
+
+static inline uint32_t wire_be32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return ntohl(v);
+}
+
+/* 0xF1 session datagram: the IOTCHeader fields in network order, then the payload */
+typedef struct {
+    uint8_t flag[4];                    /* magic(8) | type(16) | channel(8) */
+    uint8_t sid[4];
+    uint8_t seq[4];
+    uint8_t timestamp[4];
+    uint8_t payload[4];                 /* Payload bytes that follow */
+} wire_session_t;
+
+_Static_assert(sizeof(wire_session_t) == sizeof(IOTCHeader), "session header is 20 bytes");
+_Static_assert(offsetof(wire_session_t, sid) == offsetof(IOTCHeader, sid), "sid offset");
+_Static_assert(offsetof(wire_session_t, seq) == offsetof(IOTCHeader, seq), "seq offset");
+_Static_assert(offsetof(wire_session_t, timestamp) == offsetof(IOTCHeader, timestamp), "timestamp offset");
+_Static_assert(offsetof(wire_session_t, payload) == offsetof(IOTCHeader, payload), "payload offset");
+
+/* NULL unless the datagram has the session magic and holds its whole payload */
+static inline const wire_session_t *wire_session_view(const uint8_t *p, size_t len) {
+    if (len < sizeof(wire_session_t) || p[0] != IOTC_SESSION_MAGIC) return NULL;
+    const wire_session_t *w = (const wire_session_t *)p;
+    return wire_be32(w->payload) <= len - sizeof(*w) ? w : NULL;
+}
+
+static inline unsigned int wire_session_type(const wire_session_t *w) {
+    return wire_be16(w->flag + 1);
+}
+
+static inline unsigned int wire_session_channel(const wire_session_t *w) {
+    return w->flag[3];
+}
+
+static inline uint32_t wire_session_sid(const wire_session_t *w) {
+    return wire_be32(w->sid);
+}
+
+static inline uint32_t wire_session_payload_len(const wire_session_t *w) {
+    return wire_be32(w->payload);
+}
+
+static inline const uint8_t *wire_session_payload(const wire_session_t *w) {
+    return (const uint8_t *)(w + 1);
+}
+
+/* CONNECT payload: the UID, then the sender's SID */
+typedef struct {
+    uint8_t uid[20];
+    uint8_t sid[4];
+} wire_connect_t;
+
+_Static_assert(sizeof(wire_connect_t) == IOTC_CONNECT_PAYLOAD_SIZE, "CONNECT payload size");
+
+/* DATA_FRAG payload header; DATA_FEC extends it with the parity layout */
+typedef struct {
+    uint8_t msg_id[4];
+    uint8_t total_len[4];
+    uint8_t index_size[4];              /* Fragment index << 16 | fragment size */
+} wire_frag_t;
+
+typedef struct {
+    wire_frag_t frag;                   /* Index of the group's first fragment */
+    uint8_t layout[4];                  /* mode(8) | data(8) | parity(8) | row(8) */
+} wire_fec_t;
+
+_Static_assert(sizeof(wire_frag_t) == FRAG_HEADER_SIZE, "fragment header size");
+_Static_assert(sizeof(wire_fec_t) == FEC_HEADER_SIZE, "parity header size");
+_Static_assert(offsetof(wire_fec_t, layout) == FRAG_HEADER_SIZE, "parity layout follows the fragment header");
+
+static inline uint32_t wire_frag_msg_id(const wire_frag_t *f) {
+    return wire_be32(f->msg_id);
+}
+
+static inline uint32_t wire_frag_total_len(const wire_frag_t *f) {
+    return wire_be32(f->total_len);
+}
+
+static inline uint32_t wire_frag_index(const wire_frag_t *f) {
+    return wire_be16(f->index_size);
+}
+
+static inline uint32_t wire_frag_size(const wire_frag_t *f) {
+    return wire_be16(f->index_size + 2);
+}
+
+/* Delay echo closing KEEPALIVE and CC_FEEDBACK */
+typedef struct {
+    uint8_t echo[4];                    /* Newest peer timestamp, ms */
+    uint8_t hold[4];                    /* Microseconds it was held, DELAY_NO_ECHO for none */
+} wire_echo_t;
+
+typedef struct {
+    uint8_t rate[4];                    /* Receive rate, bytes per second */
+    uint8_t received[2];
+    uint8_t lost[2];
+    uint8_t usage;                      /* Delay detector state */
+    uint8_t reserved[3];
+    wire_echo_t echo;
+} wire_cc_feedback_t;
+
+_Static_assert(sizeof(wire_echo_t) == DELAY_ECHO_SIZE, "delay echo size");
+_Static_assert(sizeof(wire_cc_feedback_t) == CC_FEEDBACK_SIZE, "CC_FEEDBACK size");
+_Static_assert(offsetof(wire_cc_feedback_t, echo) == CC_FEEDBACK_SIZE - DELAY_ECHO_SIZE, "echo closes CC_FEEDBACK");
+
+/* RDT_ACK payload */
+typedef struct {
+    uint8_t cum[4];                     /* Next expected segment */
+    uint8_t sack_lo[4];                 /* SACK bitmap of the 64 segments after cum */
+    uint8_t sack_hi[4];
+    uint8_t window[4];                  /* Free receive window, segments */
+    uint8_t echo[4];                    /* Timestamp of the acknowledged segment */
+} wire_rdt_ack_t;
+
+_Static_assert(sizeof(wire_rdt_ack_t) == 5 * sizeof(uint32_t), "RDT_ACK payload size");
+
+/* LAN search probe (0xFC) and response (0xFD), as in discover_printers() */
+typedef struct {
+    uint8_t magic;
+    uint8_t reserved;
+    uint8_t length[2];                  /* 12, the bytes after this field */
+    uint8_t time[4];
+    uint8_t nonce[4];
+    uint8_t zero[4];
+} wire_lan_probe_t;
+
+typedef struct {
+    uint8_t magic;
+    uint8_t reserved[3];
+    uint8_t uid[20];
+    uint8_t ip[16];                     /* Dotted decimal, NUL padded */
+    uint8_t port[2];
+} wire_lan_response_t;
+
+_Static_assert(sizeof(wire_lan_probe_t) == 16, "LAN probe size");
+_Static_assert(offsetof(wire_lan_probe_t, time) == 4, "LAN probe time offset");
+_Static_assert(sizeof(wire_lan_response_t) == LAN_SEARCH_RESPONSE_MIN_SIZE, "LAN response size");
+_Static_assert(offsetof(wire_lan_response_t, uid) == 4, "LAN response UID offset");
+_Static_assert(offsetof(wire_lan_response_t, ip) == 24, "LAN response IP offset");
+_Static_assert(offsetof(wire_lan_response_t, port) == 40, "LAN response port offset");
+
+static inline const wire_lan_response_t *wire_lan_response_view(const uint8_t *p, size_t len) {
+    if (len < sizeof(wire_lan_response_t) || p[0] != LAN_SEARCH_RESPONSE_MAGIC) return NULL;
+    return (const wire_lan_response_t *)p;
+}
+
+/* Pseudo-RTP video, as read by stream_to_file(): an RFC 3550 header, then an
+ * H.264 NAL unit or an FU-A fragment of one.  rx_count_other classifies bare
+ * RTP datagrams with these views and the AV client rebuilds frames from them. */
+#define RTP_VERSION                       2
+#define RTP_PAYLOAD_H264                  96
+#define H264_NAL_IDR                      5
+#define H264_NAL_SPS                      7
+#define H264_NAL_PPS                      8
+#define H264_NAL_FU_A                     28
+
+typedef struct {
+    uint8_t vpxcc;                      /* version(2) | padding(1) | extension(1) | CSRC count(4) */
+    uint8_t mpt;                        /* marker(1) | payload type(7) */
+    uint8_t seq[2];
+    uint8_t timestamp[4];               /* 90 kHz media clock */
+    uint8_t ssrc[4];
+} wire_rtp_t;
+
+/* FU-A: the fragmented NAL unit's header split over two bytes */
+typedef struct {
+    uint8_t indicator;                  /* F | NRI | 28 */
+    uint8_t header;                     /* start | end | reserved | NAL type */
+} wire_fu_a_t;
+
+_Static_assert(sizeof(wire_rtp_t) == 12, "RTP fixed header size");
+_Static_assert(offsetof(wire_rtp_t, seq) == 2, "RTP sequence offset");
+_Static_assert(offsetof(wire_rtp_t, timestamp) == 4, "RTP timestamp offset");
+_Static_assert(offsetof(wire_rtp_t, ssrc) == 8, "RTP SSRC offset");
+_Static_assert(sizeof(wire_fu_a_t) == 2, "FU-A header size");
+
+/* An RTP packet and the payload left after CSRCs, extension and padding */
+typedef struct {
+    const wire_rtp_t *rtp;
+    const uint8_t *payload;
+    size_t payload_len;
+} rtp_view_t;
+
+static inline int wire_rtp_view(const uint8_t *p, size_t len, rtp_view_t *view) {
+    if (len < sizeof(wire_rtp_t) || (p[0] >> 6) != RTP_VERSION) return -1;
+    
+    size_t offset = sizeof(wire_rtp_t) + 4 * (size_t)(p[0] & 0x0F);
+    if (p[0] & 0x10) {
+        if (offset + 4 > len) return -1;
+        offset += 4 + 4 * (size_t)wire_be16(p + offset + 2);
+    }
+    size_t padding = (p[0] & 0x20) ? p[len - 1] : 0;
+    if (offset + padding > len) return -1;
+    
+    view->rtp = (const wire_rtp_t *)p;
+    view->payload = p + offset;
+    view->payload_len = len - offset - padding;
+    return 0;
+}
+
+static inline unsigned int wire_rtp_payload_type(const wire_rtp_t *r) {
+    return r->mpt & 0x7F;
+}
+
+static inline int wire_rtp_marker(const wire_rtp_t *r) {
+    return r->mpt >> 7;
+}
+
+static inline uint16_t wire_rtp_seq(const wire_rtp_t *r) {
+    return wire_be16(r->seq);
+}
+
+static inline uint32_t wire_rtp_timestamp(const wire_rtp_t *r) {
+    return wire_be32(r->timestamp);
+}
+
+static inline unsigned int wire_nal_type(uint8_t nal_header) {
+    return nal_header & 0x1F;
+}
+
+static inline int wire_fu_start(const wire_fu_a_t *fu) {
+    return (fu->header & 0x80) != 0;
+}
+
+static inline int wire_fu_end(const wire_fu_a_t *fu) {
+    return (fu->header & 0x40) != 0;
+}
+
+/* The header byte of the NAL unit the fragments rebuild */
+static inline uint8_t wire_fu_nal_header(const wire_fu_a_t *fu) {
+    return (uint8_t)((fu->indicator & 0xE0) | (fu->header & 0x1F));
+}
+
 /* Session states */
 typedef enum {
     SESSION_STATE_FREE = 0,
@@ -92,213 +538,6218 @@ typedef enum {
 typedef struct message_entry {
     uint8_t *data;
     size_t size;
+    size_t capacity;                    /* nonzero when data is a pooled reassembly buffer */
     uint16_t seq_id;
+    uint8_t pool_class;                 /* block class of the entry itself */
+    uint64_t queued_us;                 /* for the DELIVERY histogram */
     struct message_entry *next;
 } message_entry_t;
 
+/* Token bucket; rate 0 means unlimited */
+typedef struct {
+    uint32_t rate;                      /* bytes per second */
+    uint32_t burst;                     /* bytes */
+    int64_t credit;                     /* byte-milliseconds, negative while in debt */
+    uint64_t last_ms;
+    int backlogged;                     /* queue left waiting on the last drain */
+} token_bucket_t;
+
 /* Channel information */
 typedef struct {
     channel_state_t state;
     uint16_t next_seq_id;
+    uint16_t expected_seq_id;   /* next sequence number the reader expects */
+    uint8_t fec_mode;           /* IOTC_FEC_* applied to fragmented writes */
+    uint8_t fec_data;
+    uint8_t fec_parity;
+    token_bucket_t pace;
+    struct paced_packet *pace_head;     /* datagrams waiting for the buckets */
+    struct paced_packet *pace_tail;
     message_entry_t *msg_queue_head;
     message_entry_t *msg_queue_tail;
+    uint32_t queue_messages;            /* received messages waiting to be read */
+    uint64_t queue_bytes;
     pthread_mutex_t queue_mutex;
+    struct av_client *av;               /* AV client reading the channel, if any */
 } channel_info_t;
 
-/* Session information */
+/* Traffic counters for IOTC_Session_Get_Info.  They are bumped with relaxed
+ * atomic adds, as the histograms are, so a counter never depends on which
+ * lock its writer holds and readers that skip the mutex never see a torn
+ * value. */
+#define STAT_ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#define STAT_READ(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+/* Static tracepoints.  Built with -DIOTC_USDT (make USDT=1) every probe below
+ * becomes a SystemTap SDT note in the "iotc" provider that bpftrace and perf
+ * can attach to, e.g. `bpftrace -l 'usdt:native/lib/libIOTCAPIsT.so:iotc:*'`.
+ * An unattached probe is a single nop; without the flag they compile away.
+ *
+ *   session__create   sid
+ *   session__close    sid, close reason
+ *   channel__on/off   sid, channel
+ *   message__enqueue  sid, channel, bytes, bytes now queued on the channel
+ *   message__dequeue  sid, channel, bytes, microseconds spent queued
+ *   packet__send      sid, channel (-1 for control), bytes, datagrams
+ *   packet__receive   sid, channel (-1 for control), bytes
+ *   timeout__fire     sid (0 for IOTC_Listen), kind: "read", "listen", "idle",
+ *                     "connect", "retransmit", "reassembly" or "pmtu"
+ */
+#ifdef IOTC_USDT
+#define IOTC_PROBE1(name, a)          DTRACE_PROBE1(iotc, name, a)
+#define IOTC_PROBE2(name, a, b)       DTRACE_PROBE2(iotc, name, a, b)
+#define IOTC_PROBE3(name, a, b, c)    DTRACE_PROBE3(iotc, name, a, b, c)
+#define IOTC_PROBE4(name, a, b, c, d) DTRACE_PROBE4(iotc, name, a, b, c, d)
+#else
+#define IOTC_PROBE1(name, a)          do { } while (0)
+#define IOTC_PROBE2(name, a, b)       do { } while (0)
+#define IOTC_PROBE3(name, a, b, c)    do { } while (0)
+#define IOTC_PROBE4(name, a, b, c, d) do { } while (0)
+#endif
+#define IOTC_PROBE_TIMEOUT(sid, kind) IOTC_PROBE2(timeout__fire, sid, (const char *)(kind))
+
+typedef struct {
+    uint64_t bytes_in;                  /* datagrams, IOTC header included */
+    uint64_t bytes_out;
+    uint64_t packets_in;
+    uint64_t packets_out;
+    uint64_t drops;                     /* messages discarded on receive, datagrams the socket refused */
+    uint64_t retransmits;               /* RDT segments sent again */
+} traffic_counters_t;
+
+/* Timer wheel entry, embedded in the object it belongs to */
+typedef struct iotc_timer {
+    struct iotc_timer *next;
+    struct iotc_timer *prev;
+    uint64_t expires;                   /* absolute tick */
+    void (*fn)(struct iotc_timer *timer, uint64_t now_ms);
+    void *arg;
+    int pending;
+} iotc_timer_t;
+
+typedef struct {
+    iotc_timer_t slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];  /* list sentinels */
+    uint64_t current_tick;
+    uint32_t pending;
+} iotc_timer_wheel_t;
+
+/* Congestion control: the receive half runs the delay detector over the
+ * peer's media, the send half holds our own bandwidth estimate */
+typedef struct {
+    /* Receive side */
+    uint16_t rx_next_seq;               /* next expected transport sequence */
+    uint8_t rx_seq_valid;
+    uint8_t usage;                      /* IOTC_CONGESTION_* from the detector */
+    uint32_t rx_received;               /* datagrams and gaps since the last feedback */
+    uint32_t rx_lost;
+    uint64_t rx_bytes;
+    uint64_t rx_interval_start;         /* monotonic ms the feedback interval opened */
+    uint32_t group_first_send;          /* packet group being collected */
+    uint32_t group_last_send;
+    double group_arrival;
+    uint32_t prev_send;                 /* last completed group */
+    double prev_arrival;
+    uint8_t group_valid;
+    uint8_t prev_valid;
+    uint32_t num_deltas;
+    double first_arrival;
+    double accumulated_delay;           /* ms, queuing delay relative to the first group */
+    double smoothed_delay;
+    double trend_x[CC_TREND_WINDOW];
+    double trend_y[CC_TREND_WINDOW];
+    unsigned int trend_count;
+    unsigned int trend_pos;
+    double slope;                       /* ms of queuing delay per ms */
+    double trend;
+    double prev_trend;
+    double threshold;
+    double overuse_ms;                  /* time above the threshold, negative when below */
+    unsigned int overuse_count;
+    double last_detect;
+    
+    /* Send side */
+    uint16_t tx_seq;
+    uint8_t enabled;                    /* the estimate drives the session pacing rate */
+    uint8_t startup;                    /* no congestion seen yet, ramp quickly */
+    uint8_t peer_usage;
+    uint32_t estimate;                  /* bytes per second */
+    uint32_t peer_rate;                 /* receive rate in the last feedback */
+    uint32_t loss_permille;
+    uint32_t rate_limit;                /* IOTC_Session_Set_Pacing rate, 0 for none */
+    uint64_t last_feedback;
+    uint64_t last_decrease;
+} congestion_t;
+
+/* RTT from echoed timestamps, jitter and queuing delay from the peer's media */
 typedef struct {
+    uint32_t peer_ts;                   /* newest peer timestamp, echoed back */
+    uint64_t peer_ts_arrival_us;
+    uint8_t peer_ts_valid;
+    uint8_t transit_valid;
+    uint8_t window_valid;
+    uint64_t echo_sent_ms;              /* heartbeats add a KEEPALIVE when this goes stale */
+    uint32_t srtt_us;
+    uint32_t rttvar_us;
+    uint32_t rtt_min_us;
+    uint32_t rtt_latest_us;
+    uint32_t rtt_samples;
+    double prev_transit;                /* ms, receive time minus the peer's timestamp */
+    double jitter_ms;
+    double min_current;                 /* lowest transit in this window and the last one */
+    double min_prev;
+    uint64_t window_start;
+    double queuing_ms;
+} delay_tracker_t;
+
+/* Session information */
+typedef struct session_info {
     session_state_t state;
     char uid[21];
     struct sockaddr_in remote_addr;
-    int socket_fd;
+    int endpoint;                       /* shared socket used to reach remote_addr, -1 without a peer */
+    int has_peer;
     uint32_t session_id;
+    uint32_t remote_session_id;
+    uint32_t next_msg_id;               /* ID of the next fragmented message */
+    uint32_t frag_rx_newest;            /* newest message ID that started reassembly */
+    int64_t close_reason;               /* error reported once the session is DISCONNECTED */
     channel_info_t channels[MAX_CHANNEL_NUMBER];
     pthread_mutex_t session_mutex;
-    time_t last_activity;
+    pthread_cond_t state_cond;          /* data arrival and state changes, waited on with global_mutex */
+    uint64_t last_activity;             /* monotonic ms of the last datagram received */
+    uint64_t last_send;                 /* monotonic ms of the last datagram sent */
+    uint64_t connect_deadline;
+    iotc_timer_t idle_timer;
+    iotc_timer_t connect_timer;
+    
+    /* Path MTU search state; pmtu is the datagram size used for framing */
+    uint32_t pmtu;
+    uint32_t pmtu_lo;                   /* largest size known to work */
+    uint32_t pmtu_hi;                   /* smallest size known to fail, minus one */
+    uint32_t pmtu_probe;                /* size in flight, 0 when idle */
+    uint8_t pmtu_tries;
+    uint8_t pmtu_acked;
+    uint8_t pmtu_searching;
+    iotc_timer_t pmtu_timer;
+    
+    /* Transmit counters for IOTC_Session_Get_Path_Stats (heartbeats and probes excluded) */
+    uint64_t tx_bytes;
+    uint64_t tx_calls;
+    uint64_t tx_datagrams;
+    uint64_t tx_fragmented;
+    uint64_t tx_fragments;
+    uint64_t tx_parity;
+    uint64_t rx_recovered;
+    
+    /* Send pacing */
+    token_bucket_t pace;
+    size_t pace_bytes;                  /* bytes queued across all channels */
+    uint64_t pace_next_ns;              /* earliest departure of the next SO_TXTIME datagram */
+    uint8_t pace_rr;                    /* channel the next drain starts from */
+    iotc_timer_t pace_timer;
+    
+    congestion_t cc;
+    iotc_timer_t cc_timer;              /* sends CC_FEEDBACK for the current interval */
+    delay_tracker_t delay;
+    
+    /* Traffic counters; the session totals include control messages */
+    uint64_t connected_ms;              /* monotonic ms the session reached CONNECTED */
+    traffic_counters_t traffic;
+    traffic_counters_t channel_traffic[MAX_CHANNEL_NUMBER];
+    
+    struct rdt_channel *rdt[MAX_CHANNEL_NUMBER];  /* reliable stream bound to each channel */
+    struct capture *capture;            /* IOTC_Session_Capture_Start, NULL when off */
+    struct session_info *hb_next;       /* heartbeat bucket membership */
+    struct session_info *hb_prev;
+    int hb_slot;                        /* -1 when not scheduled */
 } session_info_t;
 
+/* Shared UDP socket polled by the I/O thread */
+typedef struct {
+    int fd;
+    uint16_t port;                      /* bound port for listen endpoints, 0 for the client one */
+    int txtime;                         /* SO_TXTIME accepted, paced datagrams carry departure times */
+} iotc_endpoint_t;
+
+/* IOTC_Listen caller waiting for the I/O thread to accept a CONNECT */
+typedef struct listen_wait {
+    struct listen_wait *next;
+    int endpoint;
+    const char *uid;                    /* NULL or empty accepts any UID */
+    int64_t result;                     /* accepted SID, 0 while pending */
+    int expired;
+} listen_wait_t;
+
 /* Global state */
 static struct {
     int initialized;
     session_info_t *sessions;
     int max_sessions;
+    unsigned int configured_sessions;   /* IOTC_Set_Max_Session_Number, 0 for the default */
     pthread_mutex_t global_mutex;
     int next_session_id;
-} g_iotc_state = {0};
-
-/* Network helpers */
-static int create_udp_socket(void) {
-    int sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sock < 0) return -1;
     
-    int opt = 1;
-    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    /* I/O thread, owns the timer wheel (both guarded by global_mutex) */
+    pthread_t io_thread;
+    int io_running;
+    int epoll_fd;
+    int wake_fd;
+    iotc_timer_wheel_t wheel;
+    iotc_endpoint_t endpoints[MAX_ENDPOINT_NUMBER];
+    listen_wait_t *listen_waiters;
+    pthread_cond_t listen_cond;
     
-    return sock;
+    /* Heartbeat scheduler */
+    session_info_t *heartbeat_slots[HEARTBEAT_SLOTS];
+    unsigned int heartbeat_cursor;
+    unsigned int heartbeat_sessions;
+    uint64_t heartbeat_last_ms;
+    iotc_timer_t heartbeat_timer;
+    
+    /* Setup_*_Timeout knobs */
+    unsigned int lan_connect_timeout_ms;
+    unsigned int idle_timeout_ms;
+    unsigned int keepalive_interval_ms;
+    unsigned int max_message_size;
+} g_iotc_state = {0};
+
+/* Network simulator.  Datagrams in flight are kept in arrival order.
+ * Guarded by global_mutex; the clock helpers read now_us atomically. */
+typedef struct netsim_packet {
+    struct netsim_packet *next;
+    uint64_t deliver_us;
+    struct sockaddr_in from;
+    int endpoint;                       /* destination */
+    uint8_t pool_class;
+    size_t len;
+    uint8_t data[];
+} netsim_packet_t;
+
+/* One direction between two endpoints */
+typedef struct {
+    uint64_t busy_until_us;             /* when the bottleneck has sent its backlog */
+    uint64_t last_deliver_us;           /* keeps jittered datagrams in order */
+} netsim_link_t;
+
+static struct {
+    IOTCNetSimConfig config;            /* for the next IOTC_Initialize */
+    int configured;
+    int enabled;                        /* both fixed between IOTC_Initialize and IOTC_DeInitialize */
+    int virtual_clock;
+    IOTCNetSimConfig active;            /* impairments in effect, defaults filled in */
+    uint64_t now_us;                    /* virtual clock */
+    uint64_t rng;
+    netsim_packet_t *head;
+    netsim_packet_t *tail;
+    netsim_link_t links[MAX_ENDPOINT_NUMBER][MAX_ENDPOINT_NUMBER];
+    IOTCNetSimStats stats;
+} g_netsim = {0};
+
+/* LAN device table slot, published to readers through a per-slot seqlock */
+typedef struct {
+    uint32_t seq;           /* odd while the discovery thread rewrites the slot */
+    uint32_t in_use;
+    IOTCDevInfo info;
+    uint64_t last_seen_ms;  /* accessed atomically, outside the seqlock */
+} lan_device_slot_t;
+
+/* Background LAN discovery state */
+static struct {
+    lan_device_slot_t slots[LAN_DEVICE_TABLE_SIZE];
+    int running;
+    pthread_t thread;
+    int probe_fd;
+    int passive_fd;
+    unsigned int interval_ms;
+    IOTC_Lan_Device_Callback callback;
+    void *user_data;
+    pthread_mutex_t control_mutex;
+} g_lan_discovery = {0};
+
+/* Metrics export and the library-wide counters behind it, guarded by global_mutex */
+static struct {
+    IOTCMetricsFile *file;              /* NULL while not exporting */
+    size_t size;
+    unsigned int interval_ms;
+    iotc_timer_t timer;
+    uint64_t sessions_opened;
+    uint64_t sessions_closed;
+    traffic_counters_t retired;         /* traffic of sessions already closed */
+    uint64_t rtt_count;
+    uint64_t rtt_sum_us;
+    uint64_t rtt_buckets[IOTC_METRICS_RTT_BUCKETS];
+} g_metrics = {0};
+
+static const uint32_t g_metrics_rtt_bounds[IOTC_METRICS_RTT_BUCKETS - 1] = IOTC_METRICS_RTT_BOUNDS_US;
+
+static void metrics_record_rtt(uint32_t rtt_us) {
+    unsigned int bucket = 0;
+    while (bucket < IOTC_METRICS_RTT_BUCKETS - 1 && rtt_us > g_metrics_rtt_bounds[bucket]) bucket++;
+    STAT_ADD(g_metrics.rtt_buckets[bucket], 1);
+    STAT_ADD(g_metrics.rtt_count, 1);
+    STAT_ADD(g_metrics.rtt_sum_us, rtt_us);
 }
 
-static int create_tcp_socket(void) {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) return -1;
-    
-    int opt = 1;
-    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+/* Time helpers */
+#ifndef CLOCK_MONOTONIC_COARSE
+#define CLOCK_MONOTONIC_COARSE CLOCK_MONOTONIC
+#endif
+
+/* vDSO-backed coarse clock: no syscall on the data path, ~1-4 ms resolution */
+static uint64_t iotc_now_ms(void) {
+    if (g_netsim.virtual_clock) return __atomic_load_n(&g_netsim.now_us, __ATOMIC_RELAXED) / 1000u;
     
-    return sock;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
 }
 
-/* Message queue management */
-static void init_channel(channel_info_t *channel) {
-    channel->state = CHANNEL_STATE_OFF;
-    channel->next_seq_id = 1;
-    channel->msg_queue_head = NULL;
-    channel->msg_queue_tail = NULL;
-    pthread_mutex_init(&channel->queue_mutex, NULL);
+/* Full-resolution clock for the delay measurements of congestion control */
+static uint64_t iotc_now_us(void) {
+    if (g_netsim.virtual_clock) return __atomic_load_n(&g_netsim.now_us, __ATOMIC_RELAXED);
+    
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
 }
 
-static void cleanup_channel(channel_info_t *channel) {
-    pthread_mutex_lock(&channel->queue_mutex);
-    
-    message_entry_t *entry = channel->msg_queue_head;
-    while (entry) {
-        message_entry_t *next = entry->next;
-        free(entry->data);
-        free(entry);
-        entry = next;
-    }
-    
-    channel->msg_queue_head = NULL;
-    channel->msg_queue_tail = NULL;
+/* Latency histograms
+ *
+ * Fixed-size log-linear buckets: values below 2^HISTOGRAM_SUB_BITS get a
+ * bucket each, above that every power of two splits into the same number of
+ * buckets.  Any thread records with relaxed atomic adds and no lock; a reset
+ * exchanges each bucket with zero, so every sample is reported exactly once
+ * across resetting reads.  The minimum is kept inverted so that an all-zero
+ * histogram means empty. */
+typedef struct {
+    uint64_t buckets[IOTC_HISTOGRAM_BUCKETS];
+    uint64_t sum_us;
+    uint64_t max_us;
+    uint64_t min_inv;                   /* ~minimum, 0 when empty */
+} histogram_t;
+
+static histogram_t g_histograms[IOTC_HISTOGRAM_DELIVERY + MAX_CHANNEL_NUMBER];
+
+static unsigned int histogram_bucket(uint64_t us) {
+    if (us < HISTOGRAM_SUB_BUCKETS) return (unsigned int)us;
+    if (us >> HISTOGRAM_MAX_BITS) return IOTC_HISTOGRAM_BUCKETS - 1;
     
-    pthread_mutex_unlock(&channel->queue_mutex);
-    pthread_mutex_destroy(&channel->queue_mutex);
+    unsigned int msb = 63 - (unsigned int)__builtin_clzll(us);
+    unsigned int shift = msb - HISTOGRAM_SUB_BITS;
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS + (unsigned int)(us >> shift) - HISTOGRAM_SUB_BUCKETS;
 }
 
-static int enqueue_message(channel_info_t *channel, const void *data, size_t size, uint16_t seq_id) {
-    message_entry_t *entry = malloc(sizeof(message_entry_t));
-    if (!entry) return -1;
-    
-    entry->data = malloc(size);
-    if (!entry->data) {
-        free(entry);
-        return -1;
+static void histogram_max(uint64_t *slot, uint64_t value) {
+    uint64_t current = __atomic_load_n(slot, __ATOMIC_RELAXED);
+    while (value > current &&
+           !__atomic_compare_exchange_n(slot, &current, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
     }
+}
+
+static void histogram_record(int histogram, uint64_t us) {
+    histogram_t *h = &g_histograms[histogram];
+    __atomic_fetch_add(&h->buckets[histogram_bucket(us)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_us, us, __ATOMIC_RELAXED);
+    histogram_max(&h->max_us, us);
+    histogram_max(&h->min_inv, ~us);
+}
+
+static uint64_t histogram_take(uint64_t *slot, int reset) {
+    return reset ? __atomic_exchange_n(slot, 0, __ATOMIC_RELAXED) : __atomic_load_n(slot, __ATOMIC_RELAXED);
+}
+
+/* Single-producer byte rings for the logger and packet capture.  Records
+ * are contiguous, 8-byte aligned and start with their uint32_t size; one
+ * that would straddle the end of the ring is preceded by a padding record
+ * with BYTE_RING_PAD set.  head and tail only grow and are published with
+ * release stores, so neither side ever locks. */
+typedef struct {
+    uint8_t *data;
+    size_t size;                        /* a multiple of 8 */
+    uint64_t head;                      /* written by the producer */
+    uint64_t tail;                      /* written by the consumer */
+    uint64_t next_head;                 /* producer only: head after the reserved record */
+} byte_ring_t;
+
+/* Producer: contiguous room for size bytes (a multiple of 8), or NULL when full */
+static uint8_t *byte_ring_reserve(byte_ring_t *ring, size_t size) {
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t offset = (size_t)(head % ring->size);
+    size_t pad = ring->size - offset < size ? ring->size - offset : 0;
     
-    memcpy(entry->data, data, size);
-    entry->size = size;
-    entry->seq_id = seq_id;
-    entry->next = NULL;
-    
-    pthread_mutex_lock(&channel->queue_mutex);
+    if (head + pad + size - tail > ring->size) return NULL;
     
-    if (channel->msg_queue_tail) {
-        channel->msg_queue_tail->next = entry;
-    } else {
-        channel->msg_queue_head = entry;
+    if (pad) {
+        uint32_t marker = (uint32_t)pad | BYTE_RING_PAD;
+        memcpy(ring->data + offset, &marker, sizeof(marker));
+        offset = 0;
     }
-    channel->msg_queue_tail = entry;
-    
-    pthread_mutex_unlock(&channel->queue_mutex);
-    return 0;
+    ring->next_head = head + pad + size;
+    return ring->data + offset;
 }
 
-static message_entry_t *dequeue_message(channel_info_t *channel) {
-    pthread_mutex_lock(&channel->queue_mutex);
-    
-    message_entry_t *entry = channel->msg_queue_head;
-    if (entry) {
-        channel->msg_queue_head = entry->next;
-        if (!channel->msg_queue_head) {
-            channel->msg_queue_tail = NULL;
-        }
-    }
-    
-    pthread_mutex_unlock(&channel->queue_mutex);
-    return entry;
+/* Publishes the reserved record; returns the bytes now queued */
+static uint64_t byte_ring_commit(byte_ring_t *ring) {
+    __atomic_store_n(&ring->head, ring->next_head, __ATOMIC_RELEASE);
+    return ring->next_head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
 }
 
-/* Session management */
-static session_info_t *find_session_by_id(int session_id) {
-    for (int i = 0; i < g_iotc_state.max_sessions; i++) {
-        if (g_iotc_state.sessions[i].state != SESSION_STATE_FREE &&
-            g_iotc_state.sessions[i].session_id == session_id) {
-            return &g_iotc_state.sessions[i];
+/* Consumer: the oldest record before head, skipping padding; NULL once drained */
+static const uint8_t *byte_ring_peek(byte_ring_t *ring, uint64_t head, uint32_t *size) {
+    while (ring->tail != head) {
+        const uint8_t *record = ring->data + ring->tail % ring->size;
+        uint32_t len;
+        memcpy(&len, record, sizeof(len));
+        if (!(len & BYTE_RING_PAD)) {
+            *size = len;
+            return record;
         }
+        __atomic_store_n(&ring->tail, ring->tail + (len & ~BYTE_RING_PAD), __ATOMIC_RELEASE);
     }
     return NULL;
 }
 
-static session_info_t *find_free_session(void) {
-    for (int i = 0; i < g_iotc_state.max_sessions; i++) {
-        if (g_iotc_state.sessions[i].state == SESSION_STATE_FREE) {
-            return &g_iotc_state.sessions[i];
-        }
-    }
-    return NULL;
+static void byte_ring_release(byte_ring_t *ring, uint32_t size) {
+    __atomic_store_n(&ring->tail, ring->tail + size, __ATOMIC_RELEASE);
 }
 
-static void init_session(session_info_t *session) {
-    session->state = SESSION_STATE_FREE;
-    memset(session->uid, 0, sizeof(session->uid));
-    memset(&session->remote_addr, 0, sizeof(session->remote_addr));
-    session->socket_fd = -1;
-    session->session_id = 0;
-    session->last_activity = time(NULL);
-    
-    for (int i = 0; i < MAX_CHANNEL_NUMBER; i++) {
-        init_channel(&session->channels[i]);
+/* Asynchronous logging
+ *
+ * Every thread that logs owns a byte ring of binary records: the format
+ * pointer, a wall-clock timestamp and the arguments the format names, with
+ * strings copied inline.  Producers never lock or format; the flusher
+ * thread is the only consumer and does the printf work before appending to
+ * the file. */
+typedef struct {
+    uint32_t size;                      /* whole record, a multiple of 8 */
+    uint8_t level;
+    uint8_t truncated;                  /* the arguments did not all fit */
+    uint16_t reserved;
+    uint64_t time_us;                   /* CLOCK_REALTIME */
+    const char *fmt;
+    char tag[LOG_TAG_SIZE];
+} log_record_t;
+
+typedef struct log_ring {
+    byte_ring_t ring;
+    uint8_t data[LOG_RING_SIZE];
+    uint64_t dropped;                   /* ring full */
+    uint64_t suppressed;                /* over the rate limit */
+    uint64_t reported_dropped;          /* flusher only */
+    uint64_t reported_suppressed;
+    int signalled;                      /* early wakeup sent, cleared by the flusher */
+    double tokens;                      /* owning thread only */
+    uint64_t refill_ms;
+    long tid;
+    int orphaned;                       /* owner exited; freed once drained */
+    struct log_ring *next;
+} log_ring_t;
+
+static struct {
+    int level;                          /* effective: NONE while no file is open */
+    int configured_level;
+    unsigned int rate;
+    unsigned int burst;
+    pthread_mutex_t control_mutex;      /* serializes IOTC_Set_Log_Path */
+    pthread_mutex_t mutex;              /* ring list, file and output buffer */
+    pthread_cond_t cond;
+    pthread_once_t once;
+    pthread_key_t key;
+    log_ring_t *rings;
+    int fd;
+    char *path;
+    uint64_t max_size;
+    uint64_t file_size;
+    int running;
+    pthread_t flusher;
+    size_t out_len;
+    char out[LOG_OUTPUT_BUFFER];
+} g_log = {
+    .level = IOTC_LOG_LEVEL_NONE,
+    .configured_level = IOTC_LOG_LEVEL_INFO,
+    .rate = LOG_DEFAULT_RATE,
+    .burst = LOG_DEFAULT_BURST,
+    .control_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .once = PTHREAD_ONCE_INIT,
+    .fd = -1,
+};
+
+static __thread log_ring_t *t_log_ring;
+
+/* Library messages; the arguments are only evaluated at an enabled level */
+#define IOTC_LOG(lvl, ...) \
+    do { \
+        if ((lvl) >= __atomic_load_n(&g_log.level, __ATOMIC_RELAXED)) log_write((lvl), "IOTC", __VA_ARGS__); \
+    } while (0)
+
+/* One printf conversion.  Both the producer and the flusher walk the format
+ * with this, so they agree on which arguments a record carries. */
+typedef struct {
+    const char *length;                 /* start of the length modifier */
+    const char *end;                    /* past the conversion character */
+    int width_star;
+    int precision_star;
+    int precision;                      /* -1 when absent or '*' */
+    char modifier;                      /* 'H' for hh, 'q' for ll, else the letter or 0 */
+    char conversion;
+} log_spec_t;
+
+static void log_parse_spec(const char *p, log_spec_t *spec) {
+    spec->width_star = 0;
+    spec->precision_star = 0;
+    spec->precision = -1;
+    spec->modifier = 0;
+    
+    for (p++; *p && strchr("-+ #0'", *p); p++) {
+    }
+    if (*p == '*') {
+        spec->width_star = 1;
+        p++;
+    } else {
+        while (*p >= '0' && *p <= '9') p++;
+    }
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            spec->precision_star = 1;
+            p++;
+        } else {
+            spec->precision = 0;
+            while (*p >= '0' && *p <= '9') spec->precision = spec->precision * 10 + (*p++ - '0');
+        }
+    }
+    
+    spec->length = p;
+    if (*p && strchr("hljztL", *p)) {
+        spec->modifier = *p++;
+        if (spec->modifier == 'h' && *p == 'h') {
+            spec->modifier = 'H';
+            p++;
+        } else if (spec->modifier == 'l' && *p == 'l') {
+            spec->modifier = 'q';
+            p++;
+        }
+    }
+    spec->conversion = *p;
+    spec->end = *p ? p + 1 : p;
+}
+
+static int64_t log_arg_signed(va_list *ap, char modifier) {
+    switch (modifier) {
+    case 'H': return (signed char)va_arg(*ap, int);
+    case 'h': return (short)va_arg(*ap, int);
+    case 'l': return va_arg(*ap, long);
+    case 'q': return va_arg(*ap, long long);
+    case 'j': return va_arg(*ap, intmax_t);
+    case 'z': return (int64_t)va_arg(*ap, size_t);
+    case 't': return va_arg(*ap, ptrdiff_t);
+    default: return va_arg(*ap, int);
+    }
+}
+
+static uint64_t log_arg_unsigned(va_list *ap, char modifier) {
+    switch (modifier) {
+    case 'H': return (unsigned char)va_arg(*ap, unsigned int);
+    case 'h': return (unsigned short)va_arg(*ap, unsigned int);
+    case 'l': return va_arg(*ap, unsigned long);
+    case 'q': return va_arg(*ap, unsigned long long);
+    case 'j': return va_arg(*ap, uintmax_t);
+    case 'z': return va_arg(*ap, size_t);
+    case 't': return (uint64_t)va_arg(*ap, ptrdiff_t);
+    default: return va_arg(*ap, unsigned int);
+    }
+}
+
+static int log_put(uint8_t **p, const uint8_t *end, const void *value, size_t size) {
+    if ((size_t)(end - *p) < size) return -1;
+    memcpy(*p, value, size);
+    *p += size;
+    return 0;
+}
+
+/* Copies the arguments fmt names after the record header; returns the end */
+static uint8_t *log_capture(log_record_t *rec, uint8_t *p, const uint8_t *end, va_list *ap) {
+    for (const char *f = rec->fmt; (f = strchr(f, '%')) != NULL;) {
+        log_spec_t spec;
+        log_parse_spec(f, &spec);
+        f = spec.end;
+        
+        int ok = 0;
+        int64_t stars[2] = { 0, -1 };
+        if (spec.width_star) {
+            stars[0] = va_arg(*ap, int);
+            ok |= log_put(&p, end, &stars[0], sizeof(stars[0]));
+        }
+        if (spec.precision_star) {
+            stars[1] = va_arg(*ap, int);
+            ok |= log_put(&p, end, &stars[1], sizeof(stars[1]));
+        }
+        
+        switch (spec.conversion) {
+        case 'd': case 'i': {
+            int64_t v = log_arg_signed(ap, spec.modifier);
+            ok |= log_put(&p, end, &v, sizeof(v));
+            break;
+        }
+        case 'u': case 'o': case 'x': case 'X': {
+            uint64_t v = log_arg_unsigned(ap, spec.modifier);
+            ok |= log_put(&p, end, &v, sizeof(v));
+            break;
+        }
+        case 'c': {
+            int64_t v = va_arg(*ap, int);
+            ok |= log_put(&p, end, &v, sizeof(v));
+            break;
+        }
+        case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A': {
+            double v = spec.modifier == 'L' ? (double)va_arg(*ap, long double) : va_arg(*ap, double);
+            ok |= log_put(&p, end, &v, sizeof(v));
+            break;
+        }
+        case 'p': {
+            uint64_t v = (uintptr_t)va_arg(*ap, void *);
+            ok |= log_put(&p, end, &v, sizeof(v));
+            break;
+        }
+        case 's': {
+            // A precision may bound a buffer that is not NUL-terminated
+            const char *s = va_arg(*ap, const char *);
+            size_t max = LOG_STRING_MAX;
+            if (spec.precision >= 0 && (size_t)spec.precision < max) max = (size_t)spec.precision;
+            if (stars[1] >= 0 && (uint64_t)stars[1] < max) max = (size_t)stars[1];
+            if (!s || spec.modifier == 'l') s = spec.modifier == 'l' ? "" : "(null)";
+            uint16_t len = (uint16_t)strnlen(s, max);
+            ok |= log_put(&p, end, &len, sizeof(len));
+            ok |= log_put(&p, end, s, len);
+            break;
+        }
+        case 'n':
+            (void)va_arg(*ap, void *);
+            break;
+        default:
+            break;
+        }
+        
+        if (ok < 0) {
+            rec->truncated = 1;
+            break;
+        }
+    }
+    return p;
+}
+
+static int log_ring_push(log_ring_t *ring, const void *record, size_t size) {
+    uint8_t *slot = byte_ring_reserve(&ring->ring, size);
+    if (!slot) return -1;
+    memcpy(slot, record, size);
+    
+    // Wake the flusher early once the ring passes half full; signalling
+    // without the mutex never blocks and a missed wakeup only costs latency
+    if (byte_ring_commit(&ring->ring) >= LOG_RING_SIZE / 2 &&
+        !__atomic_load_n(&ring->signalled, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&ring->signalled, 1, __ATOMIC_RELAXED);
+        pthread_cond_signal(&g_log.cond);
+    }
+    return 0;
+}
+
+static void log_thread_exit(void *arg) {
+    log_ring_t *ring = arg;
+    t_log_ring = NULL;
+    __atomic_store_n(&ring->orphaned, 1, __ATOMIC_RELEASE);
+}
+
+static void log_key_create(void) {
+    pthread_key_create(&g_log.key, log_thread_exit);
+}
+
+static log_ring_t *log_thread_ring(void) {
+    if (t_log_ring) return t_log_ring;
+    
+    log_ring_t *ring = calloc(1, sizeof(*ring));
+    if (!ring) return NULL;
+    ring->ring.data = ring->data;
+    ring->ring.size = LOG_RING_SIZE;
+    ring->tid = (long)syscall(SYS_gettid);
+    ring->tokens = __atomic_load_n(&g_log.burst, __ATOMIC_RELAXED);
+    ring->refill_ms = iotc_now_ms();
+    
+    pthread_once(&g_log.once, log_key_create);
+    pthread_setspecific(g_log.key, ring);
+    pthread_mutex_lock(&g_log.mutex);
+    ring->next = g_log.rings;
+    g_log.rings = ring;
+    pthread_mutex_unlock(&g_log.mutex);
+    
+    t_log_ring = ring;
+    return ring;
+}
+
+/* Per-thread token bucket, so the limit costs no shared writes */
+static int log_rate_allow(log_ring_t *ring) {
+    unsigned int rate = __atomic_load_n(&g_log.rate, __ATOMIC_RELAXED);
+    if (rate == 0) return 1;
+    
+    double burst = __atomic_load_n(&g_log.burst, __ATOMIC_RELAXED);
+    uint64_t now = iotc_now_ms();
+    ring->tokens += (double)(now - ring->refill_ms) * rate / 1000.0;
+    ring->refill_ms = now;
+    if (ring->tokens > burst) ring->tokens = burst < 1.0 ? 1.0 : burst;
+    if (ring->tokens < 1.0) return 0;
+    ring->tokens -= 1.0;
+    return 1;
+}
+
+static void log_vwrite(int level, const char *tag, const char *fmt, va_list *ap) {
+    log_ring_t *ring = log_thread_ring();
+    if (!ring) return;
+    if (!log_rate_allow(ring)) {
+        STAT_ADD(ring->suppressed, 1);
+        return;
+    }
+    
+    uint64_t buf[LOG_RECORD_MAX / sizeof(uint64_t)];
+    log_record_t *rec = (log_record_t *)buf;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    
+    rec->level = (uint8_t)level;
+    rec->truncated = 0;
+    rec->reserved = 0;
+    rec->time_us = (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+    rec->fmt = fmt;
+    size_t tag_len = tag ? strnlen(tag, LOG_TAG_SIZE - 1) : 0;
+    memcpy(rec->tag, tag ? tag : "", tag_len);
+    rec->tag[tag_len] = '\0';
+    
+    uint8_t *end = log_capture(rec, (uint8_t *)(rec + 1), (uint8_t *)buf + sizeof(buf), ap);
+    size_t size = ((size_t)(end - (uint8_t *)buf) + 7) & ~(size_t)7;
+    rec->size = (uint32_t)size;
+    if (log_ring_push(ring, rec, size) < 0) STAT_ADD(ring->dropped, 1);
+}
+
+static void log_write(int level, const char *tag, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+static void log_write(int level, const char *tag, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    log_vwrite(level, tag, fmt, &ap);
+    va_end(ap);
+}
+
+/* Flusher side.  Everything below requires g_log.mutex. */
+static void log_write_out(void) {
+    size_t off = 0;
+    while (off < g_log.out_len) {
+        ssize_t n = write(g_log.fd, g_log.out + off, g_log.out_len - off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        off += (size_t)n;
+    }
+    g_log.file_size += off;
+    g_log.out_len = 0;
+}
+
+static void log_rotate(void) {
+    log_write_out();
+    
+    size_t len = strlen(g_log.path);
+    char *old = malloc(len + 3);
+    if (!old) return;
+    memcpy(old, g_log.path, len);
+    memcpy(old + len, ".1", 3);
+    rename(g_log.path, old);
+    free(old);
+    
+    close(g_log.fd);
+    g_log.fd = open(g_log.path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    g_log.file_size = 0;
+}
+
+static void log_emit(const char *line, size_t len) {
+    if (g_log.fd < 0) return;
+    
+    uint64_t pending = g_log.file_size + g_log.out_len;
+    if (g_log.max_size && pending > 0 && pending + len > g_log.max_size) {
+        log_rotate();
+        if (g_log.fd < 0) return;
+    }
+    if (g_log.out_len + len > sizeof(g_log.out)) log_write_out();
+    memcpy(g_log.out + g_log.out_len, line, len);
+    g_log.out_len += len;
+}
+
+static size_t log_prefix(char *line, size_t cap, uint64_t time_us, int level, long tid, const char *tag) {
+    time_t secs = (time_t)(time_us / 1000000u);
+    struct tm tm;
+    localtime_r(&secs, &tm);
+    int n = snprintf(line, cap, "%04d-%02d-%02d %02d:%02d:%02d.%06u %c %ld %s: ",
+                     tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+                     (unsigned int)(time_us % 1000000u), "DIWE"[level & 3], tid, tag);
+    return n < 0 ? 0 : (size_t)n < cap ? (size_t)n : cap - 1;
+}
+
+static int log_take(const uint8_t **p, const uint8_t *end, void *value, size_t size) {
+    if ((size_t)(end - *p) < size) return -1;
+    memcpy(value, *p, size);
+    *p += size;
+    return 0;
+}
+
+/* Replays the format over the captured arguments, one conversion at a time */
+static void log_format_record(const log_record_t *rec, long tid) {
+    char line[LOG_LINE_MAX];
+    size_t cap = sizeof(line) - 1;      // room for the newline
+    size_t len = log_prefix(line, cap, rec->time_us, rec->level, tid, rec->tag);
+    const uint8_t *arg = (const uint8_t *)(rec + 1);
+    const uint8_t *end = (const uint8_t *)rec + rec->size;
+    const char *f = rec->fmt;
+    int truncated = 0;
+    
+    while (*f && len < cap) {
+        const char *pct = strchr(f, '%');
+        size_t literal = pct ? (size_t)(pct - f) : strlen(f);
+        if (literal > cap - len) literal = cap - len;
+        memcpy(line + len, f, literal);
+        len += literal;
+        if (!pct) break;
+        
+        log_spec_t spec;
+        log_parse_spec(pct, &spec);
+        f = spec.end;
+        if (strchr("diuoxXceEfFgGaAps", spec.conversion) == NULL || spec.conversion == '\0') {
+            // %% and anything unsupported print as written
+            const char *text = spec.conversion == '%' ? "%" : pct;
+            size_t n = spec.conversion == '%' ? 1 : (size_t)(spec.end - pct);
+            if (spec.conversion == 'n') n = 0;
+            if (n > cap - len) n = cap - len;
+            memcpy(line + len, text, n);
+            len += n;
+            continue;
+        }
+        
+        // Rebuild the conversion with '*' filled in and a 64-bit length
+        int64_t stars[2] = { 0, 0 };
+        if ((spec.width_star && log_take(&arg, end, &stars[0], sizeof(stars[0])) < 0) ||
+            (spec.precision_star && log_take(&arg, end, &stars[1], sizeof(stars[1])) < 0)) {
+            truncated = 1;
+            break;
+        }
+        char conv[48];
+        size_t c = 0;
+        int star = spec.width_star ? 0 : 1;
+        conv[c++] = '%';
+        for (const char *s = pct + 1; s < spec.length && c < sizeof(conv) - 16; s++) {
+            if (*s == '*') {
+                c += (size_t)snprintf(conv + c, sizeof(conv) - c, "%d", (int)stars[star++]);
+            } else {
+                conv[c++] = *s;
+            }
+        }
+        
+        char *out = line + len;
+        size_t room = cap - len + 1;
+        int n = 0;
+        switch (spec.conversion) {
+        case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': {
+            int64_t v;
+            if (log_take(&arg, end, &v, sizeof(v)) < 0) {
+                truncated = 1;
+                break;
+            }
+            memcpy(conv + c, "ll", 2);
+            conv[c + 2] = spec.conversion;
+            conv[c + 3] = '\0';
+            if (spec.conversion == 'd' || spec.conversion == 'i') {
+                n = snprintf(out, room, conv, (long long)v);
+            } else {
+                n = snprintf(out, room, conv, (unsigned long long)v);
+            }
+            break;
+        }
+        case 'c': case 'p': {
+            int64_t v;
+            if (log_take(&arg, end, &v, sizeof(v)) < 0) {
+                truncated = 1;
+                break;
+            }
+            conv[c] = spec.conversion;
+            conv[c + 1] = '\0';
+            if (spec.conversion == 'c') {
+                n = snprintf(out, room, conv, (int)v);
+            } else {
+                n = snprintf(out, room, conv, (void *)(uintptr_t)v);
+            }
+            break;
+        }
+        case 's': {
+            uint16_t slen;
+            char s[LOG_STRING_MAX + 1];
+            if (log_take(&arg, end, &slen, sizeof(slen)) < 0 || slen > LOG_STRING_MAX ||
+                log_take(&arg, end, s, slen) < 0) {
+                truncated = 1;
+                break;
+            }
+            s[slen] = '\0';
+            conv[c] = 's';
+            conv[c + 1] = '\0';
+            n = snprintf(out, room, conv, s);
+            break;
+        }
+        default: {
+            double v;
+            if (log_take(&arg, end, &v, sizeof(v)) < 0) {
+                truncated = 1;
+                break;
+            }
+            conv[c] = spec.conversion;
+            conv[c + 1] = '\0';
+            n = snprintf(out, room, conv, v);
+            break;
+        }
+        }
+        if (truncated) break;
+        if (n > 0) len += (size_t)n < room ? (size_t)n : room - 1;
+    }
+    
+    if (truncated || rec->truncated) {
+        static const char mark[] = " [truncated]";
+        size_t n = sizeof(mark) - 1 < cap - len ? sizeof(mark) - 1 : cap - len;
+        memcpy(line + len, mark, n);
+        len += n;
+    }
+    line[len++] = '\n';
+    log_emit(line, len);
+}
+
+static void log_report_losses(log_ring_t *ring) {
+    uint64_t dropped = STAT_READ(ring->dropped);
+    uint64_t suppressed = STAT_READ(ring->suppressed);
+    if (dropped == ring->reported_dropped && suppressed == ring->reported_suppressed) return;
+    
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    char line[LOG_LINE_MAX];
+    size_t len = log_prefix(line, sizeof(line), (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u,
+                            IOTC_LOG_LEVEL_WARNING, ring->tid, "log");
+    int n = snprintf(line + len, sizeof(line) - len, "%llu records over the rate limit, %llu lost to a full ring\n",
+                     (unsigned long long)(suppressed - ring->reported_suppressed),
+                     (unsigned long long)(dropped - ring->reported_dropped));
+    if (n > 0) log_emit(line, len + (size_t)n);
+    ring->reported_dropped = dropped;
+    ring->reported_suppressed = suppressed;
+}
+
+/* Formats every ring up to its published head and frees the rings of
+ * threads that have exited */
+static void log_drain(void) {
+    log_ring_t **link = &g_log.rings;
+    while (*link) {
+        log_ring_t *ring = *link;
+        int orphaned = __atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&ring->ring.head, __ATOMIC_ACQUIRE);
+        const uint8_t *record;
+        uint32_t size;
+        
+        while ((record = byte_ring_peek(&ring->ring, head, &size)) != NULL) {
+            log_format_record((const log_record_t *)record, ring->tid);
+            byte_ring_release(&ring->ring, size);
+        }
+        __atomic_store_n(&ring->signalled, 0, __ATOMIC_RELAXED);
+        log_report_losses(ring);
+        
+        if (orphaned) {
+            *link = ring->next;
+            free(ring);
+            continue;
+        }
+        link = &ring->next;
+    }
+    if (g_log.fd >= 0) log_write_out();
+}
+
+static void *log_flusher_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&g_log.mutex);
+    while (g_log.running) {
+        log_drain();
+        
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_FLUSH_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&g_log.cond, &g_log.mutex, &deadline);
+    }
+    pthread_mutex_unlock(&g_log.mutex);
+    return NULL;
+}
+
+/* Writes out everything logged so far, e.g. before IOTC_DeInitialize returns */
+static void log_sync(void) {
+    pthread_mutex_lock(&g_log.mutex);
+    log_drain();
+    pthread_mutex_unlock(&g_log.mutex);
+}
+
+/* Packet capture
+ *
+ * IOTC_Session_Capture_Start copies every datagram the session sends or
+ * accepts, IOTCHeader included, into a byte ring.  Producers already hold
+ * global_mutex, so the ring stays single-producer; a writer thread owned by
+ * the capture turns the records into pcapng blocks (one interface per
+ * file, LINKTYPE_USER0, microsecond timestamps, epb_flags for direction)
+ * and rotates the file to path.1 once it passes max_bytes.  A full ring
+ * drops the datagram from the capture and counts it in the ISB. */
+typedef struct {
+    uint32_t size;                      /* whole record, a multiple of 8 */
+    uint32_t len;                       /* datagram bytes that follow */
+    uint32_t inbound;
+    uint32_t reserved;
+    uint64_t time_us;                   /* CLOCK_REALTIME */
+} capture_record_t;
+
+typedef struct capture {
+    byte_ring_t ring;
+    uint64_t dropped;                   /* ring full, written by producers */
+    int signalled;                      /* early wakeup sent, cleared by the writer */
+    int stopping;                       /* set once; the writer drains and closes */
+    int detached;                       /* the writer frees the capture on exit */
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    
+    /* Writer thread only */
+    int fd;
+    char *path;
+    uint64_t max_bytes;
+    uint64_t file_bytes;
+    uint64_t header_bytes;              /* SHB and IDB at the start of the file */
+    uint64_t file_dropped;              /* dropped when the current file started */
+    uint64_t file_start_us;
+    uint32_t session_id;
+    char description[128];
+    size_t out_len;
+    uint8_t out[CAPTURE_OUTPUT_BUFFER];
+    uint8_t block[PMTU_MAX_DATAGRAM + 256];
+} capture_t;
+
+/* Records one datagram given as a header and a body.  Caller holds global_mutex. */
+static void capture_packet(session_info_t *session, int inbound, const void *head, size_t head_len,
+                           const void *body, size_t body_len) {
+    capture_t *cap = session->capture;
+    size_t len = head_len + body_len;
+    size_t size = (sizeof(capture_record_t) + len + 7) & ~(size_t)7;
+    capture_record_t *rec = (capture_record_t *)byte_ring_reserve(&cap->ring, size);
+    
+    if (!rec) {
+        STAT_ADD(cap->dropped, 1);
+        return;
+    }
+    
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec->size = (uint32_t)size;
+    rec->len = (uint32_t)len;
+    rec->inbound = (uint32_t)inbound;
+    rec->reserved = 0;
+    rec->time_us = (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+    memcpy(rec + 1, head, head_len);
+    if (body_len) memcpy((uint8_t *)(rec + 1) + head_len, body, body_len);
+    
+    if (byte_ring_commit(&cap->ring) >= CAPTURE_RING_SIZE / 2 &&
+        !__atomic_load_n(&cap->signalled, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&cap->signalled, 1, __ATOMIC_RELAXED);
+        pthread_cond_signal(&cap->cond);
+    }
+}
+
+/* pcapng blocks are built in host byte order; readers detect it from the SHB */
+static uint8_t *pcapng_u32(uint8_t *p, uint32_t value) {
+    memcpy(p, &value, sizeof(value));
+    return p + sizeof(value);
+}
+
+static uint8_t *pcapng_option(uint8_t *p, uint16_t code, const void *value, size_t len) {
+    uint16_t fields[2] = { code, (uint16_t)len };
+    size_t padded = (len + 3) & ~(size_t)3;
+    memcpy(p, fields, sizeof(fields));
+    memcpy(p + sizeof(fields), value, len);
+    memset(p + sizeof(fields) + len, 0, padded - len);
+    return p + sizeof(fields) + padded;
+}
+
+/* Closes a block started at start: end of options and both length fields */
+static size_t pcapng_finish(uint8_t *start, uint8_t *p, int options) {
+    if (options) p = pcapng_u32(p, 0);
+    uint32_t total = (uint32_t)(p - start) + 4;
+    memcpy(start + 4, &total, sizeof(total));
+    pcapng_u32(p, total);
+    return total;
+}
+
+static void capture_write_out(capture_t *cap) {
+    size_t done = 0;
+    while (done < cap->out_len) {
+        ssize_t n = write(cap->fd, cap->out + done, cap->out_len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += (size_t)n;
+    }
+    cap->file_bytes += cap->out_len;
+    cap->out_len = 0;
+}
+
+static void capture_append(capture_t *cap, const uint8_t *block, size_t len) {
+    if (cap->out_len + len > sizeof(cap->out)) capture_write_out(cap);
+    memcpy(cap->out + cap->out_len, block, len);
+    cap->out_len += len;
+}
+
+static void capture_write_header(capture_t *cap) {
+    static const char application[] = "libIOTCAPIsT";
+    uint8_t *start = cap->block, *p = start;
+    char name[32];
+    uint64_t section_length = UINT64_MAX;
+    uint16_t version[2] = { 1, 0 };
+    uint8_t tsresol = 6;
+    
+    p = pcapng_u32(p, 0x0A0D0D0A);
+    p = pcapng_u32(p, 0);
+    p = pcapng_u32(p, 0x1A2B3C4D);
+    memcpy(p, version, sizeof(version));
+    memcpy(p + sizeof(version), &section_length, sizeof(section_length));
+    p += sizeof(version) + sizeof(section_length);
+    p = pcapng_option(p, 4, application, sizeof(application) - 1);          // shb_userappl
+    size_t len = pcapng_finish(start, p, 1);
+    capture_append(cap, start, len);
+    
+    uint16_t link[2] = { CAPTURE_LINKTYPE, 0 };
+    int n = snprintf(name, sizeof(name), "iotc-sid-%u", cap->session_id);
+    p = start;
+    p = pcapng_u32(p, 1);
+    p = pcapng_u32(p, 0);
+    memcpy(p, link, sizeof(link));
+    p = pcapng_u32(p + sizeof(link), 0);                                    // no snaplen
+    p = pcapng_option(p, 2, name, (size_t)n);                               // if_name
+    p = pcapng_option(p, 3, cap->description, strlen(cap->description));   // if_description
+    p = pcapng_option(p, 9, &tsresol, sizeof(tsresol));                     // if_tsresol
+    size_t idb = pcapng_finish(start, p, 1);
+    capture_append(cap, start, idb);
+    cap->header_bytes = len + idb;
+}
+
+static void capture_write_stats(capture_t *cap, uint64_t now_us) {
+    uint8_t *start = cap->block, *p = start;
+    uint64_t dropped = STAT_READ(cap->dropped) - cap->file_dropped;
+    
+    p = pcapng_u32(p, 5);
+    p = pcapng_u32(p, 0);
+    p = pcapng_u32(p, 0);
+    p = pcapng_u32(p, (uint32_t)(now_us >> 32));
+    p = pcapng_u32(p, (uint32_t)now_us);
+    p = pcapng_option(p, 2, (uint32_t[]){ (uint32_t)(cap->file_start_us >> 32), (uint32_t)cap->file_start_us },
+                      8);                                                   // isb_starttime
+    p = pcapng_option(p, 3, (uint32_t[]){ (uint32_t)(now_us >> 32), (uint32_t)now_us }, 8);  // isb_endtime
+    p = pcapng_option(p, 7, &dropped, sizeof(dropped));                     // isb_osdrop
+    capture_append(cap, start, pcapng_finish(start, p, 1));
+}
+
+static int capture_open(capture_t *cap, uint64_t now_us) {
+    cap->fd = open(cap->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    cap->file_bytes = 0;
+    cap->file_dropped = STAT_READ(cap->dropped);
+    cap->file_start_us = now_us;
+    if (cap->fd < 0) return -1;
+    capture_write_header(cap);
+    return 0;
+}
+
+/* Closes the current file with its statistics and starts a new one */
+static void capture_rotate(capture_t *cap, uint64_t now_us) {
+    size_t len = strlen(cap->path);
+    char *old = malloc(len + 3);
+    
+    capture_write_stats(cap, now_us);
+    capture_write_out(cap);
+    close(cap->fd);
+    if (old) {
+        memcpy(old, cap->path, len);
+        memcpy(old + len, ".1", 3);
+        rename(cap->path, old);
+        free(old);
+    }
+    capture_open(cap, now_us);
+}
+
+static void capture_write_packet(capture_t *cap, const capture_record_t *rec) {
+    uint8_t *start = cap->block, *p = start;
+    uint32_t flags = rec->inbound ? 1 : 2;                                  // direction
+    size_t padded = (rec->len + 3) & ~(size_t)3;
+    size_t len = 28 + padded + 8 + 4 + 4;
+    
+    // Rotation reuses the block buffer, so it comes first
+    uint64_t pending = cap->file_bytes + cap->out_len;
+    if (cap->max_bytes && pending > cap->header_bytes && pending + len + CAPTURE_STATS_BLOCK > cap->max_bytes) {
+        capture_rotate(cap, rec->time_us);
+        if (cap->fd < 0) return;
+    }
+    
+    p = pcapng_u32(p, 6);
+    p = pcapng_u32(p, 0);
+    p = pcapng_u32(p, 0);
+    p = pcapng_u32(p, (uint32_t)(rec->time_us >> 32));
+    p = pcapng_u32(p, (uint32_t)rec->time_us);
+    p = pcapng_u32(p, rec->len);
+    p = pcapng_u32(p, rec->len);
+    memcpy(p, rec + 1, rec->len);
+    memset(p + rec->len, 0, padded - rec->len);
+    p = pcapng_option(p + padded, 2, &flags, sizeof(flags));               // epb_flags
+    capture_append(cap, start, pcapng_finish(start, p, 1));
+}
+
+static void capture_drain(capture_t *cap) {
+    uint64_t head = __atomic_load_n(&cap->ring.head, __ATOMIC_ACQUIRE);
+    const uint8_t *record;
+    uint32_t size;
+    
+    while ((record = byte_ring_peek(&cap->ring, head, &size)) != NULL) {
+        if (cap->fd >= 0) capture_write_packet(cap, (const capture_record_t *)record);
+        byte_ring_release(&cap->ring, size);
+    }
+    __atomic_store_n(&cap->signalled, 0, __ATOMIC_RELAXED);
+    if (cap->fd >= 0) capture_write_out(cap);
+}
+
+static void capture_free(capture_t *cap) {
+    pthread_mutex_destroy(&cap->mutex);
+    pthread_cond_destroy(&cap->cond);
+    free(cap->ring.data);
+    free(cap->path);
+    free(cap);
+}
+
+static void *capture_writer_main(void *arg) {
+    capture_t *cap = arg;
+    
+    pthread_mutex_lock(&cap->mutex);
+    while (!cap->stopping) {
+        pthread_mutex_unlock(&cap->mutex);
+        capture_drain(cap);
+        pthread_mutex_lock(&cap->mutex);
+        if (cap->stopping) break;
+        
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += CAPTURE_FLUSH_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&cap->cond, &cap->mutex, &deadline);
+    }
+    int detached = cap->detached;
+    pthread_mutex_unlock(&cap->mutex);
+    
+    // No producer is left once stopping is set
+    capture_drain(cap);
+    if (cap->fd >= 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        capture_write_stats(cap, (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u);
+        capture_write_out(cap);
+        close(cap->fd);
+        cap->fd = -1;
+    }
+    if (detached) capture_free(cap);
+    return NULL;
+}
+
+/* Starts a writer for session.  Caller holds global_mutex. */
+static capture_t *capture_create(session_info_t *session, const char *path, unsigned int max_bytes) {
+    capture_t *cap = calloc(1, sizeof(*cap));
+    if (!cap) return NULL;
+    
+    cap->ring.data = malloc(CAPTURE_RING_SIZE);
+    cap->ring.size = CAPTURE_RING_SIZE;
+    cap->path = strdup(path);
+    cap->max_bytes = max_bytes;
+    cap->session_id = session->session_id;
+    snprintf(cap->description, sizeof(cap->description), "IOTC session %u, uid %.20s, peer %s:%u",
+             session->session_id, session->uid, inet_ntoa(session->remote_addr.sin_addr),
+             ntohs(session->remote_addr.sin_port));
+    pthread_mutex_init(&cap->mutex, NULL);
+    pthread_cond_init(&cap->cond, NULL);
+    
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (!cap->ring.data || !cap->path ||
+        capture_open(cap, (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u) < 0) {
+        capture_free(cap);
+        return NULL;
+    }
+    capture_write_out(cap);
+    
+    if (pthread_create(&cap->thread, NULL, capture_writer_main, cap) != 0) {
+        close(cap->fd);
+        capture_free(cap);
+        return NULL;
+    }
+    return cap;
+}
+
+/* Tells the writer to finish.  A detached writer frees the capture itself,
+ * otherwise the caller joins it and calls capture_free. */
+static void capture_stop(capture_t *cap, int detach) {
+    if (detach) pthread_detach(cap->thread);
+    pthread_mutex_lock(&cap->mutex);
+    cap->stopping = 1;
+    cap->detached = detach;
+    pthread_cond_signal(&cap->cond);
+    pthread_mutex_unlock(&cap->mutex);
+}
+
+/* Timer wheel
+ *
+ * Timers are intrusive doubly-linked list nodes, so insert and cancel are
+ * O(1) and never allocate.  A timer lands in the lowest level whose span
+ * covers its delay; when a lower level wraps, the matching slot of the
+ * level above is cascaded down.  All operations require global_mutex.
+ */
+static void timer_list_init(iotc_timer_t *head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static void timer_list_unlink(iotc_timer_t *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+}
+
+static void timer_list_move(iotc_timer_t *from, iotc_timer_t *to) {
+    if (from->next == from) {
+        timer_list_init(to);
+        return;
+    }
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    timer_list_init(from);
+}
+
+static void timer_init(iotc_timer_t *timer, void (*fn)(iotc_timer_t *, uint64_t), void *arg) {
+    timer->next = timer->prev = NULL;
+    timer->expires = 0;
+    timer->fn = fn;
+    timer->arg = arg;
+    timer->pending = 0;
+}
+
+static void timer_wheel_init(iotc_timer_wheel_t *wheel, uint64_t now_ms) {
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+            timer_list_init(&wheel->slots[level][i]);
+        }
+    }
+    wheel->current_tick = now_ms / TIMER_WHEEL_TICK_MS;
+    wheel->pending = 0;
+}
+
+static void timer_wheel_place(iotc_timer_wheel_t *wheel, iotc_timer_t *timer) {
+    // Cascaded timers due on the current tick go to the slot about to be run
+    if (timer->expires < wheel->current_tick) {
+        timer->expires = wheel->current_tick;
+    }
+    
+    uint64_t delta = timer->expires - wheel->current_tick;
+    if (delta > TIMER_WHEEL_MAX_DELTA) {
+        delta = TIMER_WHEEL_MAX_DELTA;
+        timer->expires = wheel->current_tick + delta;
+    }
+    
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ULL << (TIMER_WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    
+    iotc_timer_t *head = &wheel->slots[level][(timer->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+    timer->next = head->next;
+    timer->prev = head;
+    head->next->prev = timer;
+    head->next = timer;
+}
+
+static void io_wake(void);
+static int netsim_send(int endpoint, const struct sockaddr_in *to, const struct iovec *iov, size_t iovcnt);
+
+static void timer_cancel(iotc_timer_t *timer) {
+    if (!timer->pending) return;
+    timer_list_unlink(timer);
+    timer->pending = 0;
+    __atomic_sub_fetch(&g_iotc_state.wheel.pending, 1, __ATOMIC_RELEASE);
+}
+
+static void timer_add(iotc_timer_t *timer, uint64_t delay_ms) {
+    iotc_timer_wheel_t *wheel = &g_iotc_state.wheel;
+    
+    uint64_t now_tick = iotc_now_ms() / TIMER_WHEEL_TICK_MS;
+    uint64_t ticks = (delay_ms + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+    
+    timer_cancel(timer);
+    
+    // An empty wheel is not advanced, so resynchronise it before inserting
+    if (wheel->pending == 0 && wheel->current_tick < now_tick) {
+        wheel->current_tick = now_tick;
+    }
+    
+    timer->expires = now_tick + (ticks ? ticks : 1);
+    timer_wheel_place(wheel, timer);
+    timer->pending = 1;
+    
+    // The I/O thread sleeps indefinitely while the wheel is empty
+    if (__atomic_add_fetch(&wheel->pending, 1, __ATOMIC_RELEASE) == 1) {
+        io_wake();
+    }
+}
+
+static void timer_wheel_advance(iotc_timer_wheel_t *wheel, uint64_t now_ms) {
+    uint64_t target = now_ms / TIMER_WHEEL_TICK_MS;
+    
+    while (wheel->current_tick < target) {
+        if (wheel->pending == 0) {
+            wheel->current_tick = target;
+            break;
+        }
+        
+        uint64_t tick = ++wheel->current_tick;
+        
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            if (tick & ((1ULL << (TIMER_WHEEL_BITS * level)) - 1)) break;
+            
+            iotc_timer_t cascade;
+            timer_list_move(&wheel->slots[level][(tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK], &cascade);
+            while (cascade.next != &cascade) {
+                iotc_timer_t *timer = cascade.next;
+                timer_list_unlink(timer);
+                timer_wheel_place(wheel, timer);
+            }
+        }
+        
+        // Callbacks may re-arm themselves or cancel other expired timers
+        iotc_timer_t expired;
+        timer_list_move(&wheel->slots[0][tick & TIMER_WHEEL_MASK], &expired);
+        while (expired.next != &expired) {
+            iotc_timer_t *timer = expired.next;
+            timer_list_unlink(timer);
+            timer->pending = 0;
+            __atomic_sub_fetch(&wheel->pending, 1, __ATOMIC_RELEASE);
+            timer->fn(timer, now_ms);
+        }
+    }
+}
+
+/* Network helpers */
+static int create_udp_socket(void) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) return -1;
+    
+    int opt = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    
+    return sock;
+}
+
+static int create_tcp_socket(void) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    
+    int opt = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    
+    return sock;
+}
+
+/* Reassembly buffer pool.  Buffers of completed messages come back here
+ * once read instead of being freed.  Guarded by global_mutex. */
+static struct {
+    uint8_t *data;
+    size_t capacity;
+} g_frag_pool[REASSEMBLY_POOL_SIZE];
+static int g_frag_pool_count;
+
+static uint8_t *frag_pool_get(size_t size, size_t *capacity) {
+    for (int i = 0; i < g_frag_pool_count; i++) {
+        if (g_frag_pool[i].capacity >= size) {
+            uint8_t *data = g_frag_pool[i].data;
+            *capacity = g_frag_pool[i].capacity;
+            g_frag_pool[i] = g_frag_pool[--g_frag_pool_count];
+            return data;
+        }
+    }
+    
+    uint8_t *data = malloc(size);
+    *capacity = data ? size : 0;
+    return data;
+}
+
+static void frag_pool_put(uint8_t *data, size_t capacity) {
+    if (g_frag_pool_count < REASSEMBLY_POOL_SIZE) {
+        g_frag_pool[g_frag_pool_count].data = data;
+        g_frag_pool[g_frag_pool_count].capacity = capacity;
+        g_frag_pool_count++;
+        return;
+    }
+    
+    // Keep the larger buffers, they are the expensive ones to fault in
+    for (int i = 0; i < g_frag_pool_count; i++) {
+        if (g_frag_pool[i].capacity < capacity) {
+            uint8_t *evicted = g_frag_pool[i].data;
+            g_frag_pool[i].data = data;
+            g_frag_pool[i].capacity = capacity;
+            free(evicted);
+            return;
+        }
+    }
+    free(data);
+}
+
+static void frag_pool_drain(void) {
+    while (g_frag_pool_count > 0) {
+        free(g_frag_pool[--g_frag_pool_count].data);
+    }
+}
+
+/* Block pool.  Freed blocks are chained through their first word.
+ * Guarded by global_mutex. */
+static struct {
+    void *free[BLOCK_POOL_CLASSES];
+    size_t kept[BLOCK_POOL_CLASSES];
+} g_block_pool;
+
+static uint8_t block_class(size_t size) {
+    for (uint8_t cls = 0; cls < BLOCK_POOL_CLASSES; cls++) {
+        if (size <= (size_t)1 << (BLOCK_POOL_MIN_SHIFT + cls)) return cls;
+    }
+    return BLOCK_POOL_NONE;
+}
+
+static void *block_alloc(size_t size, uint8_t *cls) {
+    *cls = block_class(size);
+    if (*cls == BLOCK_POOL_NONE) return malloc(size);
+    
+    void *block = g_block_pool.free[*cls];
+    if (block) {
+        g_block_pool.free[*cls] = *(void **)block;
+        g_block_pool.kept[*cls] -= (size_t)1 << (BLOCK_POOL_MIN_SHIFT + *cls);
+        return block;
+    }
+    return malloc((size_t)1 << (BLOCK_POOL_MIN_SHIFT + *cls));
+}
+
+static void block_free(void *block, uint8_t cls) {
+    if (cls == BLOCK_POOL_NONE) {
+        free(block);
+        return;
+    }
+    
+    size_t size = (size_t)1 << (BLOCK_POOL_MIN_SHIFT + cls);
+    if (g_block_pool.kept[cls] + size > BLOCK_POOL_CLASS_BYTES) {
+        free(block);
+        return;
+    }
+    *(void **)block = g_block_pool.free[cls];
+    g_block_pool.free[cls] = block;
+    g_block_pool.kept[cls] += size;
+}
+
+static void block_pool_drain(void) {
+    for (int cls = 0; cls < BLOCK_POOL_CLASSES; cls++) {
+        while (g_block_pool.free[cls]) {
+            void *block = g_block_pool.free[cls];
+            g_block_pool.free[cls] = *(void **)block;
+            free(block);
+        }
+        g_block_pool.kept[cls] = 0;
+    }
+}
+
+static void free_message(message_entry_t *entry) {
+    if (entry->capacity) {
+        frag_pool_put(entry->data, entry->capacity);
+    }
+    block_free(entry, entry->pool_class);
+}
+
+static void av_on_packet(struct av_client *av, const uint8_t *data, size_t size);
+
+/* Message queue management */
+static void init_channel(channel_info_t *channel) {
+    channel->state = CHANNEL_STATE_OFF;
+    channel->next_seq_id = 1;
+    channel->expected_seq_id = 1;
+    channel->fec_mode = IOTC_FEC_OFF;
+    channel->fec_data = 0;
+    channel->fec_parity = 0;
+    memset(&channel->pace, 0, sizeof(channel->pace));
+    channel->pace_head = NULL;
+    channel->pace_tail = NULL;
+    channel->msg_queue_head = NULL;
+    channel->msg_queue_tail = NULL;
+    channel->queue_messages = 0;
+    channel->queue_bytes = 0;
+    pthread_mutex_init(&channel->queue_mutex, NULL);
+    channel->av = NULL;
+}
+
+static void cleanup_channel(channel_info_t *channel) {
+    pthread_mutex_lock(&channel->queue_mutex);
+    
+    message_entry_t *entry = channel->msg_queue_head;
+    while (entry) {
+        message_entry_t *next = entry->next;
+        free_message(entry);
+        entry = next;
+    }
+    
+    channel->msg_queue_head = NULL;
+    channel->msg_queue_tail = NULL;
+    channel->queue_messages = 0;
+    channel->queue_bytes = 0;
+    
+    pthread_mutex_unlock(&channel->queue_mutex);
+    pthread_mutex_destroy(&channel->queue_mutex);
+}
+
+static void queue_append(channel_info_t *channel, message_entry_t *entry) {
+    entry->queued_us = iotc_now_us();
+    pthread_mutex_lock(&channel->queue_mutex);
+    
+    if (channel->msg_queue_tail) {
+        channel->msg_queue_tail->next = entry;
+    } else {
+        channel->msg_queue_head = entry;
+    }
+    channel->msg_queue_tail = entry;
+    STAT_ADD(channel->queue_messages, 1);
+    STAT_ADD(channel->queue_bytes, entry->size);
+    
+    pthread_mutex_unlock(&channel->queue_mutex);
+    if (channel->av) av_on_packet(channel->av, entry->data, entry->size);
+}
+
+/* Copies a single-datagram message into the entry's own block */
+static int enqueue_message(channel_info_t *channel, const void *data, size_t size, uint16_t seq_id) {
+    uint8_t cls;
+    message_entry_t *entry = block_alloc(sizeof(message_entry_t) + size, &cls);
+    if (!entry) return -1;
+    
+    entry->data = (uint8_t *)(entry + 1);
+    memcpy(entry->data, data, size);
+    entry->size = size;
+    entry->capacity = 0;
+    entry->pool_class = cls;
+    entry->seq_id = seq_id;
+    entry->next = NULL;
+    queue_append(channel, entry);
+    return 0;
+}
+
+/* Queues a pooled buffer without copying; the entry owns it from here on. */
+static int enqueue_message_buffer(channel_info_t *channel, uint8_t *data, size_t size,
+                                  size_t capacity, uint16_t seq_id) {
+    uint8_t cls;
+    message_entry_t *entry = block_alloc(sizeof(message_entry_t), &cls);
+    if (!entry) return -1;
+    
+    entry->data = data;
+    entry->size = size;
+    entry->capacity = capacity;
+    entry->pool_class = cls;
+    entry->seq_id = seq_id;
+    entry->next = NULL;
+    queue_append(channel, entry);
+    return 0;
+}
+
+static message_entry_t *dequeue_message(channel_info_t *channel) {
+    pthread_mutex_lock(&channel->queue_mutex);
+    
+    message_entry_t *entry = channel->msg_queue_head;
+    if (entry) {
+        channel->msg_queue_head = entry->next;
+        if (!channel->msg_queue_head) {
+            channel->msg_queue_tail = NULL;
+        }
+        STAT_ADD(channel->queue_messages, -1);
+        STAT_ADD(channel->queue_bytes, -(uint64_t)entry->size);
+    }
+    
+    pthread_mutex_unlock(&channel->queue_mutex);
+    return entry;
+}
+
+/* Session management */
+static session_info_t *find_session_by_id(int session_id) {
+    for (int i = 0; i < g_iotc_state.max_sessions; i++) {
+        if (g_iotc_state.sessions[i].state != SESSION_STATE_FREE &&
+            g_iotc_state.sessions[i].session_id == session_id) {
+            return &g_iotc_state.sessions[i];
+        }
+    }
+    return NULL;
+}
+
+static session_info_t *find_free_session(void) {
+    for (int i = 0; i < g_iotc_state.max_sessions; i++) {
+        if (g_iotc_state.sessions[i].state == SESSION_STATE_FREE) {
+            return &g_iotc_state.sessions[i];
+        }
+    }
+    return NULL;
+}
+
+/* Caller must hold global_mutex.  Returns the claimed slot, or NULL when all are in use. */
+static session_info_t *alloc_session_locked(void) {
+    session_info_t *session = find_free_session();
+    if (!session) {
+        return NULL;
+    }
+    
+    session->state = SESSION_STATE_USED;
+    session->session_id = g_iotc_state.next_session_id++;
+    STAT_ADD(g_metrics.sessions_opened, 1);
+    IOTC_PROBE1(session__create, session->session_id);
+    IOTC_LOG(IOTC_LOG_LEVEL_INFO, "session %u opened", session->session_id);
+    return session;
+}
+
+/* Caller must hold global_mutex. */
+static int alloc_session_id_locked(void) {
+    session_info_t *session = alloc_session_locked();
+    return session ? (int)session->session_id : IOTC_ER_EXCEED_MAX_SESSION;
+}
+
+static void session_idle_timer_fired(iotc_timer_t *timer, uint64_t now_ms);
+static void session_connect_timer_fired(iotc_timer_t *timer, uint64_t now_ms);
+static void heartbeat_timer_fired(iotc_timer_t *timer, uint64_t now_ms);
+static void pmtu_timer_fired(iotc_timer_t *timer, uint64_t now_ms);
+static void pace_timer_fired(iotc_timer_t *timer, uint64_t now_ms);
+static void pace_drop(session_info_t *session);
+static void cc_reset(congestion_t *cc);
+static void cc_stamp(session_info_t *session, uint8_t *header);
+static void cc_feedback_timer_fired(iotc_timer_t *timer, uint64_t now_ms);
+static void rdt_detach_session(session_info_t *session);
+static void reassembly_drop_session(session_info_t *session);
+static void rdt_handle_message(struct rdt_channel *rdt, const IOTCHeader *hdr, const uint8_t *payload);
+static void metrics_close(void);
+static void header_swap(IOTCHeader *hdrs, size_t count);
+static void av_release_all(void);
+
+static void session_reset_path(session_info_t *session) {
+    session->pmtu = 0;
+    session->pmtu_lo = session->pmtu_hi = session->pmtu_probe = 0;
+    session->pmtu_tries = session->pmtu_acked = session->pmtu_searching = 0;
+    session->tx_bytes = session->tx_calls = session->tx_datagrams = 0;
+    session->tx_fragmented = session->tx_fragments = 0;
+    session->tx_parity = session->rx_recovered = 0;
+    session->frag_rx_newest = 0;
+    memset(&session->pace, 0, sizeof(session->pace));
+    session->pace_bytes = 0;
+    session->pace_next_ns = 0;
+    session->pace_rr = 0;
+    cc_reset(&session->cc);
+    memset(&session->delay, 0, sizeof(session->delay));
+    session->connected_ms = 0;
+    memset(&session->traffic, 0, sizeof(session->traffic));
+    memset(session->channel_traffic, 0, sizeof(session->channel_traffic));
+}
+
+/* Channel is -1 for control messages, which only count towards the totals */
+static void traffic_count_rx(session_info_t *session, int channel, size_t bytes) {
+    IOTC_PROBE3(packet__receive, session->session_id, channel, bytes);
+    STAT_ADD(session->traffic.bytes_in, bytes);
+    STAT_ADD(session->traffic.packets_in, 1);
+    if (channel >= 0) {
+        STAT_ADD(session->channel_traffic[channel].bytes_in, bytes);
+        STAT_ADD(session->channel_traffic[channel].packets_in, 1);
+    }
+}
+
+static void traffic_count_tx(session_info_t *session, int channel, size_t bytes, unsigned int packets) {
+    if (packets) IOTC_PROBE4(packet__send, session->session_id, channel, bytes, packets);
+    STAT_ADD(session->traffic.bytes_out, bytes);
+    STAT_ADD(session->traffic.packets_out, packets);
+    if (channel >= 0) {
+        STAT_ADD(session->channel_traffic[channel].bytes_out, bytes);
+        STAT_ADD(session->channel_traffic[channel].packets_out, packets);
+    }
+}
+
+static void traffic_count_drop(session_info_t *session, int channel, unsigned int count) {
+    STAT_ADD(session->traffic.drops, count);
+    if (channel >= 0) STAT_ADD(session->channel_traffic[channel].drops, count);
+}
+
+static void traffic_count_retransmit(session_info_t *session, int channel) {
+    STAT_ADD(session->traffic.retransmits, 1);
+    STAT_ADD(session->channel_traffic[channel].retransmits, 1);
+}
+
+static void init_session(session_info_t *session) {
+    session->state = SESSION_STATE_FREE;
+    memset(session->uid, 0, sizeof(session->uid));
+    memset(&session->remote_addr, 0, sizeof(session->remote_addr));
+    session->endpoint = -1;
+    session->has_peer = 0;
+    session->session_id = 0;
+    session->remote_session_id = 0;
+    session->next_msg_id = 1;
+    session->close_reason = IOTC_ER_NoERROR;
+    session->last_activity = iotc_now_ms();
+    session->last_send = session->last_activity;
+    session->connect_deadline = 0;
+    session->hb_next = NULL;
+    session->hb_prev = NULL;
+    session->hb_slot = -1;
+    session->capture = NULL;
+    memset(session->rdt, 0, sizeof(session->rdt));
+    
+    for (int i = 0; i < MAX_CHANNEL_NUMBER; i++) {
+        init_channel(&session->channels[i]);
+    }
+    
+    pthread_mutex_init(&session->session_mutex, NULL);
+    pthread_cond_init(&session->state_cond, NULL);
+    timer_init(&session->idle_timer, session_idle_timer_fired, session);
+    timer_init(&session->connect_timer, session_connect_timer_fired, session);
+    timer_init(&session->pmtu_timer, pmtu_timer_fired, session);
+    timer_init(&session->pace_timer, pace_timer_fired, session);
+    timer_init(&session->cc_timer, cc_feedback_timer_fired, session);
+    session_reset_path(session);
+}
+
+/* Heartbeat scheduling.  Caller must hold global_mutex. */
+static void heartbeat_arm(void) {
+    unsigned int step = g_iotc_state.keepalive_interval_ms / HEARTBEAT_SLOTS;
+    
+    if (g_iotc_state.keepalive_interval_ms == 0 || g_iotc_state.heartbeat_sessions == 0 ||
+        g_iotc_state.heartbeat_timer.pending) {
+        return;
+    }
+    g_iotc_state.heartbeat_last_ms = iotc_now_ms();
+    timer_add(&g_iotc_state.heartbeat_timer, step ? step : 1);
+}
+
+static void heartbeat_schedule(session_info_t *session) {
+    // Spread sessions over the ring by slot index so beats are not bunched
+    int slot = (int)((session - g_iotc_state.sessions) % HEARTBEAT_SLOTS);
+    
+    if (session->hb_slot >= 0) return;
+    
+    session->hb_slot = slot;
+    session->hb_prev = NULL;
+    session->hb_next = g_iotc_state.heartbeat_slots[slot];
+    if (session->hb_next) session->hb_next->hb_prev = session;
+    g_iotc_state.heartbeat_slots[slot] = session;
+    g_iotc_state.heartbeat_sessions++;
+    heartbeat_arm();
+}
+
+static void heartbeat_unschedule(session_info_t *session) {
+    if (session->hb_slot < 0) return;
+    
+    if (session->hb_prev) {
+        session->hb_prev->hb_next = session->hb_next;
+    } else {
+        g_iotc_state.heartbeat_slots[session->hb_slot] = session->hb_next;
+    }
+    if (session->hb_next) session->hb_next->hb_prev = session->hb_prev;
+    
+    session->hb_next = session->hb_prev = NULL;
+    session->hb_slot = -1;
+    g_iotc_state.heartbeat_sessions--;
+}
+
+/* Drops the peer, timers and queued data.  Caller must hold global_mutex. */
+static void release_session_resources(session_info_t *session) {
+    timer_cancel(&session->idle_timer);
+    timer_cancel(&session->connect_timer);
+    timer_cancel(&session->pmtu_timer);
+    pace_drop(session);
+    timer_cancel(&session->cc_timer);
+    heartbeat_unschedule(session);
+    rdt_detach_session(session);
+    reassembly_drop_session(session);
+    
+    session->endpoint = -1;
+    session->has_peer = 0;
+    
+    for (int i = 0; i < MAX_CHANNEL_NUMBER; i++) {
+        cleanup_channel(&session->channels[i]);
+        init_channel(&session->channels[i]);
+    }
+}
+
+/* Marks a session DISCONNECTED and frees what it holds; the SID stays valid
+ * until IOTC_Session_Close so callers can observe the reason. */
+static void session_disconnect(session_info_t *session, int64_t reason) {
+    session->close_reason = reason;
+    release_session_resources(session);
+    session->state = SESSION_STATE_DISCONNECTED;
+    pthread_cond_broadcast(&session->state_cond);
+}
+
+static int session_send_packet(session_info_t *session, uint16_t type, uint8_t channel,
+                               uint32_t seq, const void *payload, size_t size);
+
+static void cleanup_session(session_info_t *session) {
+    pthread_mutex_lock(&session->session_mutex);
+    
+    if (session->has_peer && session->state == SESSION_STATE_CONNECTED) {
+        session_send_packet(session, IOTC_MSG_CLOSE, 0, 0, NULL, 0);
+    }
+    if (session->capture) {
+        capture_stop(session->capture, 1);
+        session->capture = NULL;
+    }
+    
+    release_session_resources(session);
+    if (session->state != SESSION_STATE_FREE) {
+        IOTC_PROBE2(session__close, session->session_id, session->close_reason);
+        IOTC_LOG(IOTC_LOG_LEVEL_INFO, "session %u closed, reason %lld", session->session_id,
+                 (long long)session->close_reason);
+        // Library-wide totals outlive the session
+        STAT_ADD(g_metrics.sessions_closed, 1);
+        STAT_ADD(g_metrics.retired.bytes_in, session->traffic.bytes_in);
+        STAT_ADD(g_metrics.retired.bytes_out, session->traffic.bytes_out);
+        STAT_ADD(g_metrics.retired.packets_in, session->traffic.packets_in);
+        STAT_ADD(g_metrics.retired.packets_out, session->traffic.packets_out);
+        STAT_ADD(g_metrics.retired.drops, session->traffic.drops);
+        STAT_ADD(g_metrics.retired.retransmits, session->traffic.retransmits);
+    }
+    session->state = SESSION_STATE_FREE;
+    session->session_id = 0;
+    session->remote_session_id = 0;
+    session->close_reason = IOTC_ER_NoERROR;
+    memset(&session->remote_addr, 0, sizeof(session->remote_addr));
+    session_reset_path(session);
+    pthread_cond_broadcast(&session->state_cond);
+    
+    pthread_mutex_unlock(&session->session_mutex);
+}
+
+static void destroy_session(session_info_t *session) {
+    cleanup_session(session);
+    
+    for (int i = 0; i < MAX_CHANNEL_NUMBER; i++) {
+        pthread_mutex_destroy(&session->channels[i].queue_mutex);
+    }
+    pthread_mutex_destroy(&session->session_mutex);
+    pthread_cond_destroy(&session->state_cond);
+}
+
+/* Shared endpoints.  Caller must hold global_mutex. */
+static int endpoint_open(uint16_t port) {
+    int index = -1;
+    for (int i = 0; i < MAX_ENDPOINT_NUMBER; i++) {
+        if (g_iotc_state.endpoints[i].fd < 0) {
+            index = i;
+            break;
+        }
+    }
+    if (index < 0) return IOTC_ER_FAIL_CREATE_SOCKET;
+    
+    // The simulator routes datagrams by port, no socket needed
+    if (g_netsim.enabled) {
+        g_iotc_state.endpoints[index].fd = NETSIM_ENDPOINT_FD;
+        g_iotc_state.endpoints[index].port = port;
+        g_iotc_state.endpoints[index].txtime = 0;
+        return index;
+    }
+    
+    int sock = create_udp_socket();
+    if (sock < 0) return IOTC_ER_FAIL_CREATE_SOCKET;
+    
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    local.sin_port = htons(port);
+    if (bind(sock, (struct sockaddr *)&local, sizeof(local)) < 0) {
+        close(sock);
+        return IOTC_ER_FAIL_SOCKET_BIND;
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    
+    // Room for a whole fragmented message; the kernel caps this at rmem_max/wmem_max
+    int buffer_size = IO_SOCKET_BUFFER_SIZE;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+    
+    // Datagram sizes come from per-session PMTU discovery, never IP fragmentation
+    int pmtu_mode = IP_PMTUDISC_PROBE;
+    setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &pmtu_mode, sizeof(pmtu_mode));
+    
+    // Paced datagrams carry departure times where the kernel supports them
+    int txtime = 0;
+#ifdef SO_TXTIME
+    struct sock_txtime txtime_cfg = { .clockid = CLOCK_MONOTONIC, .flags = 0 };
+    txtime = setsockopt(sock, SOL_SOCKET, SO_TXTIME, &txtime_cfg, sizeof(txtime_cfg)) == 0;
+#endif
+    
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = (uint32_t)index;
+    if (epoll_ctl(g_iotc_state.epoll_fd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+        close(sock);
+        return IOTC_ER_FAIL_CREATE_SOCKET;
+    }
+    
+    g_iotc_state.endpoints[index].fd = sock;
+    g_iotc_state.endpoints[index].port = port;
+    g_iotc_state.endpoints[index].txtime = txtime;
+    return index;
+}
+
+static int endpoint_find(uint16_t port) {
+    for (int i = 0; i < MAX_ENDPOINT_NUMBER; i++) {
+        if (g_iotc_state.endpoints[i].fd >= 0 && g_iotc_state.endpoints[i].port == port) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Sends a batch, waiting up to wait_ms for buffer space whenever the socket
+ * pushes back.  Returns the number of datagrams sent; calls counts syscalls. */
+static unsigned int endpoint_sendmmsg(int endpoint, struct mmsghdr *msgs, unsigned int count, int wait_ms,
+                                      unsigned int *calls) {
+    int fd = g_iotc_state.endpoints[endpoint].fd;
+    unsigned int sent = 0;
+    
+    if (calls) *calls = 0;
+    if (g_netsim.enabled) {
+        for (; sent < count; sent++) {
+            const struct msghdr *msg = &msgs[sent].msg_hdr;
+            if (netsim_send(endpoint, msg->msg_name, msg->msg_iov, msg->msg_iovlen) < 0) break;
+        }
+        if (calls) *calls = 1;
+        return sent;
+    }
+    while (sent < count) {
+        int n = sendmmsg(fd, &msgs[sent], count - sent, 0);
+        if (calls) (*calls)++;
+        if (n > 0) {
+            sent += (unsigned int)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        
+        struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK) || wait_ms <= 0 ||
+            poll(&pfd, 1, wait_ms) <= 0) {
+            break;
+        }
+    }
+    return sent;
+}
+
+static void endpoint_close_all(void) {
+    for (int i = 0; i < MAX_ENDPOINT_NUMBER; i++) {
+        if (g_iotc_state.endpoints[i].fd >= 0) {
+            if (g_iotc_state.endpoints[i].fd != NETSIM_ENDPOINT_FD) close(g_iotc_state.endpoints[i].fd);
+            g_iotc_state.endpoints[i].fd = -1;
+            g_iotc_state.endpoints[i].port = 0;
+            g_iotc_state.endpoints[i].txtime = 0;
+        }
+    }
+}
+
+/* Session datagram I/O */
+static void session_build_header(session_info_t *session, uint8_t *packet, uint16_t type, uint8_t channel,
+                                 uint32_t seq, size_t size, uint64_t now) {
+    IOTCHeader hdr;
+    hdr.flag = IOTC_WIRE_FLAG(type, channel);
+    hdr.sid = session->remote_session_id;
+    hdr.seq = seq;
+    // RDT compares its echoes with the coarse clock its timers run on; every
+    // other timestamp feeds the delay measurements and needs full resolution
+    if (type == IOTC_MSG_RDT_DATA || type == IOTC_MSG_RDT_ACK) {
+        hdr.timestamp = (uint32_t)now;
+    } else {
+        hdr.timestamp = (uint32_t)(iotc_now_us() / 1000);
+    }
+    hdr.payload = (uint32_t)size;
+    IOTC_Header_hton(&hdr);
+    memcpy(packet, &hdr, sizeof(hdr));
+}
+
+static size_t session_build_packet(session_info_t *session, uint8_t *packet, uint16_t type, uint8_t channel,
+                                   uint32_t seq, const void *payload, size_t size, uint64_t now) {
+    session_build_header(session, packet, type, channel, seq, size, now);
+    if (size) memcpy(packet + sizeof(IOTCHeader), payload, size);
+    return sizeof(IOTCHeader) + size;
+}
+
+static int session_send_packet(session_info_t *session, uint16_t type, uint8_t channel,
+                               uint32_t seq, const void *payload, size_t size) {
+    uint8_t packet[PMTU_MAX_DATAGRAM];
+    uint64_t now = iotc_now_ms();
+    
+    if (!session->has_peer || size > sizeof(packet) - sizeof(IOTCHeader)) return -1;
+    
+    size_t len = session_build_packet(session, packet, type, channel, seq, payload, size, now);
+    if (type == IOTC_MSG_DATA) cc_stamp(session, packet);
+    int counted = type == IOTC_MSG_DATA || type == IOTC_MSG_RDT_DATA || type == IOTC_MSG_RDT_ACK ? channel : -1;
+    struct iovec iov = { .iov_base = packet, .iov_len = len };
+    int ret = g_netsim.enabled ? netsim_send(session->endpoint, &session->remote_addr, &iov, 1)
+                               : (int)sendto(g_iotc_state.endpoints[session->endpoint].fd, packet, len, 0,
+                                             (const struct sockaddr *)&session->remote_addr,
+                                             sizeof(session->remote_addr));
+    if (ret < 0) {
+        traffic_count_drop(session, counted, 1);
+        return -1;
+    }
+    
+    traffic_count_tx(session, counted, len, 1);
+    if (session->capture) capture_packet(session, 0, packet, len, NULL, 0);
+    session->last_send = now;
+    session->tx_bytes += len;
+    session->tx_calls++;
+    session->tx_datagrams++;
+    return 0;
+}
+
+static void session_send_connect(session_info_t *session) {
+    uint8_t payload[IOTC_CONNECT_PAYLOAD_SIZE];
+    uint32_t sid = htonl(session->session_id);
+    
+    memcpy(payload, session->uid, 20);
+    memcpy(payload + 20, &sid, sizeof(sid));
+    session_send_packet(session, IOTC_MSG_CONNECT, 0, 0, payload, sizeof(payload));
+}
+
+static void session_send_connect_ack(session_info_t *session) {
+    uint32_t sid = htonl(session->session_id);
+    session_send_packet(session, IOTC_MSG_CONNECT_ACK, 0, 0, &sid, sizeof(sid));
+}
+
+/* Binds the session to a peer reachable through an endpoint and starts its
+ * idle timer and heartbeats. */
+static void session_attach_peer(session_info_t *session, int endpoint, const struct sockaddr_in *addr) {
+    session->remote_addr = *addr;
+    session->endpoint = endpoint;
+    session->has_peer = 1;
+    session->last_activity = iotc_now_ms();
+    session->last_send = session->last_activity;
+    
+    if (g_iotc_state.idle_timeout_ms) {
+        timer_add(&session->idle_timer, g_iotc_state.idle_timeout_ms);
+    }
+    heartbeat_schedule(session);
+}
+
+/* Path MTU discovery.  Endpoints set DF on every datagram
+ * (IP_PMTUDISC_PROBE), and each session searches its path with padded PMTU
+ * probes. The search runs between PMTU_BASE_DATAGRAM and the route MTU the
+ * kernel reports for the peer. A probe counts as lost after
+ * PMTU_PROBE_TRIES unanswered sends. A peer that never answers keeps the
+ * default size, since it may simply not understand probes. */
+static const uint8_t g_pmtu_padding[PMTU_MAX_DATAGRAM];
+
+static uint32_t pmtu_route_limit(const struct sockaddr_in *addr) {
+    uint32_t limit = PMTU_DEFAULT_DATAGRAM;
+    if (g_netsim.enabled) {
+        limit = g_netsim.active.mtu - PMTU_IP_UDP_OVERHEAD;
+        return limit > PMTU_MAX_DATAGRAM ? PMTU_MAX_DATAGRAM : limit;
+    }
+    
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) return limit;
+    
+    int mode = IP_PMTUDISC_DO, mtu = 0;
+    socklen_t len = sizeof(mtu);
+    setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &mode, sizeof(mode));
+    if (connect(sock, (const struct sockaddr *)addr, sizeof(*addr)) == 0 &&
+        getsockopt(sock, IPPROTO_IP, IP_MTU, &mtu, &len) == 0 && mtu > PMTU_IP_UDP_OVERHEAD) {
+        limit = (uint32_t)mtu - PMTU_IP_UDP_OVERHEAD;
+    }
+    close(sock);
+    
+    return limit > PMTU_MAX_DATAGRAM ? PMTU_MAX_DATAGRAM : limit;
+}
+
+/* Returns 0 once the probe is on the wire, -1 if it cannot leave this host. */
+static int pmtu_send_probe(session_info_t *session, uint32_t size) {
+    uint8_t header[sizeof(IOTCHeader)];
+    session_build_header(session, header, IOTC_MSG_PMTU_PROBE, 0, size, size - sizeof(IOTCHeader), iotc_now_ms());
+    
+    struct iovec iov[2] = {
+        { .iov_base = header, .iov_len = sizeof(header) },
+        { .iov_base = (void *)g_pmtu_padding, .iov_len = size - sizeof(IOTCHeader) },
+    };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &session->remote_addr;
+    msg.msg_namelen = sizeof(session->remote_addr);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    
+    int ret = g_netsim.enabled ? netsim_send(session->endpoint, &session->remote_addr, iov, 2)
+                               : (int)sendmsg(g_iotc_state.endpoints[session->endpoint].fd, &msg, 0);
+    if (ret < 0) return -1;
+    
+    if (session->capture) capture_packet(session, 0, header, sizeof(header), g_pmtu_padding, iov[1].iov_len);
+    return 0;
+}
+
+/* Sends the next probe of the binary search, or settles on the result. */
+static void pmtu_probe_next(session_info_t *session) {
+    while (session->pmtu_hi - session->pmtu_lo > PMTU_SEARCH_GRANULARITY) {
+        session->pmtu_probe = (session->pmtu_lo + session->pmtu_hi + 1) / 2;
+        session->pmtu_tries = 1;
+        
+        if (pmtu_send_probe(session, session->pmtu_probe) == 0) {
+            timer_add(&session->pmtu_timer, PMTU_PROBE_TIMEOUT_MS);
+            return;
+        }
+        // EMSGSIZE and friends: too big for the local route, no need to wait
+        session->pmtu_hi = session->pmtu_probe - 1;
+    }
+    
+    session->pmtu_searching = 0;
+    session->pmtu_probe = 0;
+    if (session->pmtu_acked) {
+        session->pmtu = session->pmtu_lo;
+    }
+    
+    // Paths change; look for a larger size again later
+    timer_add(&session->pmtu_timer, PMTU_RAISE_INTERVAL_MS);
+}
+
+static void pmtu_start(session_info_t *session) {
+    uint32_t limit = pmtu_route_limit(&session->remote_addr);
+    
+    if (session->pmtu == 0) {
+        session->pmtu = limit < PMTU_DEFAULT_DATAGRAM ? limit : PMTU_DEFAULT_DATAGRAM;
+    }
+    session->pmtu_lo = limit < PMTU_BASE_DATAGRAM ? limit : PMTU_BASE_DATAGRAM;
+    session->pmtu_hi = limit;
+    session->pmtu_acked = 0;
+    session->pmtu_searching = 1;
+    
+    // Most paths carry the full route MTU, so try that before bisecting
+    session->pmtu_probe = limit;
+    session->pmtu_tries = 1;
+    if (pmtu_send_probe(session, limit) == 0) {
+        timer_add(&session->pmtu_timer, PMTU_PROBE_TIMEOUT_MS);
+        return;
+    }
+    session->pmtu_hi = limit - 1;
+    pmtu_probe_next(session);
+}
+
+static void pmtu_timer_fired(iotc_timer_t *timer, uint64_t now_ms) {
+    (void)now_ms;
+    session_info_t *session = timer->arg;
+    
+    if (session->state != SESSION_STATE_CONNECTED) return;
+    
+    if (!session->pmtu_searching) {
+        pmtu_start(session);
+        return;
+    }
+    
+    IOTC_PROBE_TIMEOUT(session->session_id, "pmtu");
+    if (session->pmtu_tries < PMTU_PROBE_TRIES && pmtu_send_probe(session, session->pmtu_probe) == 0) {
+        session->pmtu_tries++;
+        timer_add(timer, PMTU_PROBE_TIMEOUT_MS);
+        return;
+    }
+    
+    session->pmtu_hi = session->pmtu_probe - 1;
+    pmtu_probe_next(session);
+}
+
+static void pmtu_handle_ack(session_info_t *session, uint32_t size) {
+    if (!session->pmtu_searching || size != session->pmtu_probe) return;
+    
+    timer_cancel(&session->pmtu_timer);
+    session->pmtu_lo = size;
+    session->pmtu_acked = 1;
+    pmtu_probe_next(session);
+}
+
+/* Largest payload that fits one datagram on this session's path */
+static size_t session_max_payload(const session_info_t *session) {
+    uint32_t pmtu = session->pmtu ? session->pmtu : PMTU_DEFAULT_DATAGRAM;
+    return pmtu - sizeof(IOTCHeader);
+}
+
+/* Forward error correction over DATA_FRAG groups.  Parity is computed over
+ * GF(2^8) (polynomial 0x11D): XOR groups carry one plain parity fragment,
+ * Reed-Solomon groups use Cauchy rows 1 / (row ^ (FEC_MAX_PARITY + i)), so any
+ * fragments-lost <= parity-received pattern is solvable.  The region kernels
+ * are picked once per process from the CPU features. */
+static uint8_t g_gf_exp[512];
+static uint8_t g_gf_log[256];
+
+typedef void (*fec_xor_fn)(uint8_t *dst, const uint8_t *src, size_t len);
+typedef void (*fec_mul_add_fn)(uint8_t *dst, const uint8_t *src, const uint8_t tables[32], size_t len);
+
+static fec_xor_fn g_fec_xor;
+static fec_mul_add_fn g_fec_mul_add;
+
+static uint8_t gf_mul(uint8_t a, uint8_t b) {
+    if (a == 0 || b == 0) return 0;
+    return g_gf_exp[g_gf_log[a] + g_gf_log[b]];
+}
+
+static uint8_t gf_inv(uint8_t a) {
+    return g_gf_exp[255 - g_gf_log[a]];
+}
+
+static uint8_t fec_coef(uint8_t mode, uint32_t row, uint32_t index) {
+    if (mode == IOTC_FEC_XOR) return 1;
+    return gf_inv((uint8_t)(row ^ (FEC_MAX_PARITY + index)));
+}
+
+/* Products of c with every low and high nibble; c * x = lo[x & 15] ^ hi[x >> 4] */
+static void gf_nibble_tables(uint8_t c, uint8_t tables[32]) {
+    for (int i = 0; i < 16; i++) {
+        tables[i] = gf_mul(c, (uint8_t)i);
+        tables[16 + i] = gf_mul(c, (uint8_t)(i << 4));
+    }
+}
+
+static void fec_xor_scalar(uint8_t *dst, const uint8_t *src, size_t len) {
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a ^= b;
+        memcpy(dst + i, &a, 8);
+    }
+    for (; i < len; i++) dst[i] ^= src[i];
+}
+
+static void fec_mul_add_scalar(uint8_t *dst, const uint8_t *src, const uint8_t tables[32], size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        dst[i] ^= tables[src[i] & 0x0F] ^ tables[16 + (src[i] >> 4)];
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static void fec_xor_sse2(uint8_t *dst, const uint8_t *src, size_t len) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(a, b));
+    }
+    fec_xor_scalar(dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void fec_xor_avx2(uint8_t *dst, const uint8_t *src, size_t len) {
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(a, b));
+    }
+    fec_xor_scalar(dst + i, src + i, len - i);
+}
+
+/* The nibble lookups need a byte shuffle, which SSE2 lacks */
+__attribute__((target("ssse3")))
+static void fec_mul_add_ssse3(uint8_t *dst, const uint8_t *src, const uint8_t tables[32], size_t len) {
+    __m128i lo = _mm_loadu_si128((const __m128i *)tables);
+    __m128i hi = _mm_loadu_si128((const __m128i *)(tables + 16));
+    __m128i mask = _mm_set1_epi8(0x0F);
+    size_t i = 0;
+    
+    for (; i + 16 <= len; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i p = _mm_xor_si128(_mm_shuffle_epi8(lo, _mm_and_si128(s, mask)),
+                                  _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, p));
+    }
+    fec_mul_add_scalar(dst + i, src + i, tables, len - i);
+}
+
+__attribute__((target("avx2")))
+static void fec_mul_add_avx2(uint8_t *dst, const uint8_t *src, const uint8_t tables[32], size_t len) {
+    __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)tables));
+    __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(tables + 16)));
+    __m256i mask = _mm256_set1_epi8(0x0F);
+    size_t i = 0;
+    
+    for (; i + 32 <= len; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i p = _mm256_xor_si256(_mm256_shuffle_epi8(lo, _mm256_and_si256(s, mask)),
+                                     _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, p));
+    }
+    fec_mul_add_scalar(dst + i, src + i, tables, len - i);
+}
+#endif
+
+static void fec_init(void) {
+    unsigned int x = 1;
+    for (int i = 0; i < 255; i++) {
+        g_gf_exp[i] = (uint8_t)x;
+        g_gf_log[x] = (uint8_t)i;
+        x <<= 1;
+        if (x & 0x100) x ^= 0x11D;
+    }
+    for (int i = 255; i < 512; i++) {
+        g_gf_exp[i] = g_gf_exp[i - 255];
+    }
+    
+    g_fec_xor = fec_xor_scalar;
+    g_fec_mul_add = fec_mul_add_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) g_fec_xor = fec_xor_sse2;
+    if (__builtin_cpu_supports("ssse3")) g_fec_mul_add = fec_mul_add_ssse3;
+    if (__builtin_cpu_supports("avx2")) {
+        g_fec_xor = fec_xor_avx2;
+        g_fec_mul_add = fec_mul_add_avx2;
+    }
+#endif
+}
+
+/* dst ^= c * src over len bytes */
+static void fec_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    if (c == 0) return;
+    if (c == 1) {
+        g_fec_xor(dst, src, len);
+        return;
+    }
+    uint8_t tables[32];
+    gf_nibble_tables(c, tables);
+    g_fec_mul_add(dst, src, tables, len);
+}
+
+/* Inverts an n x n matrix in place; Cauchy submatrices are never singular */
+static int gf_invert_matrix(uint8_t *m, int n) {
+    uint8_t inv[FEC_MAX_PARITY * FEC_MAX_PARITY];
+    memset(inv, 0, sizeof(inv));
+    for (int i = 0; i < n; i++) inv[i * n + i] = 1;
+    
+    for (int col = 0; col < n; col++) {
+        int pivot = col;
+        while (pivot < n && m[pivot * n + col] == 0) pivot++;
+        if (pivot == n) return -1;
+        
+        for (int k = 0; k < n; k++) {
+            uint8_t t = m[col * n + k];
+            m[col * n + k] = m[pivot * n + k];
+            m[pivot * n + k] = t;
+            t = inv[col * n + k];
+            inv[col * n + k] = inv[pivot * n + k];
+            inv[pivot * n + k] = t;
+        }
+        
+        uint8_t scale = gf_inv(m[col * n + col]);
+        for (int k = 0; k < n; k++) {
+            m[col * n + k] = gf_mul(m[col * n + k], scale);
+            inv[col * n + k] = gf_mul(inv[col * n + k], scale);
+        }
+        
+        for (int row = 0; row < n; row++) {
+            uint8_t f = m[row * n + col];
+            if (row == col || f == 0) continue;
+            for (int k = 0; k < n; k++) {
+                m[row * n + k] ^= gf_mul(f, m[col * n + k]);
+                inv[row * n + k] ^= gf_mul(f, inv[col * n + k]);
+            }
+        }
+    }
+    
+    memcpy(m, inv, (size_t)n * n);
+    return 0;
+}
+
+/* Send pacing.  Paced datagrams are copied into per-channel queues and
+ * released by the session's wheel timer as the session and channel token
+ * buckets allow, round-robin across channels.  Bucket credit is kept in
+ * byte-milliseconds so refills stay exact at low rates.  On endpoints with
+ * SO_TXTIME each datagram also carries its earliest departure time, which an
+ * fq qdisc uses to spread the burst released on each tick.  Guarded by
+ * global_mutex. */
+typedef struct paced_packet {
+    struct paced_packet *next;
+    uint8_t kind;                       /* PACE_KIND_* for the transmit counters */
+    uint8_t channel;
+    uint8_t pool_class;
+    size_t len;
+    uint8_t data[];
+} paced_packet_t;
+
+static void bucket_configure(token_bucket_t *bucket, uint32_t rate, uint32_t burst, uint64_t now) {
+    bucket->rate = rate;
+    bucket->burst = burst ? burst : PACE_DEFAULT_BURST;
+    bucket->credit = (int64_t)bucket->burst * 1000;
+    bucket->last_ms = now;
+    bucket->backlogged = 0;
+}
+
+static void bucket_refill(token_bucket_t *bucket, uint64_t now) {
+    if (bucket->rate == 0) return;
+    
+    // The timer only drains once per wheel tick, so a backlogged queue holds
+    // at least two ticks' worth or the burst size would cap the rate.  An
+    // idle bucket never starts with more than the burst.
+    int64_t cap = (int64_t)bucket->burst * 1000;
+    int64_t ticks = (int64_t)bucket->rate * 2 * TIMER_WHEEL_TICK_MS;
+    if (bucket->backlogged && cap < ticks) cap = ticks;
+    bucket->credit += (int64_t)(bucket->rate * (now - bucket->last_ms));
+    if (bucket->credit > cap) bucket->credit = cap;
+    bucket->last_ms = now;
+}
+
+/* Milliseconds until the bucket lets the next datagram through */
+static uint64_t bucket_wait_ms(const token_bucket_t *bucket) {
+    if (bucket->rate == 0 || bucket->credit > 0) return 0;
+    return (uint64_t)(-bucket->credit) / bucket->rate + 1;
+}
+
+static int session_paced(const session_info_t *session, uint8_t channel) {
+    const channel_info_t *ch = &session->channels[channel];
+    return session->pace.rate || ch->pace.rate || ch->pace_head;
+}
+
+static int pace_enqueue(session_info_t *session, uint8_t channel, uint8_t kind,
+                        const struct iovec *iov, size_t iovcnt) {
+    size_t len = 0;
+    for (size_t i = 0; i < iovcnt; i++) len += iov[i].iov_len;
+    
+    uint8_t cls;
+    paced_packet_t *packet = block_alloc(sizeof(*packet) + len, &cls);
+    if (!packet) return -1;
+    
+    packet->next = NULL;
+    packet->pool_class = cls;
+    packet->kind = kind;
+    packet->channel = channel;
+    packet->len = len;
+    size_t offset = 0;
+    for (size_t i = 0; i < iovcnt; i++) {
+        memcpy(packet->data + offset, iov[i].iov_base, iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+    
+    channel_info_t *ch = &session->channels[channel];
+    if (ch->pace_tail) {
+        ch->pace_tail->next = packet;
+    } else {
+        ch->pace_head = packet;
+    }
+    ch->pace_tail = packet;
+    session->pace_bytes += len;
+    return 0;
+}
+
+static void pace_drop_channel(session_info_t *session, uint8_t channel) {
+    channel_info_t *ch = &session->channels[channel];
+    while (ch->pace_head) {
+        paced_packet_t *packet = ch->pace_head;
+        ch->pace_head = packet->next;
+        session->pace_bytes -= packet->len;
+        block_free(packet, packet->pool_class);
+    }
+    ch->pace_tail = NULL;
+}
+
+static void pace_drop(session_info_t *session) {
+    timer_cancel(&session->pace_timer);
+    for (int i = 0; i < MAX_CHANNEL_NUMBER; i++) {
+        pace_drop_channel(session, (uint8_t)i);
+    }
+}
+
+/* Next channel, round-robin, whose head may leave now; -1 if none */
+static int pace_pick(session_info_t *session) {
+    if (session->pace.rate && session->pace.credit <= 0) return -1;
+    
+    for (int i = 0; i < MAX_CHANNEL_NUMBER; i++) {
+        int channel = (session->pace_rr + i) % MAX_CHANNEL_NUMBER;
+        channel_info_t *ch = &session->channels[channel];
+        if (ch->pace_head && (ch->pace.rate == 0 || ch->pace.credit > 0)) {
+            session->pace_rr = (uint8_t)((channel + 1) % MAX_CHANNEL_NUMBER);
+            return channel;
+        }
+    }
+    return -1;
+}
+
+static uint64_t pace_txtime_ns(session_info_t *session, const channel_info_t *ch, size_t len) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now_ns = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    
+    uint64_t rate = session->pace.rate;
+    if (ch->pace.rate && (rate == 0 || ch->pace.rate < rate)) rate = ch->pace.rate;
+    
+    uint64_t txtime = session->pace_next_ns > now_ns ? session->pace_next_ns : now_ns;
+    session->pace_next_ns = txtime + (rate ? len * 1000000000ULL / rate : 0);
+    return txtime;
+}
+
+static struct {
+    struct mmsghdr msgs[PACE_BATCH_MAX];
+    struct iovec iov[PACE_BATCH_MAX];
+    paced_packet_t *packets[PACE_BATCH_MAX];
+    union {
+        char buf[CMSG_SPACE(sizeof(uint64_t))];
+        struct cmsghdr align;
+    } control[PACE_BATCH_MAX];
+} g_pace_batch;
+
+/* Sends whatever the buckets allow and re-arms the timer for the rest */
+static void pace_drain(session_info_t *session) {
+    uint64_t now = iotc_now_ms();
+    int txtime = g_iotc_state.endpoints[session->endpoint].txtime;
+    size_t released = 0;
+    
+    bucket_refill(&session->pace, now);
+    for (int i = 0; i < MAX_CHANNEL_NUMBER; i++) {
+        if (session->channels[i].pace_head) bucket_refill(&session->channels[i].pace, now);
+    }
+    
+    for (;;) {
+        unsigned int count = 0;
+        int channel;
+        
+        while (count < PACE_BATCH_MAX && (channel = pace_pick(session)) >= 0) {
+            channel_info_t *ch = &session->channels[channel];
+            paced_packet_t *packet = ch->pace_head;
+            ch->pace_head = packet->next;
+            if (!ch->pace_head) ch->pace_tail = NULL;
+            
+            // Buckets may go into debt by one datagram rather than stall on it
+            if (session->pace.rate) session->pace.credit -= (int64_t)packet->len * 1000;
+            if (ch->pace.rate) ch->pace.credit -= (int64_t)packet->len * 1000;
+            
+            struct msghdr *msg = &g_pace_batch.msgs[count].msg_hdr;
+            memset(msg, 0, sizeof(*msg));
+            g_pace_batch.iov[count].iov_base = packet->data;
+            g_pace_batch.iov[count].iov_len = packet->len;
+            msg->msg_name = &session->remote_addr;
+            msg->msg_namelen = sizeof(session->remote_addr);
+            msg->msg_iov = &g_pace_batch.iov[count];
+            msg->msg_iovlen = 1;
+            cc_stamp(session, packet->data);
+#ifdef SCM_TXTIME
+            if (txtime) {
+                uint64_t when = pace_txtime_ns(session, ch, packet->len);
+                msg->msg_control = g_pace_batch.control[count].buf;
+                msg->msg_controllen = sizeof(g_pace_batch.control[count].buf);
+                struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_TXTIME;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(when));
+                memcpy(CMSG_DATA(cmsg), &when, sizeof(when));
+            }
+#endif
+            g_pace_batch.packets[count++] = packet;
+        }
+        if (count == 0) break;
+        
+        unsigned int calls = 0;
+        unsigned int sent = endpoint_sendmmsg(session->endpoint, g_pace_batch.msgs, count, 0, &calls);
+        session->tx_calls += calls;
+        session->tx_datagrams += sent;
+        for (unsigned int i = 0; i < count; i++) {
+            paced_packet_t *packet = g_pace_batch.packets[i];
+            if (i < sent) {
+                session->tx_bytes += packet->len;
+                if (packet->kind == PACE_KIND_FRAGMENT) session->tx_fragments++;
+                if (packet->kind == PACE_KIND_PARITY) session->tx_parity++;
+                traffic_count_tx(session, packet->channel, packet->len, 1);
+                if (session->capture) capture_packet(session, 0, packet->data, packet->len, NULL, 0);
+            } else {
+                traffic_count_drop(session, packet->channel, 1);
+            }
+            session->pace_bytes -= packet->len;
+            released += packet->len;
+            block_free(packet, packet->pool_class);
+        }
+    }
+    
+    // Sleep until the first queue whose buckets will have refilled
+    uint64_t wait = UINT64_MAX;
+    session->pace.backlogged = session->pace_bytes > 0;
+    for (int i = 0; i < MAX_CHANNEL_NUMBER; i++) {
+        channel_info_t *ch = &session->channels[i];
+        ch->pace.backlogged = ch->pace_head != NULL;
+        if (!ch->pace_head) continue;
+        
+        uint64_t channel_wait = bucket_wait_ms(&ch->pace);
+        uint64_t session_wait = bucket_wait_ms(&session->pace);
+        uint64_t ready = channel_wait > session_wait ? channel_wait : session_wait;
+        if (ready < wait) wait = ready;
+    }
+    if (wait != UINT64_MAX) {
+        timer_add(&session->pace_timer, wait);
+    } else {
+        timer_cancel(&session->pace_timer);
+    }
+    
+    if (released) {
+        session->last_send = now;
+        pthread_cond_broadcast(&session->state_cond);
+    }
+}
+
+static void pace_timer_fired(iotc_timer_t *timer, uint64_t now_ms) {
+    (void)now_ms;
+    session_info_t *session = timer->arg;
+    
+    if (session->state == SESSION_STATE_CONNECTED && session->has_peer) {
+        pace_drain(session);
+    }
+}
+
+static int session_send_data(session_info_t *session, uint8_t channel, uint32_t seq,
+                             const void *data, size_t size) {
+    if (!session_paced(session, channel)) {
+        return session_send_packet(session, IOTC_MSG_DATA, channel, seq, data, size);
+    }
+    
+    uint8_t header[sizeof(IOTCHeader)];
+    session_build_header(session, header, IOTC_MSG_DATA, channel, seq, size, iotc_now_ms());
+    struct iovec iov[2] = {
+        { .iov_base = header, .iov_len = sizeof(header) },
+        { .iov_base = (void *)data, .iov_len = size },
+    };
+    if (pace_enqueue(session, channel, PACE_KIND_DATA, iov, 2) < 0) return -1;
+    
+    pace_drain(session);
+    return 0;
+}
+
+/* Path delay.  Both ends echo the newest peer timestamp they hold, with the
+ * microseconds it was held, in CC_FEEDBACK and KEEPALIVE, so the peer gets
+ * RTT samples from traffic it already exchanges.  Jitter (RFC 3550) and the
+ * queuing part of the one-way delay come from the peer's media timestamps;
+ * the clock offset between the ends cancels out of both.  Guarded by
+ * global_mutex. */
+static void delay_on_receive(session_info_t *session, const IOTCHeader *hdr, int media) {
+    delay_tracker_t *d = &session->delay;
+    uint64_t now_us = iotc_now_us();
+    
+    d->peer_ts = hdr->timestamp;
+    d->peer_ts_arrival_us = now_us;
+    d->peer_ts_valid = 1;
+    if (!media) return;
+    
+    double transit = (double)(int32_t)((uint32_t)(now_us / 1000) - hdr->timestamp) +
+                     (double)(now_us % 1000) / 1000.0;
+    if (d->transit_valid) {
+        double change = transit - d->prev_transit;
+        if (change < 0) change = -change;
+        d->jitter_ms += (change - d->jitter_ms) / 16.0;
+    }
+    d->prev_transit = transit;
+    d->transit_valid = 1;
+    
+    // The baseline is the lowest transit over the current and previous window
+    uint64_t now_ms = now_us / 1000;
+    if (!d->window_valid || now_ms - d->window_start >= DELAY_MIN_WINDOW_MS) {
+        d->min_prev = d->window_valid ? d->min_current : transit;
+        d->min_current = transit;
+        d->window_start = now_ms;
+        d->window_valid = 1;
+    } else if (transit < d->min_current) {
+        d->min_current = transit;
+    }
+    double base = d->min_current < d->min_prev ? d->min_current : d->min_prev;
+    d->queuing_ms += (transit - base - d->queuing_ms) / 8.0;
+}
+
+/* Fills the echo fields of an outgoing packet; hold is DELAY_NO_ECHO
+ * before the peer has sent anything */
+static void delay_echo(session_info_t *session, uint32_t fields[2]) {
+    delay_tracker_t *d = &session->delay;
+    uint64_t hold = d->peer_ts_valid ? iotc_now_us() - d->peer_ts_arrival_us : DELAY_NO_ECHO;
+    
+    fields[0] = htonl(d->peer_ts);
+    fields[1] = htonl(hold < DELAY_NO_ECHO ? (uint32_t)hold : DELAY_NO_ECHO);
+    d->echo_sent_ms = iotc_now_ms();
+}
+
+/* RFC 6298 smoothing of an echoed timestamp, in microseconds */
+static void delay_on_echo(session_info_t *session, const wire_echo_t *e) {
+    delay_tracker_t *d = &session->delay;
+    uint32_t echo = wire_be32(e->echo);
+    uint32_t hold = wire_be32(e->hold);
+    if (hold == DELAY_NO_ECHO) return;
+    
+    uint64_t now_us = iotc_now_us();
+    int64_t rtt = (int64_t)(uint32_t)((uint32_t)(now_us / 1000) - echo) * 1000 +
+                  (int64_t)(now_us % 1000) - hold;
+    if (rtt < 0) rtt = 0;
+    if (rtt > DELAY_MAX_RTT_US) return;
+    
+    uint32_t sample = (uint32_t)rtt;
+    if (d->rtt_samples == 0) {
+        d->srtt_us = sample;
+        d->rttvar_us = sample / 2;
+        d->rtt_min_us = sample;
+    } else {
+        uint32_t delta = d->srtt_us > sample ? d->srtt_us - sample : sample - d->srtt_us;
+        d->rttvar_us = (3 * d->rttvar_us + delta) / 4;
+        d->srtt_us = (7 * d->srtt_us + sample) / 8;
+        if (sample < d->rtt_min_us) d->rtt_min_us = sample;
+    }
+    d->rtt_latest_us = sample;
+    d->rtt_samples++;
+    metrics_record_rtt(sample);
+}
+
+/* Congestion control.  The receive side follows the shape of GCC: media
+ * datagrams sent within CC_GROUP_SPAN_MS form a group, the change in delay
+ * between consecutive groups is accumulated into a smoothed queuing delay,
+ * and the slope of a least-squares line over the last CC_TREND_WINDOW groups
+ * is compared against an adaptive threshold.  The send side grows its
+ * estimate while the peer reports normal delay, backs off below the peer's
+ * receive rate on overuse or heavy loss, and holds on underuse.  Guarded by
+ * global_mutex. */
+static void cc_reset(congestion_t *cc) {
+    memset(cc, 0, sizeof(*cc));
+    cc->usage = IOTC_CONGESTION_NORMAL;
+    cc->peer_usage = IOTC_CONGESTION_NORMAL;
+    cc->threshold = CC_THRESHOLD_INITIAL;
+    cc->overuse_ms = -1.0;
+    cc->startup = 1;
+    cc->estimate = CC_START_RATE;
+}
+
+/* Sets the transport sequence and departure time as the datagram leaves;
+ * the low half of seq keeps the message sequence */
+static void cc_stamp(session_info_t *session, uint8_t *header) {
+    uint32_t seq, timestamp = htonl((uint32_t)(iotc_now_us() / 1000));
+    
+    memcpy(&seq, header + offsetof(IOTCHeader, seq), sizeof(seq));
+    seq = htonl((ntohl(seq) & 0xFFFF) | (uint32_t)session->cc.tx_seq++ << 16);
+    memcpy(header + offsetof(IOTCHeader, seq), &seq, sizeof(seq));
+    memcpy(header + offsetof(IOTCHeader, timestamp), &timestamp, sizeof(timestamp));
+}
+
+static void cc_detect(congestion_t *cc, double now) {
+    double dt = now - cc->last_detect;
+    if (dt > 100.0) dt = 100.0;
+    cc->last_detect = now;
+    
+    if (cc->trend > cc->threshold) {
+        // Overuse needs to persist and not be receding
+        cc->overuse_ms = cc->overuse_ms < 0 ? dt / 2 : cc->overuse_ms + dt;
+        cc->overuse_count++;
+        if (cc->overuse_ms > CC_OVERUSE_TIME_MS && cc->overuse_count > 1 && cc->trend >= cc->prev_trend) {
+            cc->overuse_ms = 0;
+            cc->overuse_count = 0;
+            cc->usage = IOTC_CONGESTION_OVERUSE;
+        }
+    } else {
+        cc->overuse_ms = -1.0;
+        cc->overuse_count = 0;
+        cc->usage = cc->trend < -cc->threshold ? IOTC_CONGESTION_UNDERUSE : IOTC_CONGESTION_NORMAL;
+    }
+    cc->prev_trend = cc->trend;
+    
+    // The threshold follows the trend's usual spread but ignores spikes
+    double magnitude = cc->trend < 0 ? -cc->trend : cc->trend;
+    if (magnitude <= cc->threshold + CC_THRESHOLD_MAX_STEP) {
+        double k = magnitude < cc->threshold ? CC_THRESHOLD_DOWN : CC_THRESHOLD_UP;
+        cc->threshold += k * (magnitude - cc->threshold) * dt;
+        if (cc->threshold < CC_THRESHOLD_MIN) cc->threshold = CC_THRESHOLD_MIN;
+        if (cc->threshold > CC_THRESHOLD_MAX) cc->threshold = CC_THRESHOLD_MAX;
+    }
+}
+
+static void cc_update_trend(congestion_t *cc, double delay_delta, double arrival) {
+    if (cc->num_deltas < CC_TREND_MAX_DELTAS) cc->num_deltas++;
+    cc->accumulated_delay += delay_delta;
+    cc->smoothed_delay = CC_TREND_SMOOTHING * cc->smoothed_delay +
+                         (1.0 - CC_TREND_SMOOTHING) * cc->accumulated_delay;
+    
+    if (cc->trend_count == 0) cc->first_arrival = arrival;
+    cc->trend_x[cc->trend_pos] = arrival - cc->first_arrival;
+    cc->trend_y[cc->trend_pos] = cc->smoothed_delay;
+    cc->trend_pos = (cc->trend_pos + 1) % CC_TREND_WINDOW;
+    if (cc->trend_count < CC_TREND_WINDOW) cc->trend_count++;
+    
+    if (cc->trend_count == CC_TREND_WINDOW) {
+        double mean_x = 0, mean_y = 0, num = 0, den = 0;
+        for (int i = 0; i < CC_TREND_WINDOW; i++) {
+            mean_x += cc->trend_x[i];
+            mean_y += cc->trend_y[i];
+        }
+        mean_x /= CC_TREND_WINDOW;
+        mean_y /= CC_TREND_WINDOW;
+        for (int i = 0; i < CC_TREND_WINDOW; i++) {
+            num += (cc->trend_x[i] - mean_x) * (cc->trend_y[i] - mean_y);
+            den += (cc->trend_x[i] - mean_x) * (cc->trend_x[i] - mean_x);
+        }
+        if (den > 0) {
+            cc->slope = num / den;
+            cc->trend = (double)cc->num_deltas * cc->slope * CC_TREND_GAIN;
+        }
+    }
+    
+    cc_detect(cc, arrival);
+}
+
+static void cc_on_media(session_info_t *session, const IOTCHeader *hdr, size_t len) {
+    congestion_t *cc = &session->cc;
+    uint16_t seq = (uint16_t)(hdr->seq >> 16);
+    double arrival = (double)iotc_now_us() / 1000.0;
+    
+    // Gaps in the transport sequence count as loss until a late datagram fills one
+    int16_t gap = (int16_t)(seq - cc->rx_next_seq);
+    if (cc->rx_seq_valid && gap < 0) {
+        if (cc->rx_lost) cc->rx_lost--;
+    } else {
+        if (cc->rx_seq_valid) cc->rx_lost += (uint32_t)gap;
+        cc->rx_next_seq = (uint16_t)(seq + 1);
+        cc->rx_seq_valid = 1;
+    }
+    cc->rx_received++;
+    cc->rx_bytes += len;
+    
+    if (!session->cc_timer.pending) {
+        cc->rx_interval_start = iotc_now_ms();
+        timer_add(&session->cc_timer, CC_FEEDBACK_INTERVAL_MS);
+    }
+    
+    uint32_t sent = hdr->timestamp;
+    if (!cc->group_valid) {
+        cc->group_first_send = cc->group_last_send = sent;
+        cc->group_arrival = arrival;
+        cc->group_valid = 1;
+        return;
+    }
+    
+    int32_t offset = (int32_t)(sent - cc->group_first_send);
+    if (offset < 0) return;             // Reordered from an earlier group
+    if (offset <= CC_GROUP_SPAN_MS) {
+        if ((int32_t)(sent - cc->group_last_send) > 0) cc->group_last_send = sent;
+        cc->group_arrival = arrival;
+        return;
+    }
+    
+    // A later send time closes the group; compare it with the one before
+    if (cc->prev_valid) {
+        double send_delta = (double)(int32_t)(cc->group_last_send - cc->prev_send);
+        cc_update_trend(cc, (cc->group_arrival - cc->prev_arrival) - send_delta, cc->group_arrival);
+    }
+    cc->prev_send = cc->group_last_send;
+    cc->prev_arrival = cc->group_arrival;
+    cc->prev_valid = 1;
+    cc->group_first_send = cc->group_last_send = sent;
+    cc->group_arrival = arrival;
+}
+
+static void cc_feedback_timer_fired(iotc_timer_t *timer, uint64_t now_ms) {
+    session_info_t *session = timer->arg;
+    congestion_t *cc = &session->cc;
+    
+    if (session->state != SESSION_STATE_CONNECTED || !session->has_peer) return;
+    
+    uint64_t elapsed = now_ms > cc->rx_interval_start ? now_ms - cc->rx_interval_start : 1;
+    uint64_t rate = cc->rx_bytes * 1000 / elapsed;
+    uint32_t fields[5] = {
+        htonl(rate > UINT32_MAX ? UINT32_MAX : (uint32_t)rate),
+        htonl((cc->rx_received > 0xFFFF ? 0xFFFF : cc->rx_received) << 16 |
+              (cc->rx_lost > 0xFFFF ? 0xFFFF : cc->rx_lost)),
+        htonl((uint32_t)cc->usage << 24),
+    };
+    delay_echo(session, &fields[3]);
+    session_send_packet(session, IOTC_MSG_CC_FEEDBACK, 0, 0, fields, sizeof(fields));
+    
+    cc->rx_bytes = 0;
+    cc->rx_received = 0;
+    cc->rx_lost = 0;
+}
+
+/* Session bucket rate: the estimate when enabled, capped by any explicit rate */
+static uint32_t cc_session_rate(const session_info_t *session) {
+    uint32_t rate = session->cc.rate_limit;
+    if (session->cc.enabled && (rate == 0 || session->cc.estimate < rate)) rate = session->cc.estimate;
+    return rate;
+}
+
+static void cc_apply_rate(session_info_t *session) {
+    uint32_t rate = cc_session_rate(session);
+    uint64_t now = iotc_now_ms();
+    
+    if (rate == session->pace.rate) return;
+    
+    if (session->pace.rate == 0 || rate == 0) {
+        bucket_configure(&session->pace, rate, session->pace.burst, now);
+    } else {
+        bucket_refill(&session->pace, now);
+        session->pace.rate = rate;
+    }
+    if (session->pace_bytes && session->has_peer) pace_drain(session);
+}
+
+static void cc_on_feedback(session_info_t *session, const wire_cc_feedback_t *fb) {
+    congestion_t *cc = &session->cc;
+    uint64_t now = iotc_now_ms();
+    uint32_t rate = wire_be32(fb->rate);
+    uint32_t received = wire_be16(fb->received);
+    uint32_t lost = wire_be16(fb->lost);
+    uint8_t usage = fb->usage;
+    
+    uint64_t dt = cc->last_feedback ? now - cc->last_feedback : CC_FEEDBACK_INTERVAL_MS;
+    if (dt > 1000) dt = 1000;
+    cc->last_feedback = now;
+    cc->peer_rate = rate;
+    cc->peer_usage = usage;
+    cc->loss_permille = received + lost ? lost * 1000 / (received + lost) : 0;
+    
+    double estimate = cc->estimate;
+    int may_decrease = now - cc->last_decrease >= CC_DECREASE_INTERVAL_MS;
+    
+    if (usage == IOTC_CONGESTION_OVERUSE && may_decrease) {
+        // Back off to just under what actually got through
+        double target = (rate ? rate : estimate) * CC_DECREASE_FACTOR;
+        if (target < estimate) estimate = target;
+        cc->startup = 0;
+        cc->last_decrease = now;
+        may_decrease = 0;
+    } else if (usage == IOTC_CONGESTION_NORMAL && cc->loss_permille <= CC_LOSS_HOLD_PERMILLE) {
+        estimate += estimate * (cc->startup ? CC_STARTUP_GROWTH : CC_GROWTH) * (double)dt / 1000.0;
+        
+        // Do not grow far past what the receiver has seen
+        double ceiling = 1.5 * rate + CC_RATE_HEADROOM;
+        if (estimate > ceiling) estimate = ceiling > cc->estimate ? ceiling : cc->estimate;
+    }
+    
+    // Heavy loss means a drop-tail queue is overflowing without the delay
+    // ever trending up; light loss only stops the growth
+    if (cc->loss_permille > CC_LOSS_DECREASE_PERMILLE && may_decrease) {
+        double target = (rate ? rate : estimate) * (1.0 - cc->loss_permille / 2000.0);
+        if (target < estimate) estimate = target;
+        cc->startup = 0;
+        cc->last_decrease = now;
+    }
+    
+    if (estimate < CC_MIN_RATE) estimate = CC_MIN_RATE;
+    if (estimate > CC_MAX_RATE) estimate = CC_MAX_RATE;
+    cc->estimate = (uint32_t)estimate;
+    
+    if (cc->enabled) cc_apply_rate(session);
+}
+
+/* Large messages.  Writes above the path's datagram size are split into DATA_FRAG
+ * packets that share a message ID; the receiver collects them in a
+ * reassembly context and queues the whole message as one delivery.  Contexts
+ * expire after REASSEMBLY_TIMEOUT_MS without progress.  Guarded by
+ * global_mutex. */
+typedef struct {
+    int in_use;
+    session_info_t *session;
+    uint8_t channel;
+    uint32_t msg_id;
+    uint16_t seq;
+    uint32_t total_len;
+    uint32_t frag_size;
+    uint32_t frag_count;
+    uint32_t frag_received;
+    uint64_t last_progress;
+    uint8_t *data;                      /* frag_count * frag_size, zero padded past total_len */
+    size_t capacity;
+    uint32_t *bitmap;                   /* received fragments, retained across messages */
+    size_t bitmap_words;
+    uint8_t fec_mode;                   /* learned from the first parity packet */
+    uint8_t fec_data;
+    uint8_t fec_parity;
+    uint8_t *parity;                    /* group * fec_parity + row slots, retained */
+    size_t parity_capacity;
+    uint16_t *parity_mask;              /* parity rows held per group, retained */
+    size_t parity_groups;
+    iotc_timer_t expire_timer;
+} reassembly_t;
+
+static reassembly_t g_reassembly[REASSEMBLY_SLOTS];
+
+static void reassembly_release(reassembly_t *ctx) {
+    timer_cancel(&ctx->expire_timer);
+    if (ctx->data) {
+        frag_pool_put(ctx->data, ctx->capacity);
+        ctx->data = NULL;
+        ctx->capacity = 0;
+    }
+    ctx->in_use = 0;
+    ctx->session = NULL;
+}
+
+static void reassembly_expire_fired(iotc_timer_t *timer, uint64_t now_ms) {
+    reassembly_t *ctx = timer->arg;
+    uint64_t quiet = now_ms - ctx->last_progress;
+    
+    if (quiet >= REASSEMBLY_TIMEOUT_MS) {
+        IOTC_PROBE_TIMEOUT(ctx->session->session_id, "reassembly");
+        IOTC_LOG(IOTC_LOG_LEVEL_DEBUG, "session %u channel %u: incomplete message expired",
+                 ctx->session->session_id, ctx->channel);
+        traffic_count_drop(ctx->session, ctx->channel, 1);
+        reassembly_release(ctx);
+        return;
+    }
+    timer_add(timer, REASSEMBLY_TIMEOUT_MS - quiet);
+}
+
+static void reassembly_drop_session(session_info_t *session) {
+    for (int i = 0; i < REASSEMBLY_SLOTS; i++) {
+        if (g_reassembly[i].in_use && g_reassembly[i].session == session) {
+            reassembly_release(&g_reassembly[i]);
+        }
+    }
+}
+
+static reassembly_t *reassembly_find(session_info_t *session, uint8_t channel, uint32_t msg_id, int may_start) {
+    reassembly_t *oldest = NULL;
+    reassembly_t *free_ctx = NULL;
+    
+    for (int i = 0; i < REASSEMBLY_SLOTS; i++) {
+        reassembly_t *ctx = &g_reassembly[i];
+        if (!ctx->in_use) {
+            if (!free_ctx) free_ctx = ctx;
+            continue;
+        }
+        if (ctx->session == session && ctx->channel == channel && ctx->msg_id == msg_id) {
+            return ctx;
+        }
+        if (!oldest || ctx->last_progress < oldest->last_progress) oldest = ctx;
+    }
+    if (!may_start) return NULL;
+    
+    // All contexts busy: the stalest message is the least likely to complete
+    if (!free_ctx) {
+        traffic_count_drop(oldest->session, oldest->channel, 1);
+        reassembly_release(oldest);
+        free_ctx = oldest;
+    }
+    return free_ctx;
+}
+
+/* Finds the message a fragment or parity packet belongs to, starting it if
+ * allowed.  Parity that trails an already delivered message must not
+ * resurrect it, so parity only starts messages newer than any seen before. */
+static reassembly_t *reassembly_get(session_info_t *session, uint8_t channel, const IOTCHeader *hdr,
+                                    const wire_frag_t *frag, int may_start) {
+    uint32_t msg_id = wire_frag_msg_id(frag);
+    uint32_t total_len = wire_frag_total_len(frag);
+    uint32_t frag_size = wire_frag_size(frag);
+    
+    if (frag_size == 0 || total_len <= frag_size || total_len > g_iotc_state.max_message_size) return NULL;
+    
+    int newer = (int32_t)(msg_id - session->frag_rx_newest) > 0;
+    reassembly_t *ctx = reassembly_find(session, channel, msg_id, may_start || newer);
+    if (!ctx) return NULL;
+    if (ctx->in_use) {
+        return ctx->total_len == total_len && ctx->frag_size == frag_size ? ctx : NULL;
+    }
+    
+    uint32_t frag_count = (total_len + frag_size - 1) / frag_size;
+    size_t padded = (size_t)frag_count * frag_size;
+    size_t words = (frag_count + 31) / 32;
+    if (ctx->bitmap_words < words) {
+        uint32_t *bitmap = realloc(ctx->bitmap, words * sizeof(uint32_t));
+        if (!bitmap) return NULL;
+        ctx->bitmap = bitmap;
+        ctx->bitmap_words = words;
+    }
+    ctx->data = frag_pool_get(padded, &ctx->capacity);
+    if (!ctx->data) return NULL;
+    
+    // Parity covers whole fragments, so the short last one reads as zero padded
+    memset(ctx->data + total_len, 0, padded - total_len);
+    memset(ctx->bitmap, 0, words * sizeof(uint32_t));
+    ctx->in_use = 1;
+    ctx->session = session;
+    ctx->channel = channel;
+    ctx->msg_id = msg_id;
+    ctx->seq = (uint16_t)hdr->seq;
+    ctx->total_len = total_len;
+    ctx->frag_size = frag_size;
+    ctx->frag_count = frag_count;
+    ctx->frag_received = 0;
+    ctx->fec_mode = IOTC_FEC_OFF;
+    ctx->last_progress = iotc_now_ms();
+    timer_init(&ctx->expire_timer, reassembly_expire_fired, ctx);
+    timer_add(&ctx->expire_timer, REASSEMBLY_TIMEOUT_MS);
+    
+    if (newer) session->frag_rx_newest = msg_id;
+    return ctx;
+}
+
+static int reassembly_has(const reassembly_t *ctx, uint32_t index) {
+    return (ctx->bitmap[index / 32] >> (index % 32)) & 1;
+}
+
+/* Rebuilds the missing fragments of a group once enough parity is held */
+static void reassembly_recover(reassembly_t *ctx, uint32_t group) {
+    uint32_t first = group * ctx->fec_data;
+    uint32_t count = ctx->frag_count - first < ctx->fec_data ? ctx->frag_count - first : ctx->fec_data;
+    uint16_t mask = ctx->parity_mask[group];
+    uint32_t missing[FEC_MAX_PARITY];
+    uint32_t rows[FEC_MAX_PARITY];
+    int lost = 0, held = 0;
+    
+    for (uint32_t i = 0; i < count; i++) {
+        if (reassembly_has(ctx, first + i)) continue;
+        if (lost == FEC_MAX_PARITY) return;
+        missing[lost++] = i;
+    }
+    for (uint32_t row = 0; row < ctx->fec_parity && held < lost; row++) {
+        if (mask & (1U << row)) rows[held++] = row;
+    }
+    if (lost == 0 || held < lost) return;
+    
+    // Strip the received fragments out of the chosen parity rows
+    size_t frag_size = ctx->frag_size;
+    uint8_t *slots[FEC_MAX_PARITY];
+    uint8_t matrix[FEC_MAX_PARITY * FEC_MAX_PARITY];
+    for (int r = 0; r < lost; r++) {
+        slots[r] = ctx->parity + ((size_t)group * ctx->fec_parity + rows[r]) * frag_size;
+        for (uint32_t i = 0; i < count; i++) {
+            if (!reassembly_has(ctx, first + i)) continue;
+            fec_mul_add(slots[r], ctx->data + (first + i) * frag_size,
+                        fec_coef(ctx->fec_mode, rows[r], i), frag_size);
+        }
+        for (int c = 0; c < lost; c++) {
+            matrix[r * lost + c] = fec_coef(ctx->fec_mode, rows[r], missing[c]);
+        }
+    }
+    if (gf_invert_matrix(matrix, lost) < 0) return;
+    
+    for (int c = 0; c < lost; c++) {
+        uint32_t index = first + missing[c];
+        uint8_t *dst = ctx->data + index * frag_size;
+        memset(dst, 0, frag_size);
+        for (int r = 0; r < lost; r++) {
+            fec_mul_add(dst, slots[r], matrix[c * lost + r], frag_size);
+        }
+        ctx->bitmap[index / 32] |= 1U << (index % 32);
+    }
+    ctx->parity_mask[group] = 0;
+    ctx->frag_received += (uint32_t)lost;
+    ctx->session->rx_recovered += (uint32_t)lost;
+}
+
+/* Queues the message once every fragment is in; returns 1 if it was queued. */
+static int reassembly_complete(reassembly_t *ctx) {
+    if (ctx->frag_received < ctx->frag_count) return 0;
+    
+    // The queue takes the buffer over and hands it back to the pool once read
+    session_info_t *session = ctx->session;
+    int ret = enqueue_message_buffer(&session->channels[ctx->channel], ctx->data, ctx->total_len,
+                                     ctx->capacity, ctx->seq);
+    if (ret == 0) {
+        IOTC_PROBE4(message__enqueue, session->session_id, ctx->channel, ctx->total_len,
+                    STAT_READ(session->channels[ctx->channel].queue_bytes));
+        ctx->data = NULL;
+        ctx->capacity = 0;
+    } else {
+        traffic_count_drop(session, ctx->channel, 1);
+    }
+    reassembly_release(ctx);
+    return ret == 0;
+}
+
+/* Returns 1 when the fragment completed its message and it was queued. */
+static int reassembly_receive(session_info_t *session, uint8_t channel, const IOTCHeader *hdr, const uint8_t *payload) {
+    if (hdr->payload <= FRAG_HEADER_SIZE) return 0;
+    
+    const wire_frag_t *frag = (const wire_frag_t *)payload;
+    uint32_t total_len = wire_frag_total_len(frag);
+    uint32_t index = wire_frag_index(frag);
+    uint32_t frag_size = wire_frag_size(frag);
+    uint32_t len = hdr->payload - FRAG_HEADER_SIZE;
+    
+    if (frag_size == 0) return 0;
+    uint32_t frag_count = (total_len + frag_size - 1) / frag_size;
+    uint32_t offset = index * frag_size;
+    if (index >= frag_count || len != (index + 1 == frag_count ? total_len - offset : frag_size)) return 0;
+    
+    reassembly_t *ctx = reassembly_get(session, channel, hdr, frag, 1);
+    if (!ctx || reassembly_has(ctx, index)) return 0;
+    
+    ctx->bitmap[index / 32] |= 1U << (index % 32);
+    memcpy(ctx->data + offset, payload + FRAG_HEADER_SIZE, len);
+    ctx->frag_received++;
+    ctx->last_progress = iotc_now_ms();
+    
+    if (ctx->fec_mode != IOTC_FEC_OFF) reassembly_recover(ctx, index / ctx->fec_data);
+    return reassembly_complete(ctx);
+}
+
+/* Returns 1 when the parity packet completed its message and it was queued. */
+static int reassembly_receive_parity(session_info_t *session, uint8_t channel, const IOTCHeader *hdr,
+                                     const uint8_t *payload) {
+    if (hdr->payload <= FEC_HEADER_SIZE) return 0;
+    
+    const wire_fec_t *fec = (const wire_fec_t *)payload;
+    uint32_t total_len = wire_frag_total_len(&fec->frag);
+    uint32_t first = wire_frag_index(&fec->frag);
+    uint32_t frag_size = wire_frag_size(&fec->frag);
+    uint32_t layout = wire_be32(fec->layout);
+    uint8_t mode = (uint8_t)(layout >> 24);
+    uint32_t data = (layout >> 16) & 0xFF;
+    uint32_t parity = (layout >> 8) & 0xFF;
+    uint32_t row = layout & 0xFF;
+    
+    if (frag_size == 0 || hdr->payload - FEC_HEADER_SIZE != frag_size) return 0;
+    if ((mode != IOTC_FEC_XOR && mode != IOTC_FEC_RS) || (mode == IOTC_FEC_XOR && parity != 1)) return 0;
+    if (data == 0 || data > FEC_MAX_DATA || parity == 0 || parity > FEC_MAX_PARITY || row >= parity) return 0;
+    if (first % data != 0 || first >= (total_len + frag_size - 1) / frag_size) return 0;
+    
+    reassembly_t *ctx = reassembly_get(session, channel, hdr, &fec->frag, 0);
+    if (!ctx) return 0;
+    
+    if (ctx->fec_mode == IOTC_FEC_OFF) {
+        size_t groups = (ctx->frag_count + data - 1) / data;
+        size_t bytes = groups * parity * frag_size;
+        if (ctx->parity_capacity < bytes) {
+            uint8_t *slots = realloc(ctx->parity, bytes);
+            if (!slots) return 0;
+            ctx->parity = slots;
+            ctx->parity_capacity = bytes;
+        }
+        if (ctx->parity_groups < groups) {
+            uint16_t *masks = realloc(ctx->parity_mask, groups * sizeof(uint16_t));
+            if (!masks) return 0;
+            ctx->parity_mask = masks;
+            ctx->parity_groups = groups;
+        }
+        memset(ctx->parity_mask, 0, groups * sizeof(uint16_t));
+        ctx->fec_mode = mode;
+        ctx->fec_data = (uint8_t)data;
+        ctx->fec_parity = (uint8_t)parity;
+    } else if (ctx->fec_mode != mode || ctx->fec_data != data || ctx->fec_parity != parity) {
+        return 0;
+    }
+    
+    uint32_t group = first / data;
+    if (ctx->parity_mask[group] & (1U << row)) return 0;
+    
+    memcpy(ctx->parity + ((size_t)group * parity + row) * frag_size, payload + FEC_HEADER_SIZE, frag_size);
+    ctx->parity_mask[group] |= (uint16_t)(1U << row);
+    ctx->last_progress = iotc_now_ms();
+    
+    reassembly_recover(ctx, group);
+    return reassembly_complete(ctx);
+}
+
+/* Fragment batch, filled by the writing thread under global_mutex.  Each
+ * datagram is gathered from its headers and either a slice of the caller's
+ * buffer or one of the parity slots. */
+static struct {
+    struct mmsghdr msgs[FRAG_BATCH_MAX];
+    struct iovec iov[FRAG_BATCH_MAX][2];
+    uint8_t headers[FRAG_BATCH_MAX][sizeof(IOTCHeader) + FEC_HEADER_SIZE];
+    uint8_t is_parity[FRAG_BATCH_MAX];
+    uint8_t parity[FRAG_BATCH_MAX][PMTU_MAX_DATAGRAM - sizeof(IOTCHeader) - FEC_HEADER_SIZE];
+} g_frag_batch;
+
+static void frag_batch_add(session_info_t *session, unsigned int slot, size_t header_len,
+                           const void *body, size_t body_len) {
+    g_frag_batch.iov[slot][0].iov_base = g_frag_batch.headers[slot];
+    g_frag_batch.iov[slot][0].iov_len = header_len;
+    g_frag_batch.iov[slot][1].iov_base = (void *)body;
+    g_frag_batch.iov[slot][1].iov_len = body_len;
+    memset(&g_frag_batch.msgs[slot], 0, sizeof(g_frag_batch.msgs[slot]));
+    g_frag_batch.msgs[slot].msg_hdr.msg_name = &session->remote_addr;
+    g_frag_batch.msgs[slot].msg_hdr.msg_namelen = sizeof(session->remote_addr);
+    g_frag_batch.msgs[slot].msg_hdr.msg_iov = g_frag_batch.iov[slot];
+    g_frag_batch.msgs[slot].msg_hdr.msg_iovlen = 2;
+}
+
+static int frag_batch_flush(session_info_t *session, uint8_t channel, unsigned int count) {
+    if (session_paced(session, channel)) {
+        for (unsigned int i = 0; i < count; i++) {
+            uint8_t kind = g_frag_batch.is_parity[i] ? PACE_KIND_PARITY : PACE_KIND_FRAGMENT;
+            if (pace_enqueue(session, channel, kind, g_frag_batch.iov[i], 2) < 0) return -1;
+        }
+        return 0;
+    }
+    
+    for (unsigned int i = 0; i < count; i++) {
+        cc_stamp(session, g_frag_batch.headers[i]);
+    }
+    
+    unsigned int calls = 0;
+    unsigned int sent = endpoint_sendmmsg(session->endpoint, g_frag_batch.msgs, count, FRAG_SEND_WAIT_MS, &calls);
+    
+    size_t bytes = 0;
+    for (unsigned int i = 0; i < sent; i++) {
+        bytes += g_frag_batch.msgs[i].msg_len;
+        if (session->capture) {
+            capture_packet(session, 0, g_frag_batch.iov[i][0].iov_base, g_frag_batch.iov[i][0].iov_len,
+                           g_frag_batch.iov[i][1].iov_base, g_frag_batch.iov[i][1].iov_len);
+        }
+        if (g_frag_batch.is_parity[i]) {
+            session->tx_parity++;
+        } else {
+            session->tx_fragments++;
+        }
+    }
+    session->tx_bytes += bytes;
+    session->tx_calls += calls;
+    session->tx_datagrams += sent;
+    traffic_count_tx(session, channel, bytes, sent);
+    if (sent < count) traffic_count_drop(session, channel, count - sent);
+    return sent == count ? 0 : -1;
+}
+
+static int session_send_fragments(session_info_t *session, uint8_t channel, uint32_t seq,
+                                  const uint8_t *data, uint32_t size) {
+    const channel_info_t *ch = &session->channels[channel];
+    uint32_t fec_data = ch->fec_mode != IOTC_FEC_OFF ? ch->fec_data : 0;
+    uint32_t frag_size = (uint32_t)session_max_payload(session) -
+                         (fec_data ? FEC_HEADER_SIZE : FRAG_HEADER_SIZE);
+    uint32_t frag_count = (size + frag_size - 1) / frag_size;
+    uint32_t msg_id = session->next_msg_id++;
+    uint64_t now = iotc_now_ms();
+    unsigned int count = 0;
+    
+    for (uint32_t index = 0; index < frag_count; index++) {
+        uint32_t offset = index * frag_size;
+        uint32_t len = size - offset < frag_size ? size - offset : frag_size;
+        uint32_t fields[3] = { htonl(msg_id), htonl(size), htonl(index << 16 | frag_size) };
+        uint8_t *headers = g_frag_batch.headers[count];
+        
+        session_build_header(session, headers, IOTC_MSG_DATA_FRAG, channel, seq, FRAG_HEADER_SIZE + len, now);
+        memcpy(headers + sizeof(IOTCHeader), fields, sizeof(fields));
+        frag_batch_add(session, count, sizeof(IOTCHeader) + FRAG_HEADER_SIZE, data + offset, len);
+        g_frag_batch.is_parity[count] = 0;
+        
+        if (++count == FRAG_BATCH_MAX) {
+            if (frag_batch_flush(session, channel, count) < 0) return -1;
+            count = 0;
+        }
+        
+        // Parity follows the last fragment of each group
+        if (!fec_data || ((index + 1) % fec_data != 0 && index + 1 != frag_count)) continue;
+        
+        uint32_t first = index / fec_data * fec_data;
+        for (uint32_t row = 0; row < ch->fec_parity; row++) {
+            uint8_t *parity = g_frag_batch.parity[count];
+            memset(parity, 0, frag_size);
+            for (uint32_t i = first; i <= index; i++) {
+                uint32_t i_len = size - i * frag_size < frag_size ? size - i * frag_size : frag_size;
+                fec_mul_add(parity, data + i * frag_size, fec_coef(ch->fec_mode, row, i - first), i_len);
+            }
+            
+            uint32_t fec_fields[4] = {
+                htonl(msg_id), htonl(size), htonl(first << 16 | frag_size),
+                htonl((uint32_t)ch->fec_mode << 24 | fec_data << 16 | (uint32_t)ch->fec_parity << 8 | row),
+            };
+            headers = g_frag_batch.headers[count];
+            session_build_header(session, headers, IOTC_MSG_DATA_FEC, channel, seq, FEC_HEADER_SIZE + frag_size, now);
+            memcpy(headers + sizeof(IOTCHeader), fec_fields, sizeof(fec_fields));
+            frag_batch_add(session, count, sizeof(IOTCHeader) + FEC_HEADER_SIZE, parity, frag_size);
+            g_frag_batch.is_parity[count] = 1;
+            
+            if (++count == FRAG_BATCH_MAX) {
+                if (frag_batch_flush(session, channel, count) < 0) return -1;
+                count = 0;
+            }
+        }
+    }
+    
+    if (count && frag_batch_flush(session, channel, count) < 0) return -1;
+    if (session_paced(session, channel)) pace_drain(session);
+    
+    session->tx_fragmented++;
+    session->last_send = now;
+    return 0;
+}
+
+/* Receive dispatch
+ *
+ * Session messages are routed through tables generated from RX_ROUTES
+ * instead of a switch.  RX_SLOT folds a message type into nine bits (the low
+ * three of its high byte, the low six of its low byte), g_rx_slots maps the
+ * slot to a route, and the route's own type rejects unlisted types that fold
+ * onto the same slot; two listed types sharing a slot fail the build through
+ * rx_slots_distinct.  The media and RDT handlers are the hot path; control
+ * handlers are marked cold so they are laid out away from it. */
+#define RX_HOT                            __attribute__((hot))
+#define RX_COLD                           __attribute__((cold))
+#define RX_SLOT(type)                     ((((type) >> 8) & 0x07) << 6 | ((type) & 0x3F))
+#define RX_SLOTS                          512
+
+#define RX_MEDIA                          0x01  /* Media for congestion control and the delay detector */
+#define RX_CHANNEL                        0x02  /* Counted per channel, needs a connected session */
+#define RX_NO_DELAY                       0x04  /* Kept out of the delay detector (RDT has its own RTT) */
+#define RX_UNBOUND                        0x08  /* Handled by the endpoint, before any session lookup */
+
+typedef void (*rx_handler_fn)(session_info_t *session, const IOTCHeader *hdr, const uint8_t *payload);
+
+typedef struct {
+    uint16_t type;
+    uint8_t rx_class;                   /* IOTC_RX_* counter */
+    uint8_t flags;
+    rx_handler_fn handler;              /* NULL: counted and dropped */
+} rx_route_t;
+
+static RX_HOT void rx_data(session_info_t *session, const IOTCHeader *hdr, const uint8_t *payload) {
+    unsigned int channel = IOTC_WIRE_CHANNEL(hdr->flag);
+    
+    if (session->channels[channel].state == CHANNEL_STATE_ON &&
+        enqueue_message(&session->channels[channel], payload, hdr->payload, (uint16_t)hdr->seq) == 0) {
+        IOTC_PROBE4(message__enqueue, session->session_id, channel, hdr->payload,
+                    STAT_READ(session->channels[channel].queue_bytes));
+        pthread_cond_broadcast(&session->state_cond);
+    } else {
+        traffic_count_drop(session, (int)channel, 1);
+    }
+}
+
+static RX_HOT void rx_data_frag(session_info_t *session, const IOTCHeader *hdr, const uint8_t *payload) {
+    unsigned int channel = IOTC_WIRE_CHANNEL(hdr->flag);
+    
+    if (session->channels[channel].state != CHANNEL_STATE_ON) {
+        traffic_count_drop(session, (int)channel, 1);
+    } else if (reassembly_receive(session, (uint8_t)channel, hdr, payload)) {
+        pthread_cond_broadcast(&session->state_cond);
+    }
+}
+
+static RX_HOT void rx_data_fec(session_info_t *session, const IOTCHeader *hdr, const uint8_t *payload) {
+    unsigned int channel = IOTC_WIRE_CHANNEL(hdr->flag);
+    
+    if (session->channels[channel].state != CHANNEL_STATE_ON) {
+        traffic_count_drop(session, (int)channel, 1);
+    } else if (reassembly_receive_parity(session, (uint8_t)channel, hdr, payload)) {
+        pthread_cond_broadcast(&session->state_cond);
+    }
+}
+
+static RX_HOT void rx_rdt(session_info_t *session, const IOTCHeader *hdr, const uint8_t *payload) {
+    unsigned int channel = IOTC_WIRE_CHANNEL(hdr->flag);
+    
+    if (session->rdt[channel]) {
+        rdt_handle_message(session->rdt[channel], hdr, payload);
+    } else {
+        traffic_count_drop(session, (int)channel, 1);
+    }
+}
+
+static RX_COLD void rx_connect_ack(session_info_t *session, const IOTCHeader *hdr, const uint8_t *payload) {
+    if (session->state != SESSION_STATE_CONNECTING || hdr->payload < sizeof(uint32_t)) return;
+    
+    timer_cancel(&session->connect_timer);
+    session->remote_session_id = wire_be32(payload);
+    session->state = SESSION_STATE_CONNECTED;
+    session->connected_ms = session->last_activity;
+    pmtu_start(session);
+    pthread_cond_broadcast(&session->state_cond);
+}
+
+static RX_COLD void rx_keepalive(session_info_t *session, const IOTCHeader *hdr, const uint8_t *payload) {
+    if (hdr->payload >= DELAY_ECHO_SIZE) delay_on_echo(session, (const wire_echo_t *)payload);
+}
+
+static RX_COLD void rx_close(session_info_t *session, const IOTCHeader *hdr, const uint8_t *payload) {
+    (void)hdr;
+    (void)payload;
+    if (session->state == SESSION_STATE_CONNECTED) {
+        session_disconnect(session, IOTC_ER_SESSION_CLOSE_BY_REMOTE);
+    }
+}
+
+static RX_COLD void rx_pmtu_probe(session_info_t *session, const IOTCHeader *hdr, const uint8_t *payload) {
+    (void)payload;
+    if (session->state == SESSION_STATE_CONNECTED) {
+        uint32_t size = htonl((uint32_t)(sizeof(IOTCHeader) + hdr->payload));
+        session_send_packet(session, IOTC_MSG_PMTU_ACK, 0, 0, &size, sizeof(size));
+    }
+}
+
+static RX_COLD void rx_pmtu_ack(session_info_t *session, const IOTCHeader *hdr, const uint8_t *payload) {
+    if (session->state == SESSION_STATE_CONNECTED && hdr->payload >= sizeof(uint32_t)) {
+        pmtu_handle_ack(session, wire_be32(payload));
+    }
+}
+
+static RX_COLD void rx_cc_feedback(session_info_t *session, const IOTCHeader *hdr, const uint8_t *payload) {
+    if (session->state == SESSION_STATE_CONNECTED && hdr->payload >= CC_FEEDBACK_SIZE) {
+        const wire_cc_feedback_t *fb = (const wire_cc_feedback_t *)payload;
+        cc_on_feedback(session, fb);
+        delay_on_echo(session, &fb->echo);
+    }
+}
+
+/* name, type, counter, flags, handler.  UNKNOWN must stay first: it owns
+ * slot 0 and every slot no listed type maps to. */
+#define RX_ROUTES(X) \
+    X(UNKNOWN,     0,                    IOTC_RX_UNKNOWN_TYPE, 0,                        NULL)           \
+    X(CONNECT,     IOTC_MSG_CONNECT,     IOTC_RX_CONNECT,      RX_UNBOUND,               NULL)           \
+    X(CONNECT_ACK, IOTC_MSG_CONNECT_ACK, IOTC_RX_CONNECT_ACK,  0,                        rx_connect_ack) \
+    X(LOGIN,       IOTC_MSG_LOGIN,       IOTC_RX_LOGIN,        0,                        NULL)           \
+    X(AV_AUTH,     IOTC_MSG_AV_AUTH,     IOTC_RX_AV_AUTH,      0,                        NULL)           \
+    X(DATA,        IOTC_MSG_DATA,        IOTC_RX_DATA,         RX_MEDIA | RX_CHANNEL,    rx_data)        \
+    X(KEEPALIVE,   IOTC_MSG_KEEPALIVE,   IOTC_RX_KEEPALIVE,    0,                        rx_keepalive)   \
+    X(CLOSE,       IOTC_MSG_CLOSE,       IOTC_RX_CLOSE,        0,                        rx_close)       \
+    X(DATA_FRAG,   IOTC_MSG_DATA_FRAG,   IOTC_RX_DATA_FRAG,    RX_MEDIA | RX_CHANNEL,    rx_data_frag)   \
+    X(DATA_FEC,    IOTC_MSG_DATA_FEC,    IOTC_RX_DATA_FEC,     RX_MEDIA | RX_CHANNEL,    rx_data_fec)    \
+    X(RDT_DATA,    IOTC_MSG_RDT_DATA,    IOTC_RX_RDT_DATA,     RX_CHANNEL | RX_NO_DELAY, rx_rdt)         \
+    X(RDT_ACK,     IOTC_MSG_RDT_ACK,     IOTC_RX_RDT_ACK,      RX_CHANNEL | RX_NO_DELAY, rx_rdt)         \
+    X(PMTU_PROBE,  IOTC_MSG_PMTU_PROBE,  IOTC_RX_PMTU_PROBE,   0,                        rx_pmtu_probe)  \
+    X(PMTU_ACK,    IOTC_MSG_PMTU_ACK,    IOTC_RX_PMTU_ACK,     0,                        rx_pmtu_ack)    \
+    X(CC_FEEDBACK, IOTC_MSG_CC_FEEDBACK, IOTC_RX_CC_FEEDBACK,  0,                        rx_cc_feedback)
+
+#define RX_ROUTE_INDEX(name, type, rx_class, flags, handler)  RX_ROUTE_##name,
+#define RX_ROUTE_ENTRY(name, type, rx_class, flags, handler)  { type, rx_class, flags, handler },
+#define RX_ROUTE_SLOT(name, type, rx_class, flags, handler)   [RX_SLOT(type)] = RX_ROUTE_##name,
+#define RX_ROUTE_CASE(name, type, rx_class, flags, handler)   case RX_SLOT(type):
+
+enum { RX_ROUTES(RX_ROUTE_INDEX) RX_ROUTE_COUNT };
+
+_Static_assert(RX_ROUTE_COUNT <= 256, "route indexes are bytes");
+
+static const rx_route_t g_rx_routes[RX_ROUTE_COUNT] = { RX_ROUTES(RX_ROUTE_ENTRY) };
+static const uint8_t g_rx_slots[RX_SLOTS] = { RX_ROUTES(RX_ROUTE_SLOT) };
+
+/* Never called: two routes on one slot are duplicate case labels, which is a
+ * compile error where a repeated designated initializer only warns */
+static inline void rx_slots_distinct(unsigned int slot) {
+    switch (slot) {
+    RX_ROUTES(RX_ROUTE_CASE)
+        break;
+    }
+}
+
+static inline const rx_route_t *rx_route(unsigned int type) {
+    const rx_route_t *route = &g_rx_routes[g_rx_slots[RX_SLOT(type)]];
+    return route->type == type ? route : &g_rx_routes[RX_ROUTE_UNKNOWN];
+}
+
+static void session_handle_message(session_info_t *session, const rx_route_t *route,
+                                   const IOTCHeader *hdr, const uint8_t *payload) {
+    unsigned int channel = IOTC_WIRE_CHANNEL(hdr->flag);
+    int media = (route->flags & RX_MEDIA) != 0;
+    session->last_activity = iotc_now_ms();
+    
+    int counted = (route->flags & RX_CHANNEL) && channel < MAX_CHANNEL_NUMBER ? (int)channel : -1;
+    traffic_count_rx(session, counted, sizeof(IOTCHeader) + hdr->payload);
+    if (media && session->state == SESSION_STATE_CONNECTED) {
+        cc_on_media(session, hdr, sizeof(IOTCHeader) + hdr->payload);
+    }
+    // Every media datagram feeds the delay detector, whichever channel it is for
+    if (!(route->flags & RX_NO_DELAY)) {
+        delay_on_receive(session, hdr, media);
+    }
+    
+    if ((route->flags & RX_CHANNEL) && (session->state != SESSION_STATE_CONNECTED || counted < 0)) return;
+    if (route->handler) route->handler(session, hdr, payload);
+}
+
+/* Families by first byte.  Only 0xF1 datagrams are served on a session
+ * port; the rest are classified so stray discovery or raw RTP traffic shows
+ * up in the counters instead of vanishing. */
+enum { RX_FAMILY_FOREIGN, RX_FAMILY_SESSION, RX_FAMILY_LAN_PROBE, RX_FAMILY_LAN_RESPONSE, RX_FAMILY_RTP };
+
+#define RX_RTP4(b)   [(b)] = RX_FAMILY_RTP, [(b) + 1] = RX_FAMILY_RTP, [(b) + 2] = RX_FAMILY_RTP, [(b) + 3] = RX_FAMILY_RTP
+#define RX_RTP16(b)  RX_RTP4(b), RX_RTP4((b) + 4), RX_RTP4((b) + 8), RX_RTP4((b) + 12)
+
+static const uint8_t g_rx_families[256] = {
+    [IOTC_SESSION_MAGIC] = RX_FAMILY_SESSION,
+    [LAN_SEARCH_PROBE_MAGIC] = RX_FAMILY_LAN_PROBE,
+    [LAN_SEARCH_RESPONSE_MAGIC] = RX_FAMILY_LAN_RESPONSE,
+    RX_RTP16(0x80), RX_RTP16(0x90), RX_RTP16(0xA0), RX_RTP16(0xB0),     /* RTP version 2 */
+};
+
+/* Written by the receive path under global_mutex */
+static IOTCReceiveStats g_rx_stats;
+
+static inline void rx_count(unsigned int rx_class, size_t len) {
+    STAT_ADD(g_rx_stats.datagrams[rx_class], 1);
+    STAT_ADD(g_rx_stats.bytes[rx_class], len);
+}
+
+static RX_COLD void rx_count_other(unsigned int family, const uint8_t *packet, size_t len) {
+    unsigned int rx_class = IOTC_RX_FOREIGN;
+    rtp_view_t rtp;
+    
+    switch (family) {
+    case RX_FAMILY_SESSION:
+        rx_class = IOTC_RX_MALFORMED;
+        break;
+    case RX_FAMILY_LAN_PROBE:
+        rx_class = IOTC_RX_LAN_PROBE;
+        break;
+    case RX_FAMILY_LAN_RESPONSE:
+        rx_class = IOTC_RX_LAN_RESPONSE;
+        break;
+    case RX_FAMILY_RTP:
+        if (wire_rtp_view(packet, len, &rtp) == 0) {
+            rx_class = wire_rtp_payload_type(rtp.rtp) == RTP_PAYLOAD_H264 ? IOTC_RX_RTP_H264 : IOTC_RX_RTP;
+        }
+        break;
+    }
+    rx_count(rx_class, len);
+}
+
+/* 1 for a well-formed session datagram, to be decoded and routed; anything
+ * else is counted here and dropped */
+static inline int rx_classify(const uint8_t *packet, size_t len) {
+    unsigned int family = len ? g_rx_families[packet[0]] : RX_FAMILY_FOREIGN;
+    
+    if (family == RX_FAMILY_SESSION && wire_session_view(packet, len)) return 1;
+    rx_count_other(family, packet, len);
+    return 0;
+}
+
+static int same_peer(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+/* Hands a CONNECT to a matching IOTC_Listen caller, or repeats the ACK when
+ * the peer is retrying because ours was lost. */
+static void endpoint_handle_connect(int endpoint, const struct sockaddr_in *peer,
+                                    const IOTCHeader *hdr, const uint8_t *payload) {
+    if (hdr->payload < IOTC_CONNECT_PAYLOAD_SIZE) return;
+    
+    const wire_connect_t *connect = (const wire_connect_t *)payload;
+    uint32_t remote_sid = wire_be32(connect->sid);
+    
+    for (int i = 0; i < g_iotc_state.max_sessions; i++) {
+        session_info_t *session = &g_iotc_state.sessions[i];
+        if (session->has_peer && session->endpoint == endpoint &&
+            session->remote_session_id == remote_sid && same_peer(&session->remote_addr, peer)) {
+            if (session->state == SESSION_STATE_CONNECTED) {
+                session->last_activity = iotc_now_ms();
+                session_send_connect_ack(session);
+            }
+            return;
+        }
+    }
+    
+    listen_wait_t **link = &g_iotc_state.listen_waiters;
+    while (*link) {
+        listen_wait_t *waiter = *link;
+        if (waiter->endpoint == endpoint &&
+            (!waiter->uid || !waiter->uid[0] || strncmp((const char *)connect->uid, waiter->uid, 20) == 0)) {
+            break;
+        }
+        link = &waiter->next;
+    }
+    if (!*link) return;
+    
+    session_info_t *session = alloc_session_locked();
+    if (!session) return;
+    
+    memcpy(session->uid, connect->uid, sizeof(connect->uid));
+    session->uid[20] = '\0';
+    session->remote_session_id = remote_sid;
+    session->state = SESSION_STATE_CONNECTED;
+    session->connected_ms = iotc_now_ms();
+    session_attach_peer(session, endpoint, peer);
+    session_send_connect_ack(session);
+    pmtu_start(session);
+    
+    listen_wait_t *waiter = *link;
+    *link = waiter->next;
+    waiter->result = session->session_id;
+    pthread_cond_broadcast(&g_iotc_state.listen_cond);
+}
+
+/* Routes a datagram that passed rx_classify, its header already converted
+ * to host order */
+static void endpoint_handle_decoded(int endpoint, const struct sockaddr_in *peer, const IOTCHeader *hdr,
+                                    const uint8_t *packet) {
+    const uint8_t *payload = packet + sizeof(*hdr);
+    const rx_route_t *route = rx_route(IOTC_WIRE_TYPE(hdr->flag));
+    
+    rx_count(route->rx_class, sizeof(*hdr) + hdr->payload);
+    if (route->flags & RX_UNBOUND) {
+        endpoint_handle_connect(endpoint, peer, hdr, payload);
+        return;
+    }
+    
+    // Everything else is addressed by our SID and must come from the bound peer
+    session_info_t *session = find_session_by_id((int)hdr->sid);
+    if (!session || !session->has_peer || session->endpoint != endpoint ||
+        !same_peer(&session->remote_addr, peer)) {
+        return;
+    }
+    if (session->capture) capture_packet(session, 1, packet, sizeof(*hdr) + hdr->payload, NULL, 0);
+    session_handle_message(session, route, hdr, payload);
+}
+
+static void endpoint_handle_datagram(int endpoint, const struct sockaddr_in *peer,
+                                     const uint8_t *packet, size_t len) {
+    if (!rx_classify(packet, len)) return;
+    
+    IOTCHeader hdr;
+    memcpy(&hdr, packet, sizeof(hdr));
+    IOTC_Header_ntoh(&hdr);
+    endpoint_handle_decoded(endpoint, peer, &hdr, packet);
+}
+
+/* Session timers, run by the I/O thread with global_mutex held */
+static void session_idle_timer_fired(iotc_timer_t *timer, uint64_t now_ms) {
+    session_info_t *session = timer->arg;
+    uint64_t idle = now_ms - session->last_activity;
+    
+    if (g_iotc_state.idle_timeout_ms == 0) return;
+    
+    if (idle >= g_iotc_state.idle_timeout_ms) {
+        IOTC_PROBE_TIMEOUT(session->session_id, "idle");
+        IOTC_LOG(IOTC_LOG_LEVEL_WARNING, "session %u idle for %llu ms", session->session_id,
+                 (unsigned long long)idle);
+        session_disconnect(session, IOTC_ER_REMOTE_TIMEOUT_DISCONNECT);
+        return;
+    }
+    
+    // Traffic re-arms the timer lazily instead of on every packet
+    timer_add(timer, g_iotc_state.idle_timeout_ms - idle);
+}
+
+static void session_connect_timer_fired(iotc_timer_t *timer, uint64_t now_ms) {
+    session_info_t *session = timer->arg;
+    
+    if (session->state != SESSION_STATE_CONNECTING) return;
+    
+    if (now_ms >= session->connect_deadline) {
+        IOTC_PROBE_TIMEOUT(session->session_id, "connect");
+        IOTC_LOG(IOTC_LOG_LEVEL_WARNING, "session %u: no answer from %s:%u", session->session_id,
+                 inet_ntoa(session->remote_addr.sin_addr), ntohs(session->remote_addr.sin_port));
+        session_disconnect(session, IOTC_ER_TIMEOUT);
+        return;
+    }
+    
+    uint64_t remaining = session->connect_deadline - now_ms;
+    session_send_connect(session);
+    timer_add(timer, remaining < CONNECT_RETRY_INTERVAL_MS ? remaining : CONNECT_RETRY_INTERVAL_MS);
+}
+
+/* Heartbeats.  One bucket of the ring is visited per tick of
+ * keepalive_interval / HEARTBEAT_SLOTS, so every session is checked once per
+ * interval and the probes for a bucket leave in one sendmmsg per endpoint. */
+typedef struct {
+    struct mmsghdr msgs[HEARTBEAT_BATCH_MAX];
+    struct iovec iov[HEARTBEAT_BATCH_MAX];
+    uint8_t packets[HEARTBEAT_BATCH_MAX][sizeof(IOTCHeader) + DELAY_ECHO_SIZE];
+    session_info_t *sessions[HEARTBEAT_BATCH_MAX];
+    unsigned int count;
+} heartbeat_batch_t;
+
+static heartbeat_batch_t g_heartbeat_batch;
+
+static void heartbeat_flush(int endpoint, heartbeat_batch_t *batch, uint64_t now_ms) {
+    // The I/O thread never waits for buffer space; unsent probes retry next visit
+    unsigned int sent = endpoint_sendmmsg(endpoint, batch->msgs, batch->count, 0, NULL);
+    
+    for (unsigned int i = 0; i < sent; i++) {
+        batch->sessions[i]->last_send = now_ms;
+        traffic_count_tx(batch->sessions[i], -1, batch->iov[i].iov_len, 1);
+        if (batch->sessions[i]->capture) {
+            capture_packet(batch->sessions[i], 0, batch->packets[i], batch->iov[i].iov_len, NULL, 0);
+        }
+    }
+    batch->count = 0;
+}
+
+static void heartbeat_probe(unsigned int first, unsigned int count, int endpoint, uint64_t now_ms) {
+    heartbeat_batch_t *batch = &g_heartbeat_batch;
+    uint64_t quiet_limit = g_iotc_state.keepalive_interval_ms / 2;
+    
+    batch->count = 0;
+    for (unsigned int n = 0; n < count; n++) {
+        session_info_t *session = g_iotc_state.heartbeat_slots[(first + n) % HEARTBEAT_SLOTS];
+        for (; session; session = session->hb_next) {
+            // A busy sender that never echoes still owes its peer an RTT sample
+            if (session->endpoint != endpoint || session->state != SESSION_STATE_CONNECTED ||
+                (now_ms - session->last_send < quiet_limit &&
+                 now_ms - session->delay.echo_sent_ms < g_iotc_state.keepalive_interval_ms)) {
+                continue;
+            }
+            
+            unsigned int i = batch->count;
+            uint32_t echo[2];
+            delay_echo(session, echo);
+            batch->iov[i].iov_base = batch->packets[i];
+            batch->iov[i].iov_len = session_build_packet(session, batch->packets[i], IOTC_MSG_KEEPALIVE,
+                                                         0, 0, echo, sizeof(echo), now_ms);
+            memset(&batch->msgs[i], 0, sizeof(batch->msgs[i]));
+            batch->msgs[i].msg_hdr.msg_name = &session->remote_addr;
+            batch->msgs[i].msg_hdr.msg_namelen = sizeof(session->remote_addr);
+            batch->msgs[i].msg_hdr.msg_iov = &batch->iov[i];
+            batch->msgs[i].msg_hdr.msg_iovlen = 1;
+            batch->sessions[i] = session;
+            
+            if (++batch->count == HEARTBEAT_BATCH_MAX) {
+                heartbeat_flush(endpoint, batch, now_ms);
+            }
+        }
+    }
+    
+    if (batch->count) heartbeat_flush(endpoint, batch, now_ms);
+}
+
+static void heartbeat_timer_fired(iotc_timer_t *timer, uint64_t now_ms) {
+    (void)timer;
+    unsigned int interval = g_iotc_state.keepalive_interval_ms;
+    
+    if (interval == 0 || g_iotc_state.heartbeat_sessions == 0) return;
+    
+    // Short intervals are clamped to the wheel tick, so catch up on every
+    // bucket that fell due since the last visit
+    uint64_t elapsed = now_ms - g_iotc_state.heartbeat_last_ms;
+    uint64_t due = (elapsed * HEARTBEAT_SLOTS + interval - 1) / interval;
+    unsigned int count = due < 1 ? 1 : due > HEARTBEAT_SLOTS ? HEARTBEAT_SLOTS : (unsigned int)due;
+    unsigned int first = g_iotc_state.heartbeat_cursor;
+    
+    g_iotc_state.heartbeat_cursor = (first + count) % HEARTBEAT_SLOTS;
+    
+    // Drop sessions whose peer has missed too many beats before probing the rest
+    uint64_t missed_limit = (uint64_t)interval * HEARTBEAT_MISSED_LIMIT;
+    for (unsigned int n = 0; n < count; n++) {
+        session_info_t *session = g_iotc_state.heartbeat_slots[(first + n) % HEARTBEAT_SLOTS];
+        while (session) {
+            session_info_t *next = session->hb_next;
+            if (session->state == SESSION_STATE_CONNECTED && now_ms - session->last_activity >= missed_limit) {
+                session_disconnect(session, IOTC_ER_REMOTE_TIMEOUT_DISCONNECT);
+            }
+            session = next;
+        }
+    }
+    
+    for (int ep = 0; ep < MAX_ENDPOINT_NUMBER; ep++) {
+        if (g_iotc_state.endpoints[ep].fd >= 0) {
+            heartbeat_probe(first, count, ep, now_ms);
+        }
+    }
+    
+    heartbeat_arm();
+}
+
+/* Network simulator.  Sends put datagrams on a link and in the arrival
+ * list; the I/O thread delivers them when real time catches up, or the
+ * virtual clock jumps from one arrival or timer tick to the next. */
+static uint32_t netsim_random(void) {
+    // xorshift64*
+    uint64_t x = g_netsim.rng;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    g_netsim.rng = x;
+    return (uint32_t)((x * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static uint16_t netsim_endpoint_port(int endpoint) {
+    uint16_t port = g_iotc_state.endpoints[endpoint].port;
+    return port ? port : (uint16_t)(NETSIM_EPHEMERAL_PORT + endpoint);
+}
+
+static int netsim_endpoint_by_port(uint16_t port) {
+    for (int i = 0; i < MAX_ENDPOINT_NUMBER; i++) {
+        if (g_iotc_state.endpoints[i].fd >= 0 && netsim_endpoint_port(i) == port) return i;
+    }
+    return -1;
+}
+
+/* Puts a datagram on the link to the endpoint bound to to's port.  Drops
+ * are silent as with UDP; only a failed allocation is an error. */
+static int netsim_send(int endpoint, const struct sockaddr_in *to, const struct iovec *iov, size_t iovcnt) {
+    const IOTCNetSimConfig *config = &g_netsim.active;
+    size_t len = 0;
+    for (size_t i = 0; i < iovcnt; i++) len += iov[i].iov_len;
+    
+    g_netsim.stats.datagrams_sent++;
+    int dest = netsim_endpoint_by_port(ntohs(to->sin_port));
+    if (dest < 0) {
+        g_netsim.stats.dropped_unreachable++;
+        return 0;
+    }
+    if (len + PMTU_IP_UDP_OVERHEAD > config->mtu) {
+        g_netsim.stats.dropped_mtu++;
+        return 0;
+    }
+    if (config->loss_permille && netsim_random() % 1000 < config->loss_permille) {
+        g_netsim.stats.dropped_loss++;
+        return 0;
+    }
+    
+    // Serialize through the bottleneck, then propagate
+    uint64_t now = iotc_now_us();
+    netsim_link_t *link = &g_netsim.links[endpoint][dest];
+    uint64_t depart = now;
+    if (config->bandwidth_bytes) {
+        uint64_t start = link->busy_until_us > now ? link->busy_until_us : now;
+        uint64_t backlog = (start - now) * config->bandwidth_bytes / 1000000;
+        if (backlog + len > config->queue_bytes) {
+            g_netsim.stats.dropped_queue++;
+            return 0;
+        }
+        link->busy_until_us = start + ((uint64_t)len * 1000000 + config->bandwidth_bytes - 1) / config->bandwidth_bytes;
+        depart = link->busy_until_us;
+    }
+    
+    uint64_t deliver = depart;
+    if (config->reorder_permille && netsim_random() % 1000 < config->reorder_permille) {
+        g_netsim.stats.reordered++;
+    } else {
+        deliver += config->delay_ms * 1000ULL;
+        if (config->jitter_ms) deliver += netsim_random() % (config->jitter_ms * 1000ULL + 1);
+        if (deliver < link->last_deliver_us) deliver = link->last_deliver_us;
+        link->last_deliver_us = deliver;
+    }
+    
+    uint8_t cls;
+    netsim_packet_t *packet = block_alloc(sizeof(*packet) + len, &cls);
+    if (!packet) return -1;
+    
+    packet->next = NULL;
+    packet->deliver_us = deliver;
+    memset(&packet->from, 0, sizeof(packet->from));
+    packet->from.sin_family = AF_INET;
+    packet->from.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    packet->from.sin_port = htons(netsim_endpoint_port(endpoint));
+    packet->endpoint = dest;
+    packet->pool_class = cls;
+    packet->len = len;
+    size_t offset = 0;
+    for (size_t i = 0; i < iovcnt; i++) {
+        memcpy(packet->data + offset, iov[i].iov_base, iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+    
+    // Arrivals mostly come in order, so search from the tail only when overtaking
+    if (!g_netsim.tail || g_netsim.tail->deliver_us <= deliver) {
+        if (g_netsim.tail) {
+            g_netsim.tail->next = packet;
+        } else {
+            g_netsim.head = packet;
+        }
+        g_netsim.tail = packet;
+    } else {
+        netsim_packet_t **link_ptr = &g_netsim.head;
+        while ((*link_ptr)->deliver_us <= deliver) link_ptr = &(*link_ptr)->next;
+        packet->next = *link_ptr;
+        *link_ptr = packet;
+    }
+    g_netsim.stats.in_flight++;
+    
+    // A sleeping I/O thread has to shorten its wait for an earlier arrival
+    if (!g_netsim.virtual_clock && g_netsim.head == packet) io_wake();
+    return 0;
+}
+
+/* Hands every datagram that has arrived by now_us to its endpoint */
+static void netsim_deliver(uint64_t now_us) {
+    while (g_netsim.head && g_netsim.head->deliver_us <= now_us) {
+        netsim_packet_t *packet = g_netsim.head;
+        g_netsim.head = packet->next;
+        if (!g_netsim.head) g_netsim.tail = NULL;
+        
+        g_netsim.stats.in_flight--;
+        g_netsim.stats.datagrams_delivered++;
+        g_netsim.stats.bytes_delivered += packet->len;
+        endpoint_handle_datagram(packet->endpoint, &packet->from, packet->data, packet->len);
+        block_free(packet, packet->pool_class);
+    }
+}
+
+/* Virtual clock: runs arrivals and timer ticks in time order up to
+ * target_us, or just the next one with single set.  Returns 0 if nothing
+ * was due. */
+static int netsim_run(uint64_t target_us, int single) {
+    int ran = 0;
+    
+    for (;;) {
+        uint64_t now = g_netsim.now_us;
+        uint64_t next = UINT64_MAX;
+        if (g_netsim.head) {
+            next = g_netsim.head->deliver_us > now ? g_netsim.head->deliver_us : now;
+        }
+        if (g_iotc_state.wheel.pending) {
+            uint64_t tick = (now / 1000 / TIMER_WHEEL_TICK_MS + 1) * TIMER_WHEEL_TICK_MS * 1000;
+            if (tick < next) next = tick;
+        }
+        if (next == UINT64_MAX || next > target_us) break;
+        
+        __atomic_store_n(&g_netsim.now_us, next, __ATOMIC_RELAXED);
+        netsim_deliver(next);
+        timer_wheel_advance(&g_iotc_state.wheel, next / 1000);
+        ran = 1;
+        if (single) return ran;
+    }
+    
+    if (!single && target_us > g_netsim.now_us) {
+        __atomic_store_n(&g_netsim.now_us, target_us, __ATOMIC_RELAXED);
+        timer_wheel_advance(&g_iotc_state.wheel, target_us / 1000);
+    }
+    return ran;
+}
+
+/* I/O thread timeout: virtual time only passes in callers, real time until
+ * the next arrival at the latest */
+static int netsim_io_wait(int wait) {
+    if (g_netsim.virtual_clock) return -1;
+    if (!g_netsim.head) return wait;
+    
+    uint64_t now = iotc_now_us();
+    uint64_t due = g_netsim.head->deliver_us > now ? (g_netsim.head->deliver_us - now + 999) / 1000 : 0;
+    return wait >= 0 && (uint64_t)wait < due ? wait : (int)due;
+}
+
+static void netsim_configure(const IOTCNetSimConfig *config) {
+    g_netsim.active = *config;
+    if (g_netsim.active.queue_bytes == 0) g_netsim.active.queue_bytes = NETSIM_DEFAULT_QUEUE;
+    if (g_netsim.active.mtu == 0) g_netsim.active.mtu = NETSIM_DEFAULT_MTU;
+}
+
+/* Caller must hold global_mutex; runs before io_start opens the endpoints */
+static void netsim_start(void) {
+    memset(g_netsim.links, 0, sizeof(g_netsim.links));
+    memset(&g_netsim.stats, 0, sizeof(g_netsim.stats));
+    g_netsim.head = g_netsim.tail = NULL;
+    g_netsim.enabled = g_netsim.configured;
+    g_netsim.virtual_clock = g_netsim.configured && g_netsim.config.virtual_clock;
+    if (!g_netsim.enabled) return;
+    
+    netsim_configure(&g_netsim.config);
+    g_netsim.rng = ((uint64_t)g_netsim.config.seed << 1 | 1) * 0x9E3779B97F4A7C15ULL;
+    __atomic_store_n(&g_netsim.now_us, NETSIM_EPOCH_US, __ATOMIC_RELAXED);
+}
+
+static void netsim_stop(void) {
+    while (g_netsim.head) {
+        netsim_packet_t *packet = g_netsim.head;
+        g_netsim.head = packet->next;
+        block_free(packet, packet->pool_class);
+    }
+    g_netsim.tail = NULL;
+    g_netsim.enabled = 0;
+    g_netsim.virtual_clock = 0;
+}
+
+/* Blocking waits on global_mutex.  Under the virtual clock the waiter runs
+ * the simulation one event at a time rather than sleeping. */
+static void iotc_wait(pthread_cond_t *cond) {
+    if (g_netsim.virtual_clock && netsim_run(UINT64_MAX, 1)) return;
+    pthread_cond_wait(cond, &g_iotc_state.global_mutex);
+}
+
+/* I/O thread */
+static void io_wake(void) {
+    uint64_t one = 1;
+    if (g_iotc_state.wake_fd >= 0) {
+        ssize_t ret = write(g_iotc_state.wake_fd, &one, sizeof(one));
+        (void)ret;
+    }
+}
+
+/* Receive buffers, only touched by the I/O thread */
+static struct {
+    struct mmsghdr msgs[IO_RECV_BATCH];
+    struct iovec iov[IO_RECV_BATCH];
+    struct sockaddr_in peers[IO_RECV_BATCH];
+    uint8_t packets[IO_RECV_BATCH][PMTU_MAX_DATAGRAM];
+    IOTCHeader headers[IO_RECV_BATCH];  /* Host order, for the datagrams in index */
+    uint8_t index[IO_RECV_BATCH];
+} g_io_recv;
+
+static void io_drain_endpoint(int endpoint) {
+    for (;;) {
+        for (int i = 0; i < IO_RECV_BATCH; i++) {
+            g_io_recv.iov[i].iov_base = g_io_recv.packets[i];
+            g_io_recv.iov[i].iov_len = sizeof(g_io_recv.packets[i]);
+            memset(&g_io_recv.msgs[i], 0, sizeof(g_io_recv.msgs[i]));
+            g_io_recv.msgs[i].msg_hdr.msg_name = &g_io_recv.peers[i];
+            g_io_recv.msgs[i].msg_hdr.msg_namelen = sizeof(g_io_recv.peers[i]);
+            g_io_recv.msgs[i].msg_hdr.msg_iov = &g_io_recv.iov[i];
+            g_io_recv.msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        
+        int n = recvmmsg(g_iotc_state.endpoints[endpoint].fd, g_io_recv.msgs, IO_RECV_BATCH, MSG_DONTWAIT, NULL);
+        if (n <= 0) return;
+        
+        // Datagrams are classified in place; the headers of the session
+        // datagrams are gathered and converted in one pass
+        unsigned int valid = 0;
+        for (int i = 0; i < n; i++) {
+            if (rx_classify(g_io_recv.packets[i], g_io_recv.msgs[i].msg_len)) {
+                memcpy(&g_io_recv.headers[valid], g_io_recv.packets[i], sizeof(IOTCHeader));
+                g_io_recv.index[valid++] = (uint8_t)i;
+            }
+        }
+        header_swap(g_io_recv.headers, valid);
+        
+        for (unsigned int v = 0; v < valid; v++) {
+            int i = g_io_recv.index[v];
+            endpoint_handle_decoded(endpoint, &g_io_recv.peers[i], &g_io_recv.headers[v], g_io_recv.packets[i]);
+        }
+        if (n < IO_RECV_BATCH) return;
+    }
+}
+
+static void *io_thread_main(void *arg) {
+    (void)arg;
+    struct epoll_event events[IO_MAX_EVENTS];
+    
+    while (__atomic_load_n(&g_iotc_state.io_running, __ATOMIC_ACQUIRE)) {
+        int wait = __atomic_load_n(&g_iotc_state.wheel.pending, __ATOMIC_ACQUIRE) ? TIMER_WHEEL_TICK_MS : -1;
+        if (g_netsim.enabled) {
+            pthread_mutex_lock(&g_iotc_state.global_mutex);
+            wait = netsim_io_wait(wait);
+            pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        }
+        int n = epoll_wait(g_iotc_state.epoll_fd, events, IO_MAX_EVENTS, wait);
+        
+        pthread_mutex_lock(&g_iotc_state.global_mutex);
+        
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.u32 == IO_WAKE_TOKEN) {
+                uint64_t value;
+                ssize_t ret = read(g_iotc_state.wake_fd, &value, sizeof(value));
+                (void)ret;
+                continue;
+            }
+            io_drain_endpoint((int)events[i].data.u32);
+        }
+        
+        // The virtual clock moves only in callers
+        if (!g_netsim.virtual_clock) {
+            if (g_netsim.enabled) netsim_deliver(iotc_now_us());
+            timer_wheel_advance(&g_iotc_state.wheel, iotc_now_ms());
+        }
+        
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    }
+    
+    return NULL;
+}
+
+/* Caller must hold global_mutex. */
+static int io_start(void) {
+    g_iotc_state.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (g_iotc_state.epoll_fd < 0) return IOTC_ER_FAIL_CREATE_SOCKET;
+    
+    g_iotc_state.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (g_iotc_state.wake_fd < 0) {
+        close(g_iotc_state.epoll_fd);
+        g_iotc_state.epoll_fd = -1;
+        return IOTC_ER_FAIL_CREATE_SOCKET;
+    }
+    
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = IO_WAKE_TOKEN;
+    epoll_ctl(g_iotc_state.epoll_fd, EPOLL_CTL_ADD, g_iotc_state.wake_fd, &ev);
+    
+    timer_wheel_init(&g_iotc_state.wheel, iotc_now_ms());
+    timer_init(&g_iotc_state.heartbeat_timer, heartbeat_timer_fired, NULL);
+    memset(g_iotc_state.heartbeat_slots, 0, sizeof(g_iotc_state.heartbeat_slots));
+    g_iotc_state.heartbeat_cursor = 0;
+    g_iotc_state.heartbeat_sessions = 0;
+    g_iotc_state.listen_waiters = NULL;
+    
+    // Outgoing sessions share one ephemeral client endpoint
+    int ret = endpoint_open(0);
+    if (ret != CLIENT_ENDPOINT) {
+        endpoint_close_all();
+        close(g_iotc_state.wake_fd);
+        close(g_iotc_state.epoll_fd);
+        g_iotc_state.wake_fd = g_iotc_state.epoll_fd = -1;
+        return ret < 0 ? ret : IOTC_ER_FAIL_CREATE_SOCKET;
+    }
+    
+    __atomic_store_n(&g_iotc_state.io_running, 1, __ATOMIC_RELEASE);
+    
+    if (pthread_create(&g_iotc_state.io_thread, NULL, io_thread_main, NULL) != 0) {
+        g_iotc_state.io_running = 0;
+        endpoint_close_all();
+        close(g_iotc_state.wake_fd);
+        close(g_iotc_state.epoll_fd);
+        g_iotc_state.wake_fd = g_iotc_state.epoll_fd = -1;
+        return IOTC_ER_FAIL_CREATE_THREAD;
+    }
+    
+    return IOTC_ER_NoERROR;
+}
+
+/* Must be called without global_mutex held; the I/O thread takes it.  The
+ * endpoints stay open so sessions can still send CLOSE while torn down. */
+static void io_stop(void) {
+    __atomic_store_n(&g_iotc_state.io_running, 0, __ATOMIC_RELEASE);
+    io_wake();
+    pthread_join(g_iotc_state.io_thread, NULL);
+    
+    close(g_iotc_state.wake_fd);
+    close(g_iotc_state.epoll_fd);
+    g_iotc_state.wake_fd = g_iotc_state.epoll_fd = -1;
+}
+
+/* LAN device table */
+static void lan_slot_write_begin(lan_device_slot_t *slot) {
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void lan_slot_write_end(lan_device_slot_t *slot) {
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Lock-free snapshot of one slot.  Returns 1 if the slot holds a device. */
+static int lan_slot_read(const lan_device_slot_t *slot, IOTCDevInfo *info) {
+    for (;;) {
+        uint32_t begin = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (begin & 1) continue;
+        
+        uint32_t in_use = slot->in_use;
+        if (in_use && info) {
+            memcpy(info, &slot->info, sizeof(*info));
+        }
+        
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == begin) {
+            return in_use ? 1 : 0;
+        }
+    }
+}
+
+static int lan_table_lookup(const char *uid, IOTCDevInfo *info) {
+    for (int i = 0; i < LAN_DEVICE_TABLE_SIZE; i++) {
+        IOTCDevInfo dev;
+        if (lan_slot_read(&g_lan_discovery.slots[i], &dev) &&
+            memcmp(dev.UID, uid, sizeof(dev.UID)) == 0) {
+            if (info) *info = dev;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void lan_table_notify(const IOTCDevInfo *dev, int event) {
+    if (g_lan_discovery.callback) {
+        g_lan_discovery.callback(dev, event, g_lan_discovery.user_data);
+    }
+}
+
+/* Only called from the discovery thread, which is the single table writer. */
+static void lan_table_upsert(const IOTCDevInfo *dev, uint64_t now) {
+    lan_device_slot_t *free_slot = NULL;
+    
+    for (int i = 0; i < LAN_DEVICE_TABLE_SIZE; i++) {
+        lan_device_slot_t *slot = &g_lan_discovery.slots[i];
+        if (!slot->in_use) {
+            if (!free_slot) free_slot = slot;
+            continue;
+        }
+        if (memcmp(slot->info.UID, dev->UID, sizeof(dev->UID)) != 0) continue;
+        
+        __atomic_store_n(&slot->last_seen_ms, now, __ATOMIC_RELAXED);
+        if (strcmp(slot->info.IP, dev->IP) != 0 || slot->info.port != dev->port) {
+            lan_slot_write_begin(slot);
+            slot->info = *dev;
+            lan_slot_write_end(slot);
+            lan_table_notify(dev, IOTC_LAN_DEVICE_UPDATED);
+        }
+        return;
+    }
+    
+    if (!free_slot) return;
+    
+    __atomic_store_n(&free_slot->last_seen_ms, now, __ATOMIC_RELAXED);
+    lan_slot_write_begin(free_slot);
+    free_slot->info = *dev;
+    free_slot->in_use = 1;
+    lan_slot_write_end(free_slot);
+    lan_table_notify(dev, IOTC_LAN_DEVICE_ADDED);
+}
+
+static void lan_table_expire(uint64_t now, uint64_t max_age_ms) {
+    for (int i = 0; i < LAN_DEVICE_TABLE_SIZE; i++) {
+        lan_device_slot_t *slot = &g_lan_discovery.slots[i];
+        if (!slot->in_use) continue;
+        if (now - __atomic_load_n(&slot->last_seen_ms, __ATOMIC_RELAXED) <= max_age_ms) continue;
+        
+        IOTCDevInfo dev = slot->info;
+        lan_slot_write_begin(slot);
+        slot->in_use = 0;
+        lan_slot_write_end(slot);
+        lan_table_notify(&dev, IOTC_LAN_DEVICE_REMOVED);
+    }
+}
+
+static void lan_table_clear(void) {
+    for (int i = 0; i < LAN_DEVICE_TABLE_SIZE; i++) {
+        lan_device_slot_t *slot = &g_lan_discovery.slots[i];
+        if (!slot->in_use) continue;
+        lan_slot_write_begin(slot);
+        slot->in_use = 0;
+        lan_slot_write_end(slot);
+    }
+}
+
+/* LAN discovery wire helpers */
+static int lan_send_probe(int sock) {
+    wire_lan_probe_t probe;
+    uint32_t ts = htonl((uint32_t)time(NULL));
+    uint32_t rnd = htonl((uint32_t)rand());
+    
+    /* struct.pack('>BBHIII', 0xFC, 0x00, 12, ts, rnd, 0) */
+    memset(&probe, 0, sizeof(probe));
+    probe.magic = LAN_SEARCH_PROBE_MAGIC;
+    probe.length[1] = sizeof(probe) - offsetof(wire_lan_probe_t, time);
+    memcpy(probe.time, &ts, sizeof(probe.time));
+    memcpy(probe.nonce, &rnd, sizeof(probe.nonce));
+    
+    struct sockaddr_in group;
+    memset(&group, 0, sizeof(group));
+    group.sin_family = AF_INET;
+    group.sin_port = htons(LAN_SEARCH_PORT);
+    inet_pton(AF_INET, LAN_SEARCH_MULTICAST_ADDR, &group.sin_addr);
+    
+    return sendto(sock, &probe, sizeof(probe), 0, (struct sockaddr *)&group, sizeof(group)) < 0 ? -1 : 0;
+}
+
+static int lan_parse_response(const uint8_t *pkt, ssize_t len, IOTCDevInfo *dev) {
+    const wire_lan_response_t *response = len > 0 ? wire_lan_response_view(pkt, (size_t)len) : NULL;
+    if (!response) return -1;
+    
+    memset(dev, 0, sizeof(*dev));
+    memcpy(dev->UID, response->uid, sizeof(dev->UID));
+    memcpy(dev->IP, response->ip, sizeof(dev->IP));
+    dev->IP[sizeof(dev->IP) - 1] = '\0';
+    dev->port = wire_be16(response->port);
+    
+    return (dev->UID[0] && dev->IP[0]) ? 0 : -1;
+}
+
+static int lan_create_probe_socket(void) {
+    int sock = create_udp_socket();
+    if (sock < 0) return -1;
+    
+    unsigned char ttl = 1;
+    setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    return sock;
+}
+
+/* Listens on the discovery port so responses to other hosts' probes are seen too. */
+static int lan_create_passive_socket(void) {
+    int sock = create_udp_socket();
+    if (sock < 0) return -1;
+    
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(LAN_SEARCH_PORT);
+    
+    struct ip_mreq mreq;
+    memset(&mreq, 0, sizeof(mreq));
+    inet_pton(AF_INET, LAN_SEARCH_MULTICAST_ADDR, &mreq.imr_multiaddr);
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        close(sock);
+        return -1;
+    }
+    
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    return sock;
+}
+
+static void *lan_discovery_thread(void *arg) {
+    (void)arg;
+    uint8_t buf[512];
+    uint64_t next_probe = 0;
+    uint64_t max_age = (uint64_t)g_lan_discovery.interval_ms * LAN_DISCOVERY_EXPIRY_INTERVALS;
+    
+    while (__atomic_load_n(&g_lan_discovery.running, __ATOMIC_ACQUIRE)) {
+        uint64_t now = iotc_now_ms();
+        if (now >= next_probe) {
+            lan_send_probe(g_lan_discovery.probe_fd);
+            lan_table_expire(now, max_age);
+            next_probe = now + g_lan_discovery.interval_ms;
+        }
+        
+        struct pollfd fds[2];
+        int nfds = 0;
+        fds[nfds].fd = g_lan_discovery.probe_fd;
+        fds[nfds++].events = POLLIN;
+        if (g_lan_discovery.passive_fd >= 0) {
+            fds[nfds].fd = g_lan_discovery.passive_fd;
+            fds[nfds++].events = POLLIN;
+        }
+        
+        uint64_t wait = next_probe - now;
+        if (wait > LAN_DISCOVERY_POLL_MS) wait = LAN_DISCOVERY_POLL_MS;
+        if (poll(fds, nfds, (int)wait) <= 0) continue;
+        
+        for (int i = 0; i < nfds; i++) {
+            if (!(fds[i].revents & POLLIN)) continue;
+            
+            ssize_t len;
+            while ((len = recv(fds[i].fd, buf, sizeof(buf), 0)) > 0) {
+                IOTCDevInfo dev;
+                if (lan_parse_response(buf, len, &dev) == 0) {
+                    lan_table_upsert(&dev, iotc_now_ms());
+                }
+            }
+        }
+    }
+    
+    return NULL;
+}
+
+/* One-shot multicast search used when the background service is not running. */
+static int lan_search_once(IOTCDevInfo *devices, int max_num, unsigned int timeout_ms) {
+    int sock = lan_create_probe_socket();
+    if (sock < 0) return IOTC_ER_FAIL_CREATE_SOCKET;
+    
+    if (lan_send_probe(sock) < 0) {
+        close(sock);
+        return IOTC_ER_NETWORK_UNREACHABLE;
+    }
+    
+    int count = 0;
+    uint8_t buf[512];
+    uint64_t deadline = iotc_now_ms() + timeout_ms;
+    
+    while (count < max_num) {
+        uint64_t now = iotc_now_ms();
+        if (now >= deadline) break;
+        
+        struct pollfd pfd = { .fd = sock, .events = POLLIN };
+        if (poll(&pfd, 1, (int)(deadline - now)) <= 0) break;
+        
+        ssize_t len;
+        while (count < max_num && (len = recv(sock, buf, sizeof(buf), 0)) > 0) {
+            IOTCDevInfo dev;
+            if (lan_parse_response(buf, len, &dev) != 0) continue;
+            
+            int duplicate = 0;
+            for (int i = 0; i < count; i++) {
+                if (memcmp(devices[i].UID, dev.UID, sizeof(dev.UID)) == 0) {
+                    duplicate = 1;
+                    break;
+                }
+            }
+            if (!duplicate) devices[count++] = dev;
+        }
+    }
+    
+    close(sock);
+    return count;
+}
+
+/* Public API Implementation */
+
+int64_t IOTC_Initialize(void) {
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    
+    if (g_iotc_state.initialized) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_ALREADY_INITIALIZED;
+    }
+    
+    fec_init();
+    g_iotc_state.max_sessions = g_iotc_state.configured_sessions ? (int)g_iotc_state.configured_sessions
+                                                                 : MAX_DEFAULT_SESSION_NUMBER;
+    g_iotc_state.sessions = calloc(g_iotc_state.max_sessions, sizeof(session_info_t));
+    if (!g_iotc_state.sessions) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_FAIL_CREATE_MUTEX;
+    }
+    
+    for (int i = 0; i < g_iotc_state.max_sessions; i++) {
+        init_session(&g_iotc_state.sessions[i]);
+    }
+    
+    netsim_start();
+    int ret = io_start();
+    if (ret < 0) {
+        netsim_stop();
+        for (int i = 0; i < g_iotc_state.max_sessions; i++) {
+            destroy_session(&g_iotc_state.sessions[i]);
+        }
+        free(g_iotc_state.sessions);
+        g_iotc_state.sessions = NULL;
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return ret;
+    }
+    
+    g_iotc_state.next_session_id = 1;
+    g_iotc_state.initialized = 1;
+    IOTC_LOG(IOTC_LOG_LEVEL_INFO, "initialized, %d sessions", g_iotc_state.max_sessions);
+    
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    return IOTC_ER_NoERROR;
+}
+
+int64_t IOTC_DeInitialize(void) {
+    IOTC_Lan_Discovery_Stop();
+    
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    
+    if (!g_iotc_state.initialized) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_NOT_INITIALIZED;
+    }
+    
+    // Refuse new calls, then stop the I/O thread outside the lock it needs
+    g_iotc_state.initialized = 0;
+    pthread_cond_broadcast(&g_iotc_state.listen_cond);
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    io_stop();
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    
+    for (int i = 0; i < g_iotc_state.max_sessions; i++) {
+        destroy_session(&g_iotc_state.sessions[i]);
+    }
+    metrics_close();
+    endpoint_close_all();
+    netsim_stop();
+    av_release_all();
+    frag_pool_drain();
+    block_pool_drain();
+    
+    free(g_iotc_state.sessions);
+    g_iotc_state.sessions = NULL;
+    g_iotc_state.initialized = 0;
+    IOTC_LOG(IOTC_LOG_LEVEL_INFO, "deinitialized");
+    
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    log_sync();
+    return IOTC_ER_NoERROR;
+}
+
+int64_t IOTC_Get_SessionID(void) {
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    
+    if (!g_iotc_state.initialized) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_NOT_INITIALIZED;
+    }
+    
+    int session_id = alloc_session_id_locked();
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    return session_id;
+}
+
+int64_t IOTC_Set_Max_Session_Number(unsigned int max_sessions) {
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    
+    if (g_iotc_state.initialized) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_ALREADY_INITIALIZED;
+    }
+    
+    // Takes effect at the next IOTC_Initialize
+    g_iotc_state.configured_sessions = max_sessions;
+    
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    return max_sessions;
+}
+
+int64_t IOTC_Set_Network_Simulator(const IOTCNetSimConfig *config) {
+    if (config && (config->loss_permille > 1000 || config->reorder_permille > 1000 ||
+                   (config->mtu && config->mtu < NETSIM_MIN_MTU))) {
+        return IOTC_ER_INVALID_ARG;
+    }
+    
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    
+    // A running simulator takes new impairments at once; backend and clock stay
+    if (g_iotc_state.initialized) {
+        if (!g_netsim.enabled || !config || !config->virtual_clock != !g_netsim.virtual_clock) {
+            pthread_mutex_unlock(&g_iotc_state.global_mutex);
+            return IOTC_ER_ALREADY_INITIALIZED;
+        }
+        netsim_configure(config);
+    }
+    
+    // Otherwise takes effect at the next IOTC_Initialize
+    g_netsim.configured = config != NULL;
+    if (config) g_netsim.config = *config;
+    
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    return IOTC_ER_NoERROR;
+}
+
+int64_t IOTC_NetSim_Advance(unsigned int ms) {
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    
+    if (!g_iotc_state.initialized) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_NOT_INITIALIZED;
+    }
+    if (!g_netsim.virtual_clock) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_NOT_SUPPORT;
+    }
+    
+    netsim_run(g_netsim.now_us + (uint64_t)ms * 1000, 0);
+    
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    return IOTC_ER_NoERROR;
+}
+
+int64_t IOTC_NetSim_Get_Stats(IOTCNetSimStats *stats) {
+    if (!stats) {
+        return IOTC_ER_INVALID_ARG;
+    }
+    
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    
+    if (!g_iotc_state.initialized) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_NOT_INITIALIZED;
+    }
+    if (!g_netsim.enabled) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_NOT_SUPPORT;
+    }
+    
+    *stats = g_netsim.stats;
+    stats->now_us = iotc_now_us();
+    
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    return IOTC_ER_NoERROR;
+}
+
+int64_t IOTC_NetSim_Inject(int session_id, const void *datagram, unsigned int len) {
+    if (!datagram) {
+        return IOTC_ER_INVALID_ARG;
+    }
+    
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    
+    if (!g_iotc_state.initialized) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_NOT_INITIALIZED;
+    }
+    if (!g_netsim.enabled) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_NOT_SUPPORT;
+    }
+    
+    session_info_t *session = find_session_by_id(session_id);
+    if (!session || !session->has_peer) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_INVALID_SID;
+    }
+    
+    // Straight into the receive path, as the I/O thread would after recvmmsg
+    g_netsim.stats.datagrams_delivered++;
+    g_netsim.stats.bytes_delivered += len;
+    endpoint_handle_datagram(session->endpoint, &session->remote_addr, datagram, len);
+    
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    return IOTC_ER_NoERROR;
+}
+
+/* CONNECT/CONNECT_ACK handshake with the device at addr, shared by
+ * IOTC_Connect and IOTC_Connect_ByUID */
+static int64_t session_connect(const char *uid, const struct sockaddr_in *addr) {
+    uint64_t start_us = iotc_now_us();
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    
+    if (!g_iotc_state.initialized) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_NOT_INITIALIZED;
+    }
+    
+    session_info_t *session = alloc_session_locked();
+    if (!session) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_EXCEED_MAX_SESSION;
+    }
+    
+    int session_id = (int)session->session_id;
+    memcpy(session->uid, uid, 20);
+    session->uid[20] = '\0';
+    session->state = SESSION_STATE_CONNECTING;
+    session_attach_peer(session, CLIENT_ENDPOINT, addr);
+    
+    // The connect timer retransmits CONNECT and enforces the deadline
+    session->connect_deadline = iotc_now_ms() + g_iotc_state.lan_connect_timeout_ms;
+    session_send_connect(session);
+    timer_add(&session->connect_timer, g_iotc_state.lan_connect_timeout_ms < CONNECT_RETRY_INTERVAL_MS ?
+                                       g_iotc_state.lan_connect_timeout_ms : CONNECT_RETRY_INTERVAL_MS);
+    
+    while (g_iotc_state.initialized && session->session_id == (uint32_t)session_id &&
+           session->state == SESSION_STATE_CONNECTING) {
+        iotc_wait(&session->state_cond);
+    }
+    
+    int64_t ret = session_id;
+    if (!g_iotc_state.initialized) {
+        ret = IOTC_ER_NOT_INITIALIZED;
+    } else if (session->session_id != (uint32_t)session_id) {
+        ret = IOTC_ER_INVALID_SID;
+    } else if (session->state != SESSION_STATE_CONNECTED) {
+        ret = session->close_reason;
+        cleanup_session(session);
+    }
+    
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    if (ret >= 0) histogram_record(IOTC_HISTOGRAM_CONNECT, iotc_now_us() - start_us);
+    return ret;
+}
+
+int64_t IOTC_Connect_ByUID(const char *uid) {
+    if (!uid || strlen(uid) != 20) {
+        return IOTC_ER_INVALID_ARG;
+    }
+    
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    int initialized = g_iotc_state.initialized;
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    if (!initialized) {
+        return IOTC_ER_NOT_INITIALIZED;
+    }
+    
+    // The address comes from the background discovery table
+    IOTCDevInfo dev;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    if (!lan_table_lookup(uid, &dev) || dev.port == 0 || inet_pton(AF_INET, dev.IP, &addr.sin_addr) != 1) {
+        return IOTC_ER_CAN_NOT_FIND_DEVICE;
+    }
+    addr.sin_port = htons(dev.port);
+    
+    return session_connect(uid, &addr);
+}
+
+int64_t IOTC_Session_Close(int session_id) {
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    
+    if (!g_iotc_state.initialized) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_NOT_INITIALIZED;
+    }
+    
+    session_info_t *session = find_session_by_id(session_id);
+    if (!session) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_INVALID_SID;
+    }
+    
+    cleanup_session(session);
+    
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    return IOTC_ER_NoERROR;
+}
+
+int64_t IOTC_Session_Channel_ON(int session_id, unsigned char channel) {
+    if (channel >= MAX_CHANNEL_NUMBER) {
+        return IOTC_ER_INVALID_ARG;
+    }
+    
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    
+    if (!g_iotc_state.initialized) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_NOT_INITIALIZED;
+    }
+    
+    session_info_t *session = find_session_by_id(session_id);
+    if (!session || session->state != SESSION_STATE_CONNECTED) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_INVALID_SID;
+    }
+    
+    session->channels[channel].state = CHANNEL_STATE_ON;
+    IOTC_PROBE2(channel__on, session->session_id, channel);
+    IOTC_LOG(IOTC_LOG_LEVEL_DEBUG, "session %u channel %u on", session->session_id, channel);
+    
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    return IOTC_ER_NoERROR;
+}
+
+int64_t IOTC_Session_Channel_OFF(int session_id, unsigned char channel) {
+    if (channel >= MAX_CHANNEL_NUMBER) {
+        return IOTC_ER_INVALID_ARG;
+    }
+    
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    
+    if (!g_iotc_state.initialized) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_NOT_INITIALIZED;
+    }
+    
+    session_info_t *session = find_session_by_id(session_id);
+    if (!session || session->state != SESSION_STATE_CONNECTED) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_INVALID_SID;
+    }
+    
+    session->channels[channel].state = CHANNEL_STATE_OFF;
+    IOTC_PROBE2(channel__off, session->session_id, channel);
+    IOTC_LOG(IOTC_LOG_LEVEL_DEBUG, "session %u channel %u off", session->session_id, channel);
+    pace_drop_channel(session, channel);
+    cleanup_channel(&session->channels[channel]);
+    init_channel(&session->channels[channel]);
+    
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    return IOTC_ER_NoERROR;
+}
+
+int64_t IOTC_Session_Channel_Check_ON_OFF(int session_id, unsigned char channel) {
+    if (channel >= MAX_CHANNEL_NUMBER) {
+        return IOTC_ER_INVALID_ARG;
+    }
+    
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    
+    if (!g_iotc_state.initialized) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_NOT_INITIALIZED;
+    }
+    
+    session_info_t *session = find_session_by_id(session_id);
+    if (!session || session->state != SESSION_STATE_CONNECTED) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_INVALID_SID;
+    }
+    
+    int state = session->channels[channel].state;
+    
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    return state;
+}
+
+int32_t IOTC_Session_Get_Free_Channel(int session_id) {
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    
+    if (!g_iotc_state.initialized) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_NOT_INITIALIZED;
+    }
+    
+    session_info_t *session = find_session_by_id(session_id);
+    if (!session || session->state != SESSION_STATE_CONNECTED) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_INVALID_SID;
+    }
+    
+    for (int i = 0; i < MAX_CHANNEL_NUMBER; i++) {
+        if (session->channels[i].state == CHANNEL_STATE_OFF) {
+            pthread_mutex_unlock(&g_iotc_state.global_mutex);
+            return i;
+        }
+    }
+    
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    return IOTC_ER_FAIL_SETUP_CHANNEL;
+}
+
+int64_t IOTC_Session_Write(int session_id, const void *data, unsigned int size, unsigned char channel) {
+    if (!data || size == 0 || channel >= MAX_CHANNEL_NUMBER) {
+        return IOTC_ER_INVALID_ARG;
+    }
+    
+    uint64_t start_us = iotc_now_us();
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    
+    if (!g_iotc_state.initialized) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_NOT_INITIALIZED;
+    }
+    if (size > g_iotc_state.max_message_size) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_INVALID_ARG;
+    }
+    
+    session_info_t *session = find_session_by_id(session_id);
+    int64_t ret;
+    for (;;) {
+        if (!g_iotc_state.initialized) {
+            ret = IOTC_ER_NOT_INITIALIZED;
+            break;
+        }
+        if (session && session->session_id != (uint32_t)session_id) {
+            session = NULL;
+        }
+        if (session && session->state == SESSION_STATE_DISCONNECTED) {
+            ret = session->close_reason;
+            break;
+        }
+        if (!session || session->state != SESSION_STATE_CONNECTED) {
+            ret = IOTC_ER_INVALID_SID;
+            break;
+        }
+        if (session->channels[channel].state != CHANNEL_STATE_ON) {
+            ret = IOTC_ER_CH_NOT_ON;
+            break;
+        }
+        
+        // Paced channels hold the writer while the session's queue is over its limit
+        if (!session->has_peer || !session_paced(session, channel) || session->pace_bytes == 0 ||
+            session->pace_bytes + size <= PACE_QUEUE_LIMIT) {
+            ret = size;
+            break;
+        }
+        iotc_wait(&session->state_cond);
+    }
+    
+    // Sessions without a peer keep the simulated behaviour and just report the size
+    // Larger messages go out as one batch of fragments under this single lock
+    if (ret == (int64_t)size && session->has_peer) {
+        channel_info_t *ch = &session->channels[channel];
+        int sent = (size_t)size > session_max_payload(session) ?
+                   session_send_fragments(session, channel, ch->next_seq_id++, data, size) :
+                   session_send_data(session, channel, ch->next_seq_id++, data, size);
+        if (sent < 0) ret = IOTC_ER_NETWORK_UNREACHABLE;
+    }
+    
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    if (ret == (int64_t)size) histogram_record(IOTC_HISTOGRAM_WRITE, iotc_now_us() - start_us);
+    return ret;
+}
+
+/* Read timeouts are driven by the timer wheel rather than timed condvar waits */
+typedef struct {
+    session_info_t *session;
+    int expired;
+} read_wait_t;
+
+static void read_timeout_fired(iotc_timer_t *timer, uint64_t now_ms) {
+    (void)now_ms;
+    read_wait_t *wait = timer->arg;
+    IOTC_PROBE_TIMEOUT(wait->session->session_id, "read");
+    wait->expired = 1;
+    pthread_cond_broadcast(&wait->session->state_cond);
+}
+
+int64_t IOTC_Session_Read_Check_Lost_Data_And_Datatype(
+    int session_id, void *buf, int size, int timeout,
+    unsigned char *lost, unsigned char *datatype, int flags, int unused) {
+    
+    (void)unused;
+    
+    // As in the SDK, flags selects the channel to read from; the last argument is unused
+    if (!buf || size <= 0 || flags < 0 || flags >= MAX_CHANNEL_NUMBER) {
+        return IOTC_ER_INVALID_ARG;
+    }
+    
+    if (lost) *lost = 0;
+    if (datatype) *datatype = 0;
+    
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    
+    if (!g_iotc_state.initialized) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_NOT_INITIALIZED;
+    }
+    
+    session_info_t *session = find_session_by_id(session_id);
+    if (session && session->state == SESSION_STATE_DISCONNECTED) {
+        int64_t reason = session->close_reason;
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return reason;
+    }
+    if (!session || session->state != SESSION_STATE_CONNECTED) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_INVALID_SID;
+    }
+    
+    channel_info_t *ch = &session->channels[flags];
+    uint64_t start_us = iotc_now_us();
+    int waited = 0;
+    read_wait_t wait = { session, 0 };
+    iotc_timer_t timer;
+    timer_init(&timer, read_timeout_fired, &wait);
+    if (timeout > 0) {
+        timer_add(&timer, (uint64_t)timeout);
+    }
+    
+    int64_t ret;
+    for (;;) {
+        if (!g_iotc_state.initialized) {
+            ret = IOTC_ER_NOT_INITIALIZED;
+            break;
+        }
+        if (session->session_id != (uint32_t)session_id) {
+            ret = IOTC_ER_INVALID_SID;
+            break;
+        }
+        if (session->state == SESSION_STATE_DISCONNECTED) {
+            ret = session->close_reason;
+            break;
+        }
+        
+        message_entry_t *entry = dequeue_message(ch);
+        if (entry) {
+            uint64_t queued_us = iotc_now_us() - entry->queued_us;
+            histogram_record(IOTC_HISTOGRAM_DELIVERY + flags, queued_us);
+            IOTC_PROBE4(message__dequeue, session_id, flags, entry->size, queued_us);
+            size_t copy = entry->size < (size_t)size ? entry->size : (size_t)size;
+            memcpy(buf, entry->data, copy);
+            if (lost) *lost = entry->seq_id != ch->expected_seq_id;
+            ch->expected_seq_id = (uint16_t)(entry->seq_id + 1);
+            free_message(entry);
+            ret = (int64_t)copy;
+            break;
+        }
+        
+        // A zero timeout polls; otherwise wait for data or the wheel to expire us
+        if (timeout <= 0) {
+            ret = 0;
+            break;
+        }
+        if (wait.expired) {
+            ret = IOTC_ER_TIMEOUT;
+            break;
+        }
+        
+        iotc_wait(&session->state_cond);
+        waited = 1;
+    }
+    
+    if (g_iotc_state.initialized) {
+        timer_cancel(&timer);
+    }
+    
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    // Reads that found data waiting never blocked and stay out of the histogram
+    if (waited) histogram_record(IOTC_HISTOGRAM_READ_WAIT, iotc_now_us() - start_us);
+    return ret;
+}
+
+int64_t IOTC_Session_Read(int session_id, void *buf, int size, int timeout, int flags) {
+    unsigned char lost = 0;
+    unsigned char datatype = 0;
+    
+    // Capture the current stack guard value and compare it after the call
+    void *guard = __stack_chk_guard;
+    int64_t ret = IOTC_Session_Read_Check_Lost_Data_And_Datatype(
+        session_id, buf, size, timeout, &lost, &datatype, flags, 0);
+    
+    // Byte counts and error codes pass straight through; only a changed
+    // guard value is fatal.
+    if (guard != __stack_chk_guard)
+        __stack_chk_fail();
+    return ret;
+}
+
+void IOTC_Get_Version(uint32_t *version) {
+    if (version)
+        *version = 0x010d0700u; // Version 1.13.7.0
+}
+
+const char *IOTC_Get_Version_String(void) {
+    return "1.13.7.0";
+}
+
+/* Endianness helpers */
+static inline uint32_t bswap32(uint32_t v) {
+    return ((v & 0x000000FFu) << 24) |
+           ((v & 0x0000FF00u) << 8)  |
+           ((v & 0x00FF0000u) >> 8)  |
+           ((v & 0xFF000000u) >> 24);
+}
+
+uint32_t IOTC_Data_ntoh(uint32_t data) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return bswap32(data);
+#else
+    return data;
+#endif
+}
+
+uint32_t IOTC_Data_hton(uint32_t data) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return bswap32(data);
+#else
+    return data;
+#endif
+}
+
+void IOTC_Header_ntoh(IOTCHeader *hdr) {
+    if (!hdr) return;
+    hdr->flag      = IOTC_Data_ntoh(hdr->flag);
+    hdr->sid       = IOTC_Data_ntoh(hdr->sid);
+    hdr->seq       = IOTC_Data_ntoh(hdr->seq);
+    hdr->timestamp = IOTC_Data_ntoh(hdr->timestamp);
+    hdr->payload   = IOTC_Data_ntoh(hdr->payload);
+}
+
+void IOTC_Header_hton(IOTCHeader *hdr) {
+    if (!hdr) return;
+    hdr->flag      = IOTC_Data_hton(hdr->flag);
+    hdr->sid       = IOTC_Data_hton(hdr->sid);
+    hdr->seq       = IOTC_Data_hton(hdr->seq);
+    hdr->timestamp = IOTC_Data_hton(hdr->timestamp);
+    hdr->payload   = IOTC_Data_hton(hdr->payload);
+}
+
+/* Batch conversion.  IOTCHeader is five 32-bit fields with no padding, so an
+ * array of headers is one run of words to byte-swap: the shuffle kernels
+ * take 4 or 8 words a step and leave the tail to the scalar loop.  The
+ * kernel is picked on first use, as the helpers work before IOTC_Initialize. */
+typedef void (*header_swap_fn)(uint32_t *words, size_t count);
+
+_Static_assert(sizeof(IOTCHeader) == 5 * sizeof(uint32_t), "IOTCHeader must be five packed words");
+
+static header_swap_fn g_header_swap;
+
+static void header_swap_scalar(uint32_t *words, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        words[i] = bswap32(words[i]);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("ssse3")))
+static void header_swap_ssse3(uint32_t *words, size_t count) {
+    const __m128i order = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    size_t i = 0;
+    
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(words + i));
+        _mm_storeu_si128((__m128i *)(words + i), _mm_shuffle_epi8(v, order));
+    }
+    header_swap_scalar(words + i, count - i);
+}
+
+/* The shuffle works within each 128-bit lane, so both lanes take the same order */
+__attribute__((target("avx2")))
+static void header_swap_avx2(uint32_t *words, size_t count) {
+    const __m256i order = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                           3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    size_t i = 0;
+    
+    for (; i + 16 <= count; i += 16) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(words + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(words + i + 8));
+        _mm256_storeu_si256((__m256i *)(words + i), _mm256_shuffle_epi8(a, order));
+        _mm256_storeu_si256((__m256i *)(words + i + 8), _mm256_shuffle_epi8(b, order));
+    }
+    header_swap_ssse3(words + i, count - i);
+}
+#elif defined(__ARM_NEON)
+static void header_swap_neon(uint32_t *words, size_t count) {
+    size_t i = 0;
+    
+    for (; i + 4 <= count; i += 4) {
+        uint8_t *p = (uint8_t *)(words + i);
+        vst1q_u8(p, vrev32q_u8(vld1q_u8(p)));
+    }
+    header_swap_scalar(words + i, count - i);
+}
+#endif
+
+static header_swap_fn header_swap_select(void) {
+    header_swap_fn fn = header_swap_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) fn = header_swap_ssse3;
+    if (__builtin_cpu_supports("avx2")) fn = header_swap_avx2;
+#elif defined(__ARM_NEON)
+    fn = header_swap_neon;
+#endif
+    // Every caller picks the same kernel, so a race here is harmless
+    __atomic_store_n(&g_header_swap, fn, __ATOMIC_RELAXED);
+    return fn;
+}
+
+/* Byte-swaps count headers in place on little-endian hosts */
+static void header_swap(IOTCHeader *hdrs, size_t count) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    header_swap_fn fn = __atomic_load_n(&g_header_swap, __ATOMIC_RELAXED);
+    if (!fn) fn = header_swap_select();
+    fn((uint32_t *)(void *)hdrs, count * (sizeof(IOTCHeader) / sizeof(uint32_t)));
+#else
+    (void)hdrs;
+    (void)count;
+#endif
+}
+
+void IOTC_Headers_ntoh_batch(IOTCHeader *hdrs, unsigned int count) {
+    if (!hdrs) return;
+    header_swap(hdrs, count);
+}
+
+void IOTC_Headers_hton_batch(IOTCHeader *hdrs, unsigned int count) {
+    if (!hdrs) return;
+    header_swap(hdrs, count);
+}
+
+/* LAN discovery */
+int64_t IOTC_Lan_Search2(IOTCDevInfo *devices, int max_num, unsigned int timeout_ms) {
+    if (!devices || max_num <= 0) {
+        return IOTC_ER_INVALID_ARG;
+    }
+    
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    int initialized = g_iotc_state.initialized;
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    if (!initialized) {
+        return IOTC_ER_NOT_INITIALIZED;
+    }
+    
+    memset(devices, 0, sizeof(IOTCDevInfo) * (size_t)max_num);
+    
+    // Serve from the live table when the background service has results
+    if (__atomic_load_n(&g_lan_discovery.running, __ATOMIC_ACQUIRE)) {
+        int count = 0;
+        for (int i = 0; i < LAN_DEVICE_TABLE_SIZE && count < max_num; i++) {
+            if (lan_slot_read(&g_lan_discovery.slots[i], &devices[count])) {
+                count++;
+            }
+        }
+        if (count > 0) return count;
+    }
+    
+    if (timeout_ms == 0) {
+        return IOTC_ER_INVALID_ARG;
+    }
+    
+    return lan_search_once(devices, max_num, timeout_ms);
+}
+
+int64_t IOTC_Lan_Discovery_Start(unsigned int interval_ms, IOTC_Lan_Device_Callback callback, void *user_data) {
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    int initialized = g_iotc_state.initialized;
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    if (!initialized) {
+        return IOTC_ER_NOT_INITIALIZED;
+    }
+    
+    pthread_mutex_lock(&g_lan_discovery.control_mutex);
+    
+    if (g_lan_discovery.running) {
+        pthread_mutex_unlock(&g_lan_discovery.control_mutex);
+        return IOTC_ER_ALREADY_LISTENING;
+    }
+    
+    g_lan_discovery.probe_fd = lan_create_probe_socket();
+    if (g_lan_discovery.probe_fd < 0) {
+        pthread_mutex_unlock(&g_lan_discovery.control_mutex);
+        return IOTC_ER_FAIL_CREATE_SOCKET;
+    }
+    
+    // Passive listening is best effort; another process may own the port
+    g_lan_discovery.passive_fd = lan_create_passive_socket();
+    g_lan_discovery.interval_ms = interval_ms ? interval_ms : LAN_DISCOVERY_DEFAULT_INTERVAL_MS;
+    g_lan_discovery.callback = callback;
+    g_lan_discovery.user_data = user_data;
+    __atomic_store_n(&g_lan_discovery.running, 1, __ATOMIC_RELEASE);
+    
+    if (pthread_create(&g_lan_discovery.thread, NULL, lan_discovery_thread, NULL) != 0) {
+        g_lan_discovery.running = 0;
+        close(g_lan_discovery.probe_fd);
+        if (g_lan_discovery.passive_fd >= 0) close(g_lan_discovery.passive_fd);
+        pthread_mutex_unlock(&g_lan_discovery.control_mutex);
+        return IOTC_ER_FAIL_CREATE_THREAD;
+    }
+    
+    pthread_mutex_unlock(&g_lan_discovery.control_mutex);
+    return IOTC_ER_NoERROR;
+}
+
+int64_t IOTC_Lan_Discovery_Stop(void) {
+    pthread_mutex_lock(&g_lan_discovery.control_mutex);
+    
+    // Stopping a service that is not running has nothing left to do
+    if (!g_lan_discovery.running) {
+        pthread_mutex_unlock(&g_lan_discovery.control_mutex);
+        return IOTC_ER_NoERROR;
+    }
+    
+    __atomic_store_n(&g_lan_discovery.running, 0, __ATOMIC_RELEASE);
+    pthread_join(g_lan_discovery.thread, NULL);
+    
+    close(g_lan_discovery.probe_fd);
+    if (g_lan_discovery.passive_fd >= 0) close(g_lan_discovery.passive_fd);
+    g_lan_discovery.probe_fd = -1;
+    g_lan_discovery.passive_fd = -1;
+    g_lan_discovery.callback = NULL;
+    g_lan_discovery.user_data = NULL;
+    lan_table_clear();
+    
+    pthread_mutex_unlock(&g_lan_discovery.control_mutex);
+    return IOTC_ER_NoERROR;
+}
+
+int64_t IOTC_Lan_Discovery_Get_Devices(IOTCLanDevice *devices, int max_num) {
+    if (!devices || max_num <= 0) {
+        return IOTC_ER_INVALID_ARG;
+    }
+    
+    uint64_t now = iotc_now_ms();
+    int count = 0;
+    for (int i = 0; i < LAN_DEVICE_TABLE_SIZE && count < max_num; i++) {
+        lan_device_slot_t *slot = &g_lan_discovery.slots[i];
+        if (!lan_slot_read(slot, &devices[count].info)) continue;
+        
+        uint64_t seen = __atomic_load_n(&slot->last_seen_ms, __ATOMIC_RELAXED);
+        devices[count].last_seen_ms = now > seen ? (uint32_t)(now - seen) : 0;
+        count++;
+    }
+    
+    return count;
+}
+
+/*
+ * SSL shutdown.  The TLS layer is a separate library; its entry points are
+ * weak references so this file still links on its own, in which case there
+ * is never a TLS session to shut down.
+ */
+extern int32_t *tutk_third_BIO_get_data(void *bio) __attribute__((weak));
+extern void *tutk_third_SSL_get_rbio(int64_t ssl) __attribute__((weak));
+extern int32_t tutk_third_SSL_shutdown(int64_t ssl) __attribute__((weak));
+extern int32_t tutk_third_SSL_get_error(int64_t ssl, int32_t ret) __attribute__((weak));
+extern int64_t translate_Error(int32_t ret, int64_t ssl) __attribute__((weak));
+
+int64_t IOTC_sCHL_shutdown(int64_t ssl) {
+    if (!tutk_third_BIO_get_data || !tutk_third_SSL_get_rbio || !tutk_third_SSL_shutdown ||
+        !tutk_third_SSL_get_error || !translate_Error) {
+        return 0;
+    }
+    
+    // Word 21 of the BIO state marks an established session; 20 and 22
+    // record whether it was closed before or after the handshake
+    int32_t *state = tutk_third_BIO_get_data(tutk_third_SSL_get_rbio(ssl));
+    if (!state[21]) {
+        state[20] = 1;
+        return 0;
+    }
+    
+    state[22] = 1;
+    int32_t ret = tutk_third_SSL_shutdown(ssl);
+    if (ret >= 0) {
+        return 0;
+    }
+    return translate_Error(tutk_third_SSL_get_error(ssl, ret), ssl);
+}
+
+/* Timeout configuration */
+int64_t IOTC_Setup_LANConnection_Timeout(unsigned int timeout_ms) {
+    if (timeout_ms == 0) {
+        return IOTC_ER_INVALID_ARG;
+    }
+    
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    g_iotc_state.lan_connect_timeout_ms = timeout_ms;
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    return IOTC_ER_NoERROR;
+}
+
+int64_t IOTC_Setup_Session_Idle_Timeout(unsigned int timeout_ms) {
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    g_iotc_state.idle_timeout_ms = timeout_ms;
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    return IOTC_ER_NoERROR;
+}
+
+int64_t IOTC_Setup_Keepalive_Interval(unsigned int interval_ms) {
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    g_iotc_state.keepalive_interval_ms = interval_ms;
+    if (g_iotc_state.initialized) {
+        timer_cancel(&g_iotc_state.heartbeat_timer);
+        heartbeat_arm();
+    }
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    return IOTC_ER_NoERROR;
+}
+
+int64_t IOTC_Setup_Max_Message_Size(unsigned int max_bytes) {
+    if (max_bytes < MAX_PACKET_SIZE || max_bytes > MAX_MESSAGE_SIZE_LIMIT) {
+        return IOTC_ER_INVALID_ARG;
+    }
+    
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    g_iotc_state.max_message_size = max_bytes;
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    return IOTC_ER_NoERROR;
+}
+
+int64_t IOTC_Session_Set_Channel_FEC(int session_id, unsigned char channel, int mode,
+                                     unsigned int data_fragments, unsigned int parity_fragments) {
+    if (channel >= MAX_CHANNEL_NUMBER) {
+        return IOTC_ER_INVALID_ARG;
+    }
+    if (mode != IOTC_FEC_OFF) {
+        if (mode != IOTC_FEC_XOR && mode != IOTC_FEC_RS) return IOTC_ER_INVALID_ARG;
+        if (data_fragments == 0 || data_fragments > FEC_MAX_DATA) return IOTC_ER_INVALID_ARG;
+        if (parity_fragments == 0 || parity_fragments > (mode == IOTC_FEC_XOR ? 1 : FEC_MAX_PARITY)) {
+            return IOTC_ER_INVALID_ARG;
+        }
+    }
+    
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    
+    if (!g_iotc_state.initialized) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_NOT_INITIALIZED;
+    }
+    
+    session_info_t *session = find_session_by_id(session_id);
+    if (!session || session->state != SESSION_STATE_CONNECTED) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_INVALID_SID;
+    }
+    
+    channel_info_t *ch = &session->channels[channel];
+    ch->fec_mode = (uint8_t)mode;
+    ch->fec_data = mode == IOTC_FEC_OFF ? 0 : (uint8_t)data_fragments;
+    ch->fec_parity = mode == IOTC_FEC_OFF ? 0 : (uint8_t)parity_fragments;
+    
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    return IOTC_ER_NoERROR;
+}
+
+/* Shared by the session and channel pacing setters; channel < 0 selects the session bucket */
+static int64_t session_set_pacing(int session_id, int channel, unsigned int rate_bytes, unsigned int burst_bytes) {
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    
+    if (!g_iotc_state.initialized) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_NOT_INITIALIZED;
+    }
+    
+    session_info_t *session = find_session_by_id(session_id);
+    if (!session || session->state != SESSION_STATE_CONNECTED) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_INVALID_SID;
+    }
+    
+    // With congestion control on, an explicit session rate only caps the estimate
+    if (channel < 0) {
+        session->cc.rate_limit = rate_bytes;
+        bucket_configure(&session->pace, cc_session_rate(session), burst_bytes, iotc_now_ms());
+    } else {
+        bucket_configure(&session->channels[channel].pace, rate_bytes, burst_bytes, iotc_now_ms());
+    }
+    
+    // Anything queued under the old rates leaves as the new ones allow
+    if (session->pace_bytes && session->has_peer) pace_drain(session);
+    
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    return IOTC_ER_NoERROR;
+}
+
+int64_t IOTC_Session_Set_Pacing(int session_id, unsigned int rate_bytes, unsigned int burst_bytes) {
+    return session_set_pacing(session_id, -1, rate_bytes, burst_bytes);
+}
+
+int64_t IOTC_Session_Channel_Set_Pacing(int session_id, unsigned char channel,
+                                        unsigned int rate_bytes, unsigned int burst_bytes) {
+    if (channel >= MAX_CHANNEL_NUMBER) {
+        return IOTC_ER_INVALID_ARG;
+    }
+    return session_set_pacing(session_id, channel, rate_bytes, burst_bytes);
+}
+
+int64_t IOTC_Session_Set_Congestion_Control(int session_id, int enable) {
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    
+    if (!g_iotc_state.initialized) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_NOT_INITIALIZED;
+    }
+    
+    session_info_t *session = find_session_by_id(session_id);
+    if (!session || session->state != SESSION_STATE_CONNECTED) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_INVALID_SID;
+    }
+    
+    session->cc.enabled = enable != 0;
+    cc_apply_rate(session);
+    
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    return IOTC_ER_NoERROR;
+}
+
+int64_t IOTC_Session_Get_Path_Stats(int session_id, IOTCSessionPathStats *stats) {
+    if (!stats) {
+        return IOTC_ER_INVALID_ARG;
+    }
+    
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    
+    if (!g_iotc_state.initialized) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_NOT_INITIALIZED;
+    }
+    
+    session_info_t *session = find_session_by_id(session_id);
+    if (!session) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_INVALID_SID;
+    }
+    
+    stats->pmtu = (unsigned int)(session_max_payload(session) + sizeof(IOTCHeader));
+    stats->pmtu_probing = session->pmtu_searching;
+    stats->bytes_sent = session->tx_bytes;
+    stats->send_calls = session->tx_calls;
+    stats->datagrams_sent = session->tx_datagrams;
+    stats->messages_fragmented = session->tx_fragmented;
+    stats->fragments_sent = session->tx_fragments;
+    stats->parity_sent = session->tx_parity;
+    stats->fragments_recovered = session->rx_recovered;
+    stats->pacing_queued = session->pace_bytes;
+    stats->bandwidth_estimate = session->cc.estimate;
+    stats->peer_receive_rate = session->cc.peer_rate;
+    stats->congestion_state = session->cc.peer_usage;
+    stats->loss_permille = session->cc.loss_permille;
+    
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    return IOTC_ER_NoERROR;
+}
+
+/* Direct connections */
+static int resolve_ipv4(const char *host, uint16_t port, struct sockaddr_in *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    
+    if (inet_pton(AF_INET, host, &addr->sin_addr) == 1) {
+        return 0;
+    }
+    
+    struct addrinfo hints, *result = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(host, NULL, &hints, &result) != 0 || !result) {
+        return -1;
+    }
+    
+    addr->sin_addr = ((struct sockaddr_in *)result->ai_addr)->sin_addr;
+    freeaddrinfo(result);
+    return 0;
+}
+
+/* Listen timeouts are driven by the timer wheel, like read timeouts */
+static void listen_timeout_fired(iotc_timer_t *timer, uint64_t now_ms) {
+    (void)now_ms;
+    listen_wait_t *waiter = timer->arg;
+    IOTC_PROBE_TIMEOUT(0, "listen");
+    waiter->expired = 1;
+    pthread_cond_broadcast(&g_iotc_state.listen_cond);
+}
+
+/* Device side: wait for the I/O thread to accept a CONNECT on the given UDP
+ * port.  The port stays bound until IOTC_DeInitialize so later calls and
+ * retransmitted CONNECTs reach the same endpoint. */
+int64_t IOTC_Listen(const char *uid, uint16_t port, uint32_t timeout_ms) {
+    if (port == 0) {
+        return IOTC_ER_INVALID_ARG;
+    }
+    
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    
+    if (!g_iotc_state.initialized) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_NOT_INITIALIZED;
+    }
+    
+    int endpoint = endpoint_find(port);
+    if (endpoint < 0) {
+        endpoint = endpoint_open(port);
+        if (endpoint < 0) {
+            pthread_mutex_unlock(&g_iotc_state.global_mutex);
+            return endpoint;
+        }
+    }
+    
+    listen_wait_t waiter = { .next = g_iotc_state.listen_waiters, .endpoint = endpoint, .uid = uid };
+    g_iotc_state.listen_waiters = &waiter;
+    
+    iotc_timer_t timer;
+    timer_init(&timer, listen_timeout_fired, &waiter);
+    if (timeout_ms) {
+        timer_add(&timer, timeout_ms);
+    }
+    
+    while (g_iotc_state.initialized && waiter.result == 0 && !waiter.expired) {
+        pthread_cond_wait(&g_iotc_state.listen_cond, &g_iotc_state.global_mutex);
+    }
+    timer_cancel(&timer);
+    
+    // An accepted waiter has already been unlinked by the I/O thread
+    for (listen_wait_t **link = &g_iotc_state.listen_waiters; *link; link = &(*link)->next) {
+        if (*link == &waiter) {
+            *link = waiter.next;
+            break;
+        }
+    }
+    
+    int64_t ret = waiter.result;
+    if (ret == 0) {
+        ret = g_iotc_state.initialized ? IOTC_ER_TIMEOUT : IOTC_ER_NOT_INITIALIZED;
+    }
+    
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    return ret;
+}
+
+/* Client side: handshake with a device at a known address. */
+int64_t IOTC_Connect(const char *uid, const char *server, uint16_t port) {
+    if (!uid || strlen(uid) != 20 || !server || port == 0) {
+        return IOTC_ER_INVALID_ARG;
+    }
+    
+    struct sockaddr_in addr;
+    if (resolve_ipv4(server, port, &addr) < 0) {
+        return IOTC_ER_FAIL_RESOLVE_HOSTNAME;
+    }
+    
+    return session_connect(uid, &addr);
+}
+
+/* Private, loopback and link-local peers count as LAN sessions */
+static int addr_is_lan(const struct in_addr *addr) {
+    uint32_t a = ntohl(addr->s_addr);
+    return (a >> 24) == 10 || (a >> 24) == 127 || (a >> 20) == 0xAC1 ||
+           (a >> 16) == 0xC0A8 || (a >> 16) == 0xA9FE;
+}
+
+static void channel_info_fill(const session_info_t *session, int channel, IOTCChannelInfo *out) {
+    const traffic_counters_t *t = &session->channel_traffic[channel];
+    const channel_info_t *ch = &session->channels[channel];
+    
+    out->bytes_in = STAT_READ(t->bytes_in);
+    out->bytes_out = STAT_READ(t->bytes_out);
+    out->packets_in = STAT_READ(t->packets_in);
+    out->packets_out = STAT_READ(t->packets_out);
+    out->drops = STAT_READ(t->drops);
+    out->retransmits = STAT_READ(t->retransmits);
+    out->queue_messages = STAT_READ(ch->queue_messages);
+    out->queue_bytes = (unsigned int)STAT_READ(ch->queue_bytes);
+    for (const paced_packet_t *packet = ch->pace_head; packet; packet = packet->next) {
+        out->pacing_queued += packet->len;
+    }
+}
+
+int64_t IOTC_Session_Get_Info(int session_id, void *info) {
+    IOTCSessionInfo out;
+    unsigned int size;
+    
+    if (!info) {
+        return IOTC_ER_INVALID_ARG;
+    }
+    memcpy(&size, info, sizeof(size));
+    if (size < offsetof(IOTCSessionInfo, rtt_us)) {
+        return IOTC_ER_INVALID_ARG;
+    }
+    
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    
+    if (!g_iotc_state.initialized) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_NOT_INITIALIZED;
+    }
+    
+    session_info_t *session = find_session_by_id(session_id);
+    if (!session) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_INVALID_SID;
+    }
+    
+    const delay_tracker_t *d = &session->delay;
+    memset(&out, 0, sizeof(out));
+    out.size = size < sizeof(out) ? size : (unsigned int)sizeof(out);
+    out.version = IOTC_SESSION_INFO_VERSION;
+    out.rtt_us = d->srtt_us;
+    out.rtt_var_us = d->rttvar_us;
+    out.rtt_min_us = d->rtt_min_us;
+    out.rtt_latest_us = d->rtt_latest_us;
+    out.rtt_samples = d->rtt_samples;
+    out.jitter_us = (unsigned int)(d->jitter_ms * 1000.0);
+    out.queuing_delay_us = d->queuing_ms > 0 ? (unsigned int)(d->queuing_ms * 1000.0) : 0;
+    out.delay_trend = (int)(session->cc.slope * 1000000.0);
+    
+    uint64_t now = iotc_now_ms();
+    if (session->has_peer) {
+        out.mode = addr_is_lan(&session->remote_addr.sin_addr) ? IOTC_SESSION_MODE_LAN : IOTC_SESSION_MODE_P2P;
+        out.remote_port = ntohs(session->remote_addr.sin_port);
+        inet_ntop(AF_INET, &session->remote_addr.sin_addr, out.remote_ip, sizeof(out.remote_ip));
+    }
+    if (session->connected_ms) out.uptime_ms = now - session->connected_ms;
+    if (session->last_activity) out.idle_ms = now - session->last_activity;
+    out.bytes_in = STAT_READ(session->traffic.bytes_in);
+    out.bytes_out = STAT_READ(session->traffic.bytes_out);
+    out.packets_in = STAT_READ(session->traffic.packets_in);
+    out.packets_out = STAT_READ(session->traffic.packets_out);
+    out.drops = STAT_READ(session->traffic.drops);
+    out.retransmits = STAT_READ(session->traffic.retransmits);
+    for (int i = 0; i < MAX_CHANNEL_NUMBER && i < IOTC_SESSION_INFO_CHANNELS; i++) {
+        channel_info_fill(session, i, &out.channels[i]);
+    }
+    
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    
+    memcpy(info, &out, out.size);
+    return IOTC_ER_NoERROR;
+}
+
+/* The session ID is kept for source compatibility; the status is global */
+int64_t IOTC_Get_Login_Info(int session_id, void *login_info) {
+    (void)session_id;
+    
+    if (!login_info) {
+        return IOTC_ER_INVALID_ARG;
+    }
+    
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    
+    if (!g_iotc_state.initialized) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_NOT_INITIALIZED;
+    }
+    
+    unsigned int status = __atomic_load_n(&g_iotc_state.io_running, __ATOMIC_ACQUIRE) ? IOTC_LOGIN_LOCAL_READY : 0;
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    
+    memcpy(login_info, &status, sizeof(status));
+    return IOTC_ER_NoERROR;
+}
+
+/* Metrics export.  A timer on the I/O thread copies the counters into a
+ * shared mapping under a seqlock, so external readers never make a syscall
+ * or take a lock to read it.  Guarded by global_mutex. */
+static void metrics_write_begin(IOTCMetricsFile *file) {
+    __atomic_store_n(&file->seq, file->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void metrics_write_end(IOTCMetricsFile *file) {
+    __atomic_store_n(&file->seq, file->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void metrics_fill_session(const session_info_t *session, IOTCMetricsSession *out, uint64_t now) {
+    out->session_id = session->session_id;
+    out->state = session->state;
+    memcpy(out->uid, session->uid, sizeof(session->uid));
+    if (session->has_peer) {
+        out->mode = addr_is_lan(&session->remote_addr.sin_addr) ? IOTC_SESSION_MODE_LAN : IOTC_SESSION_MODE_P2P;
+        out->remote_port = ntohs(session->remote_addr.sin_port);
+        inet_ntop(AF_INET, &session->remote_addr.sin_addr, out->remote_ip, sizeof(out->remote_ip));
+    }
+    if (session->connected_ms) out->uptime_ms = now - session->connected_ms;
+    out->bytes_in = STAT_READ(session->traffic.bytes_in);
+    out->bytes_out = STAT_READ(session->traffic.bytes_out);
+    out->packets_in = STAT_READ(session->traffic.packets_in);
+    out->packets_out = STAT_READ(session->traffic.packets_out);
+    out->drops = STAT_READ(session->traffic.drops);
+    out->retransmits = STAT_READ(session->traffic.retransmits);
+    out->pacing_queued = session->pace_bytes;
+    for (int i = 0; i < MAX_CHANNEL_NUMBER; i++) {
+        out->queue_bytes += STAT_READ(session->channels[i].queue_bytes);
+        if (session->channels[i].state == CHANNEL_STATE_ON) out->channels_on |= 1U << i;
+    }
+    out->rtt_us = session->delay.srtt_us;
+    out->jitter_us = (uint32_t)(session->delay.jitter_ms * 1000.0);
+    out->bandwidth_estimate = session->cc.estimate;
+}
+
+static void metrics_publish(int final) {
+    IOTCMetricsFile *file = g_metrics.file;
+    IOTCMetricsGlobal *global = &file->global;
+    uint64_t now = iotc_now_ms();
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    
+    metrics_write_begin(file);
+    
+    file->magic = IOTC_METRICS_MAGIC;
+    file->version = IOTC_METRICS_VERSION;
+    file->size = (uint32_t)g_metrics.size;
+    file->pid = final ? 0 : (uint32_t)getpid();
+    file->interval_ms = g_metrics.interval_ms;
+    file->updated_ms = (uint64_t)wall.tv_sec * 1000u + (uint64_t)wall.tv_nsec / 1000000u;
+    file->snapshots++;
+    
+    memset(global, 0, sizeof(*global));
+    global->sessions_opened = STAT_READ(g_metrics.sessions_opened);
+    global->sessions_closed = STAT_READ(g_metrics.sessions_closed);
+    global->bytes_in = STAT_READ(g_metrics.retired.bytes_in);
+    global->bytes_out = STAT_READ(g_metrics.retired.bytes_out);
+    global->packets_in = STAT_READ(g_metrics.retired.packets_in);
+    global->packets_out = STAT_READ(g_metrics.retired.packets_out);
+    global->drops = STAT_READ(g_metrics.retired.drops);
+    global->retransmits = STAT_READ(g_metrics.retired.retransmits);
+    global->rtt_count = STAT_READ(g_metrics.rtt_count);
+    global->rtt_sum_us = STAT_READ(g_metrics.rtt_sum_us);
+    for (int i = 0; i < IOTC_METRICS_RTT_BUCKETS; i++) {
+        global->rtt_buckets[i] = STAT_READ(g_metrics.rtt_buckets[i]);
+    }
+    
+    for (uint32_t i = 0; i < file->max_sessions; i++) {
+        IOTCMetricsSession *out = &file->sessions[i];
+        memset(out, 0, sizeof(*out));
+        if (i >= (uint32_t)g_iotc_state.max_sessions || !g_iotc_state.sessions) continue;
+        
+        const session_info_t *session = &g_iotc_state.sessions[i];
+        if (session->state == SESSION_STATE_FREE) continue;
+        metrics_fill_session(session, out, now);
+        global->sessions_active++;
+        if (session->state == SESSION_STATE_CONNECTED) global->sessions_connected++;
+        global->bytes_in += out->bytes_in;
+        global->bytes_out += out->bytes_out;
+        global->packets_in += out->packets_in;
+        global->packets_out += out->packets_out;
+        global->drops += out->drops;
+        global->retransmits += out->retransmits;
+    }
+    
+    metrics_write_end(file);
+}
+
+static void metrics_timer_fired(iotc_timer_t *timer, uint64_t now_ms) {
+    (void)now_ms;
+    if (!g_metrics.file) return;
+    metrics_publish(0);
+    timer_add(timer, g_metrics.interval_ms);
+}
+
+/* Publishes a last snapshot with pid 0 and unmaps the file */
+static void metrics_close(void) {
+    if (!g_metrics.file) return;
+    
+    timer_cancel(&g_metrics.timer);
+    metrics_publish(1);
+    munmap(g_metrics.file, g_metrics.size);
+    g_metrics.file = NULL;
+    g_metrics.size = 0;
+}
+
+int64_t IOTC_Metrics_Start(const char *path, unsigned int interval_ms) {
+    if (!path || !*path) {
+        return IOTC_ER_INVALID_ARG;
+    }
+    
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    
+    if (!g_iotc_state.initialized) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_NOT_INITIALIZED;
     }
     
-    pthread_mutex_init(&session->session_mutex, NULL);
+    metrics_close();
+    
+    // Readers may still map an older file at this path, so it is resized in
+    // place rather than truncated underneath them
+    size_t size = sizeof(IOTCMetricsFile) + (size_t)g_iotc_state.max_sessions * sizeof(IOTCMetricsSession);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 || ftruncate(fd, (off_t)size) < 0) {
+        if (fd >= 0) close(fd);
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_INVALID_ARG;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_INVALID_ARG;
+    }
+    
+    g_metrics.file = map;
+    g_metrics.size = size;
+    g_metrics.interval_ms = interval_ms ? interval_ms : METRICS_DEFAULT_INTERVAL_MS;
+    g_metrics.file->seq &= ~1U;          // a writer that died mid-snapshot left it odd
+    g_metrics.file->max_sessions = (uint32_t)g_iotc_state.max_sessions;
+    metrics_publish(0);
+    
+    timer_init(&g_metrics.timer, metrics_timer_fired, NULL);
+    timer_add(&g_metrics.timer, g_metrics.interval_ms);
+    
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    return IOTC_ER_NoERROR;
 }
 
-static void cleanup_session(session_info_t *session) {
-    pthread_mutex_lock(&session->session_mutex);
+int64_t IOTC_Metrics_Stop(void) {
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
     
-    if (session->socket_fd >= 0) {
-        close(session->socket_fd);
-        session->socket_fd = -1;
+    if (!g_iotc_state.initialized) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_NOT_INITIALIZED;
     }
     
-    for (int i = 0; i < MAX_CHANNEL_NUMBER; i++) {
-        cleanup_channel(&session->channels[i]);
+    metrics_close();
+    
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    return IOTC_ER_NoERROR;
+}
+
+int64_t IOTC_Histogram_Get(int histogram, unsigned char channel, IOTCHistogram *out, int reset) {
+    if (histogram < 0 || histogram > IOTC_HISTOGRAM_DELIVERY || channel >= MAX_CHANNEL_NUMBER ||
+        (!out && !reset)) {
+        return IOTC_ER_INVALID_ARG;
     }
     
-    session->state = SESSION_STATE_FREE;
+    histogram_t *h = &g_histograms[histogram == IOTC_HISTOGRAM_DELIVERY ? histogram + channel : histogram];
+    IOTCHistogram copy;
+    IOTCHistogram *dst = out ? out : &copy;
     
-    pthread_mutex_unlock(&session->session_mutex);
-    pthread_mutex_destroy(&session->session_mutex);
+    dst->count = 0;
+    for (int i = 0; i < IOTC_HISTOGRAM_BUCKETS; i++) {
+        dst->buckets[i] = histogram_take(&h->buckets[i], reset);
+        dst->count += dst->buckets[i];
+    }
+    dst->sum_us = histogram_take(&h->sum_us, reset);
+    dst->max_us = histogram_take(&h->max_us, reset);
+    uint64_t min_inv = histogram_take(&h->min_inv, reset);
+    dst->min_us = min_inv ? ~min_inv : 0;
+    return IOTC_ER_NoERROR;
 }
 
-/* Public API Implementation */
+uint64_t IOTC_Histogram_Bucket_Limit(unsigned int bucket) {
+    if (bucket >= IOTC_HISTOGRAM_BUCKETS - 1) return UINT64_MAX;
+    if (bucket < HISTOGRAM_SUB_BUCKETS) return bucket;
+    
+    unsigned int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t mantissa = HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS;
+    return ((mantissa + 1) << shift) - 1;
+}
 
-int64_t IOTC_Initialize(void) {
+uint64_t IOTC_Histogram_Percentile(const IOTCHistogram *histogram, double percentile) {
+    if (!histogram || histogram->count == 0) return 0;
+    
+    double target = (double)histogram->count * percentile / 100.0;
+    uint64_t seen = 0;
+    for (unsigned int i = 0; i < IOTC_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen > 0 && (double)seen >= target) {
+            // The bucket limit can overshoot what was actually recorded
+            uint64_t limit = IOTC_Histogram_Bucket_Limit(i);
+            if (limit > histogram->max_us) limit = histogram->max_us;
+            return limit < histogram->min_us ? histogram->min_us : limit;
+        }
+    }
+    return histogram->max_us;
+}
+
+int64_t IOTC_Receive_Stats_Get(IOTCReceiveStats *out, int reset) {
+    if (!out && !reset) return IOTC_ER_INVALID_ARG;
+    
     pthread_mutex_lock(&g_iotc_state.global_mutex);
+    if (out) *out = g_rx_stats;
+    if (reset) memset(&g_rx_stats, 0, sizeof(g_rx_stats));
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    return IOTC_ER_NoERROR;
+}
+
+int64_t IOTC_Set_Log_Path(const char *path, int max_size) {
+    if (max_size < 0) {
+        return IOTC_ER_INVALID_ARG;
+    }
     
-    if (g_iotc_state.initialized) {
-        pthread_mutex_unlock(&g_iotc_state.global_mutex);
-        return IOTC_ER_ALREADY_INITIALIZED;
+    pthread_mutex_lock(&g_log.control_mutex);
+    pthread_mutex_lock(&g_log.mutex);
+    
+    // Whatever is buffered belongs to the previous file
+    log_drain();
+    __atomic_store_n(&g_log.level, IOTC_LOG_LEVEL_NONE, __ATOMIC_RELAXED);
+    if (g_log.fd >= 0) close(g_log.fd);
+    g_log.fd = -1;
+    free(g_log.path);
+    g_log.path = NULL;
+    
+    if (!path || !*path) {
+        int running = g_log.running;
+        g_log.running = 0;
+        pthread_cond_signal(&g_log.cond);
+        pthread_mutex_unlock(&g_log.mutex);
+        if (running) pthread_join(g_log.flusher, NULL);
+        pthread_mutex_unlock(&g_log.control_mutex);
+        return IOTC_ER_NoERROR;
     }
     
-    g_iotc_state.max_sessions = MAX_DEFAULT_SESSION_NUMBER;
-    g_iotc_state.sessions = calloc(g_iotc_state.max_sessions, sizeof(session_info_t));
-    if (!g_iotc_state.sessions) {
-        pthread_mutex_unlock(&g_iotc_state.global_mutex);
-        return IOTC_ER_FAIL_CREATE_MUTEX;
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    g_log.path = strdup(path);
+    if (fd < 0 || !g_log.path) {
+        if (fd >= 0) close(fd);
+        free(g_log.path);
+        g_log.path = NULL;
+        pthread_mutex_unlock(&g_log.mutex);
+        pthread_mutex_unlock(&g_log.control_mutex);
+        return IOTC_ER_INVALID_ARG;
     }
+    off_t size = lseek(fd, 0, SEEK_END);
+    g_log.fd = fd;
+    g_log.file_size = size > 0 ? (uint64_t)size : 0;
+    g_log.max_size = (uint64_t)max_size;
     
-    for (int i = 0; i < g_iotc_state.max_sessions; i++) {
-        init_session(&g_iotc_state.sessions[i]);
+    if (!g_log.running) {
+        if (pthread_create(&g_log.flusher, NULL, log_flusher_main, NULL) != 0) {
+            close(g_log.fd);
+            g_log.fd = -1;
+            pthread_mutex_unlock(&g_log.mutex);
+            pthread_mutex_unlock(&g_log.control_mutex);
+            return IOTC_ER_FAIL_CREATE_THREAD;
+        }
+        g_log.running = 1;
     }
+    __atomic_store_n(&g_log.level, g_log.configured_level, __ATOMIC_RELAXED);
     
-    g_iotc_state.next_session_id = 1;
-    g_iotc_state.initialized = 1;
+    pthread_mutex_unlock(&g_log.mutex);
+    pthread_mutex_unlock(&g_log.control_mutex);
+    return IOTC_ER_NoERROR;
+}
+
+int64_t IOTC_Set_Log_Level(int level) {
+    if (level < IOTC_LOG_LEVEL_DEBUG || level > IOTC_LOG_LEVEL_NONE) {
+        return IOTC_ER_INVALID_ARG;
+    }
     
-    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    pthread_mutex_lock(&g_log.mutex);
+    g_log.configured_level = level;
+    if (g_log.fd >= 0) __atomic_store_n(&g_log.level, level, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&g_log.mutex);
     return IOTC_ER_NoERROR;
 }
 
-int64_t IOTC_DeInitialize(void) {
+int64_t IOTC_Set_Log_Rate_Limit(unsigned int records_per_sec, unsigned int burst) {
+    __atomic_store_n(&g_log.rate, records_per_sec, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_log.burst, burst, __ATOMIC_RELAXED);
+    return IOTC_ER_NoERROR;
+}
+
+void TUTK_LOG_MSG(int level, const char *module, int type, const char *fmt, ...) {
+    (void)type;
+    if (!fmt || level < IOTC_LOG_LEVEL_DEBUG || level >= IOTC_LOG_LEVEL_NONE ||
+        level < __atomic_load_n(&g_log.level, __ATOMIC_RELAXED)) {
+        return;
+    }
+    
+    va_list ap;
+    va_start(ap, fmt);
+    log_vwrite(level, module, fmt, &ap);
+    va_end(ap);
+}
+
+int64_t IOTC_Session_Capture_Start(int session_id, const char *path, unsigned int max_bytes) {
+    if (!path || !*path) {
+        return IOTC_ER_INVALID_ARG;
+    }
+    
     pthread_mutex_lock(&g_iotc_state.global_mutex);
     
     if (!g_iotc_state.initialized) {
@@ -306,19 +6757,25 @@ int64_t IOTC_DeInitialize(void) {
         return IOTC_ER_NOT_INITIALIZED;
     }
     
-    for (int i = 0; i < g_iotc_state.max_sessions; i++) {
-        cleanup_session(&g_iotc_state.sessions[i]);
+    session_info_t *session = find_session_by_id(session_id);
+    if (!session) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_INVALID_SID;
     }
     
-    free(g_iotc_state.sessions);
-    g_iotc_state.sessions = NULL;
-    g_iotc_state.initialized = 0;
+    capture_t *cap = capture_create(session, path, max_bytes);
+    if (!cap) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_INVALID_ARG;
+    }
+    if (session->capture) capture_stop(session->capture, 1);
+    session->capture = cap;
     
     pthread_mutex_unlock(&g_iotc_state.global_mutex);
     return IOTC_ER_NoERROR;
 }
 
-int64_t IOTC_Get_SessionID(void) {
+int64_t IOTC_Session_Capture_Stop(int session_id) {
     pthread_mutex_lock(&g_iotc_state.global_mutex);
     
     if (!g_iotc_state.initialized) {
@@ -326,39 +6783,49 @@ int64_t IOTC_Get_SessionID(void) {
         return IOTC_ER_NOT_INITIALIZED;
     }
     
-    session_info_t *session = find_free_session();
+    session_info_t *session = find_session_by_id(session_id);
     if (!session) {
         pthread_mutex_unlock(&g_iotc_state.global_mutex);
-        return IOTC_ER_EXCEED_MAX_SESSION;
+        return IOTC_ER_INVALID_SID;
     }
     
-    session->state = SESSION_STATE_USED;
-    session->session_id = g_iotc_state.next_session_id++;
-    
-    int session_id = session->session_id;
+    capture_t *cap = session->capture;
+    session->capture = NULL;
     pthread_mutex_unlock(&g_iotc_state.global_mutex);
-    return session_id;
+    
+    // Producers are gone with the pointer; wait for the file to be complete
+    if (cap) {
+        capture_stop(cap, 0);
+        pthread_join(cap->thread, NULL);
+        capture_free(cap);
+    }
+    return IOTC_ER_NoERROR;
 }
 
-int64_t IOTC_Set_Max_Session_Number(unsigned int max_sessions) {
+int64_t IOTC_Get_Session_Status(int session_id) {
     pthread_mutex_lock(&g_iotc_state.global_mutex);
     
-    if (g_iotc_state.initialized) {
+    if (!g_iotc_state.initialized) {
         pthread_mutex_unlock(&g_iotc_state.global_mutex);
-        return IOTC_ER_ALREADY_INITIALIZED;
+        return IOTC_ER_NOT_INITIALIZED;
     }
     
-    g_iotc_state.max_sessions = max_sessions;
+    session_info_t *session = find_session_by_id(session_id);
+    if (!session) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_INVALID_SID;
+    }
     
+    int status = session->state;
     pthread_mutex_unlock(&g_iotc_state.global_mutex);
-    return max_sessions;
+    return status;
 }
 
-int64_t IOTC_Connect_ByUID(const char *uid) {
-    if (!uid || strlen(uid) != 20) {
-        return IOTC_ER_INVALID_ARG;
-    }
-    
+int64_t IOTC_Session_Check(int session_id) {
+    return IOTC_Get_Session_Status(session_id) == SESSION_STATE_CONNECTED ? 1 : 0;
+}
+
+int32_t IOTC_Session_Get_Channel_ON_Count(int session_id) {
     pthread_mutex_lock(&g_iotc_state.global_mutex);
     
     if (!g_iotc_state.initialized) {
@@ -366,91 +6833,363 @@ int64_t IOTC_Connect_ByUID(const char *uid) {
         return IOTC_ER_NOT_INITIALIZED;
     }
     
-    int session_id = IOTC_Get_SessionID();
-    if (session_id < 0) {
-        pthread_mutex_unlock(&g_iotc_state.global_mutex);
-        return session_id;
-    }
-    
     session_info_t *session = find_session_by_id(session_id);
-    if (!session) {
+    if (!session || session->state != SESSION_STATE_CONNECTED) {
         pthread_mutex_unlock(&g_iotc_state.global_mutex);
         return IOTC_ER_INVALID_SID;
     }
     
-    strncpy(session->uid, uid, 20);
-    session->uid[20] = '\0';
-    session->state = SESSION_STATE_CONNECTING;
-    
-    // Simulate connection process
-    session->socket_fd = create_udp_socket();
-    if (session->socket_fd < 0) {
-        cleanup_session(session);
-        pthread_mutex_unlock(&g_iotc_state.global_mutex);
-        return IOTC_ER_FAIL_CREATE_SOCKET;
+    int count = 0;
+    for (int i = 0; i < MAX_CHANNEL_NUMBER; i++) {
+        if (session->channels[i].state == CHANNEL_STATE_ON) {
+            count++;
+        }
     }
     
-    session->state = SESSION_STATE_CONNECTED;
-    session->last_activity = time(NULL);
-    
     pthread_mutex_unlock(&g_iotc_state.global_mutex);
-    return session_id;
+    return count;
 }
 
-int64_t IOTC_Session_Close(int session_id) {
+uint32_t IOTC_Session_Get_Channel_ON_Bitmap(int session_id) {
     pthread_mutex_lock(&g_iotc_state.global_mutex);
     
     if (!g_iotc_state.initialized) {
         pthread_mutex_unlock(&g_iotc_state.global_mutex);
-        return IOTC_ER_NOT_INITIALIZED;
+        return 0;
+    }
+    
+    session_info_t *session = find_session_by_id(session_id);
+    if (!session || session->state != SESSION_STATE_CONNECTED) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return 0;
+    }
+    
+    uint32_t bitmap = 0;
+    for (int i = 0; i < MAX_CHANNEL_NUMBER; i++) {
+        if (session->channels[i].state == CHANNEL_STATE_ON) {
+            bitmap |= (1U << i);
+        }
+    }
+    
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    return bitmap;
+}
+
+/* Reliable delivery (RDT).  Each instance is an ordered byte stream bound to
+ * one session channel.  Segments carry a 32-bit sequence number in the header
+ * seq field.  The receiver answers every segment with its cumulative ACK, a
+ * 64-bit SACK bitmap of the segments after it, its free window and an echo of
+ * the segment's timestamp.  Echoed timestamps give RTT samples that
+ * retransmissions cannot confuse.  All state is guarded by global_mutex. */
+typedef struct {
+    uint16_t len;
+    uint8_t sacked;
+    uint8_t retransmitted;              /* resent since the last RTO; blocks repeat SACK recovery */
+    uint64_t sent_ms;
+    uint8_t data[RDT_SEGMENT_SIZE];
+} rdt_tx_segment_t;
+
+typedef struct {
+    uint16_t len;
+    uint8_t present;
+    uint8_t data[RDT_SEGMENT_SIZE];
+} rdt_rx_segment_t;
+
+typedef struct rdt_channel {
+    int rdt_id;
+    session_info_t *session;            /* NULL once the session has gone away */
+    uint8_t channel;
+    int64_t close_reason;               /* reported after the session has gone away */
+    int waiters;                        /* RDT_Read/RDT_Write calls blocked on this instance */
+    int destroyed;                      /* freed by the last waiter */
+    
+    /* Sender: [snd_una, snd_nxt) in flight, [snd_nxt, snd_end) queued */
+    uint32_t snd_una;
+    uint32_t snd_nxt;
+    uint32_t snd_end;
+    uint32_t snd_limit;                 /* first sequence beyond the peer's window */
+    unsigned int dupacks;
+    int has_rtt;
+    uint32_t srtt_ms;
+    uint32_t rttvar_ms;
+    uint32_t rto_ms;
+    iotc_timer_t rto_timer;
+    rdt_tx_segment_t tx[RDT_WINDOW];
+    
+    /* Receiver: [rcv_read, rcv_nxt) delivered in order but not yet read */
+    uint32_t rcv_read;
+    uint32_t rcv_nxt;
+    uint16_t rcv_read_off;
+    uint32_t rcv_adv;                   /* window in the last ACK sent */
+    rdt_rx_segment_t rx[RDT_WINDOW];
+} rdt_channel_t;
+
+static struct {
+    int initialized;
+    rdt_channel_t *channels[RDT_MAX_CHANNEL_NUMBER];
+} g_rdt;
+
+static int rdt_seq_lt(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) < 0;
+}
+
+static void rdt_send_segment(rdt_channel_t *rdt, uint32_t seq, uint64_t now_ms) {
+    rdt_tx_segment_t *seg = &rdt->tx[seq % RDT_WINDOW];
+    session_send_packet(rdt->session, IOTC_MSG_RDT_DATA, rdt->channel, seq, seg->data, seg->len);
+    seg->sent_ms = now_ms;
+}
+
+static void rdt_send_ack(rdt_channel_t *rdt, uint32_t echo) {
+    uint32_t sack_lo = 0, sack_hi = 0;
+    uint32_t window = RDT_WINDOW - (rdt->rcv_nxt - rdt->rcv_read);
+    
+    for (uint32_t i = 0; i < 64; i++) {
+        uint32_t seq = rdt->rcv_nxt + 1 + i;
+        if (seq - rdt->rcv_read >= RDT_WINDOW) break;
+        if (rdt->rx[seq % RDT_WINDOW].present) {
+            if (i < 32) sack_lo |= 1U << i;
+            else sack_hi |= 1U << (i - 32);
+        }
     }
     
-    session_info_t *session = find_session_by_id(session_id);
-    if (!session) {
+    uint32_t ack[5] = { htonl(rdt->rcv_nxt), htonl(sack_lo), htonl(sack_hi), htonl(window), htonl(echo) };
+    session_send_packet(rdt->session, IOTC_MSG_RDT_ACK, rdt->channel, 0, ack, sizeof(ack));
+    rdt->rcv_adv = window;
+}
+
+/* RFC 6298 estimator with the wheel tick as clock granularity */
+static void rdt_rtt_sample(rdt_channel_t *rdt, uint32_t rtt) {
+    if (!rdt->has_rtt) {
+        rdt->srtt_ms = rtt;
+        rdt->rttvar_ms = rtt / 2;
+        rdt->has_rtt = 1;
+    } else {
+        uint32_t delta = rdt->srtt_ms > rtt ? rdt->srtt_ms - rtt : rtt - rdt->srtt_ms;
+        rdt->rttvar_ms = (3 * rdt->rttvar_ms + delta) / 4;
+        rdt->srtt_ms = (7 * rdt->srtt_ms + rtt) / 8;
+    }
+    
+    uint32_t var = 4 * rdt->rttvar_ms;
+    uint32_t rto = rdt->srtt_ms + (var > TIMER_WHEEL_TICK_MS ? var : TIMER_WHEEL_TICK_MS);
+    rdt->rto_ms = rto < RDT_MIN_RTO_MS ? RDT_MIN_RTO_MS : rto > RDT_MAX_RTO_MS ? RDT_MAX_RTO_MS : rto;
+}
+
+/* Sends queued segments the peer has room for and keeps the RTO armed. */
+static void rdt_transmit(rdt_channel_t *rdt, uint64_t now_ms) {
+    while (rdt->snd_nxt != rdt->snd_end && rdt_seq_lt(rdt->snd_nxt, rdt->snd_limit)) {
+        rdt_send_segment(rdt, rdt->snd_nxt++, now_ms);
+    }
+    if (rdt->snd_una != rdt->snd_end && !rdt->rto_timer.pending) {
+        timer_add(&rdt->rto_timer, rdt->rto_ms);
+    }
+}
+
+static void rdt_rto_fired(iotc_timer_t *timer, uint64_t now_ms) {
+    rdt_channel_t *rdt = timer->arg;
+    
+    if (!rdt->session || rdt->snd_una == rdt->snd_end) return;
+    
+    IOTC_PROBE_TIMEOUT(rdt->session->session_id, "retransmit");
+    if (rdt->snd_una == rdt->snd_nxt) {
+        // Nothing in flight: the window update was lost, probe past it
+        rdt_send_segment(rdt, rdt->snd_nxt++, now_ms);
+    } else {
+        for (uint32_t seq = rdt->snd_una; seq != rdt->snd_nxt; seq++) {
+            rdt_tx_segment_t *seg = &rdt->tx[seq % RDT_WINDOW];
+            if (!seg->sacked && now_ms - seg->sent_ms >= rdt->rto_ms) {
+                rdt_send_segment(rdt, seq, now_ms);
+                seg->retransmitted = 1;
+                traffic_count_retransmit(rdt->session, rdt->channel);
+            }
+        }
+    }
+    
+    rdt->rto_ms = rdt->rto_ms * 2 > RDT_MAX_RTO_MS ? RDT_MAX_RTO_MS : rdt->rto_ms * 2;
+    timer_add(timer, rdt->rto_ms);
+}
+
+static void rdt_handle_ack(rdt_channel_t *rdt, const uint8_t *payload, uint32_t len, uint64_t now_ms) {
+    if (len < sizeof(wire_rdt_ack_t)) return;
+    
+    const wire_rdt_ack_t *ack = (const wire_rdt_ack_t *)payload;
+    uint32_t cum = wire_be32(ack->cum);
+    uint64_t sack = ((uint64_t)wire_be32(ack->sack_hi) << 32) | wire_be32(ack->sack_lo);
+    uint32_t window = wire_be32(ack->window);
+    uint32_t echo = wire_be32(ack->echo);
+    
+    // Reordered ACKs carry a stale window; ACKs past snd_nxt are bogus
+    if (rdt_seq_lt(cum, rdt->snd_una) || rdt_seq_lt(rdt->snd_nxt, cum)) return;
+    
+    if (echo) rdt_rtt_sample(rdt, (uint32_t)now_ms - echo);
+    
+    int advanced = cum != rdt->snd_una;
+    if (advanced) {
+        rdt->snd_una = cum;
+        rdt->dupacks = 0;
+    } else if (rdt->snd_una != rdt->snd_nxt) {
+        rdt->dupacks++;
+    }
+    rdt->snd_limit = cum + (window > RDT_WINDOW ? RDT_WINDOW : window);
+    
+    for (uint32_t i = 0; i < 64 && (sack >> i); i++) {
+        uint32_t seq = cum + 1 + i;
+        if ((sack >> i) & 1 && rdt_seq_lt(seq, rdt->snd_nxt)) {
+            rdt->tx[seq % RDT_WINDOW].sacked = 1;
+        }
+    }
+    
+    // A hole is lost once three later segments were SACKed, or after three
+    // duplicate ACKs for the first one; resend each hole once per RTO
+    unsigned int sacked_above = 0;
+    for (uint32_t seq = rdt->snd_nxt; seq != rdt->snd_una; ) {
+        rdt_tx_segment_t *seg = &rdt->tx[--seq % RDT_WINDOW];
+        if (seg->sacked) {
+            sacked_above++;
+        } else if (!seg->retransmitted &&
+                   (sacked_above >= RDT_DUPACK_THRESHOLD ||
+                    (seq == rdt->snd_una && rdt->dupacks >= RDT_DUPACK_THRESHOLD))) {
+            rdt_send_segment(rdt, seq, now_ms);
+            seg->retransmitted = 1;
+            traffic_count_retransmit(rdt->session, rdt->channel);
+        }
+    }
+    
+    if (advanced) {
+        timer_cancel(&rdt->rto_timer);
+        pthread_cond_broadcast(&rdt->session->state_cond);
+    }
+    rdt_transmit(rdt, now_ms);
+}
+
+static void rdt_handle_data(rdt_channel_t *rdt, const IOTCHeader *hdr, const uint8_t *payload) {
+    uint32_t seq = hdr->seq;
+    
+    if (hdr->payload == 0 || hdr->payload > RDT_SEGMENT_SIZE) return;
+    
+    // Duplicates and segments beyond the window are only acknowledged
+    if (!rdt_seq_lt(seq, rdt->rcv_nxt) && seq - rdt->rcv_read < RDT_WINDOW) {
+        rdt_rx_segment_t *slot = &rdt->rx[seq % RDT_WINDOW];
+        if (!slot->present) {
+            memcpy(slot->data, payload, hdr->payload);
+            slot->len = (uint16_t)hdr->payload;
+            slot->present = 1;
+        }
+        
+        if (seq == rdt->rcv_nxt) {
+            while (rdt->rcv_nxt - rdt->rcv_read < RDT_WINDOW && rdt->rx[rdt->rcv_nxt % RDT_WINDOW].present) {
+                rdt->rcv_nxt++;
+            }
+            pthread_cond_broadcast(&rdt->session->state_cond);
+        }
+    }
+    
+    rdt_send_ack(rdt, hdr->timestamp);
+}
+
+static void rdt_handle_message(rdt_channel_t *rdt, const IOTCHeader *hdr, const uint8_t *payload) {
+    if (IOTC_WIRE_TYPE(hdr->flag) == IOTC_MSG_RDT_DATA) {
+        rdt_handle_data(rdt, hdr, payload);
+    } else {
+        rdt_handle_ack(rdt, payload, hdr->payload, iotc_now_ms());
+    }
+}
+
+/* Called while the session releases its resources; pending RDT calls then
+ * fail with the session's close reason. */
+static void rdt_detach_session(session_info_t *session) {
+    for (int i = 0; i < MAX_CHANNEL_NUMBER; i++) {
+        rdt_channel_t *rdt = session->rdt[i];
+        if (!rdt) continue;
+        
+        timer_cancel(&rdt->rto_timer);
+        rdt->close_reason = session->close_reason ? session->close_reason : IOTC_ER_INVALID_SID;
+        rdt->session = NULL;
+        session->rdt[i] = NULL;
+    }
+}
+
+static void rdt_free(rdt_channel_t *rdt) {
+    timer_cancel(&rdt->rto_timer);
+    if (rdt->session) {
+        rdt->session->rdt[rdt->channel] = NULL;
+        pthread_cond_broadcast(&rdt->session->state_cond);
+        rdt->session = NULL;
+    }
+    
+    // Blocked callers free the instance when they wake up
+    if (rdt->waiters) {
+        rdt->destroyed = 1;
+        return;
+    }
+    free(rdt);
+}
+
+static rdt_channel_t *rdt_lookup(int rdt_id) {
+    if (rdt_id < 0 || rdt_id >= RDT_MAX_CHANNEL_NUMBER) return NULL;
+    return g_rdt.channels[rdt_id];
+}
+
+/* Blocks on the session's state_cond.  Returns 0 if the instance survived. */
+static int rdt_wait(rdt_channel_t *rdt) {
+    rdt->waiters++;
+    iotc_wait(&rdt->session->state_cond);
+    rdt->waiters--;
+    
+    if (rdt->destroyed) {
+        if (rdt->waiters == 0) free(rdt);
+        return -1;
+    }
+    return 0;
+}
+
+/* Public RDT API */
+int32_t RDT_Initialize(void) {
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    
+    if (g_rdt.initialized) {
         pthread_mutex_unlock(&g_iotc_state.global_mutex);
-        return IOTC_ER_INVALID_SID;
+        return RDT_ER_ALREADY_INITIALIZED;
     }
-    
-    cleanup_session(session);
+    g_rdt.initialized = 1;
     
     pthread_mutex_unlock(&g_iotc_state.global_mutex);
-    return IOTC_ER_NoERROR;
+    return RDT_MAX_CHANNEL_NUMBER;
 }
 
-int64_t IOTC_Session_Channel_ON(int session_id, unsigned char channel) {
-    if (channel >= MAX_CHANNEL_NUMBER) {
-        return IOTC_ER_INVALID_ARG;
-    }
-    
+int32_t RDT_DeInitialize(void) {
     pthread_mutex_lock(&g_iotc_state.global_mutex);
     
-    if (!g_iotc_state.initialized) {
+    if (!g_rdt.initialized) {
         pthread_mutex_unlock(&g_iotc_state.global_mutex);
-        return IOTC_ER_NOT_INITIALIZED;
+        return RDT_ER_NOT_INITIALIZED;
     }
     
-    session_info_t *session = find_session_by_id(session_id);
-    if (!session || session->state != SESSION_STATE_CONNECTED) {
-        pthread_mutex_unlock(&g_iotc_state.global_mutex);
-        return IOTC_ER_INVALID_SID;
+    for (int i = 0; i < RDT_MAX_CHANNEL_NUMBER; i++) {
+        if (g_rdt.channels[i]) {
+            rdt_free(g_rdt.channels[i]);
+            g_rdt.channels[i] = NULL;
+        }
     }
-    
-    session->channels[channel].state = CHANNEL_STATE_ON;
+    g_rdt.initialized = 0;
     
     pthread_mutex_unlock(&g_iotc_state.global_mutex);
-    return IOTC_ER_NoERROR;
+    return RDT_ER_NoERROR;
 }
 
-int64_t IOTC_Session_Channel_OFF(int session_id, unsigned char channel) {
+/* timeout_ms is accepted for compatibility: no handshake is needed since
+ * segments sent before the peer creates its end are retransmitted. */
+int32_t RDT_Create(int session_id, int timeout_ms, unsigned char channel) {
+    (void)timeout_ms;
+    
     if (channel >= MAX_CHANNEL_NUMBER) {
-        return IOTC_ER_INVALID_ARG;
+        return RDT_ER_INVALID_ARG;
     }
     
     pthread_mutex_lock(&g_iotc_state.global_mutex);
     
-    if (!g_iotc_state.initialized) {
+    if (!g_rdt.initialized || !g_iotc_state.initialized) {
         pthread_mutex_unlock(&g_iotc_state.global_mutex);
-        return IOTC_ER_NOT_INITIALIZED;
+        return RDT_ER_NOT_INITIALIZED;
     }
     
     session_info_t *session = find_session_by_id(session_id);
@@ -458,303 +7197,560 @@ int64_t IOTC_Session_Channel_OFF(int session_id, unsigned char channel) {
         pthread_mutex_unlock(&g_iotc_state.global_mutex);
         return IOTC_ER_INVALID_SID;
     }
-    
-    session->channels[channel].state = CHANNEL_STATE_OFF;
-    cleanup_channel(&session->channels[channel]);
-    init_channel(&session->channels[channel]);
-    
-    pthread_mutex_unlock(&g_iotc_state.global_mutex);
-    return IOTC_ER_NoERROR;
-}
-
-int64_t IOTC_Session_Channel_Check_ON_OFF(int session_id, unsigned char channel) {
-    if (channel >= MAX_CHANNEL_NUMBER) {
-        return IOTC_ER_INVALID_ARG;
+    if (!session->has_peer) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return IOTC_ER_NETWORK_UNREACHABLE;
+    }
+    if (session->rdt[channel]) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return RDT_ER_CHANNEL_OCCUPIED;
     }
     
-    pthread_mutex_lock(&g_iotc_state.global_mutex);
-    
-    if (!g_iotc_state.initialized) {
+    int rdt_id = -1;
+    for (int i = 0; i < RDT_MAX_CHANNEL_NUMBER; i++) {
+        if (!g_rdt.channels[i]) {
+            rdt_id = i;
+            break;
+        }
+    }
+    if (rdt_id < 0) {
         pthread_mutex_unlock(&g_iotc_state.global_mutex);
-        return IOTC_ER_NOT_INITIALIZED;
+        return RDT_ER_EXCEED_MAX_CHANNEL;
     }
     
-    session_info_t *session = find_session_by_id(session_id);
-    if (!session || session->state != SESSION_STATE_CONNECTED) {
+    rdt_channel_t *rdt = calloc(1, sizeof(*rdt));
+    if (!rdt) {
         pthread_mutex_unlock(&g_iotc_state.global_mutex);
-        return IOTC_ER_INVALID_SID;
+        return RDT_ER_MEM_INSUFF;
     }
     
-    int state = session->channels[channel].state;
+    rdt->rdt_id = rdt_id;
+    rdt->session = session;
+    rdt->channel = channel;
+    rdt->snd_limit = RDT_WINDOW;
+    rdt->rto_ms = RDT_INITIAL_RTO_MS;
+    rdt->rcv_adv = RDT_WINDOW;
+    timer_init(&rdt->rto_timer, rdt_rto_fired, rdt);
+    
+    session->rdt[channel] = rdt;
+    g_rdt.channels[rdt_id] = rdt;
     
     pthread_mutex_unlock(&g_iotc_state.global_mutex);
-    return state;
+    return rdt_id;
 }
 
-int32_t IOTC_Session_Get_Free_Channel(int session_id) {
+int32_t RDT_Destroy(int rdt_id) {
     pthread_mutex_lock(&g_iotc_state.global_mutex);
     
-    if (!g_iotc_state.initialized) {
+    rdt_channel_t *rdt = rdt_lookup(rdt_id);
+    if (!rdt) {
         pthread_mutex_unlock(&g_iotc_state.global_mutex);
-        return IOTC_ER_NOT_INITIALIZED;
+        return RDT_ER_INVALID_RDT_ID;
     }
     
-    session_info_t *session = find_session_by_id(session_id);
-    if (!session || session->state != SESSION_STATE_CONNECTED) {
+    g_rdt.channels[rdt_id] = NULL;
+    rdt_free(rdt);
+    
+    pthread_mutex_unlock(&g_iotc_state.global_mutex);
+    return RDT_ER_NoERROR;
+}
+
+/* Unacknowledged data is dropped either way; kept for API compatibility */
+int32_t RDT_Abort(int rdt_id) {
+    return RDT_Destroy(rdt_id);
+}
+
+int32_t RDT_Write(int rdt_id, const char *buf, int size) {
+    if (!buf || size <= 0) {
+        return RDT_ER_INVALID_ARG;
+    }
+    
+    pthread_mutex_lock(&g_iotc_state.global_mutex);
+    
+    rdt_channel_t *rdt = rdt_lookup(rdt_id);
+    if (!rdt) {
         pthread_mutex_unlock(&g_iotc_state.global_mutex);
-        return IOTC_ER_INVALID_SID;
+        return RDT_ER_INVALID_RDT_ID;
     }
     
-    for (int i = 0; i < MAX_CHANNEL_NUMBER; i++) {
-        if (session->channels[i].state == CHANNEL_STATE_OFF) {
+    int written = 0;
+    while (written < size) {
+        if (!rdt->session) {
+            int32_t reason = (int32_t)rdt->close_reason;
             pthread_mutex_unlock(&g_iotc_state.global_mutex);
-            return i;
+            return reason;
         }
+        
+        // Wait for the oldest segment to be acknowledged when the window is full
+        if (rdt->snd_end - rdt->snd_una >= RDT_WINDOW) {
+            if (rdt_wait(rdt) < 0) {
+                pthread_mutex_unlock(&g_iotc_state.global_mutex);
+                return RDT_ER_LOCAL_ABORT;
+            }
+            continue;
+        }
+        
+        rdt_tx_segment_t *seg = &rdt->tx[rdt->snd_end % RDT_WINDOW];
+        // Segments never exceed the path MTU, nor the fixed slot size
+        int seg_max = (int)session_max_payload(rdt->session);
+        if (seg_max > RDT_SEGMENT_SIZE) seg_max = RDT_SEGMENT_SIZE;
+        int len = size - written < seg_max ? size - written : seg_max;
+        memcpy(seg->data, buf + written, (size_t)len);
+        seg->len = (uint16_t)len;
+        seg->sacked = 0;
+        seg->retransmitted = 0;
+        rdt->snd_end++;
+        written += len;
+        
+        rdt_transmit(rdt, iotc_now_ms());
     }
     
     pthread_mutex_unlock(&g_iotc_state.global_mutex);
-    return IOTC_ER_FAIL_SETUP_CHANNEL;
+    return written;
 }
 
-int64_t IOTC_Session_Write(int session_id, const void *data, unsigned int size, unsigned char channel) {
-    if (!data || size == 0 || size > MAX_PACKET_SIZE || channel >= MAX_CHANNEL_NUMBER) {
-        return IOTC_ER_INVALID_ARG;
+/* Read timeouts reuse the wheel-driven read_wait_t from the session read path */
+int32_t RDT_Read(int rdt_id, char *buf, int size, int timeout_ms) {
+    if (!buf || size <= 0) {
+        return RDT_ER_INVALID_ARG;
     }
     
     pthread_mutex_lock(&g_iotc_state.global_mutex);
     
-    if (!g_iotc_state.initialized) {
+    rdt_channel_t *rdt = rdt_lookup(rdt_id);
+    if (!rdt) {
         pthread_mutex_unlock(&g_iotc_state.global_mutex);
-        return IOTC_ER_NOT_INITIALIZED;
+        return RDT_ER_INVALID_RDT_ID;
     }
     
-    session_info_t *session = find_session_by_id(session_id);
-    if (!session || session->state != SESSION_STATE_CONNECTED) {
-        pthread_mutex_unlock(&g_iotc_state.global_mutex);
-        return IOTC_ER_INVALID_SID;
+    read_wait_t wait = { .session = rdt->session, .expired = 0 };
+    iotc_timer_t timer;
+    timer_init(&timer, read_timeout_fired, &wait);
+    if (timeout_ms > 0 && rdt->session && rdt->rcv_read == rdt->rcv_nxt) {
+        timer_add(&timer, (uint64_t)timeout_ms);
     }
     
-    if (session->channels[channel].state != CHANNEL_STATE_ON) {
+    int32_t ret = 0;
+    while (rdt->rcv_read == rdt->rcv_nxt) {
+        if (!rdt->session) {
+            ret = (int32_t)rdt->close_reason;
+            break;
+        }
+        if (timeout_ms <= 0 || wait.expired) {
+            ret = RDT_ER_TIMEOUT;
+            break;
+        }
+        if (rdt_wait(rdt) < 0) {
+            timer_cancel(&timer);
+            pthread_mutex_unlock(&g_iotc_state.global_mutex);
+            return RDT_ER_LOCAL_ABORT;
+        }
+    }
+    timer_cancel(&timer);
+    
+    if (ret < 0) {
         pthread_mutex_unlock(&g_iotc_state.global_mutex);
-        return IOTC_ER_CH_NOT_ON;
+        return ret;
+    }
+    
+    while (ret < size && rdt->rcv_read != rdt->rcv_nxt) {
+        rdt_rx_segment_t *slot = &rdt->rx[rdt->rcv_read % RDT_WINDOW];
+        int chunk = slot->len - rdt->rcv_read_off;
+        if (chunk > size - ret) chunk = size - ret;
+        
+        memcpy(buf + ret, slot->data + rdt->rcv_read_off, (size_t)chunk);
+        ret += chunk;
+        rdt->rcv_read_off += (uint16_t)chunk;
+        if (rdt->rcv_read_off == slot->len) {
+            slot->present = 0;
+            rdt->rcv_read++;
+            rdt->rcv_read_off = 0;
+        }
     }
     
-    // Simulate sending data by just returning the size
-    session->last_activity = time(NULL);
+    // Reopen a window the sender may be stalled on
+    if (rdt->session && rdt->rcv_adv < RDT_WINDOW / 2 &&
+        RDT_WINDOW - (rdt->rcv_nxt - rdt->rcv_read) >= RDT_WINDOW / 2) {
+        rdt_send_ack(rdt, 0);
+    }
     
     pthread_mutex_unlock(&g_iotc_state.global_mutex);
-    return size;
+    return ret;
 }
 
-int64_t IOTC_Session_Read_Check_Lost_Data_And_Datatype(
-    int session_id, void *buf, int size, int timeout,
-    unsigned char *lost, unsigned char *datatype, int flags, int unused) {
-    
-    if (!buf || size <= 0) {
-        return IOTC_ER_INVALID_ARG;
+int32_t RDT_Status_Check(int rdt_id, st_RDT_Status *status) {
+    if (!status) {
+        return RDT_ER_INVALID_ARG;
     }
     
     pthread_mutex_lock(&g_iotc_state.global_mutex);
     
-    if (!g_iotc_state.initialized) {
+    rdt_channel_t *rdt = rdt_lookup(rdt_id);
+    if (!rdt) {
         pthread_mutex_unlock(&g_iotc_state.global_mutex);
-        return IOTC_ER_NOT_INITIALIZED;
+        return RDT_ER_INVALID_RDT_ID;
     }
     
-    session_info_t *session = find_session_by_id(session_id);
-    if (!session || session->state != SESSION_STATE_CONNECTED) {
-        pthread_mutex_unlock(&g_iotc_state.global_mutex);
-        return IOTC_ER_INVALID_SID;
+    unsigned int queued = 0, unread = 0;
+    for (uint32_t seq = rdt->snd_una; seq != rdt->snd_end; seq++) {
+        queued += rdt->tx[seq % RDT_WINDOW].len;
+    }
+    for (uint32_t seq = rdt->rcv_read; seq != rdt->rcv_nxt; seq++) {
+        unread += rdt->rx[seq % RDT_WINDOW].len;
     }
     
-    // For now, just return 0 to indicate no data available
-    if (lost) *lost = 0;
-    if (datatype) *datatype = 0;
-    
-    session->last_activity = time(NULL);
+    status->Timeout = (unsigned short)rdt->rto_ms;
+    status->TimeoutThreshold = RDT_MAX_RTO_MS;
+    status->BufSizeInSendQueue = queued;
+    status->BufSizeInRecvQueue = unread - rdt->rcv_read_off;
     
     pthread_mutex_unlock(&g_iotc_state.global_mutex);
-    return 0;
+    return RDT_ER_NoERROR;
 }
 
-int64_t IOTC_Session_Read(int session_id, void *buf, int size, int timeout, int flags) {
-    unsigned char lost = 0;
-    unsigned char datatype = 0;
-    
-    // Capture the current stack guard value and compare it after the call
-    void *guard = __stack_chk_guard;
-    int64_t ret = IOTC_Session_Read_Check_Lost_Data_And_Datatype(
-        session_id, buf, size, timeout, &lost, &datatype, flags, 0);
-
-    if (ret == 0 && guard == __stack_chk_guard)
-        return ret;
-
-    // Guard value changed – trigger the failure handler.
-    __stack_chk_fail();
-    // no return
-#if defined(__GNUC__)
-    __builtin_unreachable();
-#endif
+uint32_t RDT_GetRDTApiVer(void) {
+    return 0x010d0700u;
 }
 
-void IOTC_Get_Version(uint32_t *version) {
-    if (version)
-        *version = 0x010d0700u; // Version 1.13.7.0
-}
+/* AV client.  The device sends pseudo-RTP, one packet per session message
+ * on the AV channel, as read by example.py's stream_to_file(): single H.264
+ * NAL units or FU-A fragments of one, with the marker bit on the last packet
+ * of a frame.  As packets are queued the receive path only notes where
+ * frames end.  avRecvFrameData2 then walks one frame's packets once,
+ * writing each NAL unit or fragment straight into the caller's buffer at
+ * its Annex-B offset.  State is guarded by global_mutex. */
+typedef struct av_client {
+    int in_use;
+    uint32_t session_id;
+    uint8_t channel;
+    
+    /* Receive path: complete frames among the queued packets */
+    uint32_t frames_ready;
+    int rx_open;                        /* a frame has started but not ended */
+    uint32_t rx_timestamp;
+    
+    /* Reader: carried from one frame to the next */
+    int have_seq;
+    uint16_t last_seq;
+    int in_fu;                          /* an FU-A NAL unit is being rebuilt */
+    uint32_t frame_index;
+} av_client_t;
 
-const char *IOTC_Get_Version_String(void) {
-    return "1.13.7.0";
-}
+/* What one frame's packets added up to */
+typedef struct {
+    size_t bytes;                       /* Annex-B size, written or not */
+    uint32_t lost;                      /* RTP sequence numbers missing */
+    int dropped;                        /* fragments that could not be placed */
+    int key;
+} av_frame_t;
 
-/* Endianness helpers */
-static inline uint32_t bswap32(uint32_t v) {
-    return ((v & 0x000000FFu) << 24) |
-           ((v & 0x0000FF00u) << 8)  |
-           ((v & 0x00FF0000u) >> 8)  |
-           ((v & 0xFF000000u) >> 24);
-}
+static struct {
+    av_client_t clients[AV_MAX_CLIENT_NUMBER];
+} g_av;
 
-uint32_t IOTC_Data_ntoh(uint32_t data) {
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-    return bswap32(data);
-#else
-    return data;
-#endif
-}
+static const uint8_t g_av_start_code[AV_START_CODE_SIZE] = { 0, 0, 0, 1 };
 
-uint32_t IOTC_Data_hton(uint32_t data) {
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-    return bswap32(data);
-#else
-    return data;
-#endif
-}
+_Static_assert(sizeof(FRAMEINFO_t) == 16, "vendor FRAMEINFO_t size");
 
-void IOTC_Header_ntoh(IOTCHeader *hdr) {
-    if (!hdr) return;
-    hdr->flag      = IOTC_Data_ntoh(hdr->flag);
-    hdr->sid       = IOTC_Data_ntoh(hdr->sid);
-    hdr->seq       = IOTC_Data_ntoh(hdr->seq);
-    hdr->timestamp = IOTC_Data_ntoh(hdr->timestamp);
-    hdr->payload   = IOTC_Data_ntoh(hdr->payload);
+/* A frame ends at its marker bit, or where the next one's timestamp begins
+ * when the marker packet was lost */
+static void av_on_packet(av_client_t *av, const uint8_t *data, size_t size) {
+    rtp_view_t rtp;
+    if (wire_rtp_view(data, size, &rtp) < 0 || wire_rtp_payload_type(rtp.rtp) != RTP_PAYLOAD_H264) return;
+    
+    uint32_t timestamp = wire_rtp_timestamp(rtp.rtp);
+    if (av->rx_open && timestamp != av->rx_timestamp) av->frames_ready++;
+    av->rx_open = !wire_rtp_marker(rtp.rtp);
+    av->rx_timestamp = timestamp;
+    if (!av->rx_open) av->frames_ready++;
 }
 
-void IOTC_Header_hton(IOTCHeader *hdr) {
-    if (!hdr) return;
-    hdr->flag      = IOTC_Data_hton(hdr->flag);
-    hdr->sid       = IOTC_Data_hton(hdr->sid);
-    hdr->seq       = IOTC_Data_hton(hdr->seq);
-    hdr->timestamp = IOTC_Data_hton(hdr->timestamp);
-    hdr->payload   = IOTC_Data_hton(hdr->payload);
+/* Copies parts into the frame at offset when they all fit */
+static void av_write(uint8_t *frame, size_t size, size_t offset, const uint8_t *prefix, size_t prefix_len,
+                     const uint8_t *data, size_t len) {
+    if (offset + prefix_len + len > size) return;
+    if (prefix_len) memcpy(frame + offset, prefix, prefix_len);
+    memcpy(frame + offset + prefix_len, data, len);
 }
 
-/* SSL shutdown stub */
-int64_t IOTC_sCHL_shutdown(int64_t ssl) {
-    // Stub implementation - in real usage this would handle SSL shutdown
-    return 0;
+/* Places one packet's NAL data at the end of the frame.  A fragment whose
+ * start was lost has nothing to attach to and is dropped. */
+static void av_place_packet(av_client_t *av, const rtp_view_t *rtp, uint8_t *frame, size_t size,
+                            av_frame_t *out) {
+    const uint8_t *p = rtp->payload;
+    size_t len = rtp->payload_len;
+    if (len == 0) return;
+    
+    unsigned int nal = wire_nal_type(p[0]);
+    if (nal >= 1 && nal < 24) {
+        av_write(frame, size, out->bytes, g_av_start_code, AV_START_CODE_SIZE, p, len);
+        out->bytes += AV_START_CODE_SIZE + len;
+        out->key |= nal == H264_NAL_IDR;
+        av->in_fu = 0;
+        return;
+    }
+    if (nal != H264_NAL_FU_A || len < sizeof(wire_fu_a_t)) return;
+    
+    const wire_fu_a_t *fu = (const wire_fu_a_t *)p;
+    p += sizeof(*fu);
+    len -= sizeof(*fu);
+    if (wire_fu_start(fu)) {
+        uint8_t prefix[AV_START_CODE_SIZE + 1] = { 0, 0, 0, 1, wire_fu_nal_header(fu) };
+        av_write(frame, size, out->bytes, prefix, sizeof(prefix), p, len);
+        out->bytes += sizeof(prefix) + len;
+        out->key |= wire_nal_type(fu->header) == H264_NAL_IDR;
+        av->in_fu = 1;
+    } else if (av->in_fu) {
+        av_write(frame, size, out->bytes, NULL, 0, p, len);
+        out->bytes += len;
+    } else {
+        out->dropped++;
+    }
+    if (wire_fu_end(fu)) av->in_fu = 0;
 }
 
-/* Additional API stubs for compatibility */
-int64_t IOTC_Listen(const char *uid, uint16_t port, uint32_t timeout_ms) {
-    (void)uid; (void)port; (void)timeout_ms;
-    return IOTC_ER_NOT_SUPPORT;
+/* Dequeues the oldest complete frame, writing it into frame while it fits */
+static void av_take_frame(av_client_t *av, session_info_t *session, uint8_t *frame, size_t size,
+                          av_frame_t *out, uint32_t *timestamp) {
+    channel_info_t *ch = &session->channels[av->channel];
+    int started = 0;
+    
+    memset(out, 0, sizeof(*out));
+    av->frames_ready--;
+    while (ch->msg_queue_head) {
+        const message_entry_t *head = ch->msg_queue_head;
+        rtp_view_t rtp = {0};
+        int h264 = wire_rtp_view(head->data, head->size, &rtp) == 0 &&
+                   wire_rtp_payload_type(rtp.rtp) == RTP_PAYLOAD_H264;
+        if (h264 && started && wire_rtp_timestamp(rtp.rtp) != *timestamp) break;
+        
+        message_entry_t *entry = dequeue_message(ch);
+        histogram_record(IOTC_HISTOGRAM_DELIVERY + av->channel, iotc_now_us() - entry->queued_us);
+        int end = 0;
+        if (h264) {
+            if (!started) *timestamp = wire_rtp_timestamp(rtp.rtp);
+            started = 1;
+            
+            // Late packets do not move the sequence back
+            uint16_t seq = wire_rtp_seq(rtp.rtp);
+            uint16_t gap = (uint16_t)(seq - av->last_seq - 1);
+            if (!av->have_seq || gap < 0x8000) {
+                if (av->have_seq) out->lost += gap;
+                av->last_seq = seq;
+                av->have_seq = 1;
+            }
+            av_place_packet(av, &rtp, frame, size, out);
+            end = wire_rtp_marker(rtp.rtp);
+        }
+        free_message(entry);
+        if (end) break;
+    }
 }
 
-int64_t IOTC_Connect(const char *uid, const char *server, uint16_t port) {
-    (void)uid; (void)server; (void)port;
-    return IOTC_ER_NOT_SUPPORT;
+static av_client_t *av_lookup(int av_index) {
+    if (av_index < 0 || av_index >= AV_MAX_CLIENT_NUMBER || !g_av.clients[av_index].in_use) return NULL;
+    return &g_av.clients[av_index];
 }
 
-int64_t IOTC_Session_Get_Info(int session_id, void *info) {
-    (void)session_id; (void)info;
-    return IOTC_ER_NOT_SUPPORT;
+static void av_release_all(void) {
+    memset(&g_av, 0, sizeof(g_av));
 }
 
-int64_t IOTC_Get_Login_Info(int session_id, void *login_info) {
-    (void)session_id; (void)login_info;
-    return IOTC_ER_NOT_SUPPORT;
+static int32_t av_session_error(const session_info_t *session) {
+    if (session && session->state == SESSION_STATE_DISCONNECTED) {
+        if (session->close_reason == IOTC_ER_SESSION_CLOSE_BY_REMOTE) return AV_ER_SESSION_CLOSE_BY_REMOTE;
+        if (session->close_reason == IOTC_ER_REMOTE_TIMEOUT_DISCONNECT) return AV_ER_REMOTE_TIMEOUT_DISCONNECT;
+    }
+    return AV_ER_INVALID_SID;
 }
 
-int64_t IOTC_Get_Session_Status(int session_id) {
+/* Public AV API.  timeout_sec is accepted for compatibility: the
+ * credentials go out as an AV_AUTH message ("account:password", as in
+ * example.py), but no device side here answers it, so nothing is awaited.
+ * The channel is reset and turned on, and belongs to the client until
+ * avClientStop. */
+int32_t avClientStart(int session_id, const char *account, const char *password, unsigned int timeout_sec,
+                      unsigned int *serv_type, unsigned char channel) {
+    (void)timeout_sec;
+    
+    if (!account || !password || channel >= MAX_CHANNEL_NUMBER) {
+        return AV_ER_INVALID_ARG;
+    }
+    
+    char auth[AV_AUTH_MAX_SIZE];
+    int auth_len = snprintf(auth, sizeof(auth), "%s:%s", account, password);
+    if (auth_len < 0 || auth_len >= (int)sizeof(auth)) {
+        return AV_ER_INVALID_ARG;
+    }
+    
     pthread_mutex_lock(&g_iotc_state.global_mutex);
     
     if (!g_iotc_state.initialized) {
         pthread_mutex_unlock(&g_iotc_state.global_mutex);
-        return IOTC_ER_NOT_INITIALIZED;
+        return AV_ER_NOT_INITIALIZED;
     }
     
     session_info_t *session = find_session_by_id(session_id);
-    if (!session) {
+    if (!session || session->state != SESSION_STATE_CONNECTED) {
+        int32_t err = av_session_error(session);
         pthread_mutex_unlock(&g_iotc_state.global_mutex);
-        return IOTC_ER_INVALID_SID;
+        return err;
+    }
+    if (session->channels[channel].av) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return AV_ER_INVALID_ARG;
     }
     
-    int status = session->state;
+    int av_index = -1;
+    for (int i = 0; i < AV_MAX_CLIENT_NUMBER; i++) {
+        if (!g_av.clients[i].in_use) {
+            av_index = i;
+            break;
+        }
+    }
+    if (av_index < 0) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return AV_ER_EXCEED_MAX_CHANNEL;
+    }
+    
+    av_client_t *av = &g_av.clients[av_index];
+    memset(av, 0, sizeof(*av));
+    av->in_use = 1;
+    av->session_id = session->session_id;
+    av->channel = channel;
+    
+    // Start from an empty queue so frame boundaries are counted from the first packet
+    pace_drop_channel(session, channel);
+    cleanup_channel(&session->channels[channel]);
+    init_channel(&session->channels[channel]);
+    session->channels[channel].state = CHANNEL_STATE_ON;
+    session->channels[channel].av = av;
+    IOTC_PROBE2(channel__on, session->session_id, channel);
+    
+    if (session->has_peer) {
+        session_send_packet(session, IOTC_MSG_AV_AUTH, channel, 0, auth, (size_t)auth_len);
+    }
+    if (serv_type) *serv_type = 0;
+    
     pthread_mutex_unlock(&g_iotc_state.global_mutex);
-    return status;
-}
-
-int64_t IOTC_Session_Check(int session_id) {
-    return IOTC_Get_Session_Status(session_id) == SESSION_STATE_CONNECTED ? 1 : 0;
+    return av_index;
 }
 
-int32_t IOTC_Session_Get_Channel_ON_Count(int session_id) {
+/* Returns the frame size without waiting, or AV_ER_DATA_NOREADY until a
+ * whole frame is queued.  A frame with lost packets is still returned, with
+ * IPC_FRAME_FLAG_INCOMPLETE and the count in lost_fragments; one that left
+ * nothing to return gives AV_ER_LOSED_THIS_FRAME.  A frame larger than
+ * frame_size is dropped with AV_ER_BUFPARA_MAXSIZE_INSUFF and its size in
+ * *expected_frame_size. */
+int32_t avRecvFrameData2(int av_index, char *frame, int frame_size, int *actual_frame_size,
+                         int *expected_frame_size, char *frame_info, int frame_info_size,
+                         int *actual_frame_info_size, unsigned int *frame_index) {
+    if (!frame || frame_size <= 0 || frame_info_size < 0 || (frame_info_size && !frame_info)) {
+        return AV_ER_INVALID_ARG;
+    }
+    
+    if (actual_frame_size) *actual_frame_size = 0;
+    if (expected_frame_size) *expected_frame_size = 0;
+    if (actual_frame_info_size) *actual_frame_info_size = 0;
+    
     pthread_mutex_lock(&g_iotc_state.global_mutex);
     
     if (!g_iotc_state.initialized) {
         pthread_mutex_unlock(&g_iotc_state.global_mutex);
-        return IOTC_ER_NOT_INITIALIZED;
+        return AV_ER_NOT_INITIALIZED;
     }
     
-    session_info_t *session = find_session_by_id(session_id);
-    if (!session || session->state != SESSION_STATE_CONNECTED) {
+    av_client_t *av = av_lookup(av_index);
+    if (!av) {
         pthread_mutex_unlock(&g_iotc_state.global_mutex);
-        return IOTC_ER_INVALID_SID;
+        return AV_ER_INVALID_ARG;
     }
     
-    int count = 0;
-    for (int i = 0; i < MAX_CHANNEL_NUMBER; i++) {
-        if (session->channels[i].state == CHANNEL_STATE_ON) {
-            count++;
-        }
+    // Turning the channel off or closing the session unbinds the client
+    session_info_t *session = find_session_by_id((int)av->session_id);
+    if (!session || session->state != SESSION_STATE_CONNECTED || session->channels[av->channel].av != av) {
+        int32_t err = av_session_error(session);
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return err;
+    }
+    if (!av->frames_ready) {
+        pthread_mutex_unlock(&g_iotc_state.global_mutex);
+        return AV_ER_DATA_NOREADY;
     }
     
+    av_frame_t out;
+    FRAMEINFO_t info;
+    uint32_t timestamp = 0;
+    av_take_frame(av, session, (uint8_t *)frame, (size_t)frame_size, &out, &timestamp);
+    
+    memset(&info, 0, sizeof(info));
+    info.codec_id = MEDIA_CODEC_VIDEO_H264;
+    info.flags = (out.key ? IPC_FRAME_FLAG_IFRAME : IPC_FRAME_FLAG_PBFRAME) |
+                 (out.lost || out.dropped ? IPC_FRAME_FLAG_INCOMPLETE : 0);
+    info.lost_fragments = out.lost;
+    info.timestamp = timestamp;
+    if (frame_index) *frame_index = av->frame_index;
+    av->frame_index++;
+    
     pthread_mutex_unlock(&g_iotc_state.global_mutex);
-    return count;
+    
+    size_t info_len = (size_t)frame_info_size < sizeof(info) ? (size_t)frame_info_size : sizeof(info);
+    if (info_len) memcpy(frame_info, &info, info_len);
+    if (actual_frame_info_size) *actual_frame_info_size = (int)info_len;
+    if (expected_frame_size) *expected_frame_size = (int)out.bytes;
+    
+    if (out.bytes > (size_t)frame_size) return AV_ER_BUFPARA_MAXSIZE_INSUFF;
+    if (out.bytes == 0) return AV_ER_LOSED_THIS_FRAME;
+    if (actual_frame_size) *actual_frame_size = (int)out.bytes;
+    return (int32_t)out.bytes;
 }
 
-uint32_t IOTC_Session_Get_Channel_ON_Bitmap(int session_id) {
+/* Unbinds the client and turns its channel off, dropping anything queued */
+int32_t avClientStop(int av_index) {
     pthread_mutex_lock(&g_iotc_state.global_mutex);
     
-    if (!g_iotc_state.initialized) {
-        pthread_mutex_unlock(&g_iotc_state.global_mutex);
-        return 0;
-    }
-    
-    session_info_t *session = find_session_by_id(session_id);
-    if (!session || session->state != SESSION_STATE_CONNECTED) {
+    av_client_t *av = av_lookup(av_index);
+    if (!av) {
         pthread_mutex_unlock(&g_iotc_state.global_mutex);
-        return 0;
+        return AV_ER_INVALID_ARG;
     }
     
-    uint32_t bitmap = 0;
-    for (int i = 0; i < MAX_CHANNEL_NUMBER; i++) {
-        if (session->channels[i].state == CHANNEL_STATE_ON) {
-            bitmap |= (1U << i);
-        }
+    session_info_t *session = g_iotc_state.initialized ? find_session_by_id((int)av->session_id) : NULL;
+    if (session && session->channels[av->channel].av == av) {
+        session->channels[av->channel].state = CHANNEL_STATE_OFF;
+        IOTC_PROBE2(channel__off, session->session_id, av->channel);
+        pace_drop_channel(session, av->channel);
+        cleanup_channel(&session->channels[av->channel]);
+        init_channel(&session->channels[av->channel]);
     }
+    av->in_use = 0;
     
     pthread_mutex_unlock(&g_iotc_state.global_mutex);
-    return bitmap;
+    return AV_ER_NoERROR;
 }
 
 /* Initialize mutex at startup */
 __attribute__((constructor))
 static void init_global_mutex(void) {
     pthread_mutex_init(&g_iotc_state.global_mutex, NULL);
+    pthread_mutex_init(&g_lan_discovery.control_mutex, NULL);
+    g_iotc_state.epoll_fd = -1;
+    g_iotc_state.wake_fd = -1;
+    pthread_cond_init(&g_iotc_state.listen_cond, NULL);
+    for (int i = 0; i < MAX_ENDPOINT_NUMBER; i++) {
+        g_iotc_state.endpoints[i].fd = -1;
+    }
+    g_iotc_state.lan_connect_timeout_ms = DEFAULT_LAN_CONNECT_TIMEOUT_MS;
+    g_iotc_state.idle_timeout_ms = DEFAULT_SESSION_IDLE_TIMEOUT_MS;
+    g_iotc_state.keepalive_interval_ms = DEFAULT_KEEPALIVE_INTERVAL_MS;
+    g_iotc_state.max_message_size = DEFAULT_MAX_MESSAGE_SIZE;
+    g_lan_discovery.probe_fd = -1;
+    g_lan_discovery.passive_fd = -1;
 }
 
 __attribute__((destructor))
 static void cleanup_global_mutex(void) {
     pthread_mutex_destroy(&g_iotc_state.global_mutex);
+    pthread_cond_destroy(&g_iotc_state.listen_cond);
+    pthread_mutex_destroy(&g_lan_discovery.control_mutex);
 }
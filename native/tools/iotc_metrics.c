@@ -0,0 +1,232 @@
+
+/*
+ * Reader for the shared-memory metrics file written by IOTC_Metrics_Start.
+ *
+ * Maps the file read-only, copies one consistent snapshot out under the
+ * seqlock and prints it as a summary or in the Prometheus text exposition
+ * format (for node_exporter's textfile collector or a scrape wrapper).
+ *
+ *   iotc_metrics [-p] FILE
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libIOTCAPIsT.h"
+
+#define SNAPSHOT_RETRIES 100000
+
+static const char *const g_states[] = { "free", "allocated", "connecting", "connected", "disconnected" };
+static const char *const g_modes[] = { "p2p", "relay", "lan" };
+
+static const char *state_name(uint32_t state) {
+    return state < sizeof(g_states) / sizeof(g_states[0]) ? g_states[state] : "unknown";
+}
+
+static const char *mode_name(uint32_t mode) {
+    return mode < sizeof(g_modes) / sizeof(g_modes[0]) ? g_modes[mode] : "unknown";
+}
+
+/* Copies the mapping into snapshot once no snapshot is being written */
+static int read_snapshot(const IOTCMetricsFile *file, size_t size, IOTCMetricsFile *snapshot) {
+    for (int i = 0; i < SNAPSHOT_RETRIES; i++) {
+        uint32_t begin = __atomic_load_n(&file->seq, __ATOMIC_ACQUIRE);
+        if (begin & 1) {
+            sched_yield();
+            continue;
+        }
+
+        memcpy(snapshot, file, size);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&file->seq, __ATOMIC_RELAXED) == begin) return 0;
+    }
+    return -1;
+}
+
+static void print_summary(const IOTCMetricsFile *m) {
+    const IOTCMetricsGlobal *g = &m->global;
+
+    printf("IOTC metrics, pid %u%s, snapshot %llu every %u ms\n", m->pid, m->pid ? "" : " (stopped)",
+           (unsigned long long)m->snapshots, m->interval_ms);
+    printf("sessions    %u active, %u connected, %llu opened, %llu closed\n",
+           g->sessions_active, g->sessions_connected,
+           (unsigned long long)g->sessions_opened, (unsigned long long)g->sessions_closed);
+    printf("traffic     in %llu B / %llu pkts, out %llu B / %llu pkts, %llu drops, %llu retransmits\n",
+           (unsigned long long)g->bytes_in, (unsigned long long)g->packets_in,
+           (unsigned long long)g->bytes_out, (unsigned long long)g->packets_out,
+           (unsigned long long)g->drops, (unsigned long long)g->retransmits);
+    if (g->rtt_count) {
+        printf("rtt         %llu samples, mean %.2f ms\n", (unsigned long long)g->rtt_count,
+               (double)g->rtt_sum_us / (double)g->rtt_count / 1000.0);
+    }
+
+    for (uint32_t i = 0; i < m->max_sessions; i++) {
+        const IOTCMetricsSession *s = &m->sessions[i];
+        if (s->state == 0) continue;
+        printf("\nsession %u  %s  %s  %s:%u  uid %.20s  up %.1f s\n", s->session_id, state_name(s->state),
+               mode_name(s->mode), s->remote_ip[0] ? s->remote_ip : "-", s->remote_port, s->uid,
+               (double)s->uptime_ms / 1000.0);
+        printf("  in %llu B / %llu pkts, out %llu B / %llu pkts, %llu drops, %llu retransmits\n",
+               (unsigned long long)s->bytes_in, (unsigned long long)s->packets_in,
+               (unsigned long long)s->bytes_out, (unsigned long long)s->packets_out,
+               (unsigned long long)s->drops, (unsigned long long)s->retransmits);
+        printf("  rtt %.2f ms, jitter %.2f ms, bandwidth %u B/s, channels 0x%08x, queued %llu B, pacing %llu B\n",
+               s->rtt_us / 1000.0, s->jitter_us / 1000.0, s->bandwidth_estimate, s->channels_on,
+               (unsigned long long)s->queue_bytes, (unsigned long long)s->pacing_queued);
+    }
+}
+
+static void prom_metric(const char *name, const char *type, const char *help) {
+    printf("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void prom_global(const char *name, const char *type, const char *help, unsigned long long value) {
+    prom_metric(name, type, help);
+    printf("%s %llu\n", name, value);
+}
+
+/* One metric family across all live sessions; field is a byte offset into IOTCMetricsSession */
+static void prom_sessions(const IOTCMetricsFile *m, const char *name, const char *type, const char *help,
+                          size_t field, int wide) {
+    prom_metric(name, type, help);
+    for (uint32_t i = 0; i < m->max_sessions; i++) {
+        const IOTCMetricsSession *s = &m->sessions[i];
+        if (s->state == 0) continue;
+
+        const uint8_t *base = (const uint8_t *)s + field;
+        unsigned long long value;
+        if (wide) {
+            uint64_t v;
+            memcpy(&v, base, sizeof(v));
+            value = v;
+        } else {
+            uint32_t v;
+            memcpy(&v, base, sizeof(v));
+            value = v;
+        }
+        printf("%s{sid=\"%u\",uid=\"%.20s\",state=\"%s\",mode=\"%s\",remote=\"%s:%u\"} %llu\n",
+               name, s->session_id, s->uid, state_name(s->state), mode_name(s->mode),
+               s->remote_ip, s->remote_port, value);
+    }
+}
+
+static void print_prometheus(const IOTCMetricsFile *m) {
+    static const uint32_t bounds[IOTC_METRICS_RTT_BUCKETS - 1] = IOTC_METRICS_RTT_BOUNDS_US;
+    const IOTCMetricsGlobal *g = &m->global;
+
+    prom_global("iotc_up", "gauge", "1 while the writing process is exporting", m->pid != 0);
+    prom_metric("iotc_last_update_timestamp_seconds", "gauge", "Wall clock time of the snapshot");
+    printf("iotc_last_update_timestamp_seconds %.3f\n", (double)m->updated_ms / 1000.0);
+    prom_global("iotc_sessions_active", "gauge", "Allocated sessions", g->sessions_active);
+    prom_global("iotc_sessions_connected", "gauge", "Connected sessions", g->sessions_connected);
+    prom_global("iotc_sessions_opened_total", "counter", "Sessions allocated", g->sessions_opened);
+    prom_global("iotc_sessions_closed_total", "counter", "Sessions released", g->sessions_closed);
+    prom_global("iotc_received_bytes_total", "counter", "Datagram bytes received", g->bytes_in);
+    prom_global("iotc_sent_bytes_total", "counter", "Datagram bytes sent", g->bytes_out);
+    prom_global("iotc_received_packets_total", "counter", "Datagrams received", g->packets_in);
+    prom_global("iotc_sent_packets_total", "counter", "Datagrams sent", g->packets_out);
+    prom_global("iotc_drops_total", "counter", "Messages and datagrams dropped", g->drops);
+    prom_global("iotc_retransmits_total", "counter", "RDT segments sent again", g->retransmits);
+
+    prom_metric("iotc_rtt_seconds", "histogram", "Round-trip time samples from echoed timestamps");
+    unsigned long long cumulative = 0;
+    for (int i = 0; i < IOTC_METRICS_RTT_BUCKETS - 1; i++) {
+        cumulative += g->rtt_buckets[i];
+        printf("iotc_rtt_seconds_bucket{le=\"%g\"} %llu\n", bounds[i] / 1e6, cumulative);
+    }
+    printf("iotc_rtt_seconds_bucket{le=\"+Inf\"} %llu\n", (unsigned long long)g->rtt_count);
+    printf("iotc_rtt_seconds_sum %.6f\n", (double)g->rtt_sum_us / 1e6);
+    printf("iotc_rtt_seconds_count %llu\n", (unsigned long long)g->rtt_count);
+
+    prom_sessions(m, "iotc_session_uptime_milliseconds", "gauge", "Time since the session connected",
+                  offsetof(IOTCMetricsSession, uptime_ms), 1);
+    prom_sessions(m, "iotc_session_received_bytes_total", "counter", "Datagram bytes received",
+                  offsetof(IOTCMetricsSession, bytes_in), 1);
+    prom_sessions(m, "iotc_session_sent_bytes_total", "counter", "Datagram bytes sent",
+                  offsetof(IOTCMetricsSession, bytes_out), 1);
+    prom_sessions(m, "iotc_session_received_packets_total", "counter", "Datagrams received",
+                  offsetof(IOTCMetricsSession, packets_in), 1);
+    prom_sessions(m, "iotc_session_sent_packets_total", "counter", "Datagrams sent",
+                  offsetof(IOTCMetricsSession, packets_out), 1);
+    prom_sessions(m, "iotc_session_drops_total", "counter", "Messages and datagrams dropped",
+                  offsetof(IOTCMetricsSession, drops), 1);
+    prom_sessions(m, "iotc_session_retransmits_total", "counter", "RDT segments sent again",
+                  offsetof(IOTCMetricsSession, retransmits), 1);
+    prom_sessions(m, "iotc_session_receive_queue_bytes", "gauge", "Received bytes not yet read",
+                  offsetof(IOTCMetricsSession, queue_bytes), 1);
+    prom_sessions(m, "iotc_session_pacing_queue_bytes", "gauge", "Bytes waiting for the pacing buckets",
+                  offsetof(IOTCMetricsSession, pacing_queued), 1);
+    prom_sessions(m, "iotc_session_rtt_microseconds", "gauge", "Smoothed round-trip time",
+                  offsetof(IOTCMetricsSession, rtt_us), 0);
+    prom_sessions(m, "iotc_session_jitter_microseconds", "gauge", "RFC 3550 interarrival jitter",
+                  offsetof(IOTCMetricsSession, jitter_us), 0);
+    prom_sessions(m, "iotc_session_bandwidth_estimate_bytes", "gauge", "Available bandwidth per second",
+                  offsetof(IOTCMetricsSession, bandwidth_estimate), 0);
+}
+
+static int usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-p] FILE\n  -p  Prometheus text format\n", argv0);
+    return 2;
+}
+
+int main(int argc, char **argv) {
+    int prometheus = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p")) != -1) {
+        if (opt != 'p') return usage(argv[0]);
+        prometheus = 1;
+    }
+    if (optind != argc - 1) return usage(argv[0]);
+
+    int fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    size_t size = (size_t)st.st_size;
+    if (size < sizeof(IOTCMetricsFile)) {
+        fprintf(stderr, "%s: not an IOTC metrics file\n", argv[optind]);
+        return 1;
+    }
+
+    const IOTCMetricsFile *file = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    if (file->magic != IOTC_METRICS_MAGIC || file->version != IOTC_METRICS_VERSION || file->size > size) {
+        fprintf(stderr, "%s: not an IOTC metrics file, or another version\n", argv[optind]);
+        return 1;
+    }
+
+    IOTCMetricsFile *snapshot = malloc(size);
+    size_t copy = file->size;
+    if (!snapshot || read_snapshot(file, copy, snapshot) < 0 ||
+        sizeof(IOTCMetricsFile) + (size_t)snapshot->max_sessions * sizeof(IOTCMetricsSession) > copy) {
+        fprintf(stderr, "%s: no consistent snapshot\n", argv[optind]);
+        return 1;
+    }
+    munmap((void *)file, size);
+
+    if (prometheus) {
+        print_prometheus(snapshot);
+    } else {
+        print_summary(snapshot);
+    }
+    free(snapshot);
+    return 0;
+}
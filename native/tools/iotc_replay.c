@@ -0,0 +1,546 @@
+/*
+ * Replays recorded printer traffic through the library's receive path.
+ *
+ * Loads a pcap or pcapng capture (IOTC_Session_Capture_Start files, or
+ * Ethernet, Linux cooked or raw IP captures of the UDP traffic), opens a
+ * session pair on the simulated network with the virtual clock, and hands
+ * every inbound datagram straight to the client session with
+ * IOTC_NetSim_Inject, as fast as the library takes them: no sockets, no
+ * recorded timing.  The header SID is rewritten to the replay session's and
+ * CLOSE datagrams are left out so the session survives every pass.
+ *
+ * Reports messages and bytes per second and the time per datagram in each
+ * stage: header decode, queueing of single-datagram messages, fragment and
+ * parity reassembly, control messages and the reads that drain the queues.
+ *
+ *   iotc_replay [-n PASSES] [-s PORT] [-a] FILE
+ *
+ * -s keeps only UDP datagrams from source port PORT (IP captures); -a keeps
+ * outbound datagrams too when the capture records direction.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "libIOTCAPIsT.h"
+
+#define REPLAY_UID         "IOTC_REPLAY_DEVICE01"
+#define REPLAY_PORT        47260
+#define MAX_DATAGRAM       65507
+#define DRAIN_INTERVAL     16           /* Injected datagrams between queue drains */
+#define RECV_BATCH         32           /* The I/O thread's recvmmsg batch */
+#define READ_BUFFER        (4 * 1024 * 1024)   /* The library's default maximum message size */
+
+/* Wire format, see PROTOCOL.md */
+#define WIRE_MAGIC         0xF1
+#define WIRE_TYPE(flag)    (((flag) >> 8) & 0xffff)
+#define WIRE_CHANNEL(flag) ((flag) & 0xff)
+#define MSG_CLOSE          0x0302
+#define MSG_DATA           0x0300
+#define MSG_DATA_FRAG      0x0303
+#define MSG_DATA_FEC       0x0304
+#define MAX_CHANNELS       32
+
+#define LINKTYPE_ETHERNET  1
+#define LINKTYPE_RAW       101
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_IOTC      147          /* LINKTYPE_USER0, as written by the capture */
+#define LINKTYPE_SLL2      276
+
+enum { STAGE_DECODE, STAGE_QUEUE, STAGE_REASSEMBLY, STAGE_CONTROL, STAGE_READ, STAGE_COUNT };
+
+static const char *const g_stage_names[STAGE_COUNT] = {
+    "decode", "queue", "reassembly", "control", "read"
+};
+
+typedef struct {
+    uint32_t offset;                    /* into the datagram arena */
+    uint32_t len;
+    uint8_t stage;                      /* STAGE_QUEUE, STAGE_REASSEMBLY or STAGE_CONTROL */
+} datagram_t;
+
+typedef struct {
+    uint8_t *arena;
+    size_t arena_len, arena_cap;
+    datagram_t *datagrams;
+    size_t count, cap;
+
+    uint16_t source_port;               /* 0: any */
+    int all_directions;
+
+    uint64_t skipped_direction;
+    uint64_t skipped_port;
+    uint64_t skipped_other;             /* Not UDP over IPv4, IP fragments, truncated */
+    uint64_t skipped_close;
+    uint64_t foreign;                   /* Injected, but not in the session format */
+    uint32_t channels;                  /* Bit per media channel seen */
+} capture_t;
+
+typedef struct {
+    uint64_t ns;
+    uint64_t count;
+} stage_t;
+
+static int64_t g_device_sid;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-n PASSES] [-s PORT] [-a] FILE\n", argv0);
+    return 2;
+}
+
+static uint16_t rd16(const uint8_t *p, int swap) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return swap ? __builtin_bswap16(v) : v;
+}
+
+static uint32_t rd32(const uint8_t *p, int swap) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return swap ? __builtin_bswap32(v) : v;
+}
+
+static uint16_t rd16be(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static int capture_append(capture_t *cap, const uint8_t *data, uint32_t len) {
+    if (cap->count == cap->cap) {
+        size_t cap_new = cap->cap ? cap->cap * 2 : 1024;
+        datagram_t *datagrams = realloc(cap->datagrams, cap_new * sizeof(*datagrams));
+        if (!datagrams) return -1;
+        cap->datagrams = datagrams;
+        cap->cap = cap_new;
+    }
+    if (cap->arena_len + len > cap->arena_cap) {
+        size_t cap_new = cap->arena_cap ? cap->arena_cap * 2 : 1 << 20;
+        while (cap_new < cap->arena_len + len) cap_new *= 2;
+        uint8_t *arena = realloc(cap->arena, cap_new);
+        if (!arena) return -1;
+        cap->arena = arena;
+        cap->arena_cap = cap_new;
+    }
+
+    datagram_t *d = &cap->datagrams[cap->count++];
+    d->offset = (uint32_t)cap->arena_len;
+    d->len = len;
+    d->stage = STAGE_CONTROL;
+    memcpy(cap->arena + cap->arena_len, data, len);
+    cap->arena_len += len;
+
+    // Media types decide the stage the inject is timed under
+    if (len >= sizeof(IOTCHeader)) {
+        IOTCHeader hdr;
+        memcpy(&hdr, data, sizeof(hdr));
+        IOTC_Header_ntoh(&hdr);
+        if ((hdr.flag >> 24) == WIRE_MAGIC && hdr.payload <= len - sizeof(hdr)) {
+            unsigned int type = WIRE_TYPE(hdr.flag);
+            unsigned int channel = WIRE_CHANNEL(hdr.flag);
+            if (type == MSG_CLOSE) {
+                cap->count--;
+                cap->arena_len -= len;
+                cap->skipped_close++;
+                return 0;
+            }
+            if (type == MSG_DATA || type == MSG_DATA_FRAG || type == MSG_DATA_FEC) {
+                d->stage = type == MSG_DATA ? STAGE_QUEUE : STAGE_REASSEMBLY;
+                if (channel < MAX_CHANNELS) cap->channels |= 1u << channel;
+            }
+            return 0;
+        }
+    }
+    cap->foreign++;
+    return 0;
+}
+
+/* Strips the link, IPv4 and UDP headers; the UDP payload is the datagram */
+static int capture_add_frame(capture_t *cap, uint32_t linktype, const uint8_t *p, uint32_t len) {
+    if (linktype == LINKTYPE_IOTC) {
+        return len <= MAX_DATAGRAM ? capture_append(cap, p, len) : 0;
+    }
+
+    uint16_t ethertype;
+    uint32_t link_len;
+    switch (linktype) {
+    case LINKTYPE_ETHERNET:
+        if (len < 14) goto skip;
+        ethertype = rd16be(p + 12);
+        link_len = 14;
+        if (ethertype == 0x8100 && len >= 18) {
+            ethertype = rd16be(p + 16);
+            link_len = 18;
+        }
+        break;
+    case LINKTYPE_LINUX_SLL:
+        if (len < 16) goto skip;
+        ethertype = rd16be(p + 14);
+        link_len = 16;
+        break;
+    case LINKTYPE_SLL2:
+        if (len < 20) goto skip;
+        ethertype = rd16be(p);
+        link_len = 20;
+        break;
+    case LINKTYPE_RAW:
+        ethertype = 0x0800;
+        link_len = 0;
+        break;
+    default:
+        goto skip;
+    }
+    if (ethertype != 0x0800) goto skip;
+    p += link_len;
+    len -= link_len;
+
+    // IPv4, first fragment only and without more to come
+    if (len < 20 || (p[0] >> 4) != 4 || p[9] != 17) goto skip;
+    uint32_t ihl = (uint32_t)(p[0] & 0x0f) * 4;
+    uint32_t total = rd16be(p + 2);
+    if (ihl < 20 || total < ihl + 8 || total > len || (rd16be(p + 6) & 0x3fff)) goto skip;
+    const uint8_t *udp = p + ihl;
+    uint32_t udp_len = rd16be(udp + 4);
+    if (udp_len < 8 || udp_len > total - ihl) goto skip;
+
+    if (cap->source_port && rd16be(udp) != cap->source_port) {
+        cap->skipped_port++;
+        return 0;
+    }
+    return capture_append(cap, udp + 8, udp_len - 8);
+
+skip:
+    cap->skipped_other++;
+    return 0;
+}
+
+static int load_pcap(capture_t *cap, const uint8_t *data, size_t size) {
+    uint32_t magic = rd32(data, 0);
+    int swap = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+    uint32_t linktype = rd32(data + 20, swap) & 0x0fffffff;
+    size_t off = 24;
+
+    while (off + 16 <= size) {
+        uint32_t caplen = rd32(data + off + 8, swap);
+        off += 16;
+        if (caplen > size - off) break;
+        if (capture_add_frame(cap, linktype, data + off, caplen) < 0) return -1;
+        off += caplen;
+    }
+    return 0;
+}
+
+static int load_pcapng(capture_t *cap, const uint8_t *data, size_t size) {
+    uint32_t linktypes[64];
+    unsigned int interfaces = 0;
+    int swap = 0;
+    size_t off = 0;
+
+    while (off + 12 <= size) {
+        uint32_t type = rd32(data + off, swap);
+        if (type == 0x0A0D0D0A) {
+            // The byte-order magic decides how this section is read
+            swap = rd32(data + off + 8, 0) == 0x4D3C2B1A;
+            interfaces = 0;
+        }
+        uint32_t block_len = rd32(data + off + 4, swap);
+        if (block_len < 12 || block_len % 4 || block_len > size - off) {
+            fprintf(stderr, "truncated pcapng block at offset %zu\n", off);
+            return 0;
+        }
+        const uint8_t *block = data + off;
+        off += block_len;
+
+        if (type == 1) {
+            if (interfaces < sizeof(linktypes) / sizeof(linktypes[0]) && block_len >= 20) {
+                linktypes[interfaces] = rd16(block + 8, swap);
+            }
+            interfaces++;
+        } else if (type == 6 && block_len >= 32) {
+            uint32_t iface = rd32(block + 8, swap);
+            uint32_t caplen = rd32(block + 20, swap);
+            if (caplen > block_len - 32 || iface >= interfaces || iface >= 64) {
+                cap->skipped_other++;
+                continue;
+            }
+
+            // epb_flags bits 0-1: 1 inbound, 2 outbound
+            uint32_t direction = 0;
+            const uint8_t *opt = block + 28 + ((caplen + 3) & ~3u);
+            const uint8_t *end = block + block_len - 4;
+            while (opt + 4 <= end) {
+                uint16_t code = rd16(opt, swap);
+                uint16_t opt_len = rd16(opt + 2, swap);
+                if (code == 0 || opt + 4 + opt_len > end) break;
+                if (code == 2 && opt_len == 4) direction = rd32(opt + 4, swap) & 3;
+                opt += 4 + ((opt_len + 3) & ~3u);
+            }
+            if (direction == 2 && !cap->all_directions) {
+                cap->skipped_direction++;
+                continue;
+            }
+            if (capture_add_frame(cap, linktypes[iface], block + 28, caplen) < 0) return -1;
+        } else if (type == 3 && block_len >= 16 && interfaces) {
+            uint32_t orig_len = rd32(block + 8, swap);
+            uint32_t caplen = orig_len < block_len - 16 ? orig_len : block_len - 16;
+            if (capture_add_frame(cap, linktypes[0], block + 12, caplen) < 0) return -1;
+        }
+    }
+    return 0;
+}
+
+static int load_capture(capture_t *cap, const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    uint8_t *data = NULL;
+    size_t size = 0, cap_bytes = 0, got;
+    do {
+        if (size == cap_bytes) {
+            cap_bytes = cap_bytes ? cap_bytes * 2 : 1 << 20;
+            uint8_t *grown = realloc(data, cap_bytes);
+            if (!grown) {
+                free(data);
+                fclose(f);
+                fprintf(stderr, "%s: out of memory\n", path);
+                return -1;
+            }
+            data = grown;
+        }
+        got = fread(data + size, 1, cap_bytes - size, f);
+        size += got;
+    } while (got > 0);
+    fclose(f);
+
+    uint32_t magic = size >= 24 ? rd32(data, 0) : 0;
+    if (magic != 0x0A0D0D0A && magic != 0xa1b2c3d4 && magic != 0xa1b23c4d &&
+        magic != 0xd4c3b2a1 && magic != 0x4d3cb2a1) {
+        fprintf(stderr, "%s: not a pcap or pcapng file\n", path);
+        free(data);
+        return -1;
+    }
+
+    int ret = magic == 0x0A0D0D0A ? load_pcapng(cap, data, size) : load_pcap(cap, data, size);
+    free(data);
+    if (ret < 0) fprintf(stderr, "%s: out of memory\n", path);
+    return ret;
+}
+
+static void *listen_main(void *arg) {
+    (void)arg;
+    g_device_sid = IOTC_Listen(REPLAY_UID, REPLAY_PORT, 0);
+    return NULL;
+}
+
+/* Session pair on the simulated network; returns the client session */
+static int64_t open_session(const capture_t *cap) {
+    IOTCNetSimConfig config;
+    memset(&config, 0, sizeof(config));
+    config.virtual_clock = 1;
+
+    if (IOTC_Set_Network_Simulator(&config) < 0 || IOTC_Initialize() < 0) {
+        fprintf(stderr, "IOTC_Initialize failed\n");
+        return -1;
+    }
+
+    pthread_t listen_thread;
+    pthread_create(&listen_thread, NULL, listen_main, NULL);
+    usleep(20000);
+    int64_t sid = IOTC_Connect(REPLAY_UID, "127.0.0.1", REPLAY_PORT);
+    pthread_join(listen_thread, NULL);
+    if (sid < 0 || g_device_sid < 0) {
+        fprintf(stderr, "connect failed: client %lld device %lld\n", (long long)sid, (long long)g_device_sid);
+        return -1;
+    }
+
+    for (unsigned int channel = 0; channel < MAX_CHANNELS; channel++) {
+        if (cap->channels & (1u << channel)) IOTC_Session_Channel_ON((int)sid, (unsigned char)channel);
+    }
+    return sid;
+}
+
+/* Points every session datagram at sid */
+static void capture_rewrite_sid(capture_t *cap, int64_t sid) {
+    uint32_t wire_sid = htonl((uint32_t)sid);
+
+    for (size_t i = 0; i < cap->count; i++) {
+        uint8_t *p = cap->arena + cap->datagrams[i].offset;
+        if (cap->datagrams[i].len >= sizeof(IOTCHeader) && p[0] == WIRE_MAGIC) {
+            memcpy(p + offsetof(IOTCHeader, sid), &wire_sid, sizeof(wire_sid));
+        }
+    }
+}
+
+/* Cost of a back-to-back clock read, taken off every timed call */
+static uint64_t timer_overhead(void) {
+    uint64_t best = UINT64_MAX;
+    for (int i = 0; i < 1000; i++) {
+        uint64_t start = now_ns();
+        uint64_t ns = now_ns() - start;
+        if (ns < best) best = ns;
+    }
+    return best;
+}
+
+/* Reads every queued message off the media channels */
+static uint64_t drain(int64_t sid, uint32_t channels, uint8_t *buf, stage_t *read, uint64_t overhead) {
+    uint64_t messages = 0;
+
+    for (unsigned int channel = 0; channel < MAX_CHANNELS; channel++) {
+        if (!(channels & (1u << channel))) continue;
+        for (;;) {
+            uint64_t start = now_ns();
+            int64_t got = IOTC_Session_Read_Check_Lost_Data_And_Datatype((int)sid, buf, READ_BUFFER, 0,
+                                                                         NULL, NULL, (unsigned char)channel, 0);
+            uint64_t ns = now_ns() - start;
+            if (got <= 0) break;
+            read->ns += ns > overhead ? ns - overhead : 0;
+            read->count++;
+            messages++;
+        }
+    }
+    return messages;
+}
+
+static double per(uint64_t ns, uint64_t count) {
+    return count ? (double)ns / (double)count : 0.0;
+}
+
+int main(int argc, char **argv) {
+    capture_t cap;
+    unsigned int passes = 10;
+    int opt;
+
+    memset(&cap, 0, sizeof(cap));
+    while ((opt = getopt(argc, argv, "n:s:a")) != -1) {
+        switch (opt) {
+        case 'n':
+            passes = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            cap.source_port = (uint16_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'a':
+            cap.all_directions = 1;
+            break;
+        default:
+            return usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || passes == 0) return usage(argv[0]);
+
+    const char *path = argv[optind];
+    if (load_capture(&cap, path) < 0) return 1;
+    if (cap.count == 0) {
+        fprintf(stderr, "%s: no datagrams to replay\n", path);
+        return 1;
+    }
+
+    int64_t sid = open_session(&cap);
+    if (sid < 0) return 1;
+    capture_rewrite_sid(&cap, sid);
+
+    uint8_t *buf = malloc(READ_BUFFER);
+    if (!buf) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    IOTCSessionInfo info_before, info_after;
+    memset(&info_before, 0, sizeof(info_before));
+    info_before.size = sizeof(info_before);
+    IOTC_Session_Get_Info((int)sid, &info_before);
+
+    stage_t stages[STAGE_COUNT];
+    memset(stages, 0, sizeof(stages));
+    uint64_t overhead = timer_overhead();
+    uint64_t messages = 0, bytes = 0, wall_ns = 0;
+
+    for (unsigned int pass = 0; pass < passes; pass++) {
+        // Header decode alone, gathered and converted a receive batch at a time like the I/O thread
+        uint64_t start = now_ns();
+        uint32_t checksum = 0;
+        for (size_t i = 0; i < cap.count; i += RECV_BATCH) {
+            IOTCHeader hdrs[RECV_BATCH];
+            unsigned int n = 0;
+            for (size_t j = i; j < cap.count && j < i + RECV_BATCH; j++) {
+                if (cap.datagrams[j].len < sizeof(IOTCHeader)) continue;
+                memcpy(&hdrs[n++], cap.arena + cap.datagrams[j].offset, sizeof(IOTCHeader));
+            }
+            IOTC_Headers_ntoh_batch(hdrs, n);
+            for (unsigned int j = 0; j < n; j++) checksum += hdrs[j].flag ^ hdrs[j].payload;
+        }
+        __asm__ volatile("" : : "r"(checksum));
+        stages[STAGE_DECODE].ns += now_ns() - start;
+        stages[STAGE_DECODE].count += cap.count;
+
+        uint64_t pass_start = now_ns();
+        for (size_t i = 0; i < cap.count; i++) {
+            const datagram_t *d = &cap.datagrams[i];
+            start = now_ns();
+            IOTC_NetSim_Inject((int)sid, cap.arena + d->offset, d->len);
+            uint64_t ns = now_ns() - start;
+            stages[d->stage].ns += ns > overhead ? ns - overhead : 0;
+            stages[d->stage].count++;
+            bytes += d->len;
+
+            if ((i + 1) % DRAIN_INTERVAL == 0) {
+                messages += drain(sid, cap.channels, buf, &stages[STAGE_READ], overhead);
+            }
+        }
+        messages += drain(sid, cap.channels, buf, &stages[STAGE_READ], overhead);
+        wall_ns += now_ns() - pass_start;
+
+        // Replies the replay provoked (acks, probe answers) leave the link
+        IOTC_NetSim_Advance(0);
+    }
+
+    memset(&info_after, 0, sizeof(info_after));
+    info_after.size = sizeof(info_after);
+    IOTC_Session_Get_Info((int)sid, &info_after);
+
+    printf("%s: %zu datagrams, %zu bytes, %u passes\n", path, cap.count, cap.arena_len, passes);
+    printf("skipped: %llu outbound, %llu other ports, %llu not UDP/IPv4, %llu CLOSE; "
+           "%llu not in the session format\n",
+           (unsigned long long)cap.skipped_direction, (unsigned long long)cap.skipped_port,
+           (unsigned long long)cap.skipped_other, (unsigned long long)cap.skipped_close,
+           (unsigned long long)cap.foreign);
+    printf("\n%-12s %12s %12s %14s\n", "stage", "calls", "ns/call", "share");
+    uint64_t total_ns = 0;
+    for (int i = 0; i < STAGE_COUNT; i++) total_ns += stages[i].ns;
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        printf("%-12s %12llu %12.1f %13.1f%%\n", g_stage_names[i], (unsigned long long)stages[i].count,
+               per(stages[i].ns, stages[i].count), total_ns ? 100.0 * (double)stages[i].ns / (double)total_ns : 0.0);
+    }
+
+    double seconds = (double)wall_ns / 1e9;
+    printf("\nmessages     %llu read, %.0f/s\n", (unsigned long long)messages,
+           seconds > 0 ? (double)messages / seconds : 0.0);
+    printf("datagrams    %.0f/s, %.1f MB/s\n", seconds > 0 ? (double)cap.count * passes / seconds : 0.0,
+           seconds > 0 ? (double)bytes / seconds / 1e6 : 0.0);
+    printf("drops        %llu\n", (unsigned long long)(info_after.drops - info_before.drops));
+
+    free(buf);
+    IOTC_Session_Close((int)sid);
+    IOTC_Session_Close((int)g_device_sid);
+    IOTC_DeInitialize();
+    free(cap.arena);
+    free(cap.datagrams);
+    return 0;
+}
@@ -0,0 +1,190 @@
+/*
+ * Zero-allocation check for the steady-state data path.
+ *
+ * Links the library in with malloc, calloc and realloc wrapped at link time
+ * (-Wl,--wrap), then streams messages over a loopback session pair: single
+ * datagrams, fragmented messages, an FEC channel and a paced channel.  Each
+ * workload runs a warm-up pass to fill the library's pools, then a measured
+ * pass during which every allocation by the library, its I/O thread or this
+ * program is counted.  Any allocation in a measured pass fails the run and
+ * prints the calling addresses; the binary is built without PIE so they can
+ * be resolved with addr2line -f -e tests/alloc_check ADDRESS.
+ *
+ *   make check-alloc
+ *   alloc_check [-n MESSAGES]
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libIOTCAPIsT.h"
+
+#define DEVICE_UID        "ALLOC_CHECK_DEVICE01"
+#define DEVICE_PORT       47250
+#define READ_TIMEOUT_MS   2000
+#define MAX_CALLERS       16
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+typedef struct {
+    void *caller;
+    size_t size;
+} alloc_site_t;
+
+static int g_armed;
+static unsigned int g_allocations;
+static alloc_site_t g_callers[MAX_CALLERS];
+
+static void note_allocation(void *caller, size_t size) {
+    if (!__atomic_load_n(&g_armed, __ATOMIC_RELAXED)) return;
+
+    unsigned int n = __atomic_fetch_add(&g_allocations, 1, __ATOMIC_RELAXED);
+    if (n < MAX_CALLERS) {
+        g_callers[n].caller = caller;
+        g_callers[n].size = size;
+    }
+}
+
+void *__wrap_malloc(size_t size) {
+    note_allocation(__builtin_return_address(0), size);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    note_allocation(__builtin_return_address(0), count * size);
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    note_allocation(__builtin_return_address(0), size);
+    return __real_realloc(ptr, size);
+}
+
+typedef struct {
+    const char *name;
+    unsigned char channel;
+    unsigned int size;
+} workload_t;
+
+static const workload_t g_workloads[] = {
+    { "datagram",   1, 1000 },
+    { "fragmented", 1, 60000 },
+    { "fec",        2, 30000 },
+    { "paced",      3, 1000 },
+    { "paced_fragmented", 3, 30000 },
+};
+
+static int64_t g_client;
+static int64_t g_device;
+static uint8_t g_write_buf[64 * 1024];
+static uint8_t g_read_buf[64 * 1024];
+
+static void *listen_main(void *arg) {
+    (void)arg;
+    g_device = IOTC_Listen(DEVICE_UID, DEVICE_PORT, 10000);
+    return NULL;
+}
+
+static int pair_open(void) {
+    pthread_t listen_thread;
+
+    pthread_create(&listen_thread, NULL, listen_main, NULL);
+    usleep(20000);
+    g_client = IOTC_Connect(DEVICE_UID, "127.0.0.1", DEVICE_PORT);
+    pthread_join(listen_thread, NULL);
+    if (g_client < 0 || g_device < 0) {
+        fprintf(stderr, "connect failed: client %lld device %lld\n",
+                (long long)g_client, (long long)g_device);
+        return -1;
+    }
+
+    for (unsigned char channel = 1; channel <= 3; channel++) {
+        IOTC_Session_Channel_ON((int)g_client, channel);
+        IOTC_Session_Channel_ON((int)g_device, channel);
+    }
+    IOTC_Session_Set_Channel_FEC((int)g_client, 2, IOTC_FEC_XOR, 8, 1);
+    IOTC_Session_Channel_Set_Pacing((int)g_client, 3, 8 * 1024 * 1024, 0);
+
+    // Let path MTU discovery settle so it does not run during the measurements
+    IOTCSessionPathStats stats;
+    do {
+        usleep(10000);
+        IOTC_Session_Get_Path_Stats((int)g_client, &stats);
+    } while (stats.pmtu_probing);
+    return 0;
+}
+
+/* Writes and reads back count messages in lockstep; -1 on a failed write or read */
+static int run_messages(const workload_t *w, unsigned int count) {
+    for (unsigned int i = 0; i < count; i++) {
+        memcpy(g_write_buf, &i, sizeof(i));
+        if (IOTC_Session_Write((int)g_client, g_write_buf, w->size, w->channel) < 0) return -1;
+        int64_t got = IOTC_Session_Read_Check_Lost_Data_And_Datatype((int)g_device, g_read_buf,
+                                                                     sizeof(g_read_buf), READ_TIMEOUT_MS,
+                                                                     NULL, NULL, w->channel, 0);
+        if (got != (int64_t)w->size || memcmp(g_read_buf, &i, sizeof(i)) != 0) return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    unsigned int messages = 500;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt == 'n') {
+            messages = (unsigned int)strtoul(optarg, NULL, 10);
+        } else {
+            fprintf(stderr, "usage: %s [-n MESSAGES]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (IOTC_Initialize() < 0) {
+        fprintf(stderr, "IOTC_Initialize failed\n");
+        return 2;
+    }
+    if (pair_open() < 0) return 2;
+
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(g_workloads) / sizeof(g_workloads[0]); i++) {
+        const workload_t *w = &g_workloads[i];
+
+        if (run_messages(w, messages / 4 + 1) < 0) {
+            fprintf(stderr, "%s: warm-up transfer failed\n", w->name);
+            return 2;
+        }
+
+        __atomic_store_n(&g_allocations, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&g_armed, 1, __ATOMIC_SEQ_CST);
+        int ret = run_messages(w, messages);
+        __atomic_store_n(&g_armed, 0, __ATOMIC_SEQ_CST);
+
+        unsigned int allocations = __atomic_load_n(&g_allocations, __ATOMIC_RELAXED);
+        if (ret < 0) {
+            fprintf(stderr, "%s: transfer failed\n", w->name);
+            return 2;
+        }
+        printf("%-18s %6u x %5u bytes  %u allocations\n", w->name, messages, w->size, allocations);
+        for (unsigned int n = 0; n < allocations && n < MAX_CALLERS; n++) {
+            printf("    %zu bytes from %p\n", g_callers[n].size, g_callers[n].caller);
+        }
+        if (allocations) failed = 1;
+    }
+
+    IOTC_Session_Close((int)g_client);
+    IOTC_Session_Close((int)g_device);
+    IOTC_DeInitialize();
+
+    printf(failed ? "FAIL: allocations on the steady-state data path\n"
+                  : "PASS: no allocations after warm-up\n");
+    return failed;
+}
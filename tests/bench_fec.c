@@ -0,0 +1,164 @@
+
+/*
+ * FEC recovery and CPU cost benchmark.
+ *
+ * Streams video-sized frames on one channel with FEC off, XOR and
+ * Reed-Solomon groups while the relay drops client-to-device datagrams, and
+ * counts the frames that arrive intact.  CPU time covers both ends of the
+ * session.
+ *
+ *   make bench-fec
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libIOTCAPIsT.h"
+#include "bench_relay.h"
+
+#define DEVICE_UID        "BENCH_FEC_DEVICE_001"
+#define DEVICE_PORT       47220
+#define RELAY_PORT        47221
+#define FRAME_COUNT       200
+#define FRAME_SIZE        (128 * 1024)
+#define FRAME_INTERVAL_US 10000      /* about 100 Mbit/s */
+#define VIDEO_CHANNEL     1
+
+static void fill_frame(uint8_t *frame, int number) {
+    for (int i = 0; i < FRAME_SIZE; i++) {
+        frame[i] = (uint8_t)(i * 31 + number);
+    }
+}
+
+/* Device side: count frames that arrive complete and unmodified */
+typedef struct {
+    int64_t sid;
+    int intact;
+    int corrupt;
+} device_args_t;
+
+static void *device_main(void *arg) {
+    device_args_t *args = arg;
+    static uint8_t buf[FRAME_SIZE], expected[FRAME_SIZE];
+
+    for (;;) {
+        unsigned char lost, datatype;
+        int64_t ret = IOTC_Session_Read_Check_Lost_Data_And_Datatype(
+            (int)args->sid, buf, sizeof(buf), 300, &lost, &datatype, VIDEO_CHANNEL, 0);
+        if (ret < 0) break;
+
+        // Frames carry their number in the first byte pattern
+        fill_frame(expected, buf[0]);
+        if (ret == FRAME_SIZE && memcmp(buf, expected, FRAME_SIZE) == 0) {
+            args->intact++;
+        } else {
+            args->corrupt++;
+        }
+    }
+    return NULL;
+}
+
+typedef struct {
+    const char *name;
+    int mode;
+    unsigned int data;
+    unsigned int parity;
+} fec_config_t;
+
+static double cpu_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int run(bench_relay_t *relay, int64_t client_sid, int64_t device_sid, const fec_config_t *config, double loss) {
+    static uint8_t frame[FRAME_SIZE];
+    IOTCSessionPathStats tx_before, tx_after, rx_before, rx_after;
+
+    if (IOTC_Session_Set_Channel_FEC((int)client_sid, VIDEO_CHANNEL, config->mode,
+                                     config->data, config->parity) != 0) {
+        fprintf(stderr, "FEC setup failed for %s\n", config->name);
+        return -1;
+    }
+    IOTC_Session_Get_Path_Stats((int)client_sid, &tx_before);
+    IOTC_Session_Get_Path_Stats((int)device_sid, &rx_before);
+
+    device_args_t device = { .sid = device_sid, .intact = 0, .corrupt = 0 };
+    pthread_t device_thread;
+    pthread_create(&device_thread, NULL, device_main, &device);
+
+    // Only the video direction is lossy
+    relay->loss[BENCH_UPLINK] = loss;
+    double cpu_start = cpu_seconds();
+    for (int i = 0; i < FRAME_COUNT; i++) {
+        fill_frame(frame, i);
+        if (IOTC_Session_Write((int)client_sid, frame, FRAME_SIZE, VIDEO_CHANNEL) != FRAME_SIZE) {
+            fprintf(stderr, "write failed\n");
+            return -1;
+        }
+        // A steady stream keeps losses down to the relay's own drops
+        usleep(FRAME_INTERVAL_US);
+    }
+    pthread_join(device_thread, NULL);
+    double cpu = cpu_seconds() - cpu_start;
+    relay->loss[BENCH_UPLINK] = 0.0;
+
+    IOTC_Session_Get_Path_Stats((int)client_sid, &tx_after);
+    IOTC_Session_Get_Path_Stats((int)device_sid, &rx_after);
+    uint64_t fragments = tx_after.fragments_sent - tx_before.fragments_sent;
+    uint64_t parity = tx_after.parity_sent - tx_before.parity_sent;
+
+    printf("%-10s loss %4.1f%%  frames %5.1f%% intact  recovered %6llu  overhead %5.1f%%  cpu %6.2f ms/MB%s\n",
+           config->name, loss * 100.0, 100.0 * device.intact / FRAME_COUNT,
+           (unsigned long long)(rx_after.fragments_recovered - rx_before.fragments_recovered),
+           fragments ? 100.0 * (double)parity / (double)fragments : 0.0,
+           1000.0 * cpu / ((double)FRAME_COUNT * FRAME_SIZE / (1024 * 1024)),
+           device.corrupt ? "  CORRUPT" : "");
+    return device.corrupt ? -1 : 0;
+}
+
+int main(void) {
+    static const double losses[] = { 0.0, 0.01, 0.05, 0.10 };
+    static const fec_config_t configs[] = {
+        { "off", IOTC_FEC_OFF, 0, 0 },
+        { "xor 8+1", IOTC_FEC_XOR, 8, 1 },
+        { "rs 8+2", IOTC_FEC_RS, 8, 2 },
+        { "rs 8+4", IOTC_FEC_RS, 8, 4 },
+    };
+
+    static bench_relay_t relay;
+    if (bench_relay_start(&relay, RELAY_PORT, DEVICE_PORT) != 0) return 1;
+
+    IOTC_Initialize();
+
+    int64_t client_sid, device_sid;
+    if (bench_relay_connect(&relay, DEVICE_UID, &client_sid, &device_sid) != 0) return 1;
+    IOTC_Session_Channel_ON((int)client_sid, VIDEO_CHANNEL);
+    IOTC_Session_Channel_ON((int)device_sid, VIDEO_CHANNEL);
+
+    // Let path MTU discovery settle before the relay starts dropping
+    IOTCSessionPathStats stats;
+    bench_wait_pmtu(client_sid, &stats);
+
+    printf("FEC benchmark: %d x %d KB frames, %u-byte datagrams\n", FRAME_COUNT, FRAME_SIZE / 1024, stats.pmtu);
+
+    int failed = 0;
+    for (size_t l = 0; l < sizeof(losses) / sizeof(losses[0]); l++) {
+        for (size_t c = 0; c < sizeof(configs) / sizeof(configs[0]); c++) {
+            if (run(&relay, client_sid, device_sid, &configs[c], losses[l]) != 0) failed = 1;
+        }
+    }
+
+    IOTC_Session_Close((int)client_sid);
+    IOTC_Session_Close((int)device_sid);
+    bench_relay_stop(&relay);
+    IOTC_DeInitialize();
+    return failed;
+}
@@ -0,0 +1,457 @@
+
+/*
+ * Microbenchmarks for the public API hot paths.
+ *
+ * Each benchmark repeats an operation until it has run for the minimum
+ * time, three times over, and reports the median run: wall time per
+ * operation as seen by one thread, process CPU time per operation (I/O
+ * thread included) and total operations per second.  Covered are the
+ * header conversion helpers, one at a time and batched, session lookup as
+ * max_sessions grows, IOTC_Session_Write and the channel queue on a
+ * loopback session pair, and the global lock under 1 to 8 contending
+ * threads.
+ *
+ * Results go to stdout as a table and, with -o, to a JSON file in the
+ * Google Benchmark layout so its compare.py can diff two runs.
+ *
+ *   make bench
+ *   bench_micro [-o FILE] [-f FILTER] [-t MIN_TIME_MS]
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "libIOTCAPIsT.h"
+
+#define DEVICE_UID        "BENCH_MICRO_DEVICE01"
+#define DEVICE_PORT       47240
+#define BENCH_CHANNEL     1
+#define REPETITIONS       3
+#define MAX_THREADS       8
+#define MAX_RESULTS       64
+
+typedef struct {
+    char name[64];
+    int threads;
+    uint64_t iterations;                /* per thread */
+    double real_ns;                     /* wall time per operation, one thread's view */
+    double cpu_ns;                      /* process CPU time per operation, all threads */
+    double items_per_second;            /* all threads */
+} bench_result_t;
+
+typedef void (*bench_fn)(void *arg, uint64_t iterations);
+
+static unsigned int g_min_time_ms = 200;
+static const char *g_filter;
+static bench_result_t g_results[MAX_RESULTS];
+static int g_result_count;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t cpu_ns(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ((uint64_t)ru.ru_utime.tv_sec + (uint64_t)ru.ru_stime.tv_sec) * 1000000000ULL +
+           ((uint64_t)ru.ru_utime.tv_usec + (uint64_t)ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+/* Threads start together on a barrier and each run the same iteration count */
+typedef struct {
+    bench_fn fn;
+    void *arg;
+    uint64_t iterations;
+    pthread_barrier_t *start;
+} bench_thread_t;
+
+static void *bench_thread_main(void *arg) {
+    bench_thread_t *t = arg;
+    pthread_barrier_wait(t->start);
+    t->fn(t->arg, t->iterations);
+    return NULL;
+}
+
+static void bench_once(bench_fn fn, void *const *args, int threads, uint64_t iterations,
+                       uint64_t *wall, uint64_t *cpu) {
+    pthread_t tids[MAX_THREADS];
+    bench_thread_t ctx[MAX_THREADS];
+    pthread_barrier_t start;
+
+    pthread_barrier_init(&start, NULL, (unsigned int)threads + 1);
+    for (int i = 0; i < threads; i++) {
+        ctx[i] = (bench_thread_t){ .fn = fn, .arg = args[i], .iterations = iterations, .start = &start };
+        pthread_create(&tids[i], NULL, bench_thread_main, &ctx[i]);
+    }
+    uint64_t cpu_start = cpu_ns();
+    uint64_t wall_start = now_ns();
+    pthread_barrier_wait(&start);
+    for (int i = 0; i < threads; i++) pthread_join(tids[i], NULL);
+    *wall = now_ns() - wall_start;
+    *cpu = cpu_ns() - cpu_start;
+    pthread_barrier_destroy(&start);
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Runs fn on threads threads, thread i getting args[i] */
+static void bench_run(const char *name, bench_fn fn, void *const *args, int threads) {
+    if (g_filter && !strstr(name, g_filter)) return;
+    if (g_result_count == MAX_RESULTS) return;
+
+    // Grow the iteration count until a run takes a tenth of the minimum time
+    uint64_t iterations = 1, wall, cpu;
+    uint64_t target = (uint64_t)g_min_time_ms * 1000000ULL;
+    for (;;) {
+        bench_once(fn, args, threads, iterations, &wall, &cpu);
+        if (wall >= target / 10 || iterations >= (1ULL << 30)) break;
+        iterations *= wall < target / 100 ? 10 : 2;
+    }
+    if (wall < target) iterations = iterations * target / (wall ? wall : 1) + 1;
+
+    double real[REPETITIONS], cpus[REPETITIONS];
+    for (int r = 0; r < REPETITIONS; r++) {
+        bench_once(fn, args, threads, iterations, &wall, &cpu);
+        real[r] = (double)wall / (double)iterations;
+        cpus[r] = (double)cpu / (double)(iterations * (uint64_t)threads);
+    }
+    qsort(real, REPETITIONS, sizeof(double), cmp_double);
+    qsort(cpus, REPETITIONS, sizeof(double), cmp_double);
+
+    bench_result_t *result = &g_results[g_result_count++];
+    snprintf(result->name, sizeof(result->name), "%s", name);
+    result->threads = threads;
+    result->iterations = iterations;
+    result->real_ns = real[REPETITIONS / 2];
+    result->cpu_ns = cpus[REPETITIONS / 2];
+    result->items_per_second = 1e9 * threads / result->real_ns;
+    printf("%-40s %3d %12llu %12.1f %12.1f %14.0f\n", result->name, threads,
+           (unsigned long long)iterations, result->real_ns, result->cpu_ns, result->items_per_second);
+    fflush(stdout);
+}
+
+static void bench_run_single(const char *name, bench_fn fn, void *arg) {
+    void *args[1] = { arg };
+    bench_run(name, fn, args, 1);
+}
+
+/* Header conversion */
+static void bench_header_ntoh(void *arg, uint64_t iterations) {
+    IOTCHeader *hdr = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        IOTC_Header_ntoh(hdr);
+        __asm__ __volatile__("" : : "r"(hdr) : "memory");
+    }
+}
+
+static void bench_header_hton(void *arg, uint64_t iterations) {
+    IOTCHeader *hdr = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        IOTC_Header_hton(hdr);
+        __asm__ __volatile__("" : : "r"(hdr) : "memory");
+    }
+}
+
+/* A batch of headers, one operation per batch: per header against the batch API */
+typedef struct {
+    IOTCHeader *hdrs;
+    unsigned int count;
+} header_batch_t;
+
+static void bench_header_loop(void *arg, uint64_t iterations) {
+    header_batch_t *batch = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        for (unsigned int n = 0; n < batch->count; n++) {
+            IOTC_Header_ntoh(&batch->hdrs[n]);
+        }
+        __asm__ __volatile__("" : : "r"(batch->hdrs) : "memory");
+    }
+}
+
+static void bench_header_batch(void *arg, uint64_t iterations) {
+    header_batch_t *batch = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        IOTC_Headers_ntoh_batch(batch->hdrs, batch->count);
+        __asm__ __volatile__("" : : "r"(batch->hdrs) : "memory");
+    }
+}
+
+static void bench_data_ntoh(void *arg, uint64_t iterations) {
+    volatile uint32_t *value = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        *value = IOTC_Data_ntoh(*value);
+    }
+}
+
+/* Session lookup: every call takes the global lock and scans the table */
+static void bench_session_status(void *arg, uint64_t iterations) {
+    int sid = (int)(intptr_t)arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        IOTC_Get_Session_Status(sid);
+    }
+}
+
+/* Session pair on loopback with a thread draining the device side */
+typedef struct {
+    int64_t client;
+    int64_t device;
+    volatile int draining;
+    pthread_t drainer;
+} session_pair_t;
+
+typedef struct {
+    int64_t sid;
+} listen_args_t;
+
+static void *listen_main(void *arg) {
+    listen_args_t *args = arg;
+    args->sid = IOTC_Listen(DEVICE_UID, DEVICE_PORT, 10000);
+    return NULL;
+}
+
+static int pair_open(session_pair_t *pair) {
+    listen_args_t listen_args = { .sid = 0 };
+    pthread_t listen_thread;
+
+    pthread_create(&listen_thread, NULL, listen_main, &listen_args);
+    usleep(20000);
+    pair->client = IOTC_Connect(DEVICE_UID, "127.0.0.1", DEVICE_PORT);
+    pthread_join(listen_thread, NULL);
+    pair->device = listen_args.sid;
+    if (pair->client < 0 || pair->device < 0) {
+        fprintf(stderr, "connect failed: client %lld device %lld\n",
+                (long long)pair->client, (long long)pair->device);
+        return -1;
+    }
+    IOTC_Session_Channel_ON((int)pair->client, BENCH_CHANNEL);
+    IOTC_Session_Channel_ON((int)pair->device, BENCH_CHANNEL);
+
+    // Let path MTU discovery settle so it does not run during the measurements
+    IOTCSessionPathStats stats;
+    do {
+        usleep(10000);
+        IOTC_Session_Get_Path_Stats((int)pair->client, &stats);
+    } while (stats.pmtu_probing);
+    return 0;
+}
+
+static void *drain_main(void *arg) {
+    session_pair_t *pair = arg;
+    static uint8_t buf[64 * 1024];
+    while (pair->draining) {
+        IOTC_Session_Read_Check_Lost_Data_And_Datatype((int)pair->device, buf, sizeof(buf), 50,
+                                                       NULL, NULL, BENCH_CHANNEL, 0);
+    }
+    return NULL;
+}
+
+static void pair_drain_start(session_pair_t *pair) {
+    pair->draining = 1;
+    pthread_create(&pair->drainer, NULL, drain_main, pair);
+}
+
+static void pair_drain_stop(session_pair_t *pair) {
+    pair->draining = 0;
+    pthread_join(pair->drainer, NULL);
+}
+
+typedef struct {
+    int sid;
+    unsigned int size;
+    uint8_t data[64 * 1024];
+} write_args_t;
+
+static void bench_session_write(void *arg, uint64_t iterations) {
+    write_args_t *w = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        IOTC_Session_Write(w->sid, w->data, w->size, BENCH_CHANNEL);
+    }
+}
+
+/* One message through the client's send path, the device's channel queue and back out */
+typedef struct {
+    session_pair_t *pair;
+    unsigned int size;
+    uint8_t data[64 * 1024];
+} queue_args_t;
+
+static void bench_write_read(void *arg, uint64_t iterations) {
+    queue_args_t *q = arg;
+    for (uint64_t i = 0; i < iterations; i++) {
+        IOTC_Session_Write((int)q->pair->client, q->data, q->size, BENCH_CHANNEL);
+        IOTC_Session_Read_Check_Lost_Data_And_Datatype((int)q->pair->device, q->data, sizeof(q->data), 1000,
+                                                       NULL, NULL, BENCH_CHANNEL, 0);
+    }
+}
+
+static void run_header_benchmarks(void) {
+    static IOTCHeader hdr = { 0xF1000101u, 7, 42, 123456, 64 };
+    static uint32_t value = 0x12345678u;
+
+    bench_run_single("header_ntoh", bench_header_ntoh, &hdr);
+    bench_run_single("header_hton", bench_header_hton, &hdr);
+
+    // 32 is a full recvmmsg batch in the I/O thread
+    static IOTCHeader hdrs[1024];
+    static const unsigned int counts[] = { 32, 1024 };
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        header_batch_t batch = { hdrs, counts[i] };
+        char name[64];
+        snprintf(name, sizeof(name), "header_ntoh_loop/%u", counts[i]);
+        bench_run_single(name, bench_header_loop, &batch);
+        snprintf(name, sizeof(name), "header_ntoh_batch/%u", counts[i]);
+        bench_run_single(name, bench_header_batch, &batch);
+    }
+    bench_run_single("data_ntoh", bench_data_ntoh, &value);
+}
+
+/* The session looked up is the last one allocated, so the scan is the longest */
+static void run_lookup_benchmarks(void) {
+    static const unsigned int sizes[] = { 16, 64, 256, 1024 };
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "session_lookup/max_sessions:%u", sizes[i]);
+        if (g_filter && !strstr(name, g_filter)) continue;
+
+        IOTC_Set_Max_Session_Number(sizes[i]);
+        IOTC_Initialize();
+        int64_t sid = -1;
+        for (unsigned int n = 0; n < sizes[i]; n++) sid = IOTC_Get_SessionID();
+        if (sid > 0) bench_run_single(name, bench_session_status, (void *)(intptr_t)sid);
+        IOTC_DeInitialize();
+    }
+    IOTC_Set_Max_Session_Number(0);
+}
+
+static void run_session_benchmarks(void) {
+    static const unsigned int write_sizes[] = { 64, 1024, 16 * 1024 };
+    static const unsigned int queue_sizes[] = { 64, 1024 };
+    static const int thread_counts[] = { 1, 2, 4, 8 };
+    static write_args_t writers[MAX_THREADS];
+    static queue_args_t queue;
+    static session_pair_t pair;
+    char name[64];
+    void *args[MAX_THREADS];
+
+    IOTC_Initialize();
+    if (pair_open(&pair) < 0) {
+        IOTC_DeInitialize();
+        return;
+    }
+
+    // Round trips first, with nothing else reading the device side
+    queue.pair = &pair;
+    for (size_t i = 0; i < sizeof(queue_sizes) / sizeof(queue_sizes[0]); i++) {
+        queue.size = queue_sizes[i];
+        snprintf(name, sizeof(name), "channel_queue/write_read/%u", queue.size);
+        bench_run_single(name, bench_write_read, &queue);
+    }
+
+    pair_drain_start(&pair);
+    for (size_t i = 0; i < sizeof(write_sizes) / sizeof(write_sizes[0]); i++) {
+        for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+            int threads = thread_counts[t];
+            for (int n = 0; n < threads; n++) {
+                writers[n].sid = (int)pair.client;
+                writers[n].size = write_sizes[i];
+                args[n] = &writers[n];
+            }
+            snprintf(name, sizeof(name), "session_write/%u/threads:%d", write_sizes[i], threads);
+            bench_run(name, bench_session_write, args, threads);
+        }
+    }
+    pair_drain_stop(&pair);
+
+    // Lookups from several threads serialise on the global lock
+    for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+        int threads = thread_counts[t];
+        for (int n = 0; n < threads; n++) args[n] = (void *)(intptr_t)pair.client;
+        snprintf(name, sizeof(name), "session_lookup/threads:%d", threads);
+        bench_run(name, bench_session_status, args, threads);
+    }
+
+    IOTC_Session_Close((int)pair.client);
+    IOTC_Session_Close((int)pair.device);
+    IOTC_DeInitialize();
+}
+
+static int write_json(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    char date[32];
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", &tm);
+    char host[64] = "";
+    gethostname(host, sizeof(host) - 1);
+    uint32_t version = 0;
+    IOTC_Get_Version(&version);
+
+    fprintf(f, "{\n  \"context\": {\n");
+    fprintf(f, "    \"date\": \"%s\",\n    \"host_name\": \"%s\",\n", date, host);
+    fprintf(f, "    \"executable\": \"bench_micro\",\n    \"num_cpus\": %ld,\n", sysconf(_SC_NPROCESSORS_ONLN));
+    fprintf(f, "    \"library_version\": \"%s\",\n", IOTC_Get_Version_String());
+    fprintf(f, "    \"library_build_type\": \"release\",\n    \"min_time_ms\": %u,\n", g_min_time_ms);
+    fprintf(f, "    \"repetitions\": %d\n  },\n  \"benchmarks\": [\n", REPETITIONS);
+    for (int i = 0; i < g_result_count; i++) {
+        const bench_result_t *r = &g_results[i];
+        fprintf(f, "    {\n      \"name\": \"%s\",\n      \"run_name\": \"%s\",\n", r->name, r->name);
+        fprintf(f, "      \"run_type\": \"iteration\",\n      \"threads\": %d,\n", r->threads);
+        fprintf(f, "      \"iterations\": %llu,\n", (unsigned long long)r->iterations);
+        fprintf(f, "      \"real_time\": %.3f,\n      \"cpu_time\": %.3f,\n", r->real_ns, r->cpu_ns);
+        fprintf(f, "      \"time_unit\": \"ns\",\n      \"items_per_second\": %.1f\n", r->items_per_second);
+        fprintf(f, "    }%s\n", i + 1 < g_result_count ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+static int usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-o FILE] [-f FILTER] [-t MIN_TIME_MS]\n"
+                    "  -o  also write JSON results to FILE\n"
+                    "  -f  only run benchmarks whose name contains FILTER\n"
+                    "  -t  minimum time per repetition (default 200 ms)\n", argv0);
+    return 2;
+}
+
+int main(int argc, char **argv) {
+    const char *json = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "o:f:t:")) != -1) {
+        switch (opt) {
+        case 'o': json = optarg; break;
+        case 'f': g_filter = optarg; break;
+        case 't': g_min_time_ms = (unsigned int)strtoul(optarg, NULL, 10); break;
+        default: return usage(argv[0]);
+        }
+    }
+    if (optind != argc || g_min_time_ms == 0) return usage(argv[0]);
+
+    printf("%-40s %3s %12s %12s %12s %14s\n", "benchmark", "thr", "iterations", "ns/op", "cpu ns/op", "ops/s");
+    run_header_benchmarks();
+    run_lookup_benchmarks();
+    run_session_benchmarks();
+
+    if (json && write_json(json) < 0) return 1;
+    return 0;
+}
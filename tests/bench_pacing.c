@@ -0,0 +1,222 @@
+
+/*
+ * Send pacing loss-versus-burst benchmark.
+ *
+ * Streams 30 fps video with a keyframe every second, unpaced and through
+ * token buckets of several rates and burst sizes, and reports loss, intact
+ * frames and keyframe latency.  The relay's uplink hook models a bottleneck:
+ * datagrams towards the device drain at a fixed rate from a drop-tail buffer,
+ * so bursts above the buffer size are lost.
+ *
+ *   make bench-pacing
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "libIOTCAPIsT.h"
+#include "bench_relay.h"
+
+#define DEVICE_UID        "BENCH_PACE_DEVICE_01"
+#define DEVICE_PORT       47230
+#define RELAY_PORT        47231
+#define LINK_RATE         (2500 * 1000)     /* bytes per second, 20 Mbit/s */
+#define LINK_BUFFER       (64 * 1024)
+#define LINK_QUEUE_MAX    4096
+#define FRAME_COUNT       150
+#define FRAME_INTERVAL_US 33333
+#define GOP               30
+#define KEYFRAME_SIZE     (128 * 1024)
+#define FRAME_SIZE        (8 * 1024)
+#define VIDEO_CHANNEL     1
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* Bottleneck link: a FIFO of datagrams released at LINK_RATE */
+typedef struct {
+    uint64_t due_ns;
+    size_t len;
+    uint8_t *data;
+} link_packet_t;
+
+typedef struct {
+    link_packet_t queue[LINK_QUEUE_MAX];
+    unsigned int head, count;
+    size_t backlog;                 /* bytes queued on the link */
+    uint64_t link_free_ns;          /* when the link finishes its current backlog */
+} link_t;
+
+/* Sends the datagrams whose time on the link is up; polls until the next one is */
+static int link_tick(bench_relay_t *relay) {
+    link_t *link = relay->ctx;
+    uint64_t now = now_ns();
+    while (link->count && link->queue[link->head].due_ns <= now) {
+        link_packet_t *packet = &link->queue[link->head];
+        sendto(relay->sock, packet->data, packet->len, 0,
+               (const struct sockaddr *)&relay->device, sizeof(relay->device));
+        link->backlog -= packet->len;
+        free(packet->data);
+        link->head = (link->head + 1) % LINK_QUEUE_MAX;
+        link->count--;
+    }
+
+    if (!link->count) return 50;
+    uint64_t due = link->queue[link->head].due_ns;
+    return due > now ? (int)((due - now) / 1000000) : 0;
+}
+
+static int link_enqueue(bench_relay_t *relay, const uint8_t *packet, size_t len) {
+    link_t *link = relay->ctx;
+
+    // Drop-tail: a datagram that does not fit the buffer is lost
+    uint64_t now = now_ns();
+    if (link->backlog + len > LINK_BUFFER || link->count == LINK_QUEUE_MAX) return 0;
+    if (link->link_free_ns < now) link->link_free_ns = now;
+    link->link_free_ns += (uint64_t)len * 1000000000ULL / LINK_RATE;
+
+    link_packet_t *slot = &link->queue[(link->head + link->count) % LINK_QUEUE_MAX];
+    slot->due_ns = link->link_free_ns;
+    slot->len = len;
+    slot->data = malloc(len);
+    memcpy(slot->data, packet, len);
+    link->count++;
+    link->backlog += len;
+    return 1;
+}
+
+/* Frames start with their number and send time */
+typedef struct {
+    uint32_t number;
+    uint64_t sent_ns;
+} frame_stamp_t;
+
+static size_t frame_size(uint32_t number) {
+    return number % GOP == 0 ? KEYFRAME_SIZE : FRAME_SIZE;
+}
+
+typedef struct {
+    int64_t sid;
+    int intact;
+    int keyframes;
+    uint64_t keyframe_ms[FRAME_COUNT / GOP + 1];
+} device_args_t;
+
+static void *device_main(void *arg) {
+    device_args_t *args = arg;
+    static uint8_t buf[KEYFRAME_SIZE];
+
+    for (;;) {
+        unsigned char lost, datatype;
+        int64_t ret = IOTC_Session_Read_Check_Lost_Data_And_Datatype(
+            (int)args->sid, buf, sizeof(buf), 500, &lost, &datatype, VIDEO_CHANNEL, 0);
+        if (ret < 0) break;
+
+        frame_stamp_t stamp;
+        memcpy(&stamp, buf, sizeof(stamp));
+        if ((size_t)ret != frame_size(stamp.number)) continue;
+
+        args->intact++;
+        if (stamp.number % GOP == 0) {
+            args->keyframe_ms[args->keyframes++] = (now_ns() - stamp.sent_ns) / 1000000;
+        }
+    }
+    return NULL;
+}
+
+typedef struct {
+    const char *name;
+    unsigned int rate;
+    unsigned int burst;
+} pace_config_t;
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void run(bench_relay_t *relay, int64_t client_sid, int64_t device_sid, const pace_config_t *config) {
+    static uint8_t frame[KEYFRAME_SIZE];
+
+    IOTC_Session_Set_Pacing((int)client_sid, config->rate, config->burst);
+    unsigned long forwarded = relay->forwarded[BENCH_UPLINK], dropped = relay->dropped[BENCH_UPLINK];
+
+    device_args_t device;
+    memset(&device, 0, sizeof(device));
+    device.sid = device_sid;
+    pthread_t device_thread;
+    pthread_create(&device_thread, NULL, device_main, &device);
+
+    for (uint32_t i = 0; i < FRAME_COUNT; i++) {
+        frame_stamp_t stamp = { .number = i, .sent_ns = now_ns() };
+        memcpy(frame, &stamp, sizeof(stamp));
+        IOTC_Session_Write((int)client_sid, frame, (unsigned int)frame_size(i), VIDEO_CHANNEL);
+        usleep(FRAME_INTERVAL_US);
+    }
+    pthread_join(device_thread, NULL);
+
+    forwarded = relay->forwarded[BENCH_UPLINK] - forwarded;
+    dropped = relay->dropped[BENCH_UPLINK] - dropped;
+    qsort(device.keyframe_ms, (size_t)device.keyframes, sizeof(uint64_t), cmp_u64);
+
+    printf("%-22s  loss %5.1f%%  frames %5.1f%% intact  keyframes %d/%d",
+           config->name, 100.0 * (double)dropped / (double)(dropped + forwarded),
+           100.0 * device.intact / FRAME_COUNT, device.keyframes, (FRAME_COUNT + GOP - 1) / GOP);
+    if (device.keyframes) {
+        printf("  keyframe latency p50 %4llu ms  max %4llu ms",
+               (unsigned long long)device.keyframe_ms[device.keyframes / 2],
+               (unsigned long long)device.keyframe_ms[device.keyframes - 1]);
+    }
+    printf("\n");
+}
+
+int main(void) {
+    static const pace_config_t configs[] = {
+        { "unpaced", 0, 0 },
+        { "2 MB/s, 16 KB burst", 2000 * 1000, 16 * 1024 },
+        { "2 MB/s, 64 KB burst", 2000 * 1000, 64 * 1024 },
+        { "2 MB/s, 256 KB burst", 2000 * 1000, 256 * 1024 },
+        { "4 MB/s, 16 KB burst", 4000 * 1000, 16 * 1024 },
+    };
+
+    static link_t link;
+    static bench_relay_t relay;
+    relay.tick = link_tick;
+    relay.uplink = link_enqueue;
+    relay.ctx = &link;
+    if (bench_relay_start(&relay, RELAY_PORT, DEVICE_PORT) != 0) return 1;
+
+    IOTC_Initialize();
+
+    int64_t client_sid, device_sid;
+    if (bench_relay_connect(&relay, DEVICE_UID, &client_sid, &device_sid) != 0) return 1;
+    IOTC_Session_Channel_ON((int)client_sid, VIDEO_CHANNEL);
+    IOTC_Session_Channel_ON((int)device_sid, VIDEO_CHANNEL);
+
+    IOTCSessionPathStats stats;
+    bench_wait_pmtu(client_sid, &stats);
+
+    printf("Pacing benchmark: %d Mbit/s link with a %d KB buffer, %d KB keyframe every %d frames, %d KB otherwise\n",
+           LINK_RATE * 8 / 1000000, LINK_BUFFER / 1024, KEYFRAME_SIZE / 1024, GOP, FRAME_SIZE / 1024);
+
+    for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); i++) {
+        run(&relay, client_sid, device_sid, &configs[i]);
+    }
+
+    IOTC_Session_Close((int)client_sid);
+    IOTC_Session_Close((int)device_sid);
+    bench_relay_stop(&relay);
+    IOTC_DeInitialize();
+    return 0;
+}
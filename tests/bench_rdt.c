@@ -0,0 +1,165 @@
+
+/*
+ * RDT throughput and latency benchmark.
+ *
+ * Measures bulk throughput and ping-pong latency over an RDT channel while
+ * the relay drops 0%, 1% and 5% of the datagrams in each direction.
+ *
+ *   make bench-rdt
+ */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libIOTCAPIsT.h"
+#include "bench_relay.h"
+
+#define DEVICE_UID        "BENCH_RDT_DEVICE_001"
+#define BULK_BYTES        (8 * 1024 * 1024)
+#define BULK_CHUNK        (64 * 1024)
+#define PING_COUNT        500
+#define PING_SIZE         64
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int read_exact(int rdt, char *buf, int size) {
+    int got = 0;
+    while (got < size) {
+        int ret = RDT_Read(rdt, buf + got, size - got, 5000);
+        if (ret < 0) return ret;
+        got += ret;
+    }
+    return got;
+}
+
+/* Device side: sink the bulk transfer, then echo pings */
+typedef struct {
+    int rdt;
+    int result;
+} device_args_t;
+
+static void *device_main(void *arg) {
+    device_args_t *args = arg;
+    static char buf[BULK_CHUNK];
+    long total = 0;
+
+    while (total < BULK_BYTES) {
+        // Never read past the bulk phase into the first ping
+        long want = BULK_BYTES - total < BULK_CHUNK ? BULK_BYTES - total : BULK_CHUNK;
+        int ret = RDT_Read(args->rdt, buf, (int)want, 5000);
+        if (ret < 0) {
+            args->result = ret;
+            return NULL;
+        }
+        total += ret;
+    }
+
+    for (int i = 0; i < PING_COUNT; i++) {
+        int ret = read_exact(args->rdt, buf, PING_SIZE);
+        if (ret < 0 || RDT_Write(args->rdt, buf, PING_SIZE) != PING_SIZE) {
+            args->result = ret < 0 ? ret : -1;
+            return NULL;
+        }
+    }
+
+    args->result = 0;
+    return NULL;
+}
+
+static int run(double loss, uint16_t device_port, uint16_t relay_port) {
+    bench_relay_t relay;
+    memset(&relay, 0, sizeof(relay));
+    relay.loss[BENCH_UPLINK] = loss;
+    relay.loss[BENCH_DOWNLINK] = loss;
+    if (bench_relay_start(&relay, relay_port, device_port) != 0) return -1;
+
+    int64_t client_sid, device_sid;
+    if (bench_relay_connect(&relay, DEVICE_UID, &client_sid, &device_sid) != 0) return -1;
+
+    pthread_t device_thread;
+    int client_rdt = RDT_Create((int)client_sid, 5000, 1);
+    device_args_t device = { .rdt = RDT_Create((int)device_sid, 5000, 1), .result = -1 };
+    assert(client_rdt >= 0 && device.rdt >= 0);
+    pthread_create(&device_thread, NULL, device_main, &device);
+
+    // Bulk throughput
+    static char chunk[BULK_CHUNK];
+    memset(chunk, 0xA5, sizeof(chunk));
+    uint64_t start = now_us();
+    for (long sent = 0; sent < BULK_BYTES; sent += BULK_CHUNK) {
+        if (RDT_Write(client_rdt, chunk, BULK_CHUNK) != BULK_CHUNK) {
+            fprintf(stderr, "bulk write failed\n");
+            return -1;
+        }
+    }
+
+    // Ping-pong latency; the first reply also marks the end of the bulk phase
+    static uint64_t rtt[PING_COUNT];
+    char ping[PING_SIZE];
+    uint64_t bulk_us = 0;
+    for (int i = 0; i < PING_COUNT; i++) {
+        uint64_t t0 = now_us();
+        memset(ping, i & 0xFF, sizeof(ping));
+        if (RDT_Write(client_rdt, ping, PING_SIZE) != PING_SIZE ||
+            read_exact(client_rdt, ping, PING_SIZE) != PING_SIZE) {
+            fprintf(stderr, "ping %d failed\n", i);
+            return -1;
+        }
+        rtt[i] = now_us() - t0;
+        if (i == 0) bulk_us = now_us() - start;
+    }
+
+    pthread_join(device_thread, NULL);
+    qsort(rtt, PING_COUNT, sizeof(rtt[0]), cmp_u64);
+
+    printf("loss %4.1f%%  throughput %8.2f MB/s  rtt p50 %7.1f us  p99 %8.1f us  max %8.1f us  dropped %lu/%lu\n",
+           loss * 100.0, (double)BULK_BYTES / (double)bulk_us,
+           (double)rtt[PING_COUNT / 2], (double)rtt[PING_COUNT * 99 / 100], (double)rtt[PING_COUNT - 1],
+           relay.dropped[BENCH_UPLINK] + relay.dropped[BENCH_DOWNLINK],
+           relay.dropped[BENCH_UPLINK] + relay.dropped[BENCH_DOWNLINK] +
+           relay.forwarded[BENCH_UPLINK] + relay.forwarded[BENCH_DOWNLINK]);
+
+    RDT_Destroy(client_rdt);
+    RDT_Destroy(device.rdt);
+    IOTC_Session_Close((int)client_sid);
+    IOTC_Session_Close((int)device_sid);
+
+    bench_relay_stop(&relay);
+    return device.result;
+}
+
+int main(void) {
+    static const double losses[] = { 0.0, 0.01, 0.05 };
+
+    IOTC_Initialize();
+    RDT_Initialize();
+
+    printf("RDT benchmark: %d MB bulk transfer, %d x %d-byte ping-pong\n",
+           BULK_BYTES / (1024 * 1024), PING_COUNT, PING_SIZE);
+
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(losses) / sizeof(losses[0]); i++) {
+        if (run(losses[i], (uint16_t)(47200 + i), (uint16_t)(47210 + i)) != 0) failed = 1;
+    }
+
+    RDT_DeInitialize();
+    IOTC_DeInitialize();
+    return failed;
+}
@@ -0,0 +1,122 @@
+/*
+ * UDP relay and session setup shared by the RDT, FEC and pacing benchmarks.
+ */
+
+#define _GNU_SOURCE
+
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "bench_relay.h"
+
+static void *relay_main(void *arg) {
+    bench_relay_t *relay = arg;
+    static uint8_t packet[65536];
+
+    while (relay->running) {
+        int timeout = relay->tick ? relay->tick(relay) : 50;
+        struct pollfd pfd = { .fd = relay->sock, .events = POLLIN };
+        if (poll(&pfd, 1, timeout) <= 0) continue;
+
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        ssize_t len = recvfrom(relay->sock, packet, sizeof(packet), 0, (struct sockaddr *)&from, &from_len);
+        if (len <= 0) continue;
+
+        int from_device = from.sin_port == relay->device.sin_port &&
+                          from.sin_addr.s_addr == relay->device.sin_addr.s_addr;
+        if (!from_device) relay->client = from;
+        if (from_device && relay->client.sin_port == 0) continue;
+
+        int dir = from_device ? BENCH_DOWNLINK : BENCH_UPLINK;
+        if (relay->loss[dir] > 0.0 && (double)rand_r(&relay->seed) / RAND_MAX < relay->loss[dir]) {
+            relay->dropped[dir]++;
+            continue;
+        }
+
+        if (dir == BENCH_UPLINK && relay->uplink) {
+            if (relay->uplink(relay, packet, (size_t)len)) {
+                relay->forwarded[dir]++;
+            } else {
+                relay->dropped[dir]++;
+            }
+            continue;
+        }
+
+        const struct sockaddr_in *to = from_device ? &relay->client : &relay->device;
+        sendto(relay->sock, packet, (size_t)len, 0, (const struct sockaddr *)to, sizeof(*to));
+        relay->forwarded[dir]++;
+    }
+    return NULL;
+}
+
+int bench_relay_start(bench_relay_t *relay, uint16_t relay_port, uint16_t device_port) {
+    relay->seed = 12345;
+    relay->running = 1;
+    relay->port = relay_port;
+    relay->device.sin_family = AF_INET;
+    relay->device.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    relay->device.sin_port = htons(device_port);
+
+    relay->sock = socket(AF_INET, SOCK_DGRAM, 0);
+    int rcvbuf = 4 * 1024 * 1024;
+    setsockopt(relay->sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    struct sockaddr_in local = { .sin_family = AF_INET, .sin_port = htons(relay_port) };
+    local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(relay->sock, (struct sockaddr *)&local, sizeof(local)) < 0) {
+        perror("relay bind");
+        close(relay->sock);
+        return -1;
+    }
+
+    pthread_create(&relay->thread, NULL, relay_main, relay);
+    return 0;
+}
+
+void bench_relay_stop(bench_relay_t *relay) {
+    relay->running = 0;
+    pthread_join(relay->thread, NULL);
+    close(relay->sock);
+}
+
+typedef struct {
+    const char *uid;
+    uint16_t port;
+    int64_t sid;
+} listen_args_t;
+
+static void *listen_main(void *arg) {
+    listen_args_t *args = arg;
+    args->sid = IOTC_Listen(args->uid, args->port, 10000);
+    return NULL;
+}
+
+int bench_relay_connect(bench_relay_t *relay, const char *uid, int64_t *client_sid, int64_t *device_sid) {
+    listen_args_t listen_args = { .uid = uid, .port = ntohs(relay->device.sin_port), .sid = 0 };
+    pthread_t listen_thread;
+    pthread_create(&listen_thread, NULL, listen_main, &listen_args);
+    usleep(20000);
+
+    *client_sid = IOTC_Connect(uid, "127.0.0.1", relay->port);
+    pthread_join(listen_thread, NULL);
+    *device_sid = listen_args.sid;
+    if (*client_sid < 0 || *device_sid < 0) {
+        fprintf(stderr, "connect failed: client %lld device %lld\n",
+                (long long)*client_sid, (long long)*device_sid);
+        return -1;
+    }
+    return 0;
+}
+
+void bench_wait_pmtu(int64_t sid, IOTCSessionPathStats *stats) {
+    do {
+        usleep(10000);
+        IOTC_Session_Get_Path_Stats((int)sid, stats);
+    } while (stats->pmtu_probing);
+}
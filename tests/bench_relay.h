@@ -0,0 +1,58 @@
+/*
+ * UDP relay and session setup shared by the RDT, FEC and pacing benchmarks.
+ *
+ * Each benchmark runs both ends of a session in one process and routes the
+ * client side through a relay on loopback.  The relay drops datagrams with a
+ * per-direction probability; a benchmark that models its own link hands the
+ * client-to-device datagrams to an uplink hook instead of sending them.
+ */
+
+#ifndef BENCH_RELAY_H
+#define BENCH_RELAY_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "libIOTCAPIsT.h"
+
+#define BENCH_UPLINK      0     /* client to device */
+#define BENCH_DOWNLINK    1     /* device to client */
+
+typedef struct bench_relay {
+    int sock;
+    uint16_t port;
+    struct sockaddr_in device;
+    struct sockaddr_in client;
+    volatile double loss[2];            /* drop probability per direction */
+    unsigned int seed;
+    volatile int running;
+    unsigned long forwarded[2];
+    unsigned long dropped[2];
+    pthread_t thread;
+
+    /* Optional link model: runs every loop and returns the poll timeout in ms */
+    int (*tick)(struct bench_relay *relay);
+    /* Optional link model: takes an uplink datagram, returns 0 if it was dropped */
+    int (*uplink)(struct bench_relay *relay, const uint8_t *packet, size_t len);
+    void *ctx;
+} bench_relay_t;
+
+/*
+ * Binds the relay to relay_port in front of a device on device_port and
+ * starts its thread.  The relay starts zeroed apart from loss, hooks and ctx.
+ */
+int bench_relay_start(bench_relay_t *relay, uint16_t relay_port, uint16_t device_port);
+void bench_relay_stop(bench_relay_t *relay);
+
+/*
+ * Listens as uid on the relay's device port and connects to it through the
+ * relay.  Returns 0 with both session IDs filled in, or -1.
+ */
+int bench_relay_connect(bench_relay_t *relay, const char *uid, int64_t *client_sid, int64_t *device_sid);
+
+/* Waits for path MTU discovery to settle so probes are not counted as loss */
+void bench_wait_pmtu(int64_t sid, IOTCSessionPathStats *stats);
+
+#endif
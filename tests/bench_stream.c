@@ -0,0 +1,395 @@
+
+/*
+ * End-to-end streaming benchmark, device and client halves.
+ *
+ * The device registers its UID with the mock server (tests/mock_iotc_server)
+ * over its TCP text protocol, accepts sessions on the port the mock server
+ * hands out for it (its own port + 1) and streams synthetic H.264-sized
+ * frames on each: a keyframe every GOP frames, KEYFRAME_RATIO times the size
+ * of the others, averaging the requested bitrate.  Frames are sent on an
+ * absolute schedule and carry their capture time.
+ *
+ * The client asks the mock server where the device is, opens the sessions
+ * and reads until the device ends every stream.  It reports frames per
+ * second, capture-to-read latency percentiles, CPU per stream and resident
+ * memory per session.  Both halves print one JSON line with their results;
+ * tests/stream_benchmark.py runs them against the mock server.
+ *
+ *   bench_stream device -m PORT -u UID [-n SESSIONS] [-f FPS] [-b KBPS] [-g GOP] [-d SECONDS]
+ *   bench_stream client -m PORT -u UID [-n SESSIONS] [-d SECONDS]
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "libIOTCAPIsT.h"
+
+#define VIDEO_CHANNEL     1
+#define FRAME_MAGIC       0x46524D45u   /* "FRME" */
+#define END_MAGIC         0x454E4421u   /* "END!" */
+#define KEYFRAME_RATIO    5
+#define MAX_SESSIONS      256
+#define MAX_FRAME_SIZE    (1024 * 1024)
+#define START_DELAY_US    200000
+#define END_GRACE_S       5             /* client wait past the stream duration */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t size;                      /* whole message, header included */
+    uint32_t keyframe;
+    uint64_t capture_ns;                /* CLOCK_MONOTONIC, shared by both processes */
+} frame_header_t;
+
+typedef struct {
+    const char *uid;
+    uint16_t mock_port;
+    unsigned int sessions;
+    unsigned int fps;
+    unsigned int kbps;
+    unsigned int gop;
+    unsigned int duration_s;
+} options_t;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t cpu_ns(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ((uint64_t)ru.ru_utime.tv_sec + (uint64_t)ru.ru_stime.tv_sec) * 1000000000ULL +
+           ((uint64_t)ru.ru_utime.tv_usec + (uint64_t)ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+/* High-water mark of the resident set so far.  VmHWM rather than ru_maxrss,
+ * which carries over the peak of the process that forked and exec'd us. */
+static long peak_rss_kb(void) {
+    char line[128];
+    long kb = 0;
+    FILE *f = fopen("/proc/self/status", "r");
+    if (!f) return 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmHWM: %ld kB", &kb) == 1) break;
+    }
+    fclose(f);
+    return kb;
+}
+
+/* One request/response exchange with the mock server; returns the socket */
+static int mock_request(uint16_t port, const char *request, char *response, size_t size) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("mock server");
+        if (sock >= 0) close(sock);
+        return -1;
+    }
+    send(sock, request, strlen(request), 0);
+    ssize_t len = recv(sock, response, size - 1, 0);
+    response[len > 0 ? len : 0] = '\0';
+    return sock;
+}
+
+/* Device: paces frames onto one session until the duration is up */
+typedef struct {
+    const options_t *opt;
+    int sid;
+    pthread_t thread;
+    unsigned long frames;
+    unsigned long errors;
+} stream_t;
+
+static void *stream_main(void *arg) {
+    stream_t *stream = arg;
+    const options_t *opt = stream->opt;
+    uint8_t *frame = malloc(MAX_FRAME_SIZE);
+    uint64_t average = (uint64_t)opt->kbps * 1000 / 8 / opt->fps;
+    uint64_t delta = average * opt->gop / (opt->gop - 1 + KEYFRAME_RATIO);
+    uint64_t interval = 1000000000ULL / opt->fps;
+    uint32_t count = opt->fps * opt->duration_s;
+    struct timespec due;
+
+    clock_gettime(CLOCK_MONOTONIC, &due);
+    for (uint32_t seq = 0; seq < count; seq++) {
+        int keyframe = seq % opt->gop == 0;
+        uint64_t size = keyframe ? delta * KEYFRAME_RATIO : delta;
+        if (size < sizeof(frame_header_t)) size = sizeof(frame_header_t);
+        if (size > MAX_FRAME_SIZE) size = MAX_FRAME_SIZE;
+
+        frame_header_t hdr = { FRAME_MAGIC, seq, (uint32_t)size, (uint32_t)keyframe, now_ns() };
+        memcpy(frame, &hdr, sizeof(hdr));
+        if (IOTC_Session_Write(stream->sid, frame, (unsigned int)size, VIDEO_CHANNEL) < 0) {
+            stream->errors++;
+        } else {
+            stream->frames++;
+        }
+
+        due.tv_nsec += (long)interval;
+        while (due.tv_nsec >= 1000000000L) {
+            due.tv_sec++;
+            due.tv_nsec -= 1000000000L;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+    }
+
+    frame_header_t end = { END_MAGIC, count, sizeof(frame_header_t), 0, now_ns() };
+    IOTC_Session_Write(stream->sid, &end, sizeof(end), VIDEO_CHANNEL);
+    free(frame);
+    return NULL;
+}
+
+static int run_device(const options_t *opt) {
+    static stream_t streams[MAX_SESSIONS];
+    char request[64], response[128];
+
+    snprintf(request, sizeof(request), "DEVICE_LOGIN:%s", opt->uid);
+    int mock = mock_request(opt->mock_port, request, response, sizeof(response));
+    if (mock < 0 || strcmp(response, "IOTC_LOGIN_OK") != 0) {
+        fprintf(stderr, "device login failed: %s\n", mock < 0 ? "no mock server" : response);
+        return 1;
+    }
+
+    IOTC_Set_Max_Session_Number(opt->sessions);
+    IOTC_Initialize();
+    printf("READY\n");
+    fflush(stdout);
+
+    unsigned int accepted = 0;
+    for (; accepted < opt->sessions; accepted++) {
+        int64_t sid = IOTC_Listen(opt->uid, (uint16_t)(opt->mock_port + 1), 30000);
+        if (sid < 0) {
+            fprintf(stderr, "listen failed: %lld\n", (long long)sid);
+            break;
+        }
+        IOTC_Session_Channel_ON((int)sid, VIDEO_CHANNEL);
+        streams[accepted] = (stream_t){ .opt = opt, .sid = (int)sid };
+    }
+    
+    // All streams start together, once the client has had time to turn its channels on
+    usleep(START_DELAY_US);
+    uint64_t cpu_start = cpu_ns(), wall_start = now_ns();
+    for (unsigned int i = 0; i < accepted; i++) {
+        pthread_create(&streams[i].thread, NULL, stream_main, &streams[i]);
+    }
+
+    unsigned long frames = 0, errors = 0;
+    for (unsigned int i = 0; i < accepted; i++) {
+        pthread_join(streams[i].thread, NULL);
+        frames += streams[i].frames;
+        errors += streams[i].errors;
+    }
+    double wall_s = (double)(now_ns() - wall_start) / 1e9;
+    double cpu_s = (double)(cpu_ns() - cpu_start) / 1e9;
+
+    // Give the last frames time to leave before the sessions go
+    sleep(1);
+    for (unsigned int i = 0; i < accepted; i++) IOTC_Session_Close(streams[i].sid);
+    IOTC_DeInitialize();
+    send(mock, "QUIT", 4, 0);
+    close(mock);
+
+    printf("{\"role\": \"device\", \"sessions\": %u, \"frames_sent\": %lu, \"write_errors\": %lu, "
+           "\"cpu_percent_per_stream\": %.2f}\n",
+           accepted, frames, errors, accepted && wall_s > 0 ? 100.0 * cpu_s / wall_s / accepted : 0.0);
+    return accepted == opt->sessions ? 0 : 1;
+}
+
+/* Client: reads one session until its end marker */
+typedef struct {
+    int sid;
+    pthread_t thread;
+    uint64_t *latency_ns;
+    unsigned long capacity;
+    unsigned long frames;
+    unsigned long keyframes;
+    unsigned long gaps;                 /* frames never seen */
+    uint64_t bytes;
+    uint64_t first_ns, last_ns;
+    int ended;
+} reader_t;
+
+static unsigned int g_read_timeout_ms;
+
+static void *reader_main(void *arg) {
+    reader_t *reader = arg;
+    uint8_t *buf = malloc(MAX_FRAME_SIZE);
+    uint32_t next_seq = 0;
+    uint64_t deadline = now_ns() + (uint64_t)g_read_timeout_ms * 1000000ULL;
+
+    while (!reader->ended && now_ns() < deadline) {
+        int64_t ret = IOTC_Session_Read_Check_Lost_Data_And_Datatype(reader->sid, buf, MAX_FRAME_SIZE, 500,
+                                                                     NULL, NULL, VIDEO_CHANNEL, 0);
+        if (ret == IOTC_ER_TIMEOUT) continue;
+        if (ret < (int64_t)sizeof(frame_header_t)) break;
+
+        uint64_t arrival = now_ns();
+        frame_header_t hdr;
+        memcpy(&hdr, buf, sizeof(hdr));
+        if (hdr.magic == END_MAGIC) {
+            reader->gaps += hdr.seq > next_seq ? hdr.seq - next_seq : 0;
+            __atomic_store_n(&reader->ended, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        if (hdr.magic != FRAME_MAGIC || (uint64_t)ret != hdr.size) continue;
+
+        if (reader->frames == 0) reader->first_ns = arrival;
+        reader->last_ns = arrival;
+        if (hdr.seq > next_seq) reader->gaps += hdr.seq - next_seq;
+        next_seq = hdr.seq + 1;
+        if (reader->frames < reader->capacity) reader->latency_ns[reader->frames] = arrival - hdr.capture_ns;
+        reader->frames++;
+        reader->keyframes += hdr.keyframe;
+        reader->bytes += (uint64_t)ret;
+    }
+    free(buf);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(const uint64_t *sorted, unsigned long count, double p) {
+    if (count == 0) return 0.0;
+    unsigned long index = (unsigned long)(p / 100.0 * (double)(count - 1) + 0.5);
+    return (double)sorted[index] / 1e6;
+}
+
+static int run_client(const options_t *opt) {
+    static reader_t readers[MAX_SESSIONS];
+    char request[64], response[128], host[64];
+    unsigned int port;
+
+    long rss_baseline = peak_rss_kb();
+    snprintf(request, sizeof(request), "SESSION_REQUEST:%s", opt->uid);
+    int mock = mock_request(opt->mock_port, request, response, sizeof(response));
+    if (mock >= 0) close(mock);
+    if (mock < 0 || sscanf(response, "IOTC_SESSION_OK:%63[^:]:%u", host, &port) != 2) {
+        fprintf(stderr, "session request failed: %s\n", mock < 0 ? "no mock server" : response);
+        return 1;
+    }
+
+    IOTC_Set_Max_Session_Number(opt->sessions);
+    IOTC_Initialize();
+    unsigned long capacity = (unsigned long)opt->fps * opt->duration_s + 1;
+    unsigned int connected = 0;
+    for (; connected < opt->sessions; connected++) {
+        int64_t sid = IOTC_Connect(opt->uid, host, (uint16_t)port);
+        if (sid < 0) {
+            fprintf(stderr, "connect %u failed: %lld\n", connected, (long long)sid);
+            break;
+        }
+        IOTC_Session_Channel_ON((int)sid, VIDEO_CHANNEL);
+        readers[connected] = (reader_t){ .sid = (int)sid, .capacity = capacity };
+        readers[connected].latency_ns = malloc(capacity * sizeof(uint64_t));
+    }
+
+    // The device starts streaming shortly after the last session is accepted
+    g_read_timeout_ms = (opt->duration_s + END_GRACE_S) * 1000;
+    uint64_t cpu_start = cpu_ns(), wall_start = now_ns();
+    for (unsigned int i = 0; i < connected; i++) {
+        pthread_create(&readers[i].thread, NULL, reader_main, &readers[i]);
+    }
+
+    for (;;) {
+        unsigned int ended = 0;
+        for (unsigned int i = 0; i < connected; i++) ended += __atomic_load_n(&readers[i].ended, __ATOMIC_RELAXED);
+        if (ended == connected || now_ns() - wall_start > (uint64_t)g_read_timeout_ms * 1000000ULL) break;
+        usleep(100000);
+    }
+
+    unsigned long frames = 0, keyframes = 0, gaps = 0, samples = 0, ended = 0;
+    uint64_t bytes = 0;
+    double fps_sum = 0.0;
+    for (unsigned int i = 0; i < connected; i++) {
+        pthread_join(readers[i].thread, NULL);
+        reader_t *r = &readers[i];
+        frames += r->frames;
+        keyframes += r->keyframes;
+        gaps += r->gaps;
+        bytes += r->bytes;
+        ended += (unsigned long)r->ended;
+        if (r->frames > 1) fps_sum += (double)(r->frames - 1) * 1e9 / (double)(r->last_ns - r->first_ns);
+        samples += r->frames < r->capacity ? r->frames : r->capacity;
+    }
+    double wall_s = (double)(now_ns() - wall_start) / 1e9;
+    double cpu_s = (double)(cpu_ns() - cpu_start) / 1e9;
+    long rss_peak = peak_rss_kb();
+
+    uint64_t *latency = malloc((samples ? samples : 1) * sizeof(uint64_t));
+    unsigned long n = 0;
+    for (unsigned int i = 0; i < connected; i++) {
+        unsigned long count = readers[i].frames < readers[i].capacity ? readers[i].frames : readers[i].capacity;
+        memcpy(latency + n, readers[i].latency_ns, count * sizeof(uint64_t));
+        n += count;
+        free(readers[i].latency_ns);
+        IOTC_Session_Close(readers[i].sid);
+    }
+    qsort(latency, n, sizeof(uint64_t), cmp_u64);
+    IOTC_DeInitialize();
+
+    printf("{\"role\": \"client\", \"sessions\": %u, \"streams_ended\": %lu, \"frames\": %lu, "
+           "\"frames_expected\": %lu, \"frames_missing\": %lu, \"keyframes\": %lu, "
+           "\"fps_per_session\": %.2f, \"throughput_mbps\": %.2f, "
+           "\"latency_ms\": {\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f}, "
+           "\"cpu_percent_per_stream\": %.2f, \"rss_kb_baseline\": %ld, \"rss_kb_peak\": %ld, "
+           "\"rss_kb_per_session\": %.1f}\n",
+           connected, ended, frames, (unsigned long)opt->fps * opt->duration_s * connected, gaps, keyframes,
+           connected ? fps_sum / connected : 0.0, wall_s > 0 ? (double)bytes * 8 / wall_s / 1e6 : 0.0,
+           percentile_ms(latency, n, 50), percentile_ms(latency, n, 90), percentile_ms(latency, n, 99),
+           percentile_ms(latency, n, 99.9), n ? (double)latency[n - 1] / 1e6 : 0.0,
+           connected && wall_s > 0 ? 100.0 * cpu_s / wall_s / connected : 0.0, rss_baseline, rss_peak,
+           connected ? (double)(rss_peak - rss_baseline) / connected : 0.0);
+    free(latency);
+    return connected == opt->sessions && ended == connected ? 0 : 1;
+}
+
+static int usage(const char *argv0) {
+    fprintf(stderr, "usage: %s device -m PORT -u UID [-n SESSIONS] [-f FPS] [-b KBPS] [-g GOP] [-d SECONDS]\n"
+                    "       %s client -m PORT -u UID [-n SESSIONS] [-f FPS] [-d SECONDS]\n", argv0, argv0);
+    return 2;
+}
+
+int main(int argc, char **argv) {
+    options_t opt = { .sessions = 1, .fps = 30, .kbps = 2000, .gop = 30, .duration_s = 10 };
+    int opt_char;
+
+    if (argc < 2 || (strcmp(argv[1], "device") != 0 && strcmp(argv[1], "client") != 0)) return usage(argv[0]);
+    optind = 2;
+    while ((opt_char = getopt(argc, argv, "m:u:n:f:b:g:d:")) != -1) {
+        unsigned long value = optarg ? strtoul(optarg, NULL, 10) : 0;
+        switch (opt_char) {
+        case 'm': opt.mock_port = (uint16_t)value; break;
+        case 'u': opt.uid = optarg; break;
+        case 'n': opt.sessions = (unsigned int)value; break;
+        case 'f': opt.fps = (unsigned int)value; break;
+        case 'b': opt.kbps = (unsigned int)value; break;
+        case 'g': opt.gop = (unsigned int)value; break;
+        case 'd': opt.duration_s = (unsigned int)value; break;
+        default: return usage(argv[0]);
+        }
+    }
+    if (!opt.uid || strlen(opt.uid) != 20 || opt.mock_port == 0 || opt.mock_port == 65535 ||
+        opt.sessions == 0 || opt.sessions > MAX_SESSIONS || opt.fps == 0 || opt.gop == 0 ||
+        opt.duration_s == 0 || opt.kbps == 0) {
+        return usage(argv[0]);
+    }
+
+    return strcmp(argv[1], "device") == 0 ? run_device(&opt) : run_client(&opt);
+}
@@ -0,0 +1,112 @@
+#!/usr/bin/env python3
+"""
+End-to-end streaming benchmark against the mock server.
+
+Starts the mock server, then for each session count runs a bench_stream
+device that registers with it and streams synthetic H.264-sized frames,
+and a bench_stream client that finds the device through it and reads every
+stream. Prints frames/sec, capture-to-read latency percentiles, CPU per
+stream and RSS per session, and optionally writes all results as JSON.
+"""
+
+import argparse
+import json
+import subprocess
+import sys
+import time
+from pathlib import Path
+
+from integration_test import MockServerManager
+
+DEVICE_UID = "STREAM_BENCH_DEV0001"
+
+
+def parse_json_line(output, role):
+    for line in output.splitlines():
+        line = line.strip()
+        if line.startswith("{"):
+            result = json.loads(line)
+            if result.get("role") == role:
+                return result
+    return None
+
+
+def run_once(binary, args, sessions):
+    """One device/client pair at a session count; returns (device, client) results"""
+    common = ["-m", str(args.port), "-u", DEVICE_UID, "-n", str(sessions),
+              "-f", str(args.fps), "-d", str(args.duration)]
+    device = subprocess.Popen([str(binary), "device", *common, "-b", str(args.bitrate), "-g", str(args.gop)],
+                              stdout=subprocess.PIPE, stderr=subprocess.PIPE, text=True)
+
+    # The device prints READY once it is registered and listening
+    ready = device.stdout.readline().strip()
+    if ready != "READY":
+        device.kill()
+        _, err = device.communicate()
+        print(f"✗ device did not start: {err.strip()}")
+        return None, None
+
+    timeout = args.duration + 60
+    client = subprocess.run([str(binary), "client", *common],
+                            capture_output=True, text=True, timeout=timeout)
+    device_out, device_err = device.communicate(timeout=timeout)
+
+    if client.returncode != 0 or device.returncode != 0:
+        print(f"✗ {sessions} sessions: {client.stderr.strip()} {device_err.strip()}")
+    return parse_json_line(device_out, "device"), parse_json_line(client.stdout, "client")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--binary", default="tests/bench_stream", help="bench_stream executable")
+    parser.add_argument("--port", type=int, default=8090, help="mock server port; the device uses port + 1")
+    parser.add_argument("--sessions", default="1,4,16", help="comma-separated session counts")
+    parser.add_argument("--fps", type=int, default=30)
+    parser.add_argument("--bitrate", type=int, default=2000, help="kbit/s per stream")
+    parser.add_argument("--gop", type=int, default=30, help="frames per keyframe interval")
+    parser.add_argument("--duration", type=int, default=10, help="seconds per run")
+    parser.add_argument("--json", help="write results to this file")
+    args = parser.parse_args()
+
+    binary = Path(args.binary)
+    if not binary.exists():
+        print(f"{binary} not found; build it with make bench-stream")
+        return 1
+
+    server = MockServerManager(port=args.port)
+    if not server.start():
+        print("❌ Failed to start mock server")
+        return 1
+
+    results = []
+    try:
+        print(f"Streaming {args.fps} fps at {args.bitrate} kbit/s, keyframe every {args.gop} frames, "
+              f"{args.duration} s per run\n")
+        print(f"{'sessions':>8} {'fps':>7} {'frames':>13} {'Mbit/s':>8} {'p50 ms':>8} {'p99 ms':>8} "
+              f"{'max ms':>8} {'cpu%/strm':>9} {'dev cpu%':>8} {'RSS KB/sess':>11}")
+        for sessions in (int(n) for n in args.sessions.split(",")):
+            device, client = run_once(binary, args, sessions)
+            if not client:
+                continue
+            results.append({"sessions": sessions, "client": client, "device": device})
+            latency = client["latency_ms"]
+            print(f"{sessions:>8} {client['fps_per_session']:>7.2f} "
+                  f"{client['frames']:>6}/{client['frames_expected']:<6} {client['throughput_mbps']:>8.2f} "
+                  f"{latency['p50']:>8.3f} {latency['p99']:>8.3f} {latency['max']:>8.3f} "
+                  f"{client['cpu_percent_per_stream']:>9.2f} "
+                  f"{device['cpu_percent_per_stream'] if device else 0.0:>8.2f} "
+                  f"{client['rss_kb_per_session']:>11.1f}")
+            time.sleep(0.5)
+    finally:
+        server.stop()
+
+    if args.json:
+        config = {"fps": args.fps, "bitrate_kbps": args.bitrate, "gop": args.gop, "duration_s": args.duration}
+        with open(args.json, "w") as f:
+            json.dump({"config": config, "runs": results}, f, indent=2)
+            f.write("\n")
+    return 0 if results else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -1,11 +1,17 @@
 
+#define _GNU_SOURCE
 #include <assert.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -27,42 +33,17 @@ typedef struct {
 
 static mock_server_state_t mock_state = {0};
 
-/* Globals used to simulate stack guard */
-void *__stack_chk_guard = (void*)0x1;
+/*
+ * Stack guard that replaces the library's own when linked with its source, and
+ * a failure handler that records instead of aborting
+ */
+void *__stack_chk_guard = (void *)0x1;
 static int stack_fail_called;
 void __stack_chk_fail(void)
 {
     stack_fail_called = 1;
 }
 
-/* Mock network functions for testing */
-static int mock_network_error = 0;
-static int mock_connect_delay = 0;
-
-/* Stub and tracking for IOTC_Session_Read_Check_Lost_Data_And_Datatype */
-static int64_t stub_read_ret;
-static int modify_guard;
-int64_t IOTC_Session_Read_Check_Lost_Data_And_Datatype(
-    int64_t sid, void *buf, int64_t size, int64_t timeout,
-    unsigned char *lost, unsigned char *datatype, int32_t flags,
-    int32_t unused)
-{
-    (void)sid; (void)buf; (void)size; (void)timeout;
-    (void)lost; (void)datatype; (void)flags; (void)unused;
-    if (modify_guard)
-        __stack_chk_guard = (void*)((uintptr_t)__stack_chk_guard + 1);
-    
-    if (mock_network_error) {
-        return -1;
-    }
-    
-    if (mock_connect_delay > 0) {
-        usleep(mock_connect_delay * 1000);
-    }
-    
-    return stub_read_ret;
-}
-
 /* Stubs for SSL/bio helpers */
 int32_t *tutk_third_BIO_get_data(void *bio)
 {
@@ -88,14 +69,6 @@ int32_t tutk_third_SSL_get_error(int64_t ssl, int32_t ret)
     return ssl_error_ret;
 }
 
-void TUTK_LOG_MSG(int level, const char *module, int type,
-                  const char *fmt, const char *func,
-                  int32_t sid, int32_t chID, int32_t ret)
-{
-    (void)level; (void)module; (void)type;
-    (void)fmt; (void)func; (void)sid; (void)chID; (void)ret;
-}
-
 static int64_t translate_err_ret;
 int64_t translate_Error(int32_t ret, int64_t ssl)
 {
@@ -180,31 +153,47 @@ int start_mock_server(void) {
 void stop_mock_server(void) {
     if (mock_server_running) {
         mock_server_running = 0;
-        close(mock_server_socket);
+        // Closing alone does not wake a thread blocked in accept()
+        shutdown(mock_server_socket, SHUT_RDWR);
         pthread_join(mock_server_thread, NULL);
+        close(mock_server_socket);
     }
 }
 
 /* Test helper functions */
 void reset_test_state(void) {
     stack_fail_called = 0;
-    stub_read_ret = 0;
-    modify_guard = 0;
-    mock_network_error = 0;
-    mock_connect_delay = 0;
     ssl_shutdown_ret = 1;
     ssl_error_ret = 0;
     translate_err_ret = 0;
     memset(&mock_state, 0, sizeof(mock_state));
 }
 
+/* Listens on the port arg points to; the session ID is left in listen_sid */
+static int64_t listen_sid;
+static void *listen_worker(void *arg) {
+    listen_sid = IOTC_Listen("TEST_DEVICE_12345678", *(uint16_t *)arg, 2000);
+    return NULL;
+}
+
+/* Connects a session to a listener on a loopback port; the device end is left in listen_sid */
+static int connect_pair(uint16_t port) {
+    pthread_t listener;
+    pthread_create(&listener, NULL, listen_worker, &port);
+    usleep(50000);
+    int64_t sid = IOTC_Connect("TEST_DEVICE_12345678", "127.0.0.1", port);
+    pthread_join(listener, NULL);
+    assert(sid > 0 && listen_sid > 0);
+    return (int)sid;
+}
+
 /* Basic functionality tests */
 static void test_initialization(void) {
     printf("Testing IOTC initialization...\n");
     
     // Test multiple initializations
     assert(IOTC_Initialize() == 0);
-    assert(IOTC_Initialize() == 0); // Should handle multiple calls
+    assert(IOTC_Initialize() == IOTC_ER_ALREADY_INITIALIZED); // Second call is rejected
     
     // Test deinitialization
     IOTC_DeInitialize();
@@ -229,26 +218,28 @@ static void test_version_info(void) {
 static void test_session_management(void) {
     printf("Testing session management...\n");
     
+    // The session limit takes effect at the next initialization
+    assert(IOTC_Set_Max_Session_Number(5) == 5);
     IOTC_Initialize();
+    assert(IOTC_Set_Max_Session_Number(8) == IOTC_ER_ALREADY_INITIALIZED);
     
     // Test session ID allocation
-    assert(IOTC_Set_Max_Session_Number(5) == 5);
-    
     int64_t sid1 = IOTC_Get_SessionID();
     int64_t sid2 = IOTC_Get_SessionID();
     assert(sid1 > 0 && sid2 > 0 && sid1 != sid2);
     
     // Test session closure
     assert(IOTC_Session_Close(sid1) == 0);
-    assert(IOTC_Session_Close(sid1) == -1); // Already closed
+    assert(IOTC_Session_Close(sid1) == IOTC_ER_INVALID_SID); // Already closed
     
     // Test session limit
-    for (int i = 0; i < 5; i++) {
-        IOTC_Get_SessionID();
+    for (int i = 0; i < 4; i++) {
+        assert(IOTC_Get_SessionID() > 0);
     }
-    assert(IOTC_Get_SessionID() == -1); // Should be full
+    assert(IOTC_Get_SessionID() == IOTC_ER_EXCEED_MAX_SESSION); // Should be full
     
     IOTC_DeInitialize();
+    assert(IOTC_Set_Max_Session_Number(0) == 0);
     printf("✓ Session management tests passed\n");
 }
 
@@ -257,8 +248,12 @@ static void test_channel_operations(void) {
     
     IOTC_Initialize();
     
-    int64_t sid = IOTC_Get_SessionID();
-    assert(sid > 0);
+    // Channels only exist on connected sessions
+    int64_t idle = IOTC_Get_SessionID();
+    assert(IOTC_Session_Channel_ON(idle, 0) == IOTC_ER_INVALID_SID);
+    IOTC_Session_Close(idle);
+    
+    int sid = connect_pair(47101);
     
     // Test channel on/off
     assert(IOTC_Session_Channel_Check_ON_OFF(sid, 0) == 0);
@@ -276,9 +271,10 @@ static void test_channel_operations(void) {
     for (int i = 1; i < 32; i++) {
         IOTC_Session_Channel_ON(sid, i);
     }
-    assert(IOTC_Session_Get_Free_Channel(sid) == -1);
+    assert(IOTC_Session_Get_Free_Channel(sid) == IOTC_ER_FAIL_SETUP_CHANNEL);
     
     IOTC_Session_Close(sid);
+    IOTC_Session_Close(listen_sid);
     IOTC_DeInitialize();
     printf("✓ Channel operations tests passed\n");
 }
@@ -299,6 +295,22 @@ static void test_data_conversion(void) {
     
     assert(memcmp(&header, &original, sizeof(header)) == 0);
     
+    // Batches match the one-header helper at every length around the vector widths
+    IOTCHeader batch[37], expected[37];
+    for (unsigned int count = 0; count <= 37; count++) {
+        for (unsigned int i = 0; i < 37; i++) {
+            batch[i] = (IOTCHeader){ 0xF1000300u + i, i * 0x01020304u, ~i, i << 16, 0x12345678u ^ i };
+            expected[i] = batch[i];
+            if (i < count) IOTC_Header_ntoh(&expected[i]);
+        }
+        IOTC_Headers_ntoh_batch(batch, count);
+        assert(memcmp(batch, expected, sizeof(batch)) == 0);
+        IOTC_Headers_hton_batch(batch, count);
+        for (unsigned int i = 0; i < count; i++) IOTC_Header_hton(&expected[i]);
+        assert(memcmp(batch, expected, sizeof(batch)) == 0);
+    }
+    IOTC_Headers_ntoh_batch(NULL, 4);
+    
     printf("✓ Data conversion tests passed\n");
 }
 
@@ -311,14 +323,14 @@ static void test_error_conditions(void) {
     IOTC_Initialize();
     
     // Test invalid session operations
-    assert(IOTC_Session_Close(-1) == -1);
-    assert(IOTC_Session_Channel_ON(-1, 0) == -1);
-    assert(IOTC_Session_Channel_OFF(-1, 0) == -1);
+    assert(IOTC_Session_Close(-1) == IOTC_ER_INVALID_SID);
+    assert(IOTC_Session_Channel_ON(-1, 0) == IOTC_ER_INVALID_SID);
+    assert(IOTC_Session_Channel_OFF(-1, 0) == IOTC_ER_INVALID_SID);
     
     // Test invalid channel numbers
     int64_t sid = IOTC_Get_SessionID();
-    assert(IOTC_Session_Channel_ON(sid, 32) == -1); // Channel out of range
-    assert(IOTC_Session_Channel_OFF(sid, 32) == -1);
+    assert(IOTC_Session_Channel_ON(sid, 32) == IOTC_ER_INVALID_ARG); // Channel out of range
+    assert(IOTC_Session_Channel_OFF(sid, 32) == IOTC_ER_INVALID_ARG);
     
     IOTC_Session_Close(sid);
     IOTC_DeInitialize();
@@ -330,17 +342,19 @@ static void test_concurrent_operations(void) {
     
     IOTC_Initialize();
     
-    // Test multiple sessions from different "threads" (simulated)
-    int64_t sessions[5];
+    // Test multiple sessions side by side
+    int sessions[5];
+    int devices[5];
     for (int i = 0; i < 5; i++) {
-        sessions[i] = IOTC_Get_SessionID();
-        assert(sessions[i] > 0);
+        sessions[i] = connect_pair(47101);
+        devices[i] = (int)listen_sid;
     }
     
     // Test channel isolation between sessions
     for (int i = 0; i < 5; i++) {
         IOTC_Session_Channel_ON(sessions[i], 0);
         assert(IOTC_Session_Channel_Check_ON_OFF(sessions[i], 0) == 1);
+        assert(IOTC_Session_Channel_Check_ON_OFF(devices[i], 0) == 0);
     }
     
     // Close one session, others should remain unaffected
@@ -356,6 +370,7 @@ static void test_concurrent_operations(void) {
         if (i != 2) {
             IOTC_Session_Close(sessions[i]);
         }
+        IOTC_Session_Close(devices[i]);
     }
     
     IOTC_DeInitialize();
@@ -397,76 +412,1455 @@ static void test_mock_server_integration(void) {
 static void test_network_error_handling(void) {
     printf("Testing network error handling...\n");
     
+    char buf[16];
+    stack_fail_called = 0;
+    
+    // Read errors come back as their codes without tripping the guard check
+    assert(IOTC_Session_Read(1, buf, sizeof(buf), 20, 0) == IOTC_ER_NOT_INITIALIZED);
+    
     IOTC_Initialize();
     int64_t sid = IOTC_Get_SessionID();
+    assert(IOTC_Session_Read((int)sid, NULL, 10, 20, 0) == IOTC_ER_INVALID_ARG);
+    assert(IOTC_Session_Read((int)sid, buf, sizeof(buf), 20, 0) == IOTC_ER_INVALID_SID); // Never connected
+    assert(IOTC_Session_Read((int)sid, buf, sizeof(buf), 20, 32) == IOTC_ER_INVALID_ARG);
+    assert(stack_fail_called == 0);
     
-    // Test with simulated network errors
-    mock_network_error = 1;
-    stub_read_ret = -1;
+    IOTC_Session_Close(sid);
+    IOTC_DeInitialize();
+    printf("✓ Network error handling tests passed\n");
+}
+
+static void test_lan_discovery(void) {
+    printf("Testing LAN discovery service...\n");
     
-    int64_t result = IOTC_Session_Read(sid, NULL, 10, 20, 0);
-    assert(result < 0); // Should fail due to network error
+    IOTCDevInfo devices[4];
+    IOTCLanDevice table[4];
     
-    // Reset and test recovery
-    mock_network_error = 0;
-    stub_read_ret = 0;
-    result = IOTC_Session_Read(sid, NULL, 10, 20, 0);
-    assert(result >= 0); // Should succeed
+    assert(IOTC_Lan_Search2(NULL, 4, 100) == IOTC_ER_INVALID_ARG);
+    assert(IOTC_Lan_Search2(devices, 0, 100) == IOTC_ER_INVALID_ARG);
+    assert(IOTC_Lan_Discovery_Start(100, NULL, NULL) == IOTC_ER_NOT_INITIALIZED);
+    
+    IOTC_Initialize();
+    
+    assert(IOTC_Lan_Discovery_Start(100, NULL, NULL) == 0);
+    assert(IOTC_Lan_Discovery_Start(100, NULL, NULL) == IOTC_ER_ALREADY_LISTENING); // Already running
+    assert(IOTC_Lan_Discovery_Get_Devices(table, 4) >= 0);
+    assert(IOTC_Lan_Discovery_Stop() == 0);
+    assert(IOTC_Lan_Discovery_Stop() == 0); // Not running is not an error
+    
+    // Stopping clears the table
+    assert(IOTC_Lan_Discovery_Get_Devices(table, 4) == 0);
     
-    IOTC_Session_Close(sid);
     IOTC_DeInitialize();
-    printf("✓ Network error handling tests passed\n");
+    printf("✓ LAN discovery tests passed\n");
 }
 
-static void test_timeout_behavior(void) {
-    printf("Testing timeout behavior...\n");
+static void test_direct_connect_and_timeouts(void) {
+    printf("Testing direct connect, keep-alive and idle reaping...\n");
     
     IOTC_Initialize();
-    int64_t sid = IOTC_Get_SessionID();
     
-    // Test with simulated delays
-    mock_connect_delay = 100; // 100ms delay
-    stub_read_ret = 0;
+    // Nobody is listening: the connect timer gives up after the LAN timeout
+    assert(IOTC_Setup_LANConnection_Timeout(200) == 0);
+    assert(IOTC_Connect("TEST_DEVICE_12345678", "127.0.0.1", 47109) == IOTC_ER_TIMEOUT);
     
-    time_t start_time = time(NULL);
-    IOTC_Session_Read(sid, NULL, 10, 50, 0); // 50ms timeout
-    time_t end_time = time(NULL);
+    int64_t sid = connect_pair(47101);
+    assert(IOTC_Session_Check(sid) == 1);
     
-    // Should have taken at least the delay time
-    assert(end_time >= start_time);
+    // Keep-alives hold an otherwise silent session open
+    IOTC_Setup_Session_Idle_Timeout(300);
+    IOTC_Setup_Keepalive_Interval(50);
+    IOTC_Session_Channel_ON(sid, 0);
+    assert(IOTC_Session_Write(sid, "ping", 4, 0) == 4);
+    usleep(500000);
+    assert(IOTC_Session_Check(listen_sid) == 1);
     
-    mock_connect_delay = 0;
+    // Closing one end tells the other
     IOTC_Session_Close(sid);
+    usleep(100000);
+    assert(IOTC_Get_Session_Status(listen_sid) == 4); // SESSION_STATE_DISCONNECTED
+    IOTC_Session_Close(listen_sid);
+    
+    IOTC_Setup_LANConnection_Timeout(5000);
+    IOTC_Setup_Session_Idle_Timeout(30000);
+    IOTC_Setup_Keepalive_Interval(1000);
     IOTC_DeInitialize();
-    printf("✓ Timeout behavior tests passed\n");
+    printf("✓ Direct connect and timeout tests passed\n");
 }
 
-/* Legacy tests from original suite */
-static void test_read_no_guard_change(void) {
-    stub_read_ret = 0;
-    modify_guard = 0;
-    stack_fail_called = 0;
-    int64_t r = IOTC_Session_Read(5, NULL, 10, 20, 0);
-    assert(r == 0);
-    assert(stack_fail_called == 0);
+/* Blocks in IOTC_Session_Read while the main thread changes the guard */
+static int64_t guarded_read_ret;
+static void *guarded_read_worker(void *arg) {
+    char buf[16];
+    guarded_read_ret = IOTC_Session_Read(*(int *)arg, buf, sizeof(buf), 300, 0);
+    return NULL;
 }
 
-static void test_read_failure_calls_stack_fail(void) {
-    stub_read_ret = 1;
-    modify_guard = 0;
+static void test_session_read(void) {
+    printf("Testing IOTC_Session_Read...\n");
+    
+    IOTC_Initialize();
+    int sid = connect_pair(47101);
+    IOTC_Session_Channel_ON(sid, 0);
+    IOTC_Session_Channel_ON((int)listen_sid, 0);
     stack_fail_called = 0;
-    (void)IOTC_Session_Read(5, NULL, 10, 20, 0);
+    
+    // A successful read returns the byte count
+    char buf[16];
+    assert(IOTC_Session_Write(sid, "hello", 5, 0) == 5);
+    assert(IOTC_Session_Read((int)listen_sid, buf, sizeof(buf), 1000, 0) == 5);
+    assert(memcmp(buf, "hello", 5) == 0);
+    
+    // An empty channel waits out the timeout and reports it
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    assert(IOTC_Session_Read((int)listen_sid, buf, sizeof(buf), 50, 0) == IOTC_ER_TIMEOUT);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    long elapsed_ms = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000;
+    assert(elapsed_ms >= 40);
+    assert(stack_fail_called == 0);
+    
+#ifndef IOTC_SHARED_LIB_TEST
+    // A guard value that changes while the read blocks is still fatal; the
+    // shared library keeps its guard to itself, so only a linked-in build can
+    // reach it from here
+    pthread_t reader;
+    int reader_sid = (int)listen_sid;
+    pthread_create(&reader, NULL, guarded_read_worker, &reader_sid);
+    usleep(50000);
+    void *saved_guard = __stack_chk_guard;
+    __stack_chk_guard = (void *)((uintptr_t)saved_guard + 1);
+    pthread_join(reader, NULL);
+    __stack_chk_guard = saved_guard;
+    assert(guarded_read_ret == IOTC_ER_TIMEOUT);
     assert(stack_fail_called == 1);
+#endif
+    
+    IOTC_Session_Close(sid);
+    IOTC_Session_Close(listen_sid);
+    IOTC_DeInitialize();
+    printf("✓ Session read tests passed\n");
 }
 
-static void test_read_guard_change_triggers_fail(void) {
-    stub_read_ret = 0;
-    modify_guard = 1;
-    stack_fail_called = 0;
-    (void)IOTC_Session_Read(5, NULL, 10, 20, 0);
-    assert(stack_fail_called == 1);
+/* Sends a 0xFD LAN search response to the discovery port on loopback */
+static void announce_device(const char *uid, uint16_t port) {
+    uint8_t response[42] = { 0xFD };
+    memcpy(response + 4, uid, 20);
+    memcpy(response + 24, "127.0.0.1", 9);
+    response[40] = (uint8_t)(port >> 8);
+    response[41] = (uint8_t)port;
+    
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in to = { .sin_family = AF_INET, .sin_port = htons(10000) };
+    to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sendto(sock, response, sizeof(response), 0, (struct sockaddr *)&to, sizeof(to));
+    close(sock);
+}
+
+static void test_connect_by_uid(void) {
+    printf("Testing connect by UID...\n");
+    
+    assert(IOTC_Connect_ByUID("TEST_DEVICE_12345678") == IOTC_ER_NOT_INITIALIZED);
+    
+    IOTC_Initialize();
+    assert(IOTC_Connect_ByUID("SHORT") == IOTC_ER_INVALID_ARG);
+    assert(IOTC_Connect_ByUID("TEST_DEVICE_12345678") == IOTC_ER_CAN_NOT_FIND_DEVICE);
+    
+    // Seed the discovery table: one device listening, one that never answers
+    IOTCLanDevice table[4];
+    assert(IOTC_Lan_Discovery_Start(1000, NULL, NULL) == 0);
+    int found = 0;
+    for (int i = 0; i < 50 && found < 2; i++) {
+        announce_device("TEST_DEVICE_12345678", 47101);
+        announce_device("TEST_DEVICE_87654321", 47109);
+        usleep(20000);
+        found = (int)IOTC_Lan_Discovery_Get_Devices(table, 4);
+    }
+    if (found < 2) {
+        printf("⚠️ Discovery port unavailable, skipping connect by UID\n");
+        IOTC_Lan_Discovery_Stop();
+        IOTC_DeInitialize();
+        return;
+    }
+    
+    // A discovered device still has to answer the handshake
+    uint16_t port = 47101;
+    pthread_t listener;
+    pthread_create(&listener, NULL, listen_worker, &port);
+    usleep(50000);
+    int64_t sid = IOTC_Connect_ByUID("TEST_DEVICE_12345678");
+    pthread_join(listener, NULL);
+    assert(sid > 0 && listen_sid > 0);
+    assert(IOTC_Session_Check(sid) == 1);
+    assert(IOTC_Session_Check(listen_sid) == 1);
+    
+    assert(IOTC_Setup_LANConnection_Timeout(200) == 0);
+    assert(IOTC_Connect_ByUID("TEST_DEVICE_87654321") == IOTC_ER_TIMEOUT);
+    
+    IOTC_Session_Close(sid);
+    IOTC_Session_Close(listen_sid);
+    IOTC_Setup_LANConnection_Timeout(5000);
+    IOTC_Lan_Discovery_Stop();
+    IOTC_DeInitialize();
+    printf("✓ Connect by UID tests passed\n");
+}
+
+/* A peer that completes the handshake and then goes silent */
+static int silent_peer_probes;
+static void *silent_peer_worker(void *arg) {
+    int sock = *(int *)arg;
+    uint8_t packet[256];
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+    
+    ssize_t len = recvfrom(sock, packet, sizeof(packet), 0, (struct sockaddr *)&from, &from_len);
+    assert(len >= (ssize_t)sizeof(IOTCHeader) + 24);
+    
+    // CONNECT_ACK addressed to the SID carried in the CONNECT payload
+    IOTCHeader hdr;
+    uint32_t remote_sid, our_sid = htonl(99);
+    memcpy(&remote_sid, packet + sizeof(hdr) + 20, sizeof(remote_sid));
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.flag = 0xF1000000 | (0x0102 << 8);
+    hdr.sid = ntohl(remote_sid);
+    hdr.payload = sizeof(our_sid);
+    IOTC_Header_hton(&hdr);
+    memcpy(packet, &hdr, sizeof(hdr));
+    memcpy(packet + sizeof(hdr), &our_sid, sizeof(our_sid));
+    sendto(sock, packet, sizeof(hdr) + sizeof(our_sid), 0, (struct sockaddr *)&from, from_len);
+    
+    struct timeval tv = { .tv_sec = 0, .tv_usec = 500000 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    while (recv(sock, packet, sizeof(packet), 0) >= (ssize_t)sizeof(hdr)) {
+        memcpy(&hdr, packet, sizeof(hdr));
+        IOTC_Header_ntoh(&hdr);
+        if (((hdr.flag >> 8) & 0xFFFF) == 0x0301) silent_peer_probes++;
+    }
+    return NULL;
+}
+
+static void test_heartbeat_missed_beats(void) {
+    printf("Testing heartbeat probes and missed-beat disconnect...\n");
+    
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(47102);
+    assert(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    
+    IOTC_Initialize();
+    
+    // Idle reaping off: only the heartbeat can notice the dead peer
+    IOTC_Setup_Session_Idle_Timeout(0);
+    IOTC_Setup_Keepalive_Interval(50);
+    
+    pthread_t peer;
+    pthread_create(&peer, NULL, silent_peer_worker, &sock);
+    int64_t sid = IOTC_Connect("TEST_DEVICE_12345678", "127.0.0.1", 47102);
+    assert(sid > 0);
+    
+    usleep(400000);
+    assert(IOTC_Get_Session_Status(sid) == 4); // SESSION_STATE_DISCONNECTED
+    assert(IOTC_Session_Write(sid, "x", 1, 0) == IOTC_ER_REMOTE_TIMEOUT_DISCONNECT);
+    pthread_join(peer, NULL);
+    assert(silent_peer_probes >= 2);
+    close(sock);
+    
+    IOTC_Session_Close(sid);
+    IOTC_Setup_Session_Idle_Timeout(30000);
+    IOTC_Setup_Keepalive_Interval(1000);
+    IOTC_DeInitialize();
+    printf("✓ Heartbeat tests passed\n");
+}
+
+static char rdt_out[200000];
+static void *rdt_write_worker(void *arg) {
+    int rdt = *(int *)arg;
+    assert(RDT_Write(rdt, rdt_out, 100000) == 100000);
+    assert(RDT_Write(rdt, rdt_out + 100000, 100000) == 100000);
+    return NULL;
+}
+
+static void test_rdt_stream(void) {
+    printf("Testing RDT reliable stream...\n");
+    
+    static char in[sizeof(rdt_out)];
+    st_RDT_Status status;
+    
+    IOTC_Initialize();
+    assert(RDT_Create(1, 1000, 0) == RDT_ER_NOT_INITIALIZED);
+    assert(RDT_Initialize() > 0);
+    assert(RDT_Initialize() == RDT_ER_ALREADY_INITIALIZED);
+    assert(RDT_Create(999, 1000, 0) == IOTC_ER_INVALID_SID);
+    assert(RDT_Write(5, "x", 1) == RDT_ER_INVALID_RDT_ID);
+    
+    int64_t sid = connect_pair(47103);
+    
+    int writer = RDT_Create((int)sid, 1000, 2);
+    int reader = RDT_Create((int)listen_sid, 1000, 2);
+    assert(writer >= 0 && reader >= 0);
+    assert(RDT_Create((int)sid, 1000, 2) == RDT_ER_CHANNEL_OCCUPIED);
+    assert(RDT_Read(reader, in, sizeof(in), 20) == RDT_ER_TIMEOUT);
+    
+    // More than one window of data arrives complete and in order
+    for (size_t i = 0; i < sizeof(rdt_out); i++) rdt_out[i] = (char)(i * 31 + 7);
+    pthread_t sender;
+    pthread_create(&sender, NULL, rdt_write_worker, &writer);
+    
+    int got = 0;
+    while (got < (int)sizeof(in)) {
+        int ret = RDT_Read(reader, in + got, (int)sizeof(in) - got, 2000);
+        assert(ret > 0);
+        got += ret;
+    }
+    pthread_join(sender, NULL);
+    assert(memcmp(in, rdt_out, sizeof(in)) == 0);
+    
+    assert(RDT_Status_Check(reader, &status) == 0);
+    assert(status.BufSizeInRecvQueue == 0);
+    
+    // Closing the session fails pending stream calls
+    IOTC_Session_Close((int)listen_sid);
+    assert(RDT_Read(reader, in, 16, 100) == IOTC_ER_INVALID_SID);
+    assert(RDT_Destroy(reader) == 0);
+    assert(RDT_Destroy(reader) == RDT_ER_INVALID_RDT_ID);
+    assert(RDT_Destroy(writer) == 0);
+    
+    IOTC_Session_Close((int)sid);
+    assert(RDT_DeInitialize() == 0);
+    IOTC_DeInitialize();
+    printf("✓ RDT stream tests passed\n");
+}
+
+static void test_large_message_write(void) {
+    printf("Testing large message fragmentation...\n");
+    
+    static char message[(4 << 20) + 1];
+    memset(message, 0x5A, sizeof(message));
+    
+    assert(IOTC_Setup_Max_Message_Size(1399) == IOTC_ER_INVALID_ARG); // Below MAX_PACKET_SIZE
+    assert(IOTC_Setup_Max_Message_Size((16 << 20) + 1) == IOTC_ER_INVALID_ARG);
+    
+    IOTC_Initialize();
+    
+    int64_t sid = connect_pair(47104);
+    IOTC_Session_Channel_ON(sid, 1);
+    IOTC_Session_Channel_ON(listen_sid, 1);
+    
+    // Anything up to the configured limit goes out in one call
+    assert(IOTC_Session_Write(sid, message, 1401, 1) == 1401);
+    assert(IOTC_Session_Write(sid, message, 4 << 20, 1) == 4 << 20);
+    assert(IOTC_Session_Write(sid, message, (4 << 20) + 1, 1) == IOTC_ER_INVALID_ARG);
+    
+    assert(IOTC_Setup_Max_Message_Size(64 * 1024) == 0);
+    assert(IOTC_Session_Write(sid, message, 64 * 1024 + 1, 1) == IOTC_ER_INVALID_ARG);
+    assert(IOTC_Setup_Max_Message_Size(4 << 20) == 0);
+    
+    IOTC_Session_Close((int)sid);
+    IOTC_Session_Close((int)listen_sid);
+    IOTC_DeInitialize();
+    printf("✓ Large message tests passed\n");
+}
+
+static void test_path_mtu_discovery(void) {
+    printf("Testing path MTU discovery and path stats...\n");
+    
+    static char message[20000];
+    memset(message, 0x3C, sizeof(message));
+    IOTCSessionPathStats stats;
+    
+    assert(IOTC_Session_Get_Path_Stats(1, &stats) == IOTC_ER_NOT_INITIALIZED);
+    
+    IOTC_Initialize();
+    assert(IOTC_Session_Get_Path_Stats(1, NULL) == IOTC_ER_INVALID_ARG);
+    
+    int64_t sid = connect_pair(47105);
+    IOTC_Session_Channel_ON(sid, 1);
+    
+    // Loopback carries far more than the 1420-byte default; wait for both
+    // ends so probe answers stop moving the counters
+    IOTCSessionPathStats peer;
+    for (int i = 0; i < 100; i++) {
+        assert(IOTC_Session_Get_Path_Stats(sid, &stats) == 0);
+        assert(IOTC_Session_Get_Path_Stats(listen_sid, &peer) == 0);
+        if (!stats.pmtu_probing && !peer.pmtu_probing) break;
+        usleep(10000);
+    }
+    assert(!stats.pmtu_probing && stats.pmtu > 1420);
+    
+    // One datagram per write that fits the path
+    IOTCSessionPathStats before = stats;
+    assert(IOTC_Session_Write(sid, message, 2000, 1) == 2000);
+    assert(IOTC_Session_Get_Path_Stats(sid, &stats) == 0);
+    assert(stats.datagrams_sent - before.datagrams_sent == 1);
+    assert(stats.send_calls - before.send_calls == 1);
+    assert(stats.bytes_sent - before.bytes_sent == 2020);
+    assert(stats.messages_fragmented == 0);
+    
+    unsigned int frag_size = stats.pmtu - 20 - 12; // IOTC header, fragment header
+    unsigned int frags = (sizeof(message) + frag_size - 1) / frag_size;
+    before = stats;
+    assert(IOTC_Session_Write(sid, message, sizeof(message), 1) == sizeof(message));
+    assert(IOTC_Session_Get_Path_Stats(sid, &stats) == 0);
+    assert(stats.messages_fragmented == 1 && stats.fragments_sent == frags);
+    assert(stats.datagrams_sent - before.datagrams_sent == frags);
+    assert(stats.send_calls - before.send_calls == 1); // One sendmmsg batch
+    
+    IOTC_Session_Close((int)sid);
+    IOTC_Session_Close((int)listen_sid);
+    IOTC_DeInitialize();
+    printf("✓ Path MTU tests passed\n");
+}
+
+static void test_channel_fec(void) {
+    printf("Testing channel forward error correction...\n");
+    
+    static char message[60000];
+    memset(message, 0x6B, sizeof(message));
+    IOTCSessionPathStats before, stats;
+    
+    IOTC_Initialize();
+    
+    int64_t sid = connect_pair(47106);
+    IOTC_Session_Channel_ON(sid, 1);
+    
+    // IOTC_ER_INVALID_ARG for bad modes and group shapes
+    assert(IOTC_Session_Set_Channel_FEC(sid, 1, 3, 8, 1) == IOTC_ER_INVALID_ARG);
+    assert(IOTC_Session_Set_Channel_FEC(sid, 1, IOTC_FEC_XOR, 8, 2) == IOTC_ER_INVALID_ARG);
+    assert(IOTC_Session_Set_Channel_FEC(sid, 1, IOTC_FEC_RS, 0, 2) == IOTC_ER_INVALID_ARG);
+    assert(IOTC_Session_Set_Channel_FEC(sid, 1, IOTC_FEC_RS, 65, 2) == IOTC_ER_INVALID_ARG);
+    assert(IOTC_Session_Set_Channel_FEC(sid, 1, IOTC_FEC_RS, 8, 17) == IOTC_ER_INVALID_ARG);
+    assert(IOTC_Session_Set_Channel_FEC(sid, 32, IOTC_FEC_RS, 8, 2) == IOTC_ER_INVALID_ARG);
+    assert(IOTC_Session_Set_Channel_FEC(999, 1, IOTC_FEC_RS, 8, 2) == IOTC_ER_INVALID_SID);
+    
+    for (int i = 0; i < 100; i++) {
+        assert(IOTC_Session_Get_Path_Stats(sid, &stats) == 0);
+        if (!stats.pmtu_probing) break;
+        usleep(10000);
+    }
+    
+    // Parity follows every group of four fragments, including the short last one
+    assert(IOTC_Session_Set_Channel_FEC(sid, 1, IOTC_FEC_RS, 4, 2) == 0);
+    unsigned int frag_size = stats.pmtu - 20 - 16; // IOTC header, parity header
+    unsigned int frags = (sizeof(message) + frag_size - 1) / frag_size;
+    unsigned int groups = (frags + 3) / 4;
+    before = stats;
+    assert(IOTC_Session_Write(sid, message, sizeof(message), 1) == sizeof(message));
+    assert(IOTC_Session_Get_Path_Stats(sid, &stats) == 0);
+    assert(stats.fragments_sent - before.fragments_sent == frags);
+    assert(stats.parity_sent - before.parity_sent == groups * 2);
+    
+    // Small writes stay single datagrams, and turning the channel off clears FEC
+    before = stats;
+    assert(IOTC_Session_Write(sid, message, 1000, 1) == 1000);
+    IOTC_Session_Channel_OFF(sid, 1);
+    IOTC_Session_Channel_ON(sid, 1);
+    assert(IOTC_Session_Write(sid, message, sizeof(message), 1) == sizeof(message));
+    assert(IOTC_Session_Get_Path_Stats(sid, &stats) == 0);
+    assert(stats.parity_sent == before.parity_sent);
+    
+    IOTC_Session_Close((int)sid);
+    IOTC_Session_Close((int)listen_sid);
+    IOTC_DeInitialize();
+    printf("✓ FEC tests passed\n");
+}
+
+static void test_send_pacing(void) {
+    printf("Testing send pacing...\n");
+    
+    static char message[200000];
+    memset(message, 0x5A, sizeof(message));
+    IOTCSessionPathStats stats;
+    
+    IOTC_Initialize();
+    
+    int64_t sid = connect_pair(47107);
+    IOTC_Session_Channel_ON(sid, 1);
+    
+    assert(IOTC_Session_Channel_Set_Pacing(sid, 32, 100000, 0) == IOTC_ER_INVALID_ARG);
+    assert(IOTC_Session_Set_Pacing(999, 100000, 0) == IOTC_ER_INVALID_SID);
+    
+    // At 400 KB/s a 200 KB write leaves most of itself queued
+    assert(IOTC_Session_Set_Pacing(sid, 400000, 16384) == 0);
+    assert(IOTC_Session_Write(sid, message, sizeof(message), 1) == sizeof(message));
+    assert(IOTC_Session_Get_Path_Stats(sid, &stats) == 0);
+    assert(stats.pacing_queued > 100000);
+    
+    // ...and drains it over the following half second
+    uint64_t queued = stats.pacing_queued;
+    usleep(150000);
+    assert(IOTC_Session_Get_Path_Stats(sid, &stats) == 0);
+    assert(stats.pacing_queued > 0 && stats.pacing_queued < queued);
+    
+    // Lifting the rate releases the rest at once
+    assert(IOTC_Session_Set_Pacing(sid, 0, 0) == 0);
+    assert(IOTC_Session_Get_Path_Stats(sid, &stats) == 0);
+    assert(stats.pacing_queued == 0);
+    
+    // A channel rate paces that channel alone
+    assert(IOTC_Session_Channel_Set_Pacing(sid, 1, 400000, 16384) == 0);
+    assert(IOTC_Session_Write(sid, message, sizeof(message), 1) == sizeof(message));
+    assert(IOTC_Session_Get_Path_Stats(sid, &stats) == 0);
+    assert(stats.pacing_queued > 100000);
+    IOTC_Session_Channel_OFF(sid, 1);
+    assert(IOTC_Session_Get_Path_Stats(sid, &stats) == 0);
+    assert(stats.pacing_queued == 0);
+    
+    IOTC_Session_Close((int)sid);
+    IOTC_Session_Close((int)listen_sid);
+    IOTC_DeInitialize();
+    printf("✓ Send pacing tests passed\n");
+}
+
+static void test_congestion_control(void) {
+    printf("Testing congestion control and bandwidth estimation...\n");
+    
+    static char message[2 * 1024 * 1024];
+    memset(message, 0x2E, sizeof(message));
+    IOTCSessionPathStats stats;
+    
+    IOTC_Initialize();
+    
+    int64_t sid = connect_pair(47108);
+    IOTC_Session_Channel_ON(sid, 1);
+    IOTC_Session_Channel_ON(listen_sid, 1);
+    
+    assert(IOTC_Session_Set_Congestion_Control(999, 1) == IOTC_ER_INVALID_SID);
+    assert(IOTC_Session_Get_Path_Stats(sid, &stats) == 0);
+    assert(stats.bandwidth_estimate > 0 && stats.peer_receive_rate == 0);
+    
+    // A steady stream brings back receive-rate reports from the device
+    for (int i = 0; i < 40; i++) {
+        assert(IOTC_Session_Write(sid, message, 20000, 1) == 20000);
+        usleep(10000);
+    }
+    usleep(150000);
+    assert(IOTC_Session_Get_Path_Stats(sid, &stats) == 0);
+    assert(stats.peer_receive_rate > 0);
+    assert(stats.loss_permille == 0);
+    assert(stats.congestion_state <= IOTC_CONGESTION_OVERUSE);
+    
+    // Enabled, the estimate paces the session; disabled, the queue flushes
+    assert(IOTC_Session_Set_Congestion_Control(sid, 1) == 0);
+    assert(IOTC_Session_Write(sid, message, sizeof(message), 1) == sizeof(message));
+    assert(IOTC_Session_Get_Path_Stats(sid, &stats) == 0);
+    assert(stats.pacing_queued > 0);
+    assert(IOTC_Session_Set_Congestion_Control(sid, 0) == 0);
+    assert(IOTC_Session_Get_Path_Stats(sid, &stats) == 0);
+    assert(stats.pacing_queued == 0);
+    
+    IOTC_Session_Close((int)sid);
+    IOTC_Session_Close((int)listen_sid);
+    IOTC_DeInitialize();
+    printf("✓ Congestion control tests passed\n");
+}
+
+static void test_session_delay_info(void) {
+    printf("Testing RTT, jitter and one-way delay reporting...\n");
+    
+    static char message[2000];
+    memset(message, 0x44, sizeof(message));
+    IOTCSessionInfo info;
+    
+    IOTC_Initialize();
+    IOTC_Setup_Keepalive_Interval(100);
+    
+    int64_t sid = connect_pair(47110);
+    IOTC_Session_Channel_ON(sid, 1);
+    IOTC_Session_Channel_ON(listen_sid, 1);
+    
+    assert(IOTC_Session_Get_Info(sid, NULL) == IOTC_ER_INVALID_ARG);
+    info.size = 4;
+    assert(IOTC_Session_Get_Info(sid, &info) == IOTC_ER_INVALID_ARG);
+    info.size = sizeof(info);
+    assert(IOTC_Session_Get_Info(999, &info) == IOTC_ER_INVALID_SID);
+    
+    // Receive-rate reports echo the sender's timestamps; the busy sender's
+    // keep-alives echo the device's
+    for (int i = 0; i < 30; i++) {
+        assert(IOTC_Session_Write(sid, message, sizeof(message), 1) == sizeof(message));
+        usleep(10000);
+    }
+    usleep(100000);
+    
+    memset(&info, 0xFF, sizeof(info));
+    info.size = sizeof(info);
+    assert(IOTC_Session_Get_Info(sid, &info) == 0);
+    assert(info.version == IOTC_SESSION_INFO_VERSION && info.size == sizeof(info));
+    assert(info.rtt_samples > 0);
+    assert(info.rtt_us < 100000 && info.rtt_min_us <= info.rtt_latest_us);
+    
+    memset(&info, 0xFF, sizeof(info));
+    info.size = sizeof(info);
+    assert(IOTC_Session_Get_Info(listen_sid, &info) == 0);
+    assert(info.rtt_samples > 0 && info.rtt_us < 100000);
+    assert(info.jitter_us < 100000 && info.queuing_delay_us < 100000);
+    
+    // Older, shorter layouts get only their prefix
+    memset(&info, 0xFF, sizeof(info));
+    info.size = offsetof(IOTCSessionInfo, rtt_min_us);
+    assert(IOTC_Session_Get_Info(sid, &info) == 0);
+    assert(info.size == offsetof(IOTCSessionInfo, rtt_min_us));
+    assert(info.rtt_min_us == 0xFFFFFFFF);
+    
+    IOTC_Session_Close((int)sid);
+    IOTC_Session_Close((int)listen_sid);
+    IOTC_Setup_Keepalive_Interval(1000);
+    IOTC_DeInitialize();
+    printf("✓ Session delay tests passed\n");
+}
+
+static void test_session_traffic_info(void) {
+    printf("Testing per-session traffic statistics and login info...\n");
+    
+    static const char message[100] = "traffic";
+    IOTCSessionInfo info;
+    unsigned int login = 0;
+    
+    assert(IOTC_Get_Login_Info(0, &login) == IOTC_ER_NOT_INITIALIZED);
+    IOTC_Initialize();
+    assert(IOTC_Get_Login_Info(0, NULL) == IOTC_ER_INVALID_ARG);
+    assert(IOTC_Get_Login_Info(0, &login) == 0);
+    assert(login == IOTC_LOGIN_LOCAL_READY);
+    
+    int64_t sid = connect_pair(47111);
+    IOTC_Session_Channel_ON(sid, 2);
+    IOTC_Session_Channel_ON(sid, 3);
+    IOTC_Session_Channel_ON(listen_sid, 2);
+    
+    // Channel 2 queues unread messages; the device never turned channel 3 on
+    for (int i = 0; i < 5; i++) {
+        assert(IOTC_Session_Write(sid, message, sizeof(message), 2) == sizeof(message));
+    }
+    assert(IOTC_Session_Write(sid, message, sizeof(message), 3) == sizeof(message));
+    usleep(100000);
+    
+    memset(&info, 0xFF, sizeof(info));
+    info.size = sizeof(info);
+    assert(IOTC_Session_Get_Info(sid, &info) == 0);
+    assert(info.version == IOTC_SESSION_INFO_VERSION);
+    assert(info.mode == IOTC_SESSION_MODE_LAN && info.remote_port == 47111);
+    assert(strcmp(info.remote_ip, "127.0.0.1") == 0);
+    assert(info.uptime_ms >= 90 && info.uptime_ms < 10000);
+    assert(info.channels[2].packets_out == 5);
+    assert(info.channels[2].bytes_out == 5 * (sizeof(IOTCHeader) + sizeof(message)));
+    assert(info.channels[3].packets_out == 1 && info.channels[1].packets_out == 0);
+    assert(info.packets_out > 6 && info.bytes_out > 6 * (sizeof(IOTCHeader) + sizeof(message)));
+    assert(info.drops == 0 && info.retransmits == 0);
+    
+    memset(&info, 0xFF, sizeof(info));
+    info.size = sizeof(info);
+    assert(IOTC_Session_Get_Info(listen_sid, &info) == 0);
+    assert(info.channels[2].packets_in == 5 && info.channels[2].drops == 0);
+    assert(info.channels[2].queue_messages == 5 && info.channels[2].queue_bytes == 5 * sizeof(message));
+    assert(info.channels[3].packets_in == 1 && info.channels[3].drops == 1);
+    assert(info.drops == 1 && info.packets_in > 6);
+    
+    // Reading drains the queue depth
+    char buf[sizeof(message)];
+    assert(IOTC_Session_Read_Check_Lost_Data_And_Datatype(listen_sid, buf, sizeof(buf), 100,
+                                                          NULL, NULL, 2, 0) == sizeof(message));
+    info.size = sizeof(info);
+    assert(IOTC_Session_Get_Info(listen_sid, &info) == 0);
+    assert(info.channels[2].queue_messages == 4 && info.channels[2].queue_bytes == 4 * sizeof(message));
+    
+    IOTC_Session_Close((int)sid);
+    IOTC_Session_Close((int)listen_sid);
+    IOTC_DeInitialize();
+    printf("✓ Session traffic tests passed\n");
 }
 
+/* Copies the metrics file out under its seqlock, as an external reader would */
+static size_t metrics_snapshot(const char *path, IOTCMetricsFile *out, size_t cap) {
+    int fd = open(path, O_RDONLY);
+    assert(fd >= 0);
+    size_t size = (size_t)lseek(fd, 0, SEEK_END);
+    assert(size >= sizeof(IOTCMetricsFile) && size <= cap);
+    const IOTCMetricsFile *file = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    assert(file != MAP_FAILED);
+    close(fd);
+    
+    for (;;) {
+        uint32_t begin = __atomic_load_n(&file->seq, __ATOMIC_ACQUIRE);
+        if (begin & 1) continue;
+        memcpy(out, file, size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&file->seq, __ATOMIC_RELAXED) == begin) break;
+    }
+    munmap((void *)file, size);
+    return size;
+}
+
+static void test_metrics_export(void) {
+    printf("Testing shared-memory metrics export...\n");
+    
+    static const char message[200] = "metrics";
+    static uint64_t buf[8192];
+    IOTCMetricsFile *m = (IOTCMetricsFile *)buf;
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/iotc_metrics_test.%d", (int)getpid());
+    
+    assert(IOTC_Metrics_Start(path, 50) == IOTC_ER_NOT_INITIALIZED);
+    IOTC_Initialize();
+    assert(IOTC_Metrics_Start(NULL, 50) == IOTC_ER_INVALID_ARG);
+    assert(IOTC_Metrics_Start("/nonexistent/iotc/metrics", 50) == IOTC_ER_INVALID_ARG);
+    assert(IOTC_Metrics_Start(path, 50) == 0);
+    
+    int64_t sid = connect_pair(47112);
+    IOTC_Session_Channel_ON(sid, 1);
+    IOTC_Session_Channel_ON(listen_sid, 1);
+    for (int i = 0; i < 10; i++) {
+        assert(IOTC_Session_Write(sid, message, sizeof(message), 1) == sizeof(message));
+    }
+    usleep(200000);
+    
+    size_t size = metrics_snapshot(path, m, sizeof(buf));
+    assert(m->magic == IOTC_METRICS_MAGIC && m->version == IOTC_METRICS_VERSION);
+    assert(m->size == size && m->pid == (uint32_t)getpid() && m->snapshots >= 2);
+    assert(size == sizeof(IOTCMetricsFile) + m->max_sessions * sizeof(IOTCMetricsSession));
+    assert(m->global.sessions_active == 2 && m->global.sessions_connected == 2);
+    
+    const IOTCMetricsSession *client = NULL;
+    for (uint32_t i = 0; i < m->max_sessions; i++) {
+        if (m->sessions[i].session_id == (uint32_t)sid) client = &m->sessions[i];
+    }
+    assert(client && client->state == 3 && client->mode == IOTC_SESSION_MODE_LAN);
+    assert(client->remote_port == 47112 && strcmp(client->remote_ip, "127.0.0.1") == 0);
+    assert(client->bytes_out >= 10 * sizeof(message) && client->channels_on == 0x2);
+    assert(m->global.bytes_out >= client->bytes_out && m->global.bytes_in >= 10 * sizeof(message));
+    
+    // Closed sessions leave the table but stay in the totals
+    uint64_t bytes_out = m->global.bytes_out;
+    IOTC_Session_Close((int)sid);
+    IOTC_Session_Close((int)listen_sid);
+    usleep(150000);
+    metrics_snapshot(path, m, sizeof(buf));
+    assert(m->global.sessions_active == 0 && m->global.sessions_closed >= 2);
+    assert(m->global.bytes_out >= bytes_out);
+    
+    assert(IOTC_Metrics_Stop() == 0);
+    metrics_snapshot(path, m, sizeof(buf));
+    assert(m->pid == 0);
+    
+    IOTC_DeInitialize();
+    unlink(path);
+    printf("✓ Metrics export tests passed\n");
+}
+
+static void test_latency_histograms(void) {
+    printf("Testing latency histograms...\n");
+    
+    static const char message[64] = "histogram";
+    static IOTCHistogram h;
+    char buf[sizeof(message)];
+    
+    assert(IOTC_Histogram_Get(-1, 0, &h, 0) == IOTC_ER_INVALID_ARG);
+    assert(IOTC_Histogram_Get(IOTC_HISTOGRAM_DELIVERY, 32, &h, 0) == IOTC_ER_INVALID_ARG);
+    assert(IOTC_Histogram_Get(IOTC_HISTOGRAM_WRITE, 0, NULL, 0) == IOTC_ER_INVALID_ARG);
+    
+    // Bucket limits grow log-linearly and stay within 1/16 of their value
+    assert(IOTC_Histogram_Bucket_Limit(0) == 0 && IOTC_Histogram_Bucket_Limit(15) == 15);
+    assert(IOTC_Histogram_Bucket_Limit(16) == 16 && IOTC_Histogram_Bucket_Limit(32) == 33);
+    for (unsigned int i = 17; i < IOTC_HISTOGRAM_BUCKETS - 1; i++) {
+        uint64_t low = IOTC_Histogram_Bucket_Limit(i - 1) + 1, high = IOTC_Histogram_Bucket_Limit(i);
+        assert(high >= low && (high - low) * 16 <= high);
+    }
+    assert(IOTC_Histogram_Bucket_Limit(IOTC_HISTOGRAM_BUCKETS - 1) == UINT64_MAX);
+    
+    IOTC_Histogram_Get(IOTC_HISTOGRAM_READ_WAIT, 0, NULL, 1);
+    IOTC_Histogram_Get(IOTC_HISTOGRAM_WRITE, 0, NULL, 1);
+    IOTC_Histogram_Get(IOTC_HISTOGRAM_CONNECT, 0, NULL, 1);
+    IOTC_Histogram_Get(IOTC_HISTOGRAM_DELIVERY, 1, NULL, 1);
+    
+    IOTC_Initialize();
+    int64_t sid = connect_pair(47113);
+    IOTC_Session_Channel_ON(sid, 1);
+    IOTC_Session_Channel_ON(listen_sid, 1);
+    
+    assert(IOTC_Histogram_Get(IOTC_HISTOGRAM_CONNECT, 0, &h, 0) == 0);
+    assert(h.count == 1 && h.min_us == h.max_us && h.max_us < 1000000);
+    
+    // A read that waits out its timeout blocks for about that long
+    assert(IOTC_Session_Read_Check_Lost_Data_And_Datatype(listen_sid, buf, sizeof(buf), 50,
+                                                          NULL, NULL, 1, 0) == IOTC_ER_TIMEOUT);
+    assert(IOTC_Histogram_Get(IOTC_HISTOGRAM_READ_WAIT, 0, &h, 0) == 0);
+    assert(h.count == 1 && h.min_us >= 40000 && h.max_us < 1000000);
+    
+    // Messages left queued for 30 ms show up in the delivery histogram
+    for (int i = 0; i < 5; i++) {
+        assert(IOTC_Session_Write(sid, message, sizeof(message), 1) == sizeof(message));
+    }
+    usleep(30000);
+    for (int i = 0; i < 5; i++) {
+        assert(IOTC_Session_Read_Check_Lost_Data_And_Datatype(listen_sid, buf, sizeof(buf), 1000,
+                                                              NULL, NULL, 1, 0) == sizeof(message));
+    }
+    assert(IOTC_Histogram_Get(IOTC_HISTOGRAM_WRITE, 0, &h, 0) == 0);
+    assert(h.count == 5 && h.sum_us >= h.max_us);
+    assert(IOTC_Histogram_Get(IOTC_HISTOGRAM_DELIVERY, 1, &h, 1) == 0);
+    assert(h.count == 5 && h.min_us >= 25000 && h.max_us < 1000000);
+    uint64_t p50 = IOTC_Histogram_Percentile(&h, 50.0);
+    assert(p50 >= h.min_us && p50 <= h.max_us);
+    assert(IOTC_Histogram_Percentile(&h, 100.0) == h.max_us);
+    
+    // The resetting read took every sample
+    assert(IOTC_Histogram_Get(IOTC_HISTOGRAM_DELIVERY, 1, &h, 0) == 0);
+    assert(h.count == 0 && h.sum_us == 0 && h.min_us == 0 && h.max_us == 0);
+    assert(IOTC_Histogram_Percentile(&h, 99.0) == 0);
+    
+    IOTC_Session_Close((int)sid);
+    IOTC_Session_Close((int)listen_sid);
+    IOTC_DeInitialize();
+    printf("✓ Latency histogram tests passed\n");
+}
+
+static void *log_worker(void *arg) {
+    (void)arg;
+    for (int i = 0; i < 3; i++) {
+        TUTK_LOG_MSG(IOTC_LOG_LEVEL_WARNING, "worker", 0, "worker record %d", i);
+    }
+    return NULL;
+}
+
+static char *read_log_file(const char *path) {
+    FILE *f = fopen(path, "r");
+    assert(f);
+    static char text[64 * 1024];
+    size_t len = fread(text, 1, sizeof(text) - 1, f);
+    text[len] = '\0';
+    fclose(f);
+    return text;
+}
+
+/* Level letter of the line containing needle, after the timestamp */
+static char log_line_level(const char *text, const char *needle) {
+    const char *hit = strstr(text, needle);
+    assert(hit);
+    while (hit > text && hit[-1] != '\n') hit--;
+    return hit[27];
+}
+
+static void test_async_logger(void) {
+    printf("Testing asynchronous logger...\n");
+    
+    char path[64], rotated[70];
+    snprintf(path, sizeof(path), "/tmp/iotc_test_%d.log", (int)getpid());
+    snprintf(rotated, sizeof(rotated), "%s.1", path);
+    unlink(path);
+    unlink(rotated);
+    
+    assert(IOTC_Set_Log_Level(-1) == IOTC_ER_INVALID_ARG);
+    assert(IOTC_Set_Log_Level(IOTC_LOG_LEVEL_NONE + 1) == IOTC_ER_INVALID_ARG);
+    assert(IOTC_Set_Log_Path(path, -1) == IOTC_ER_INVALID_ARG);
+    assert(IOTC_Set_Log_Path("/nonexistent/dir/iotc.log", 0) == IOTC_ER_INVALID_ARG);
+    
+    // Nothing is kept while no file is set
+    TUTK_LOG_MSG(IOTC_LOG_LEVEL_ERROR, "test", 0, "before the path");
+    
+    assert(IOTC_Set_Log_Level(IOTC_LOG_LEVEL_DEBUG) == 0);
+    assert(IOTC_Set_Log_Path(path, 0) == 0);
+    TUTK_LOG_MSG(IOTC_LOG_LEVEL_INFO, "test", 0, "ints %d %5u %-3x| %lld %hhd %zu",
+                 -42, 7u, 0xabu, -1234567890123LL, (signed char)-3, (size_t)99);
+    const char *volatile missing = NULL;
+    TUTK_LOG_MSG(IOTC_LOG_LEVEL_DEBUG, "test", 0, "floats %.2f %e %*d|%-*.*s| %c %% %s",
+                 3.14159, 1.5, 4, 9, 6, 3, "abcdef", 'z', missing);
+    
+    // Strings are copied when logged, formatting happens later
+    char scratch[16];
+    strcpy(scratch, "copied");
+    TUTK_LOG_MSG(IOTC_LOG_LEVEL_INFO, "test", 0, "string %s", scratch);
+    strcpy(scratch, "changed");
+    
+    pthread_t worker;
+    pthread_create(&worker, NULL, log_worker, NULL);
+    pthread_join(worker, NULL);
+    
+    assert(IOTC_Set_Log_Level(IOTC_LOG_LEVEL_WARNING) == 0);
+    TUTK_LOG_MSG(IOTC_LOG_LEVEL_INFO, "test", 0, "filtered out");
+    TUTK_LOG_MSG(IOTC_LOG_LEVEL_ERROR, "test", 0, "kept at error");
+    assert(IOTC_Set_Log_Level(IOTC_LOG_LEVEL_INFO) == 0);
+    
+    // The library logs into the same file
+    IOTC_Initialize();
+    IOTC_DeInitialize();
+    
+    assert(IOTC_Set_Log_Rate_Limit(10, 10) == 0);
+    for (int i = 0; i < 100; i++) {
+        TUTK_LOG_MSG(IOTC_LOG_LEVEL_INFO, "rate", 0, "flood %d", i);
+    }
+    assert(IOTC_Set_Log_Path(NULL, 0) == 0);
+    TUTK_LOG_MSG(IOTC_LOG_LEVEL_ERROR, "test", 0, "after close");
+    
+    const char *text = read_log_file(path);
+    assert(strstr(text, " test: ints -42     7 ab | -1234567890123 -3 99\n"));
+    assert(strstr(text, " test: floats 3.14 1.500000e+00    9|abc   | z % (null)\n"));
+    assert(strstr(text, " test: string copied\n"));
+    assert(strstr(text, "worker record 0") && strstr(text, "worker record 0") < strstr(text, "worker record 2"));
+    assert(!strstr(text, "filtered out") && !strstr(text, "before the path") && !strstr(text, "after close"));
+    assert(log_line_level(text, "kept at error") == 'E');
+    assert(log_line_level(text, "string copied") == 'I');
+    assert(log_line_level(text, "floats") == 'D');
+    assert(strstr(text, " IOTC: initialized, 16 sessions\n") && strstr(text, " IOTC: deinitialized\n"));
+    
+    int floods = 0;
+    for (const char *p = text; (p = strstr(p, " rate: flood ")) != NULL; p++) floods++;
+    assert(floods >= 10 && floods <= 12);
+    assert(log_line_level(text, "records over the rate limit") == 'W');
+    
+    // Rotation keeps the current file and one predecessor under max_size
+    unlink(path);
+    assert(IOTC_Set_Log_Rate_Limit(0, 0) == 0);
+    assert(IOTC_Set_Log_Path(path, 512) == 0);
+    for (int i = 0; i < 40; i++) {
+        TUTK_LOG_MSG(IOTC_LOG_LEVEL_INFO, "rotate", 0, "line %d padded out to take some room", i);
+    }
+    assert(IOTC_Set_Log_Path(NULL, 0) == 0);
+    struct stat st;
+    assert(stat(path, &st) == 0 && st.st_size > 0 && st.st_size <= 512);
+    assert(stat(rotated, &st) == 0 && st.st_size > 0 && st.st_size <= 512);
+    assert(strstr(read_log_file(path), " rotate: line 39 padded"));
+    
+    IOTC_Set_Log_Rate_Limit(1000, 1000);
+    unlink(path);
+    unlink(rotated);
+    printf("✓ Async logger tests passed\n");
+}
+
+static int contains(const uint8_t *data, size_t len, const char *needle) {
+    size_t n = strlen(needle);
+    for (size_t i = 0; i + n <= len; i++) {
+        if (memcmp(data + i, needle, n) == 0) return 1;
+    }
+    return 0;
+}
+
+/* Block counts of a pcapng file written by IOTC_Session_Capture_Start */
+typedef struct {
+    int sections, interfaces, inbound, outbound, stats;
+    uint16_t linktype;
+    int iotc_headers;                   /* packets starting with the session magic */
+    int needle_in, needle_out;          /* packets carrying the needle, by direction */
+    uint64_t dropped;
+} pcapng_summary_t;
+
+static void read_pcapng(const char *path, const char *needle, pcapng_summary_t *sum) {
+    static uint8_t data[256 * 1024];
+    FILE *f = fopen(path, "rb");
+    assert(f);
+    size_t len = fread(data, 1, sizeof(data), f);
+    fclose(f);
+    
+    memset(sum, 0, sizeof(*sum));
+    size_t offset = 0;
+    while (offset + 12 <= len) {
+        uint32_t type, size, trailer;
+        memcpy(&type, data + offset, 4);
+        memcpy(&size, data + offset + 4, 4);
+        assert(size >= 12 && size % 4 == 0 && offset + size <= len);
+        memcpy(&trailer, data + offset + size - 4, 4);
+        assert(trailer == size);
+        
+        const uint8_t *body = data + offset + 8;
+        if (type == 0x0A0D0D0A) {
+            uint32_t bom;
+            memcpy(&bom, body, 4);
+            assert(bom == 0x1A2B3C4D);
+            sum->sections++;
+        } else if (type == 1) {
+            memcpy(&sum->linktype, body, 2);
+            sum->interfaces++;
+        } else if (type == 6) {
+            uint32_t caplen, flags;
+            memcpy(&caplen, body + 12, 4);
+            const uint8_t *packet = body + 20;
+            const uint8_t *option = packet + ((caplen + 3) & ~3u);
+            assert(option[0] == 2 && option[2] == 4);
+            memcpy(&flags, option + 4, 4);
+            int inbound = (flags & 3) == 1;
+            if (inbound) sum->inbound++; else sum->outbound++;
+            if (caplen >= 20 && packet[0] == 0xF1) sum->iotc_headers++;
+            if (needle && contains(packet, caplen, needle)) {
+                if (inbound) sum->needle_in++; else sum->needle_out++;
+            }
+        } else if (type == 5) {
+            // isb_osdrop follows the start and end time options
+            const uint8_t *option = body + 12 + 2 * 12;
+            assert(option[0] == 7 && option[2] == 8);
+            memcpy(&sum->dropped, option + 4, 8);
+            sum->stats++;
+        }
+        offset += size;
+    }
+    assert(offset == len);
+}
+
+static void test_session_capture(void) {
+    printf("Testing per-session packet capture...\n");
+    
+    char path[64], rotated[70], second[70];
+    char buf[256];
+    pcapng_summary_t sum;
+    struct stat st;
+    snprintf(path, sizeof(path), "/tmp/iotc_test_%d.pcapng", (int)getpid());
+    snprintf(rotated, sizeof(rotated), "%s.1", path);
+    snprintf(second, sizeof(second), "%s.b", path);
+    unlink(path);
+    unlink(rotated);
+    unlink(second);
+    
+    assert(IOTC_Session_Capture_Start(1, path, 0) == IOTC_ER_NOT_INITIALIZED);
+    
+    IOTC_Initialize();
+    int64_t sid = connect_pair(47114);
+    IOTC_Session_Channel_ON(sid, 1);
+    IOTC_Session_Channel_ON(listen_sid, 1);
+    
+    assert(IOTC_Session_Capture_Start(sid, NULL, 0) == IOTC_ER_INVALID_ARG);
+    assert(IOTC_Session_Capture_Start(sid, "", 0) == IOTC_ER_INVALID_ARG);
+    assert(IOTC_Session_Capture_Start(sid, "/nonexistent/dir/capture.pcapng", 0) == IOTC_ER_INVALID_ARG);
+    assert(IOTC_Session_Capture_Start(9999, path, 0) == IOTC_ER_INVALID_SID);
+    assert(IOTC_Session_Capture_Stop(9999) == IOTC_ER_INVALID_SID);
+    assert(IOTC_Session_Capture_Stop(sid) == 0);
+    
+    // Both directions land in one interface, header included
+    assert(IOTC_Session_Capture_Start(sid, path, 0) == 0);
+    static const char request[] = "capture request";
+    static const char reply[] = "capture reply";
+    for (int i = 0; i < 5; i++) {
+        assert(IOTC_Session_Write(sid, request, sizeof(request), 1) == sizeof(request));
+        assert(IOTC_Session_Read_Check_Lost_Data_And_Datatype(listen_sid, buf, sizeof(buf), 1000,
+                                                              NULL, NULL, 1, 0) == sizeof(request));
+        assert(IOTC_Session_Write(listen_sid, reply, sizeof(reply), 1) == sizeof(reply));
+        assert(IOTC_Session_Read_Check_Lost_Data_And_Datatype(sid, buf, sizeof(buf), 1000,
+                                                              NULL, NULL, 1, 0) == sizeof(reply));
+    }
+    // A fragmented message is captured fragment by fragment
+    static char large[20000];
+    memset(large, 'L', sizeof(large));
+    assert(IOTC_Session_Write(sid, large, sizeof(large), 1) == sizeof(large));
+    assert(IOTC_Session_Read_Check_Lost_Data_And_Datatype(listen_sid, large, sizeof(large), 1000,
+                                                          NULL, NULL, 1, 0) == sizeof(large));
+    assert(IOTC_Session_Capture_Stop(sid) == 0);
+    
+    read_pcapng(path, request, &sum);
+    assert(sum.sections == 1 && sum.interfaces == 1 && sum.stats == 1);
+    assert(sum.linktype == 147 && sum.dropped == 0);
+    assert(sum.needle_out == 5 && sum.needle_in == 0);
+    assert(sum.outbound >= 5 + 3 && sum.inbound >= 5);
+    assert(sum.iotc_headers == sum.inbound + sum.outbound);
+    read_pcapng(path, reply, &sum);
+    assert(sum.needle_in == 5 && sum.needle_out == 0);
+    
+    // Nothing more is written once stopped
+    assert(IOTC_Session_Write(sid, request, sizeof(request), 1) == sizeof(request));
+    assert(IOTC_Session_Read_Check_Lost_Data_And_Datatype(listen_sid, buf, sizeof(buf), 1000,
+                                                          NULL, NULL, 1, 0) == sizeof(request));
+    read_pcapng(path, request, &sum);
+    assert(sum.needle_out == 5);
+    
+    // Rotation starts a complete section in each file under max_bytes
+    unlink(path);
+    assert(IOTC_Session_Capture_Start(sid, path, 2048) == 0);
+    for (int i = 0; i < 30; i++) {
+        assert(IOTC_Session_Write(sid, request, sizeof(request), 1) == sizeof(request));
+        assert(IOTC_Session_Read_Check_Lost_Data_And_Datatype(listen_sid, buf, sizeof(buf), 1000,
+                                                              NULL, NULL, 1, 0) == sizeof(request));
+    }
+    assert(IOTC_Session_Capture_Stop(sid) == 0);
+    assert(stat(rotated, &st) == 0 && st.st_size > 0 && st.st_size <= 2048);
+    read_pcapng(rotated, request, &sum);
+    assert(sum.sections == 1 && sum.interfaces == 1 && sum.stats == 1 && sum.needle_out > 0);
+    int first = sum.needle_out;
+    assert(stat(path, &st) == 0 && st.st_size <= 2048);
+    read_pcapng(path, request, &sum);
+    assert(sum.sections == 1 && sum.interfaces == 1 && sum.stats == 1);
+    assert(first + sum.needle_out <= 30 && sum.needle_out > 0);
+    
+    // Closing the session finishes the capture in the background
+    assert(IOTC_Session_Capture_Start(listen_sid, second, 0) == 0);
+    assert(IOTC_Session_Write(sid, request, sizeof(request), 1) == sizeof(request));
+    assert(IOTC_Session_Read_Check_Lost_Data_And_Datatype(listen_sid, buf, sizeof(buf), 1000,
+                                                          NULL, NULL, 1, 0) == sizeof(request));
+    IOTC_Session_Close((int)listen_sid);
+    for (int i = 0; i < 100; i++) {
+        read_pcapng(second, request, &sum);
+        if (sum.stats) break;
+        usleep(10000);
+    }
+    assert(sum.stats == 1 && sum.needle_in == 1);
+    
+    IOTC_Session_Close((int)sid);
+    IOTC_DeInitialize();
+    unlink(path);
+    unlink(rotated);
+    unlink(second);
+    printf("✓ Packet capture tests passed\n");
+}
+
+/* Simulated network on the virtual clock */
+static int64_t netsim_open_pair(const IOTCNetSimConfig *config) {
+    assert(IOTC_Set_Network_Simulator(config) == 0);
+    assert(IOTC_Initialize() == 0);
+    int64_t sid = connect_pair(47115);
+    IOTC_Session_Channel_ON(sid, 1);
+    IOTC_Session_Channel_ON(listen_sid, 1);
+    return sid;
+}
+
+static uint64_t netsim_now(void) {
+    IOTCNetSimStats stats;
+    assert(IOTC_NetSim_Get_Stats(&stats) == 0);
+    return stats.now_us;
+}
+
+/* Sends count numbered messages a millisecond apart and returns the order they were read in */
+static int netsim_transfer(int64_t sid, int count, int *order) {
+    char buf[200] = {0};
+    for (int i = 0; i < count; i++) {
+        memcpy(buf, &i, sizeof(i));
+        assert(IOTC_Session_Write(sid, buf, sizeof(buf), 1) == sizeof(buf));
+        assert(IOTC_NetSim_Advance(1) == 0);
+    }
+    assert(IOTC_NetSim_Advance(500) == 0);
+    
+    int received = 0;
+    while (IOTC_Session_Read_Check_Lost_Data_And_Datatype(listen_sid, buf, sizeof(buf), 0,
+                                                          NULL, NULL, 1, 0) == sizeof(buf)) {
+        memcpy(&order[received++], buf, sizeof(int));
+    }
+    return received;
+}
+
+static void test_network_simulator(void) {
+    printf("Testing simulated network...\n");
+    
+    IOTCNetSimConfig config;
+    IOTCNetSimStats stats;
+    char buf[1000];
+    memset(buf, 'S', sizeof(buf));
+    
+    memset(&config, 0, sizeof(config));
+    config.loss_permille = 1001;
+    assert(IOTC_Set_Network_Simulator(&config) == IOTC_ER_INVALID_ARG);
+    config.loss_permille = 0;
+    config.mtu = 100;
+    assert(IOTC_Set_Network_Simulator(&config) == IOTC_ER_INVALID_ARG);
+    assert(IOTC_NetSim_Advance(10) == IOTC_ER_NOT_INITIALIZED);
+    assert(IOTC_NetSim_Get_Stats(&stats) == IOTC_ER_NOT_INITIALIZED);
+    
+    // Real sockets unless configured before IOTC_Initialize
+    IOTC_Initialize();
+    assert(IOTC_NetSim_Get_Stats(&stats) == IOTC_ER_NOT_SUPPORT);
+    assert(IOTC_NetSim_Advance(10) == IOTC_ER_NOT_SUPPORT);
+    assert(IOTC_NetSim_Inject(1, buf, 20) == IOTC_ER_NOT_SUPPORT);
+    config.mtu = 0;
+    assert(IOTC_Set_Network_Simulator(&config) == IOTC_ER_ALREADY_INITIALIZED);
+    IOTC_DeInitialize();
+    
+    // Real-time mode: the I/O thread delivers after the delay
+    config.delay_ms = 30;
+    int64_t sid = netsim_open_pair(&config);
+    assert(IOTC_NetSim_Advance(10) == IOTC_ER_NOT_SUPPORT);
+    uint64_t start = netsim_now();
+    assert(IOTC_Session_Write(sid, buf, 100, 1) == 100);
+    assert(IOTC_Session_Read_Check_Lost_Data_And_Datatype(listen_sid, buf, sizeof(buf), 1000,
+                                                          NULL, NULL, 1, 0) == 100);
+    assert(netsim_now() - start >= 30000);
+    IOTC_DeInitialize();
+    
+    // Virtual clock: a blocked read moves time to the arrival
+    config.virtual_clock = 1;
+    sid = netsim_open_pair(&config);
+    start = netsim_now();
+    assert(IOTC_Session_Write(sid, buf, 100, 1) == 100);
+    assert(IOTC_Session_Read_Check_Lost_Data_And_Datatype(listen_sid, buf, sizeof(buf), 1000,
+                                                          NULL, NULL, 1, 0) == 100);
+    uint64_t elapsed = netsim_now() - start;
+    assert(elapsed >= 30000 && elapsed < 40000);
+    
+    // Timeouts and idle hours pass without waiting for them
+    time_t wall = time(NULL);
+    start = netsim_now();
+    assert(IOTC_Session_Read_Check_Lost_Data_And_Datatype(listen_sid, buf, sizeof(buf), 500,
+                                                          NULL, NULL, 1, 0) == IOTC_ER_TIMEOUT);
+    assert(netsim_now() - start >= 500000);
+    assert(IOTC_NetSim_Advance(3600 * 1000) == 0);
+    assert(netsim_now() - start >= 3600ULL * 1000000);
+    assert(time(NULL) - wall <= 5);
+    assert(IOTC_Session_Write(sid, buf, 100, 1) == 100);
+    assert(IOTC_Session_Read_Check_Lost_Data_And_Datatype(listen_sid, buf, sizeof(buf), 1000,
+                                                          NULL, NULL, 1, 0) == 100);
+    
+    // Injected datagrams skip the link and land in the receive path at once
+    IOTCHeader hdr = { (0xF1u << 24) | (0x0300u << 8) | 1, (uint32_t)listen_sid, 0, 0, 5 };
+    uint8_t datagram[sizeof(hdr) + 5];
+    IOTC_Header_hton(&hdr);
+    memcpy(datagram, &hdr, sizeof(hdr));
+    memcpy(datagram + sizeof(hdr), "hello", 5);
+    assert(IOTC_NetSim_Inject(listen_sid, NULL, 0) == IOTC_ER_INVALID_ARG);
+    assert(IOTC_NetSim_Inject(9999, datagram, sizeof(datagram)) == IOTC_ER_INVALID_SID);
+    start = netsim_now();
+    assert(IOTC_NetSim_Inject(listen_sid, datagram, sizeof(datagram)) == 0);
+    assert(IOTC_Session_Read_Check_Lost_Data_And_Datatype(listen_sid, buf, sizeof(buf), 0,
+                                                          NULL, NULL, 1, 0) == 5);
+    assert(memcmp(buf, "hello", 5) == 0 && netsim_now() == start);
+    memset(buf, 'S', sizeof(buf));
+    // Bottleneck: 20 datagrams of about 1 KB at 100 KB/s take 200 ms, a
+    // burst beyond the queue is dropped
+    config.delay_ms = 0;
+    config.bandwidth_bytes = 100000;
+    config.queue_bytes = 10000;
+    assert(IOTC_Set_Network_Simulator(&config) == 0);
+    start = netsim_now();
+    for (int i = 0; i < 20; i++) {
+        assert(IOTC_Session_Write(sid, buf, sizeof(buf), 1) == sizeof(buf));
+        assert(IOTC_Session_Read_Check_Lost_Data_And_Datatype(listen_sid, buf, sizeof(buf), 1000,
+                                                              NULL, NULL, 1, 0) == sizeof(buf));
+    }
+    assert(netsim_now() - start >= 200000);
+    for (int i = 0; i < 30; i++) {
+        assert(IOTC_Session_Write(sid, buf, sizeof(buf), 1) == sizeof(buf));
+    }
+    assert(IOTC_NetSim_Get_Stats(&stats) == 0);
+    assert(stats.dropped_queue >= 15 && stats.in_flight > 0);
+    assert(IOTC_NetSim_Advance(1000) == 0);
+    while (IOTC_Session_Read_Check_Lost_Data_And_Datatype(listen_sid, buf, sizeof(buf), 0,
+                                                          NULL, NULL, 1, 0) > 0) {
+    }
+    
+    // Datagrams over the MTU never arrive
+    config.bandwidth_bytes = 0;
+    config.mtu = 600;
+    assert(IOTC_Set_Network_Simulator(&config) == 0);
+    assert(IOTC_Session_Write(sid, buf, 700, 1) == 700);
+    assert(IOTC_Session_Read_Check_Lost_Data_And_Datatype(listen_sid, buf, sizeof(buf), 200,
+                                                          NULL, NULL, 1, 0) == IOTC_ER_TIMEOUT);
+    assert(IOTC_NetSim_Get_Stats(&stats) == 0 && stats.dropped_mtu == 1);
+    
+    // Reordered datagrams skip the delay and overtake the others
+    config.mtu = 0;
+    config.delay_ms = 30;
+    config.reorder_permille = 300;
+    assert(IOTC_Set_Network_Simulator(&config) == 0);
+    int order[50];
+    assert(netsim_transfer(sid, 50, order) == 50);
+    int inversions = 0;
+    for (int i = 1; i < 50; i++) {
+        if (order[i] < order[i - 1]) inversions++;
+    }
+    assert(inversions > 0);
+    assert(IOTC_NetSim_Get_Stats(&stats) == 0 && stats.reordered > 0);
+    IOTC_DeInitialize();
+    
+    // The same seed loses the same messages
+    int lost_first[50], lost_second[50];
+    uint64_t drops = 0;
+    for (int run = 0; run < 2; run++) {
+        int *lost = run ? lost_second : lost_first;
+        memset(&config, 0, sizeof(config));
+        config.virtual_clock = 1;
+        config.delay_ms = 20;
+        config.jitter_ms = 10;
+        config.seed = 7;
+        sid = netsim_open_pair(&config);
+        config.loss_permille = 300;
+        assert(IOTC_Set_Network_Simulator(&config) == 0);
+        assert(IOTC_NetSim_Get_Stats(&stats) == 0);
+        uint64_t before = stats.dropped_loss;
+        
+        memset(lost, 1, sizeof(lost_first));
+        int received = netsim_transfer(sid, 50, order);
+        assert(received > 0 && received < 50);
+        for (int i = 0; i < received; i++) {
+            lost[order[i]] = 0;
+            if (i) assert(order[i] > order[i - 1]);
+        }
+        assert(IOTC_NetSim_Get_Stats(&stats) == 0);
+        if (run) {
+            assert(stats.dropped_loss - before == drops);
+        } else {
+            drops = stats.dropped_loss - before;
+        }
+        IOTC_DeInitialize();
+    }
+    assert(memcmp(lost_first, lost_second, sizeof(lost_first)) == 0);
+    
+    assert(IOTC_Set_Network_Simulator(NULL) == 0);
+    printf("✓ Network simulator tests passed\n");
+}
+
+static void inject_session_type(int64_t sid, unsigned int type, unsigned int payload, size_t len) {
+    IOTCHeader hdr = { (0xF1u << 24) | (type << 8) | 1, (uint32_t)sid, 0, 0, payload };
+    uint8_t datagram[64] = {0};
+    IOTC_Header_hton(&hdr);
+    memcpy(datagram, &hdr, sizeof(hdr));
+    assert(IOTC_NetSim_Inject(sid, datagram, (unsigned int)len) == 0);
+}
+
+static void test_receive_dispatch(void) {
+    printf("Testing receive dispatch...\n");
+    
+    IOTCNetSimConfig config;
+    IOTCReceiveStats stats;
+    char buf[100] = {0};
+    
+    assert(IOTC_Receive_Stats_Get(NULL, 0) == IOTC_ER_INVALID_ARG);
+    memset(&config, 0, sizeof(config));
+    config.virtual_clock = 1;
+    int64_t sid = netsim_open_pair(&config);
+    assert(IOTC_Receive_Stats_Get(NULL, 1) == 0);
+    
+    assert(IOTC_Session_Write(sid, buf, sizeof(buf), 1) == sizeof(buf));
+    assert(IOTC_Session_Read_Check_Lost_Data_And_Datatype(listen_sid, buf, sizeof(buf), 1000,
+                                                          NULL, NULL, 1, 0) == sizeof(buf));
+    
+    // Types and families the library does not serve are counted, not delivered
+    inject_session_type(listen_sid, 0x0999, 0, 20);
+    inject_session_type(listen_sid, 0x0122, 4, 24);
+    inject_session_type(listen_sid, 0x0200, 8, 28);
+    inject_session_type(listen_sid, 0x0300, 30, 40);
+    uint8_t lan[42] = { 0xFD };
+    uint8_t rtp[16] = { 0x80, 0x80 | 96 };
+    uint8_t other_rtp[16] = { 0x80, 0 };
+    uint8_t foreign[8] = { 0x17 };
+    assert(IOTC_NetSim_Inject(listen_sid, lan, sizeof(lan)) == 0);
+    assert(IOTC_NetSim_Inject(listen_sid, rtp, sizeof(rtp)) == 0);
+    assert(IOTC_NetSim_Inject(listen_sid, other_rtp, sizeof(other_rtp)) == 0);
+    assert(IOTC_NetSim_Inject(listen_sid, foreign, sizeof(foreign)) == 0);
+    assert(IOTC_Session_Read_Check_Lost_Data_And_Datatype(listen_sid, buf, sizeof(buf), 10,
+                                                          NULL, NULL, 1, 0) == IOTC_ER_TIMEOUT);
+    
+    assert(IOTC_Receive_Stats_Get(&stats, 1) == 0);
+    assert(stats.datagrams[IOTC_RX_DATA] == 1 && stats.bytes[IOTC_RX_DATA] == 20 + sizeof(buf));
+    assert(stats.datagrams[IOTC_RX_UNKNOWN_TYPE] == 1);
+    assert(stats.datagrams[IOTC_RX_LOGIN] == 1 && stats.bytes[IOTC_RX_LOGIN] == 24);
+    assert(stats.datagrams[IOTC_RX_AV_AUTH] == 1);
+    assert(stats.datagrams[IOTC_RX_MALFORMED] == 1 && stats.bytes[IOTC_RX_MALFORMED] == 40);
+    assert(stats.datagrams[IOTC_RX_LAN_RESPONSE] == 1);
+    assert(stats.datagrams[IOTC_RX_RTP_H264] == 1 && stats.datagrams[IOTC_RX_RTP] == 1);
+    assert(stats.datagrams[IOTC_RX_FOREIGN] == 1 && stats.bytes[IOTC_RX_FOREIGN] == sizeof(foreign));
+    
+    // The session still works, and the read reset the counters
+    assert(IOTC_Session_Write(sid, buf, sizeof(buf), 1) == sizeof(buf));
+    assert(IOTC_Session_Read_Check_Lost_Data_And_Datatype(listen_sid, buf, sizeof(buf), 1000,
+                                                          NULL, NULL, 1, 0) == sizeof(buf));
+    assert(IOTC_Receive_Stats_Get(&stats, 0) == 0);
+    assert(stats.datagrams[IOTC_RX_DATA] == 1 && stats.datagrams[IOTC_RX_LOGIN] == 0);
+    IOTC_DeInitialize();
+    
+    assert(IOTC_Set_Network_Simulator(NULL) == 0);
+    printf("✓ Receive dispatch tests passed\n");
+}
+
+/* Sends one pseudo-RTP packet on channel 2: a 12-byte header, then the NAL data */
+static void send_rtp(int64_t sid, uint16_t seq, uint32_t timestamp, int marker,
+                     const uint8_t *nal, size_t len) {
+    uint8_t packet[1200] = { 0x80, (uint8_t)((marker ? 0x80 : 0) | 96) };
+    packet[2] = (uint8_t)(seq >> 8);
+    packet[3] = (uint8_t)seq;
+    for (int i = 0; i < 4; i++) packet[4 + i] = (uint8_t)(timestamp >> (24 - 8 * i));
+    memcpy(packet + 12, nal, len);
+    assert(IOTC_Session_Write(sid, packet, (unsigned int)(12 + len), 2) == (int64_t)(12 + len));
+}
+
+static void test_av_client(void) {
+    printf("Testing AV client frame reassembly...\n");
+    
+    IOTCNetSimConfig config;
+    IOTCReceiveStats stats;
+    FRAMEINFO_t info;
+    char frame[4096];
+    int size, expected, info_size;
+    unsigned int index;
+    
+    memset(&config, 0, sizeof(config));
+    config.virtual_clock = 1;
+    int64_t sid = netsim_open_pair(&config);
+    int64_t device = listen_sid;
+    assert(IOTC_Session_Channel_ON(device, 2) == 0);
+    assert(IOTC_Receive_Stats_Get(NULL, 1) == 0);
+    
+    assert(avClientStart(sid, NULL, "12345678", 5, NULL, 2) == AV_ER_INVALID_ARG);
+    assert(avClientStart(9999, "bblp", "12345678", 5, NULL, 2) == AV_ER_INVALID_SID);
+    unsigned int serv_type = 7;
+    int av = avClientStart(sid, "bblp", "12345678", 5, &serv_type, 2);
+    assert(av >= 0 && serv_type == 0);
+    assert(avClientStart(sid, "bblp", "12345678", 5, NULL, 2) == AV_ER_INVALID_ARG);
+    assert(avRecvFrameData2(av, frame, sizeof(frame), &size, NULL, NULL, 0, NULL, NULL) == AV_ER_DATA_NOREADY);
+    
+    // A keyframe: SPS and PPS alone, then an IDR slice in three FU-A fragments
+    uint8_t sps[] = { 0x67, 0x42, 0x00, 0x1F };
+    uint8_t pps[] = { 0x68, 0xCE, 0x38 };
+    uint8_t fu[3][102];
+    for (int i = 0; i < 3; i++) {
+        fu[i][0] = 0x60 | 28;
+        fu[i][1] = (uint8_t)((i == 0 ? 0x80 : 0) | (i == 2 ? 0x40 : 0) | 5);
+        memset(fu[i] + 2, 'a' + i, 100);
+    }
+    send_rtp(device, 1, 3000, 0, sps, sizeof(sps));
+    send_rtp(device, 2, 3000, 0, pps, sizeof(pps));
+    for (int i = 0; i < 3; i++) send_rtp(device, (uint16_t)(3 + i), 3000, i == 2, fu[i], sizeof(fu[i]));
+    assert(IOTC_NetSim_Advance(10) == 0);
+    
+    int ret = avRecvFrameData2(av, frame, sizeof(frame), &size, &expected, (char *)&info, sizeof(info),
+                               &info_size, &index);
+    assert(ret == 4 + 4 + 4 + 3 + 4 + 1 + 300 && size == ret && expected == ret);
+    assert(info_size == sizeof(info) && index == 0);
+    assert(info.codec_id == MEDIA_CODEC_VIDEO_H264 && info.flags == IPC_FRAME_FLAG_IFRAME);
+    assert(info.timestamp == 3000 && info.lost_fragments == 0);
+    assert(memcmp(frame, "\0\0\0\1", 4) == 0 && memcmp(frame + 4, sps, sizeof(sps)) == 0);
+    assert(memcmp(frame + 8, "\0\0\0\1", 4) == 0 && memcmp(frame + 12, pps, sizeof(pps)) == 0);
+    char *idr = frame + 15;
+    assert(memcmp(idr, "\0\0\0\1", 4) == 0 && (uint8_t)idr[4] == (0x60 | 5));
+    for (int i = 0; i < 300; i++) assert(idr[5 + i] == 'a' + i / 100);
+    assert(avRecvFrameData2(av, frame, sizeof(frame), &size, NULL, NULL, 0, NULL, NULL) == AV_ER_DATA_NOREADY);
+    
+    // A P-frame that lost its middle fragment is returned and flagged
+    for (int i = 0; i < 3; i++) fu[i][1] = (uint8_t)((fu[i][1] & 0xE0) | 1);
+    send_rtp(device, 6, 6000, 0, fu[0], sizeof(fu[0]));
+    send_rtp(device, 8, 6000, 1, fu[2], sizeof(fu[2]));
+    assert(IOTC_NetSim_Advance(10) == 0);
+    ret = avRecvFrameData2(av, frame, sizeof(frame), &size, NULL, (char *)&info, sizeof(info), NULL, &index);
+    assert(ret == 4 + 1 + 200 && index == 1);
+    assert(info.flags == IPC_FRAME_FLAG_INCOMPLETE && info.lost_fragments == 1 && info.timestamp == 6000);
+    
+    // Fragments without their start cannot be placed
+    send_rtp(device, 10, 9000, 1, fu[2], sizeof(fu[2]));
+    assert(IOTC_NetSim_Advance(10) == 0);
+    assert(avRecvFrameData2(av, frame, sizeof(frame), &size, NULL, (char *)&info, sizeof(info),
+                            NULL, NULL) == AV_ER_LOSED_THIS_FRAME);
+    assert(info.flags & IPC_FRAME_FLAG_INCOMPLETE);
+    
+    // Without a marker the next timestamp ends the frame; a frame over the
+    // buffer is dropped with its size
+    send_rtp(device, 11, 12000, 0, sps, sizeof(sps));
+    assert(IOTC_NetSim_Advance(10) == 0);
+    assert(avRecvFrameData2(av, frame, sizeof(frame), &size, NULL, NULL, 0, NULL, NULL) == AV_ER_DATA_NOREADY);
+    send_rtp(device, 12, 15000, 1, fu[0], sizeof(fu[0]));
+    send_rtp(device, 13, 18000, 1, pps, sizeof(pps));
+    assert(IOTC_NetSim_Advance(10) == 0);
+    assert(avRecvFrameData2(av, frame, sizeof(frame), &size, NULL, (char *)&info, sizeof(info),
+                            NULL, NULL) == 4 + (int)sizeof(sps));
+    assert(info.timestamp == 12000 && info.flags == IPC_FRAME_FLAG_PBFRAME);
+    assert(avRecvFrameData2(av, frame, 50, &size, &expected, NULL, 0, NULL, NULL) == AV_ER_BUFPARA_MAXSIZE_INSUFF);
+    assert(size == 0 && expected == 4 + 1 + 100);
+    assert(avRecvFrameData2(av, frame, sizeof(frame), &size, NULL, NULL, 0, NULL, NULL) == 4 + (int)sizeof(pps));
+    
+    // The device saw the credentials; a stopped client is gone
+    assert(IOTC_Receive_Stats_Get(&stats, 0) == 0 && stats.datagrams[IOTC_RX_AV_AUTH] == 1);
+    assert(avClientStop(av) == 0);
+    assert(avClientStop(av) == AV_ER_INVALID_ARG);
+    assert(avRecvFrameData2(av, frame, sizeof(frame), &size, NULL, NULL, 0, NULL, NULL) == AV_ER_INVALID_ARG);
+    assert(IOTC_Session_Channel_Check_ON_OFF(sid, 2) == 0);
+    IOTC_DeInitialize();
+    
+    assert(IOTC_Set_Network_Simulator(NULL) == 0);
+    printf("✓ AV client tests passed\n");
+}
+
+/* Legacy tests from original suite */
 static void test_shutdown_no_existing(void) {
     int32_t bio[23] = {0};
     bio[21] = 0;
@@ -516,15 +1910,31 @@ int main(void) {
     test_error_conditions();
     test_concurrent_operations();
     test_network_error_handling();
-    test_timeout_behavior();
+    test_lan_discovery();
+    test_direct_connect_and_timeouts();
+    test_session_read();
+    test_connect_by_uid();
+    test_heartbeat_missed_beats();
+    test_rdt_stream();
+    test_large_message_write();
+    test_path_mtu_discovery();
+    test_channel_fec();
+    test_send_pacing();
+    test_congestion_control();
+    test_session_delay_info();
+    test_session_traffic_info();
+    test_metrics_export();
+    test_latency_histograms();
+    test_async_logger();
+    test_session_capture();
+    test_network_simulator();
+    test_receive_dispatch();
+    test_av_client();
     test_mock_server_integration();
     
     // Run legacy tests
     printf("\nRunning legacy compatibility tests...\n");
     reset_test_state();
-    test_read_no_guard_change();
-    test_read_failure_calls_stack_fail();
-    test_read_guard_change_triggers_fail();
     test_shutdown_no_existing();
     test_shutdown_existing_success();
     test_shutdown_existing_error();
@@ -538,8 +1948,25 @@ int main(void) {
     printf("  - Error handling and edge cases\n");
     printf("  - Concurrent operations\n");
     printf("  - Network error simulation\n");
-    printf("  - Timeout behavior\n");
+    printf("  - Session reads and read timeouts\n");
     printf("  - Mock server integration\n");
+    printf("  - LAN discovery service\n");
+    printf("  - Connect by UID through the discovery table\n");
+    printf("  - Direct connect, keep-alive and idle reaping\n");
+    printf("  - Heartbeat probes and missed-beat disconnect\n");
+    printf("  - RDT reliable ordered streams\n");
+    printf("  - Large message fragmentation\n");
+    printf("  - Path MTU discovery\n");
+    printf("  - Forward error correction\n");
+    printf("  - Send pacing\n");
+    printf("  - Congestion control and bandwidth estimation\n");
+    printf("  - RTT, jitter and one-way delay\n");
+    printf("  - Per-session traffic statistics\n");
+    printf("  - Shared-memory metrics export\n");
+    printf("  - Latency histograms\n");
+    printf("  - Asynchronous logger\n");
+    printf("  - Per-session pcapng capture\n");
+    printf("  - Simulated network and virtual clock\n");
     printf("  - Stack guard protection\n");
     printf("  - SSL/TLS operations\n");
     